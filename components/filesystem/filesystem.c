@@ -259,6 +259,23 @@ void filesystem_delete_all(void)
     }
 }
 
+esp_err_t filesystem_get_info(uint64_t *total_bytes, uint64_t *free_bytes)
+{
+    #ifdef USE_FATFS
+    return esp_vfs_fat_info(FS_MOUNT_POINT, total_bytes, free_bytes);
+    #else
+    size_t total = 0;
+    size_t used = 0;
+    esp_err_t ret = esp_littlefs_info(STORAGE_PARTITION_LABEL, &total, &used);
+    if (ret == ESP_OK)
+    {
+        *total_bytes = total;
+        *free_bytes = (used < total) ? total - used : 0;
+    }
+    return ret;
+    #endif
+}
+
 void filesystem_init(void)
 {
     if (initialized) 
@@ -19,8 +19,10 @@
 
 #pragma once
 
+#include <stdint.h>
 #include "esp_err.h"
 
 void filesystem_init(void);
 void filesystem_delete_config_files(void);
-void filesystem_delete_all(void); // delete all files and folders under FS_MOUNT_POINT
\ No newline at end of file
+void filesystem_delete_all(void); // delete all files and folders under FS_MOUNT_POINT
+esp_err_t filesystem_get_info(uint64_t *total_bytes, uint64_t *free_bytes);
\ No newline at end of file
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include "twai_host.h"
+
+typedef struct {
+	const char *trace_path;			// candump log to replay, NULL for the synthetic trace
+	const char *can_iface;			// SocketCAN interface for the live benchmarks, e.g. vcan0
+	uint32_t frames;				// frames per run, 0 for the benchmark's own default
+	bool quick;						// smoke test sizes, from ctest
+}bench_opts_t;
+
+typedef struct {
+	const char *name;
+	const char *description;
+	void (*run)(const bench_opts_t *opts);
+}bench_t;
+
+int64_t bench_now_ns(void);
+// One result line: time per operation and operations per second
+void bench_report(const char *bench, const char *what, uint64_t ops, int64_t ns);
+void bench_note(const char *bench, const char *format, ...) __attribute__((format(printf, 2, 3)));
+// The frames the CAN benchmarks feed in, count is a default the options override
+uint32_t bench_load_frames(const bench_opts_t *opts, uint32_t count, twai_host_frame_t **frames);
+// Heap allocations so far, for the paths that shouldn't allocate
+uint64_t bench_allocations(void);
+
+void bench_can_rx(const bench_opts_t *opts);
+void bench_expr(const bench_opts_t *opts);
+void bench_isotp(const bench_opts_t *opts);
+void bench_mqtt_canflt(const bench_opts_t *opts);
+void bench_encode(const bench_opts_t *opts);
+void bench_json(const bench_opts_t *opts);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Received frames from the TWAI driver to the ring readers, the way
+ * can_rx_task and the ELM327/MQTT tasks move them: can_receive() in batches,
+ * can_ring_push(), one can_ring_notify() per batch, each reader draining
+ * with its own cursor. Reports the producer rate and what each reader lost.
+ *
+ * With --can the frames come from a SocketCAN interface instead of a trace,
+ * e.g. "cangen vcan0 -g 0 -n 200000" in another shell.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "twai_host.h"
+#include "can.h"
+#include "can_ring.h"
+#include "bench.h"
+
+// Same as main.c
+#define CAN_RX_WAIT_MS			50
+#define CAN_RX_BATCH_MAX		32
+
+#define BENCH_READERS			2
+
+typedef struct {
+	can_ring_reader_t reader;
+	uint32_t frames;
+}bench_reader_t;
+
+static volatile bool producer_done;
+static SemaphoreHandle_t readers_done;
+static bench_reader_t readers[BENCH_READERS];
+
+static void bench_reader_task(void *param)
+{
+	bench_reader_t *r = param;
+	can_ring_frame_t frame;
+
+	while(1)
+	{
+		if(can_ring_read(&r->reader, &frame, pdMS_TO_TICKS(10)))
+		{
+			r->frames++;
+		}
+		else if(__atomic_load_n(&producer_done, __ATOMIC_ACQUIRE) && can_ring_available(&r->reader) == 0)
+		{
+			break;
+		}
+	}
+
+	xSemaphoreGive(readers_done);
+	vTaskDelete(NULL);
+}
+
+// The can_rx_task loop without the LED, websocket and TCP forwarding
+static uint32_t bench_rx_loop(uint32_t max_frames, int64_t max_us)
+{
+	int64_t start = esp_timer_get_time();
+	uint32_t frames = 0;
+	uint32_t idle = 0;
+
+	while(frames < max_frames && esp_timer_get_time() - start < max_us)
+	{
+		twai_message_t rx_msg;
+		uint32_t batch = 0;
+
+		esp_err_t ret = can_receive(&rx_msg, pdMS_TO_TICKS(CAN_RX_WAIT_MS));
+		if(ret != ESP_OK)
+		{
+			// A replayed trace is over once it times out
+			if(twai_host_replay_done() || ++idle > 40)
+			{
+				break;
+			}
+			continue;
+		}
+		idle = 0;
+
+		uint32_t queue_depth = can_msgs_to_rx() + 1;
+		do
+		{
+			can_ring_push(&rx_msg, esp_timer_get_time());
+			batch++;
+		}while(batch < CAN_RX_BATCH_MAX && can_receive(&rx_msg, 0) == ESP_OK);
+
+		can_ring_notify();
+		can_rx_stats_account(batch, queue_depth);
+		frames += batch;
+	}
+
+	return frames;
+}
+
+void bench_can_rx(const bench_opts_t *opts)
+{
+	twai_host_frame_t *trace = NULL;
+	uint32_t count = 0;
+	uint32_t frames;
+	int64_t start;
+
+	can_ring_init();
+	for(uint32_t i = 0; i < BENCH_READERS; i++)
+	{
+		readers[i].frames = 0;
+		if(!can_ring_reader_init(&readers[i].reader))
+		{
+			bench_note("can_rx", "no free ring reader");
+			return;
+		}
+	}
+	readers_done = xSemaphoreCreateCounting(BENCH_READERS, 0);
+	producer_done = false;
+
+	if(opts->can_iface != NULL)
+	{
+		if(twai_host_use_socketcan(opts->can_iface) != ESP_OK)
+		{
+			bench_note("can_rx", "can't open %s, skipped", opts->can_iface);
+			return;
+		}
+	}
+	else
+	{
+		count = bench_load_frames(opts, 1000000, &trace);
+		if(count == 0)
+		{
+			bench_note("can_rx", "no frames to replay");
+			return;
+		}
+		twai_host_use_replay(trace, count, 1);
+	}
+
+	can_init(CAN_500K);
+	can_enable();
+	// The enable timer lets frames through after 10 ms
+	vTaskDelay(pdMS_TO_TICKS(20));
+
+	for(uint32_t i = 0; i < BENCH_READERS; i++)
+	{
+		xTaskCreate(bench_reader_task, "bench_reader", 4096, &readers[i], 5, NULL);
+	}
+
+	start = bench_now_ns();
+	frames = bench_rx_loop(opts->can_iface ? (opts->frames ? opts->frames : 100000) : UINT32_MAX,
+							opts->quick ? 2000000 : 30000000);
+	bench_report("can_rx", opts->can_iface ? opts->can_iface : "replay, 2 ring readers", frames, bench_now_ns() - start);
+
+	__atomic_store_n(&producer_done, true, __ATOMIC_RELEASE);
+	can_ring_notify();
+	for(uint32_t i = 0; i < BENCH_READERS; i++)
+	{
+		xSemaphoreTake(readers_done, portMAX_DELAY);
+	}
+	for(uint32_t i = 0; i < BENCH_READERS; i++)
+	{
+		bench_note("can_rx", "reader %lu: %lu frames, %lu overwritten before read", (unsigned long)i,
+					(unsigned long)readers[i].frames, (unsigned long)readers[i].reader.overflows);
+	}
+
+	can_disable();
+	twai_host_use_peer();
+	free(trace);
+}
@@ -0,0 +1,178 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The streaming encoders of can_rx_task, GVRET for SavvyCAN, SLCAN and
+ * RealDash 66. GVRET and SLCAN pack a trace into dev_buffer segments and
+ * queue a pointer per full segment, the baseline is the path this replaced,
+ * one frame per xdev_buffer copied through the queue. RealDash still sends
+ * one frame per segment and only has the baseline. Both queues are
+ * drained right away, so the time includes the queue but no transport.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/twai.h"
+#include "types.h"
+#include "dev_buffer.h"
+#include "gvret.h"
+#include "slcan.h"
+#include "realdash.h"
+#include "bench.h"
+
+typedef uint16_t (*bench_encoder_t)(uint8_t *buf, uint16_t size, const twai_message_t *frame, int64_t timestamp);
+
+// RealDash frames are 20 bytes at most and the encoder doesn't check room
+static uint16_t bench_real_dash_66(uint8_t *buf, uint16_t size, const twai_message_t *frame, int64_t timestamp)
+{
+	if(size < 20)
+	{
+		return 0;
+	}
+
+	return real_dash_set_66((twai_message_t*)frame, buf);
+}
+
+static void bench_encode_report(const char *what, uint64_t frames, uint64_t bytes, uint64_t elements, int64_t ns)
+{
+	bench_report("encode", what, frames, ns);
+	bench_note("encode", "%.1f bytes/frame, %.0f MB/s, %.3f queue elements/frame", (double)bytes / frames,
+				ns ? bytes * 1e3 / ns : 0, (double)elements / frames);
+}
+
+// Before packing: each frame went into a cleared xdev_buffer that was copied
+// into the queue
+static void bench_encoder_per_frame(const char *what, bench_encoder_t encode, const twai_host_frame_t *trace, uint32_t count, uint32_t rounds)
+{
+	QueueHandle_t q = xQueueCreate(16, sizeof(xdev_buffer));
+	static xdev_buffer buf, out;
+	uint64_t bytes = 0, elements = 0;
+	volatile uint8_t sink = 0;
+	char name[64];
+
+	int64_t start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < count; i++)
+		{
+			memset(buf.ucElement, 0, sizeof(buf.ucElement));
+			buf.usLen = encode(buf.ucElement, sizeof(buf.ucElement), &trace[i].frame, trace[i].timestamp);
+			if(buf.usLen != 0)
+			{
+				xQueueSend(q, &buf, 0);
+				xQueueReceive(q, &out, 0);
+				sink ^= out.ucElement[0];
+				bytes += out.usLen;
+				elements++;
+			}
+		}
+	}
+	int64_t ns = bench_now_ns() - start;
+
+	snprintf(name, sizeof(name), "%s, 1 frame/buffer", what);
+	bench_encode_report(name, (uint64_t)count * rounds, bytes, elements, ns);
+	vQueueDelete(q);
+}
+
+// can_rx_task: frames are appended to a segment, it is queued when full
+static void bench_encoder_packed(const char *what, bench_encoder_t encode, QueueHandle_t q, const twai_host_frame_t *trace, uint32_t count, uint32_t rounds)
+{
+	uint64_t bytes = 0, elements = 0;
+	volatile uint8_t sink = 0;
+	dev_buffer_t *buf = NULL, *out;
+	char name[64];
+
+	int64_t start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < count; i++)
+		{
+			if(buf == NULL)
+			{
+				buf = dev_buffer_alloc(NULL, 0, 0);
+			}
+			uint16_t n = encode(&buf->data[buf->len], DEV_SEGMENT_SIZE - buf->len, &trace[i].frame, trace[i].timestamp);
+
+			if(n == 0)
+			{
+				// Segment full, can_rx_dispatch() queues it here
+				dev_buffer_send(q, buf, 0);
+				dev_buffer_free(buf);
+				dev_buffer_receive(q, &out, 0);
+				sink ^= out->data[0];
+				bytes += out->total_len;
+				elements++;
+				dev_buffer_free(out);
+				buf = dev_buffer_alloc(NULL, 0, 0);
+				n = encode(buf->data, DEV_SEGMENT_SIZE, &trace[i].frame, trace[i].timestamp);
+			}
+			dev_buffer_commit(buf, n);
+		}
+	}
+	if(buf != NULL)
+	{
+		bytes += buf->total_len;
+		elements++;
+		dev_buffer_free(buf);
+	}
+	int64_t ns = bench_now_ns() - start;
+
+	snprintf(name, sizeof(name), "%s, packed segments", what);
+	bench_encode_report(name, (uint64_t)count * rounds, bytes, elements, ns);
+}
+
+void bench_encode(const bench_opts_t *opts)
+{
+	twai_host_frame_t *trace;
+	uint32_t count = bench_load_frames(opts, 1000000, &trace);
+	uint32_t rounds = opts->quick ? 1 : 10;
+	static const struct {
+		const char *name;
+		bench_encoder_t encode;
+		bool packed;
+	}encoders[] = {
+		{"gvret_encode_frame", gvret_encode_frame, true},
+		{"slcan_encode_frame", slcan_encode_frame, true},
+		{"real_dash_set_66", bench_real_dash_66, false},
+	};
+
+	if(count == 0)
+	{
+		bench_note("encode", "no frames to encode");
+		return;
+	}
+
+	// Time base and scratch buffer of the GVRET encoder
+	gvret_init(NULL);
+	dev_buffer_init();
+	QueueHandle_t q = dev_buffer_queue_create(16, 16);
+	for(uint32_t e = 0; e < sizeof(encoders) / sizeof(encoders[0]); e++)
+	{
+		bench_encoder_per_frame(encoders[e].name, encoders[e].encode, trace, count, rounds);
+		if(encoders[e].packed)
+		{
+			bench_encoder_packed(encoders[e].name, encoders[e].encode, q, trace, count, rounds);
+		}
+	}
+
+	free(trace);
+}
@@ -0,0 +1,193 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every distinct expression of vehicle_profiles.json evaluated by the
+ * interpreter (evaluate_expression) and as a compiled program, on the same
+ * data. Also reports how many results differ, which should be none, and
+ * what the optimizer does to the expressions of each vehicle profile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "expression_parser.h"
+#include "profile_expressions.h"
+#include "bench.h"
+
+#define BENCH_DATA_LEN		1024
+
+// Instructions before and after optimizing, per vehicle profile
+static void bench_expr_profiles(void)
+{
+	vehicle_profile_t *profiles;
+	uint32_t count = profile_expressions_load_profiles(WICAN_VEHICLE_PROFILES, &profiles);
+
+	for(uint32_t p = 0; p < count; p++)
+	{
+		uint32_t unoptimized = 0, optimized = 0, regs = 0;
+
+		for(uint32_t e = 0; e < profiles[p].count; e++)
+		{
+			expr_program_t *program = compile_expression(profiles[p].expressions[e]);
+
+			if(program != NULL)
+			{
+				unoptimized += program->unoptimized_len;
+				optimized += program->code_len;
+				regs += program->regs_used;
+				free_compiled_expression(program);
+			}
+		}
+		bench_note("expr", "%-40.40s %3lu expressions, %4lu -> %4lu instructions, %lu registers", profiles[p].name,
+					(unsigned long)profiles[p].count, (unsigned long)unoptimized, (unsigned long)optimized, (unsigned long)regs);
+	}
+
+	profile_expressions_free_profiles(profiles, count);
+}
+
+void bench_expr(const bench_opts_t *opts)
+{
+	static uint8_t data[BENCH_DATA_LEN];
+	char **expressions;
+	uint32_t count = profile_expressions_load(WICAN_VEHICLE_PROFILES, &expressions);
+	expr_program_t **programs;
+	uint32_t rounds = opts->quick ? 20 : 2000;
+	uint32_t mismatches = 0, compiled_count = 0;
+	volatile double sink = 0;
+	char copy[256];
+	uint32_t skipped = 0;
+	int64_t start;
+
+	// The interpreter works on a copy, expressions that don't fit are left out
+	// of every run so both engines see the same set
+	for(uint32_t e = 0; e < count; e++)
+	{
+		if(strlen(expressions[e]) >= sizeof(copy))
+		{
+			free(expressions[e]);
+			skipped++;
+			continue;
+		}
+		expressions[e - skipped] = expressions[e];
+	}
+	count -= skipped;
+	if(skipped != 0)
+	{
+		bench_note("expr", "%lu expressions longer than %lu characters skipped", (unsigned long)skipped,
+					(unsigned long)sizeof(copy) - 1);
+	}
+
+	if(count == 0)
+	{
+		bench_note("expr", "no expressions in %s", WICAN_VEHICLE_PROFILES);
+		free(expressions);
+		return;
+	}
+
+	for(uint32_t i = 0; i < BENCH_DATA_LEN; i++)
+	{
+		data[i] = (uint8_t)(i * 37 + 11);
+	}
+
+	programs = calloc(count, sizeof(expr_program_t *));
+	start = bench_now_ns();
+	for(uint32_t e = 0; e < count; e++)
+	{
+		programs[e] = compile_expression(expressions[e]);
+		compiled_count += (programs[e] != NULL);
+	}
+	bench_report("expr", "compile", count, bench_now_ns() - start);
+
+	// What the optimizing pass does to the profiles
+	uint32_t unoptimized = 0, optimized = 0, with_regs = 0, regs = 0, consts = 0;
+	for(uint32_t e = 0; e < count; e++)
+	{
+		if(programs[e] != NULL)
+		{
+			unoptimized += programs[e]->unoptimized_len;
+			optimized += programs[e]->code_len;
+			consts += programs[e]->consts_len;
+			regs += programs[e]->regs_used;
+			with_regs += (programs[e]->regs_used != 0);
+		}
+	}
+	bench_note("expr", "instructions: %lu before optimizing, %lu after (%.1f%% fewer), %lu constants",
+				(unsigned long)unoptimized, (unsigned long)optimized,
+				unoptimized ? 100.0 * (unoptimized - optimized) / unoptimized : 0, (unsigned long)consts);
+	bench_note("expr", "registers: %lu in %lu expressions", (unsigned long)regs, (unsigned long)with_regs);
+	bench_expr_profiles();
+
+	start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t e = 0; e < count; e++)
+		{
+			double result = 0;
+
+			// The interpreter takes a writable string, the copy is part of its
+			// cost. Every expression left fits, see above
+			memcpy(copy, expressions[e], strlen(expressions[e]) + 1);
+			evaluate_expression((uint8_t *)copy, data, r, &result);
+			sink += result;
+		}
+	}
+	bench_report("expr", "interpreted", (uint64_t)rounds * count, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t e = 0; e < count; e++)
+		{
+			double result = 0;
+
+			if(programs[e] != NULL)
+			{
+				evaluate_compiled_expression(programs[e], data, BENCH_DATA_LEN, r, &result);
+			}
+			sink += result;
+		}
+	}
+	bench_report("expr", "compiled", (uint64_t)rounds * count, bench_now_ns() - start);
+
+	for(uint32_t e = 0; e < count; e++)
+	{
+		double interpreted = 0, compiled = 0;
+		bool ok_interpreted, ok_compiled = false;
+
+		memcpy(copy, expressions[e], strlen(expressions[e]) + 1);
+		ok_interpreted = evaluate_expression((uint8_t *)copy, data, 42, &interpreted);
+		if(programs[e] != NULL)
+		{
+			ok_compiled = evaluate_compiled_expression(programs[e], data, BENCH_DATA_LEN, 42, &compiled);
+		}
+		if(ok_interpreted != ok_compiled || (ok_compiled && interpreted != compiled && !(isnan(interpreted) && isnan(compiled))))
+		{
+			mismatches++;
+		}
+		free_compiled_expression(programs[e]);
+	}
+	bench_note("expr", "%lu expressions, %lu compiled, %lu results differ", (unsigned long)count,
+				(unsigned long)compiled_count, (unsigned long)mismatches);
+
+	free(programs);
+	profile_expressions_free(expressions, count);
+}
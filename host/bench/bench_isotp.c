@@ -0,0 +1,211 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * ISO-TP reassembly of ECU responses. The synthetic trace is segmented by a
+ * second link playing the ECU, so every reassembled message is also checked
+ * against what was sent. With --trace the frames of the OBD response IDs in
+ * the candump log are fed instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "isotp.h"
+#include "bench.h"
+
+#define BENCH_ECU_ID		0x7E8
+#define BENCH_TESTER_ID		0x7E0
+
+static const uint16_t bench_lengths[] = {5, 7, 18, 62, 250, 1000, ISOTP_MAX_LENGTH};
+#define BENCH_LENGTHS		(sizeof(bench_lengths) / sizeof(bench_lengths[0]))
+
+typedef struct {
+	twai_message_t *frames;
+	uint32_t count;
+	uint32_t size;
+}bench_trace_t;
+
+static void bench_trace_append(twai_message_t *frame, void *ctx)
+{
+	bench_trace_t *trace = (bench_trace_t *)ctx;
+
+	if(trace->count == trace->size)
+	{
+		trace->size = trace->size ? trace->size * 2 : 1024;
+		trace->frames = realloc(trace->frames, trace->size * sizeof(twai_message_t));
+	}
+	trace->frames[trace->count++] = *frame;
+}
+
+static void bench_discard(twai_message_t *frame, void *ctx)
+{
+}
+
+static void bench_fill(uint8_t *payload, uint16_t length, uint32_t message)
+{
+	for(uint16_t i = 0; i < length; i++)
+	{
+		payload[i] = (uint8_t)(message * 31 + i);
+	}
+}
+
+// Sends one message through the ECU link, the tester's flow control is a
+// single clear to send without limits
+static void bench_segment(isotp_link_t *ecu, isotp_session_t *session, const uint8_t *payload, uint16_t length)
+{
+	twai_message_t fc = {.identifier = BENCH_TESTER_ID, .data_length_code = 3, .data = {0x30, 0, 0}};
+
+	isotp_send(ecu, session, payload, length, 0);
+	if(session->state == ISOTP_TX_WAIT_FC)
+	{
+		isotp_on_frame(ecu, &fc, 0);
+		isotp_poll(ecu, 0);
+	}
+}
+
+static uint32_t bench_feed(isotp_link_t *link, const twai_message_t *frames, uint32_t count, uint64_t *bytes)
+{
+	uint32_t messages = 0;
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		isotp_session_t *session = isotp_on_frame(link, &frames[i], 0);
+
+		if(session != NULL && session->state == ISOTP_RX_DONE)
+		{
+			messages++;
+			*bytes += session->length;
+		}
+	}
+
+	return messages;
+}
+
+static void bench_isotp_trace(const bench_opts_t *opts)
+{
+	static uint8_t buf[ISOTP_MAX_SESSIONS][ISOTP_MAX_LENGTH];
+	twai_host_frame_t *loaded;
+	uint32_t count = bench_load_frames(opts, 0, &loaded);
+	twai_message_t *frames = malloc((count ? count : 1) * sizeof(twai_message_t));
+	isotp_link_t link;
+	uint32_t used = 0, sessions = 0;
+	uint64_t bytes = 0;
+
+	isotp_init(&link, bench_discard, NULL);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t id = loaded[i].frame.identifier;
+		bool obd = loaded[i].frame.extd ? ((id & 0xFFFF0000) == 0x18DA0000) : (id >= 0x7E8 && id <= 0x7EF);
+
+		if(!obd)
+		{
+			continue;
+		}
+		if(isotp_find(&link, id) == NULL && sessions < ISOTP_MAX_SESSIONS)
+		{
+			isotp_open(&link, 0, id, loaded[i].frame.extd, buf[sessions++], ISOTP_MAX_LENGTH);
+		}
+		frames[used++] = loaded[i].frame;
+	}
+
+	int64_t start = bench_now_ns();
+	uint32_t messages = bench_feed(&link, frames, used, &bytes);
+	bench_report("isotp", "trace frames, reassembled", used, bench_now_ns() - start);
+	bench_note("isotp", "%lu response frames of %lu, %lu messages, %llu bytes, %lu sequence errors",
+				(unsigned long)used, (unsigned long)count, (unsigned long)messages,
+				(unsigned long long)bytes, (unsigned long)link.seq_errors);
+
+	free(frames);
+	free(loaded);
+}
+
+void bench_isotp(const bench_opts_t *opts)
+{
+	static uint8_t payload[ISOTP_MAX_LENGTH];
+	static uint8_t buf[ISOTP_MAX_LENGTH];
+	uint32_t target = opts->frames ? opts->frames : (opts->quick ? 10000 : 1000000);
+	uint32_t rounds = opts->quick ? 2 : 20;
+	bench_trace_t trace = {0};
+	isotp_link_t ecu, link;
+	uint32_t sent = 0, messages = 0, mismatches = 0;
+	uint64_t bytes = 0;
+	int64_t start;
+
+	if(opts->trace_path != NULL)
+	{
+		bench_isotp_trace(opts);
+		return;
+	}
+
+	isotp_init(&ecu, bench_trace_append, &trace);
+	isotp_session_t *ecu_session = isotp_open(&ecu, BENCH_ECU_ID, BENCH_TESTER_ID, false, NULL, 0);
+
+	start = bench_now_ns();
+	while(trace.count < target)
+	{
+		uint16_t length = bench_lengths[sent % BENCH_LENGTHS];
+
+		bench_fill(payload, length, sent);
+		bench_segment(&ecu, ecu_session, payload, length);
+		sent++;
+	}
+	bench_report("isotp", "segment, frames sent", trace.count, bench_now_ns() - start);
+
+	// Checked once, outside the timed runs
+	isotp_init(&link, bench_discard, NULL);
+	isotp_session_t *session = isotp_open(&link, BENCH_TESTER_ID, BENCH_ECU_ID, false, buf, sizeof(buf));
+	for(uint32_t i = 0; i < trace.count; i++)
+	{
+		if(isotp_on_frame(&link, &trace.frames[i], 0) == session && session->state == ISOTP_RX_DONE)
+		{
+			uint16_t length = bench_lengths[messages % BENCH_LENGTHS];
+
+			bench_fill(payload, length, messages);
+			mismatches += (session->length != length || memcmp(buf, payload, length) != 0);
+			messages++;
+		}
+	}
+
+	start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		bench_feed(&link, trace.frames, trace.count, &bytes);
+	}
+	int64_t ns = bench_now_ns() - start;
+	bench_report("isotp", "reassemble, frames received", (uint64_t)trace.count * rounds, ns);
+	bench_note("isotp", "%.1f MB/s of payload", ns ? bytes * 1e3 / ns : 0);
+
+	// What the text path does, sessions without a buffer
+	isotp_init(&link, bench_discard, NULL);
+	isotp_open(&link, BENCH_TESTER_ID, BENCH_ECU_ID, false, NULL, 0);
+	bytes = 0;
+	start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		bench_feed(&link, trace.frames, trace.count, &bytes);
+	}
+	bench_report("isotp", "track only, frames received", (uint64_t)trace.count * rounds, bench_now_ns() - start);
+
+	bench_note("isotp", "%lu messages sent, %lu reassembled, %lu differ, %lu sequence errors",
+				(unsigned long)sent, (unsigned long)messages, (unsigned long)mismatches, (unsigned long)link.seq_errors);
+
+	free(trace.frames);
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * One autopid publish of 200 parameters into the preallocated buffer, the
+ * way autopid_publish_all_parameters() builds it, and the number formatting
+ * on its own against the printf calls the cJSON tree went through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "json_writer.h"
+#include "bench.h"
+
+#define BENCH_JSON_PARAMS		200
+#define BENCH_JSON_VALUES		4096
+
+// formatNumberPrecision(), atof() and cJSON's "%1.15g" of the old publish
+static size_t bench_printf_number(char *out, double value)
+{
+	char fixed[32];
+
+	snprintf(fixed, sizeof(fixed), "%.2f", value);
+	double d = strtod(fixed, NULL);
+	size_t len = snprintf(out, JSON_NUMBER_MAX_LEN, "%1.15g", d);
+	if(fabs(strtod(out, NULL) - d) > fmax(fabs(d), DBL_MIN) * DBL_EPSILON)
+	{
+		len = snprintf(out, JSON_NUMBER_MAX_LEN, "%1.17g", d);
+	}
+	return len;
+}
+
+static void bench_json_numbers(const double *values, uint32_t rounds)
+{
+	char out[JSON_NUMBER_MAX_LEN];
+	uint64_t ops = (uint64_t)BENCH_JSON_VALUES * rounds;
+	volatile size_t sink = 0;
+
+	int64_t start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < BENCH_JSON_VALUES; i++)
+		{
+			sink += json_format_number(out, values[i]);
+		}
+	}
+	bench_report("json", "json_format_number", ops, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < BENCH_JSON_VALUES; i++)
+		{
+			sink += bench_printf_number(out, values[i]);
+		}
+	}
+	bench_report("json", "printf \"%.2f\", strtod, \"%1.15g\"", ops, bench_now_ns() - start);
+}
+
+void bench_json(const bench_opts_t *opts)
+{
+	uint32_t rounds = opts->quick ? 100 : 20000;
+	char *keys[BENCH_JSON_PARAMS];
+	double *values = malloc(BENCH_JSON_VALUES * sizeof(double));
+	size_t size = 3;
+	uint64_t bytes = 0;
+	json_writer_t writer;
+
+	// Names and readings like a vehicle profile's: a few decimals, mixed scales
+	srand(1);
+	for(uint32_t i = 0; i < BENCH_JSON_PARAMS; i++)
+	{
+		char name[32];
+
+		snprintf(name, sizeof(name), "PARAM_%u_%s", i, (i % 3) ? "TEMP" : "PRESSURE");
+		keys[i] = json_writer_make_key(name);
+		size += strlen(keys[i]) + JSON_NUMBER_MAX_LEN + 1;
+	}
+	for(uint32_t i = 0; i < BENCH_JSON_VALUES; i++)
+	{
+		values[i] = (rand() % 200000 - 50000) / pow(10, rand() % 4);
+	}
+	char *buf = malloc(size);
+
+	uint64_t allocs = bench_allocations();
+	int64_t start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		json_writer_init(&writer, buf, size);
+		json_writer_begin_object(&writer);
+		for(uint32_t i = 0; i < BENCH_JSON_PARAMS; i++)
+		{
+			json_writer_key(&writer, keys[i]);
+			json_writer_number(&writer, values[(r * 7 + i) % BENCH_JSON_VALUES]);
+		}
+		json_writer_end_object(&writer);
+		const char *json = json_writer_finish(&writer);
+		bytes += (json != NULL) ? writer.len : 0;
+	}
+	int64_t ns = bench_now_ns() - start;
+	allocs = bench_allocations() - allocs;
+
+	bench_report("json", "publish of 200 parameters", rounds, ns);
+	bench_note("json", "%.0f bytes/publish, %.0f MB/s, %.2f allocations/publish", (double)bytes / rounds,
+				ns ? bytes * 1e3 / ns : 0, (double)allocs / rounds);
+
+	bench_json_numbers(values, opts->quick ? 10 : 1000);
+
+	for(uint32_t i = 0; i < BENCH_JSON_PARAMS; i++)
+	{
+		free(keys[i]);
+	}
+	free(values);
+	free(buf);
+}
@@ -0,0 +1,175 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark runner for the host build
+ *
+ *   wican_bench [--trace candump.log] [--can vcan0] [--frames N] [--quick] [name ...]
+ *
+ * Without names every benchmark runs. CAN frames come from the candump log
+ * (e.g. a recording converted with tools/wican-trace) or a synthetic trace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "esp_log.h"
+#include "bench.h"
+
+static const bench_t benchmarks[] = {
+	{"can_rx", "driver to ring readers, the can_rx_task loop", bench_can_rx},
+	{"expr", "profile expressions, interpreted and compiled", bench_expr},
+	{"isotp", "ISO-TP segmentation and reassembly of ECU responses", bench_isotp},
+	{"canflt", "MQTT CAN filter ID lookup vs linear scan, decoding a replayed trace", bench_mqtt_canflt},
+	{"encode", "GVRET, SLCAN and RealDash encoders, packed vs 1 frame per buffer", bench_encode},
+	{"json", "autopid JSON publish of 200 parameters, no allocations", bench_json},
+};
+
+#define BENCH_COUNT		(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int64_t bench_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void bench_report(const char *bench, const char *what, uint64_t ops, int64_t ns)
+{
+	double per_op = ops ? (double)ns / ops : 0;
+	double per_sec = ns ? (double)ops * 1e9 / ns : 0;
+
+	printf("%-10s %-40s %12.1f ns/op %14.0f /s\n", bench, what, per_op, per_sec);
+	fflush(stdout);
+}
+
+void bench_note(const char *bench, const char *format, ...)
+{
+	va_list args;
+
+	printf("%-10s ", bench);
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	putchar('\n');
+	fflush(stdout);
+}
+
+uint32_t bench_load_frames(const bench_opts_t *opts, uint32_t count, twai_host_frame_t **frames)
+{
+	if(opts->trace_path != NULL)
+	{
+		return twai_host_load_candump(opts->trace_path, frames);
+	}
+
+	if(opts->frames != 0)
+	{
+		count = opts->frames;
+	}
+	else if(opts->quick)
+	{
+		count = (count > 10000) ? 10000 : count;
+	}
+
+	return twai_host_synth_trace(count, 1, frames);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: wican_bench [--trace candump.log] [--can iface] [--frames N] [--quick] [name ...]\n");
+	for(uint32_t i = 0; i < BENCH_COUNT; i++)
+	{
+		fprintf(stderr, "  %-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bench_opts_t opts = {0};
+	const char *names[BENCH_COUNT];
+	uint32_t name_count = 0;
+
+	esp_log_level_set("*", ESP_LOG_ERROR);
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			opts.trace_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--can") == 0 && i + 1 < argc)
+		{
+			opts.can_iface = argv[++i];
+		}
+		else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+		{
+			opts.frames = strtoul(argv[++i], NULL, 0);
+		}
+		else if(strcmp(argv[i], "--quick") == 0)
+		{
+			opts.quick = true;
+		}
+		else if(argv[i][0] != '-' && name_count < BENCH_COUNT)
+		{
+			names[name_count++] = argv[i];
+		}
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+
+	for(uint32_t n = 0; n < name_count; n++)
+	{
+		bool found = false;
+
+		for(uint32_t i = 0; i < BENCH_COUNT; i++)
+		{
+			found |= (strcmp(names[n], benchmarks[i].name) == 0);
+		}
+		if(!found)
+		{
+			fprintf(stderr, "unknown benchmark %s\n", names[n]);
+			usage();
+			return 2;
+		}
+	}
+
+	for(uint32_t i = 0; i < BENCH_COUNT; i++)
+	{
+		bool selected = (name_count == 0);
+
+		for(uint32_t n = 0; n < name_count; n++)
+		{
+			selected |= (strcmp(names[n], benchmarks[i].name) == 0);
+		}
+		if(selected)
+		{
+			benchmarks[i].run(&opts);
+		}
+	}
+
+	return 0;
+}
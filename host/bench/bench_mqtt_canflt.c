@@ -0,0 +1,323 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The MQTT CAN filter path of mqtt_task: a trace replayed through can.c and
+ * the ring, one reader draining the ring and decoding the filters. The same
+ * reader paced one frame per tick, as the task used to be, shows what that
+ * loses. The filters cover the OBD answers and the first IDs of the trace.
+ * The ID lookup alone is compared with the linear scan it replaced, from a
+ * few filters up to a few hundred.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "twai_host.h"
+#include "can.h"
+#include "can_ring.h"
+#include "mqtt_canflt.h"
+#include "bench.h"
+
+#define BENCH_FILTERS			16
+#define BENCH_CAN_RX_BATCH_MAX	32
+#define BENCH_LOOKUP_FILTERS_MAX	512
+
+typedef struct {
+	can_ring_reader_t reader;
+	bool paced;
+	uint32_t frames;
+	uint32_t values;
+	double sum;
+}bench_filter_reader_t;
+
+static mqtt_canflt_t bench_flt;
+static volatile bool bench_producer_done;
+static SemaphoreHandle_t bench_reader_done;
+
+static void bench_on_value(const CANFilter *filter, double value, void *ctx)
+{
+	bench_filter_reader_t *r = ctx;
+
+	r->values++;
+	r->sum += value;
+}
+
+static void bench_add_filter(uint32_t id, int32_t pid, uint32_t start_bit, uint32_t bit_length, const char *expression)
+{
+	CANFilter *f = &bench_flt.values[bench_flt.size++];
+
+	f->can_id = id;
+	snprintf(f->name, sizeof(f->name), "f%lu", (unsigned long)bench_flt.size);
+	f->pid = pid;
+	f->pidi = 2;
+	f->start_bit = start_bit;
+	f->bit_length = bit_length;
+	snprintf(f->expression, sizeof(f->expression), "%s", expression);
+	f->program = compile_expression(f->expression);
+}
+
+static void bench_build_filters(const twai_host_frame_t *frames, uint32_t count)
+{
+	bench_flt.values = calloc(BENCH_FILTERS, sizeof(CANFilter));
+	bench_flt.size = 0;
+
+	// RPM and coolant, like the example filters of the web UI
+	bench_add_filter(0x7E8, 0x0C, 24, 16, "V/4");
+	bench_add_filter(0x7EC, 0x05, 24, 8, "V-40");
+	for(uint32_t i = 0; i < count && bench_flt.size < BENCH_FILTERS; i++)
+	{
+		uint16_t first, n;
+
+		if(frames[i].frame.data_length_code < 2 || mqtt_canflt_find_id(&bench_flt, frames[i].frame.identifier, &first, &n))
+		{
+			continue;
+		}
+		bench_add_filter(frames[i].frame.identifier, -1, 0, 16, "V*0.1+[B0:B1]");
+		// The index is rebuilt so the lookup above sees the new ID
+		free(bench_flt.index);
+		mqtt_canflt_build_index(&bench_flt);
+	}
+}
+
+// The lookup mqtt_task used before the index: the whole table is scanned for
+// every frame, and again from each match for the next filter of the ID
+static int32_t bench_linear_find_id(const mqtt_canflt_t *flt, uint32_t id, uint32_t start_index)
+{
+	for(uint32_t i = start_index; i < flt->size; i++)
+	{
+		if(flt->values[i].can_id == id)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Filters on the first distinct IDs of the trace, then on IDs the trace
+// doesn't use. Only the lookup is timed, so the filters have no program.
+static void bench_lookup(const twai_host_frame_t *frames, uint32_t count, uint32_t filters, uint32_t rounds)
+{
+	mqtt_canflt_t flt = {0};
+	uint64_t hash_matches = 0, linear_matches = 0;
+	volatile uint32_t sink = 0;
+	char what[64];
+
+	flt.values = calloc(filters, sizeof(CANFilter));
+	if(flt.values == NULL)
+	{
+		return;
+	}
+	for(uint32_t i = 0; i < count && flt.size < filters; i++)
+	{
+		if(bench_linear_find_id(&flt, frames[i].frame.identifier, 0) < 0)
+		{
+			flt.values[flt.size++].can_id = frames[i].frame.identifier;
+		}
+	}
+	uint32_t on_trace = flt.size;
+	for(uint32_t id = 0x10000000; flt.size < filters; id++)
+	{
+		flt.values[flt.size++].can_id = id;
+	}
+	if(!mqtt_canflt_build_index(&flt))
+	{
+		mqtt_canflt_free(&flt);
+		return;
+	}
+
+	int64_t start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < count; i++)
+		{
+			uint16_t first, n;
+
+			if(mqtt_canflt_find_id(&flt, frames[i].frame.identifier, &first, &n))
+			{
+				sink += first;
+				hash_matches += n;
+			}
+		}
+	}
+	snprintf(what, sizeof(what), "find_id index, %lu filters", (unsigned long)filters);
+	bench_report("canflt", what, (uint64_t)count * rounds, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < count; i++)
+		{
+			int32_t found;
+			uint32_t start_index = 0;
+
+			while((found = bench_linear_find_id(&flt, frames[i].frame.identifier, start_index)) >= 0)
+			{
+				sink += found;
+				linear_matches++;
+				start_index = found + 1;
+			}
+		}
+	}
+	snprintf(what, sizeof(what), "find_id linear scan, %lu filters", (unsigned long)filters);
+	bench_report("canflt", what, (uint64_t)count * rounds, bench_now_ns() - start);
+	bench_note("canflt", "%lu filters on trace IDs, %s matches", (unsigned long)on_trace,
+				(hash_matches == linear_matches) ? "same" : "DIFFERENT");
+
+	mqtt_canflt_free(&flt);
+}
+
+// mqtt_task's CAN filter loop
+static void bench_filter_task(void *param)
+{
+	bench_filter_reader_t *r = param;
+	can_ring_frame_t item;
+
+	while(!__atomic_load_n(&bench_producer_done, __ATOMIC_ACQUIRE) || can_ring_available(&r->reader) != 0)
+	{
+		can_ring_wait(&r->reader, pdMS_TO_TICKS(10));
+		while(can_ring_read(&r->reader, &item, 0))
+		{
+			r->frames++;
+			mqtt_canflt_process(&bench_flt, &item.frame, esp_timer_get_time(), bench_on_value, r);
+			if(r->paced)
+			{
+				break;
+			}
+		}
+		if(r->paced)
+		{
+			vTaskDelay(pdMS_TO_TICKS(1));
+		}
+	}
+
+	xSemaphoreGive(bench_reader_done);
+	vTaskDelete(NULL);
+}
+
+static uint32_t bench_produce(int64_t max_us)
+{
+	int64_t start = esp_timer_get_time();
+	uint32_t frames = 0;
+	twai_message_t rx_msg;
+
+	while(esp_timer_get_time() - start < max_us)
+	{
+		uint32_t batch = 0;
+
+		if(can_receive(&rx_msg, pdMS_TO_TICKS(50)) != ESP_OK)
+		{
+			if(twai_host_replay_done())
+			{
+				break;
+			}
+			continue;
+		}
+		do
+		{
+			can_ring_push(&rx_msg, esp_timer_get_time());
+			batch++;
+		}while(batch < BENCH_CAN_RX_BATCH_MAX && can_receive(&rx_msg, 0) == ESP_OK);
+		can_ring_notify();
+		frames += batch;
+	}
+
+	return frames;
+}
+
+static void bench_replay(const twai_host_frame_t *trace, uint32_t count, bool paced, bool quick)
+{
+	static bench_filter_reader_t r;
+	const char *what = paced ? "replay, reader paced 1 frame/tick" : "replay, reader drains the ring";
+
+	r = (bench_filter_reader_t){.paced = paced};
+	can_ring_init();
+	if(!can_ring_reader_init(&r.reader))
+	{
+		bench_note("canflt", "no free ring reader");
+		return;
+	}
+	bench_producer_done = false;
+
+	twai_host_use_replay(trace, count, 1);
+	can_init(CAN_500K);
+	can_enable();
+	vTaskDelay(pdMS_TO_TICKS(20));
+	xTaskCreate(bench_filter_task, "bench_filter", 4096, &r, 5, NULL);
+
+	int64_t start = bench_now_ns();
+	uint32_t frames = bench_produce(quick ? 2000000 : 30000000);
+	__atomic_store_n(&bench_producer_done, true, __ATOMIC_RELEASE);
+	can_ring_notify();
+	xSemaphoreTake(bench_reader_done, portMAX_DELAY);
+	bench_report("canflt", what, frames, bench_now_ns() - start);
+	bench_note("canflt", "%lu frames decoded, %lu values, %lu overwritten before read",
+				(unsigned long)r.frames, (unsigned long)r.values, (unsigned long)r.reader.overflows);
+
+	can_disable();
+	twai_host_use_peer();
+}
+
+void bench_mqtt_canflt(const bench_opts_t *opts)
+{
+	twai_host_frame_t *trace;
+	uint32_t count = bench_load_frames(opts, 1000000, &trace);
+	bench_filter_reader_t direct = {0};
+	uint32_t rounds = opts->quick ? 1 : 10;
+
+	if(count == 0)
+	{
+		bench_note("canflt", "no frames to replay");
+		return;
+	}
+
+	bench_build_filters(trace, count);
+	bench_reader_done = xSemaphoreCreateCounting(1, 0);
+
+	// The filter lookup and decoding alone, without the ring
+	int64_t start = bench_now_ns();
+	for(uint32_t r = 0; r < rounds; r++)
+	{
+		for(uint32_t i = 0; i < count; i++)
+		{
+			mqtt_canflt_process(&bench_flt, &trace[i].frame, 0, bench_on_value, &direct);
+		}
+	}
+	bench_report("canflt", "lookup and decode", (uint64_t)count * rounds, bench_now_ns() - start);
+	bench_note("canflt", "%lu filters, %lu values from %lu frames", (unsigned long)bench_flt.size,
+				(unsigned long)direct.values, (unsigned long)count * rounds);
+
+	static const uint32_t lookup_filters[] = {16, 128, BENCH_LOOKUP_FILTERS_MAX};
+	for(uint32_t i = 0; i < sizeof(lookup_filters) / sizeof(lookup_filters[0]); i++)
+	{
+		bench_lookup(trace, count, lookup_filters[i], rounds);
+	}
+
+	bench_replay(trace, count, false, opts->quick);
+	// A short trace is enough to show the paced reader falling behind
+	bench_replay(trace, (count > 20000) ? 20000 : count, true, opts->quick);
+
+	mqtt_canflt_free(&bench_flt);
+	free(trace);
+}
@@ -0,0 +1,312 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "driver/gpio.h"
+#include "host_os.h"
+
+/* esp_err */
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	switch(code)
+	{
+		case ESP_OK:					return "ESP_OK";
+		case ESP_FAIL:					return "ESP_FAIL";
+		case ESP_ERR_NO_MEM:			return "ESP_ERR_NO_MEM";
+		case ESP_ERR_INVALID_ARG:		return "ESP_ERR_INVALID_ARG";
+		case ESP_ERR_INVALID_STATE:		return "ESP_ERR_INVALID_STATE";
+		case ESP_ERR_INVALID_SIZE:		return "ESP_ERR_INVALID_SIZE";
+		case ESP_ERR_NOT_FOUND:			return "ESP_ERR_NOT_FOUND";
+		case ESP_ERR_NOT_SUPPORTED:		return "ESP_ERR_NOT_SUPPORTED";
+		case ESP_ERR_TIMEOUT:			return "ESP_ERR_TIMEOUT";
+		case ESP_ERR_INVALID_RESPONSE:	return "ESP_ERR_INVALID_RESPONSE";
+		case ESP_ERR_INVALID_CRC:		return "ESP_ERR_INVALID_CRC";
+		case ESP_ERR_INVALID_VERSION:	return "ESP_ERR_INVALID_VERSION";
+		case ESP_ERR_NOT_FINISHED:		return "ESP_ERR_NOT_FINISHED";
+		default:						return "UNKNOWN ERROR";
+	}
+}
+
+/* esp_log */
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+	// Per tag levels aren't kept, TAG is __func__ in most modules anyway
+	if(tag != NULL && strcmp(tag, "*") == 0)
+	{
+		host_log_level = level;
+	}
+}
+
+void host_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+	static const char letters[] = "NEWIDV";
+	va_list args;
+
+	fprintf(stderr, "%c (%lld) %s: ", letters[level], (long long)(host_time_us() / 1000), tag);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+
+void host_log_buffer_hex(const char *tag, const void *buffer, uint16_t length)
+{
+	const uint8_t *p = buffer;
+
+	fprintf(stderr, "I (%lld) %s:", (long long)(host_time_us() / 1000), tag);
+	for(uint16_t i = 0; i < length; i++)
+	{
+		fprintf(stderr, " %02x", p[i]);
+	}
+	fputc('\n', stderr);
+}
+
+/* esp_rom_crc */
+
+uint16_t esp_rom_crc16_le(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	crc = ~crc;
+	for(uint32_t i = 0; i < len; i++)
+	{
+		crc ^= buf[i];
+		for(uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+		}
+	}
+
+	return ~crc;
+}
+
+/* gpio */
+
+#define HOST_GPIO_COUNT		64
+
+static uint8_t gpio_levels[HOST_GPIO_COUNT];
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+	if(gpio_num < 0 || gpio_num >= HOST_GPIO_COUNT)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+	__atomic_store_n(&gpio_levels[gpio_num], level ? 1 : 0, __ATOMIC_RELAXED);
+
+	return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+	if(gpio_num < 0 || gpio_num >= HOST_GPIO_COUNT)
+	{
+		return 0;
+	}
+
+	return __atomic_load_n(&gpio_levels[gpio_num], __ATOMIC_RELAXED);
+}
+
+/* esp_timer, callbacks run on one thread per timer instead of the timer task */
+
+struct host_esp_timer {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t thread;
+	bool thread_started;
+	bool active;
+	uint32_t generation;
+	uint64_t period_us;				// 0 for one shot
+	struct timespec expiry;
+	esp_timer_cb_t callback;
+	void *arg;
+};
+
+int64_t esp_timer_get_time(void)
+{
+	return host_time_us();
+}
+
+static void *esp_timer_thread(void *param)
+{
+	struct host_esp_timer *timer = param;
+
+	pthread_mutex_lock(&timer->lock);
+	while(1)
+	{
+		while(!timer->active)
+		{
+			pthread_cond_wait(&timer->changed, &timer->lock);
+		}
+
+		uint32_t generation = timer->generation;
+		struct timespec expiry = timer->expiry;
+
+		if(host_cond_wait(&timer->changed, &timer->lock, &expiry) || generation != timer->generation)
+		{
+			continue;
+		}
+
+		if(timer->period_us != 0)
+		{
+			host_deadline_us(timer->period_us, &timer->expiry);
+		}
+		else
+		{
+			timer->active = false;
+		}
+		pthread_mutex_unlock(&timer->lock);
+		timer->callback(timer->arg);
+		pthread_mutex_lock(&timer->lock);
+	}
+
+	return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out_handle)
+{
+	struct host_esp_timer *timer;
+
+	if(args == NULL || args->callback == NULL || out_handle == NULL)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	timer = calloc(1, sizeof(struct host_esp_timer));
+	if(timer == NULL)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	pthread_mutex_init(&timer->lock, NULL);
+	host_cond_init(&timer->changed);
+	timer->callback = args->callback;
+	timer->arg = args->arg;
+	*out_handle = timer;
+
+	return ESP_OK;
+}
+
+static esp_err_t esp_timer_start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us)
+{
+	esp_err_t ret = ESP_OK;
+
+	pthread_mutex_lock(&timer->lock);
+	if(timer->active)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else if(!timer->thread_started && pthread_create(&timer->thread, NULL, esp_timer_thread, timer) != 0)
+	{
+		ret = ESP_ERR_NO_MEM;
+	}
+	else
+	{
+		if(!timer->thread_started)
+		{
+			pthread_detach(timer->thread);
+			timer->thread_started = true;
+		}
+		host_deadline_us(timeout_us, &timer->expiry);
+		timer->period_us = period_us;
+		timer->active = true;
+		timer->generation++;
+		pthread_cond_broadcast(&timer->changed);
+	}
+	pthread_mutex_unlock(&timer->lock);
+
+	return ret;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+	return esp_timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us)
+{
+	return esp_timer_start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	esp_err_t ret = ESP_OK;
+
+	pthread_mutex_lock(&timer->lock);
+	if(!timer->active)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	timer->active = false;
+	timer->generation++;
+	pthread_cond_broadcast(&timer->changed);
+	pthread_mutex_unlock(&timer->lock);
+
+	return ret;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+	// The thread may still hold the timer, it is stopped and left to it
+	if(esp_timer_is_active(timer))
+	{
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer)
+{
+	bool active;
+
+	pthread_mutex_lock(&timer->lock);
+	active = timer->active;
+	pthread_mutex_unlock(&timer->lock);
+
+	return active;
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if(size != 0)
+	{
+		size_t n = (len < size) ? len : size - 1;
+
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+
+	return len;
+}
+#endif
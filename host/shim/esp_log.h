@@ -0,0 +1,63 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Logs go to stderr, below the level set with esp_log_level_set("*", ...)
+// only. The default is ESP_LOG_WARN so benchmarks aren't slowed down.
+
+#ifndef __HOST_ESP_LOG_H__
+#define __HOST_ESP_LOG_H__
+#include <stdint.h>
+#include <inttypes.h>
+
+typedef enum {
+	ESP_LOG_NONE,
+	ESP_LOG_ERROR,
+	ESP_LOG_WARN,
+	ESP_LOG_INFO,
+	ESP_LOG_DEBUG,
+	ESP_LOG_VERBOSE
+}esp_log_level_t;
+
+extern esp_log_level_t host_log_level;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+void host_log_write(esp_log_level_t level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+void host_log_buffer_hex(const char *tag, const void *buffer, uint16_t length);
+
+#define ESP_LOG_LEVEL(level, tag, format, ...) do {											\
+		if((level) <= host_log_level) host_log_write(level, tag, format, ##__VA_ARGS__);		\
+	} while(0)
+
+#define ESP_LOGE(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)	ESP_LOG_LEVEL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#define ESP_LOG_BUFFER_HEX(tag, buffer, length) do {											\
+		if(ESP_LOG_INFO <= host_log_level) host_log_buffer_hex(tag, buffer, length);			\
+	} while(0)
+#define ESP_LOG_BUFFER_HEX_LEVEL(tag, buffer, length, level) do {								\
+		if((level) <= host_log_level) host_log_buffer_hex(tag, buffer, length);				\
+	} while(0)
+#define ESP_LOG_BUFFER_HEXDUMP(tag, buffer, length, level)	ESP_LOG_BUFFER_HEX_LEVEL(tag, buffer, length, level)
+#define ESP_LOG_BUFFER_CHAR(tag, buffer, length)			ESP_LOG_BUFFER_HEX(tag, buffer, length)
+
+#endif
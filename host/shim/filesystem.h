@@ -0,0 +1,29 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HOST_FILESYSTEM_H__
+#define __HOST_FILESYSTEM_H__
+#include <stdint.h>
+#include "esp_err.h"
+
+// Size of the filesystem holding FS_MOUNT_POINT, as the LittleFS partition
+esp_err_t filesystem_get_info(uint64_t *total_bytes, uint64_t *free_bytes);
+
+#endif
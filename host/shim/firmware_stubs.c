@@ -0,0 +1,67 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Firmware functions outside the host build that the built modules call,
+// with the values of a default configuration
+
+#include <stdint.h>
+#include <sys/statvfs.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "config_server.h"
+#include "comm_server.h"
+#include "sleep_mode.h"
+#include "filesystem.h"
+
+int8_t config_server_get_can_rate(void)
+{
+	return CAN_500K;
+}
+
+int8_t config_server_get_can_mode(void)
+{
+	return CAN_NORMAL;
+}
+
+// Reports a connected host, which keeps the GVRET discovery broadcast quiet
+int8_t tcp_port_open(void)
+{
+	return 1;
+}
+
+// No voltage reading, ATRV answers like before the first ADC sample
+int8_t sleep_mode_get_voltage(float *val)
+{
+	return -1;
+}
+
+// The host filesystem stands in for the LittleFS partition
+esp_err_t filesystem_get_info(uint64_t *total_bytes, uint64_t *free_bytes)
+{
+	struct statvfs st;
+
+	if(statvfs(FS_MOUNT_POINT, &st) != 0)
+	{
+		return ESP_FAIL;
+	}
+	*total_bytes = (uint64_t)st.f_blocks * st.f_frsize;
+	*free_bytes = (uint64_t)st.f_bavail * st.f_frsize;
+	return ESP_OK;
+}
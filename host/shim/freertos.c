@@ -0,0 +1,724 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "freertos/timers.h"
+#include "host_os.h"
+
+/*
+ * FreeRTOS on pthreads. Priorities and core affinity are ignored, the host
+ * scheduler runs the tasks in parallel, so anything that relies on a higher
+ * priority task never being preempted by a lower one isn't modelled.
+ */
+
+static pthread_mutex_t critical_lock;
+static pthread_once_t critical_once = PTHREAD_ONCE_INIT;
+
+static void critical_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&critical_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void host_critical_enter(void)
+{
+	pthread_once(&critical_once, critical_init);
+	pthread_mutex_lock(&critical_lock);
+}
+
+void host_critical_exit(void)
+{
+	pthread_mutex_unlock(&critical_lock);
+}
+
+int64_t host_time_us(void)
+{
+	static int64_t start = 0;
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	if(start == 0)
+	{
+		// First call is process start as far as the firmware can tell
+		int64_t expected = 0;
+		__atomic_compare_exchange_n(&start, &expected, us - 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+
+	return us - __atomic_load_n(&start, __ATOMIC_RELAXED);
+}
+
+void host_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void host_deadline_us(uint64_t us, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += us / 1000000;
+	deadline->tv_nsec += (us % 1000000) * 1000;
+	if(deadline->tv_nsec >= 1000000000)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+const struct timespec *host_deadline(TickType_t ticks_to_wait, struct timespec *deadline)
+{
+	if(ticks_to_wait == portMAX_DELAY)
+	{
+		return NULL;
+	}
+
+	host_deadline_us((uint64_t)pdTICKS_TO_MS(ticks_to_wait) * 1000, deadline);
+	return deadline;
+}
+
+bool host_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline)
+{
+	if(deadline == NULL)
+	{
+		pthread_cond_wait(cond, mutex);
+		return true;
+	}
+
+	return pthread_cond_timedwait(cond, mutex, deadline) != ETIMEDOUT;
+}
+
+/* Tasks */
+
+struct host_task {
+	pthread_t thread;
+	TaskFunction_t function;
+	void *param;
+};
+
+static __thread struct host_task *current_task = NULL;
+
+static void *task_entry(void *arg)
+{
+	struct host_task *task = arg;
+
+	current_task = task;
+	task->function(task->param);
+
+	return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *param,
+						UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+	struct host_task *task = calloc(1, sizeof(struct host_task));
+	pthread_attr_t attr;
+
+	(void)name;
+	(void)priority;
+	(void)core;
+
+	if(task == NULL)
+	{
+		return pdFAIL;
+	}
+
+	task->function = function;
+	task->param = param;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	// Firmware stacks are sized in bytes for the ESP32, leave room for the host ABI
+	pthread_attr_setstacksize(&attr, (stack_depth < 16384 ? 16384 : stack_depth) * 4);
+	if(pthread_create(&task->thread, &attr, task_entry, task) != 0)
+	{
+		pthread_attr_destroy(&attr);
+		free(task);
+		return pdFAIL;
+	}
+	pthread_attr_destroy(&attr);
+
+	if(handle != NULL)
+	{
+		*handle = task;
+	}
+
+	return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *param,
+						UBaseType_t priority, TaskHandle_t *handle)
+{
+	return xTaskCreatePinnedToCore(function, name, stack_depth, param, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+	// Only self deletion is supported, it is the only form the firmware uses
+	if(task == NULL || task == current_task)
+	{
+		pthread_exit(NULL);
+	}
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	struct timespec deadline;
+
+	if(ticks == 0)
+	{
+		sched_yield();
+		return;
+	}
+
+	host_deadline(ticks, &deadline);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(host_time_us() / (1000000 / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return current_task;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+	(void)task;
+	return 0;
+}
+
+void taskYIELD(void)
+{
+	sched_yield();
+}
+
+/* Queues */
+
+struct host_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	uint32_t length;
+	uint32_t item_size;
+	uint32_t head;
+	uint32_t count;
+	uint8_t *items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	struct host_queue *queue = calloc(1, sizeof(struct host_queue));
+
+	if(queue == NULL || length == 0)
+	{
+		free(queue);
+		return NULL;
+	}
+
+	queue->items = calloc(length, item_size ? item_size : 1);
+	if(queue->items == NULL)
+	{
+		free(queue);
+		return NULL;
+	}
+	queue->length = length;
+	queue->item_size = item_size;
+	pthread_mutex_init(&queue->lock, NULL);
+	host_cond_init(&queue->not_empty);
+	host_cond_init(&queue->not_full);
+
+	return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+	if(queue != NULL)
+	{
+		pthread_mutex_destroy(&queue->lock);
+		pthread_cond_destroy(&queue->not_empty);
+		pthread_cond_destroy(&queue->not_full);
+		free(queue->items);
+		free(queue);
+	}
+}
+
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait, bool front)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+	uint32_t slot;
+
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == queue->length)
+	{
+		if(ticks_to_wait == 0 || !host_cond_wait(&queue->not_full, &queue->lock, deadline))
+		{
+			pthread_mutex_unlock(&queue->lock);
+			return errQUEUE_FULL;
+		}
+	}
+
+	if(front)
+	{
+		queue->head = (queue->head + queue->length - 1) % queue->length;
+		slot = queue->head;
+	}
+	else
+	{
+		slot = (queue->head + queue->count) % queue->length;
+	}
+	memcpy(&queue->items[slot * queue->item_size], item, queue->item_size);
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	return pdPASS;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+	return queue_send(queue, item, ticks_to_wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+	return queue_send(queue, item, ticks_to_wait, true);
+}
+
+static BaseType_t queue_receive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait, bool peek)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == 0)
+	{
+		if(ticks_to_wait == 0 || !host_cond_wait(&queue->not_empty, &queue->lock, deadline))
+		{
+			pthread_mutex_unlock(&queue->lock);
+			return pdFALSE;
+		}
+	}
+
+	if(item != NULL)
+	{
+		memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+	}
+	if(!peek)
+	{
+		queue->head = (queue->head + 1) % queue->length;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait)
+{
+	return queue_receive(queue, item, ticks_to_wait, false);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks_to_wait)
+{
+	return queue_receive(queue, item, ticks_to_wait, true);
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->head = 0;
+	queue->count = 0;
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+
+	return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+	UBaseType_t count;
+
+	pthread_mutex_lock(&queue->lock);
+	count = queue->count;
+	pthread_mutex_unlock(&queue->lock);
+
+	return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+	return queue->length - uxQueueMessagesWaiting(queue);
+}
+
+/* Semaphores, a mutex is a binary semaphore that starts given */
+
+struct host_sem {
+	pthread_mutex_t lock;
+	pthread_cond_t given;
+	UBaseType_t count;
+	UBaseType_t max_count;
+};
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+	struct host_sem *sem = calloc(1, sizeof(struct host_sem));
+
+	if(sem != NULL)
+	{
+		pthread_mutex_init(&sem->lock, NULL);
+		host_cond_init(&sem->given);
+		sem->count = initial_count;
+		sem->max_count = max_count;
+	}
+
+	return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+	return xSemaphoreCreateCounting(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return xSemaphoreCreateCounting(1, 0);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+	if(sem != NULL)
+	{
+		pthread_mutex_destroy(&sem->lock);
+		pthread_cond_destroy(&sem->given);
+		free(sem);
+	}
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks_to_wait)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+
+	pthread_mutex_lock(&sem->lock);
+	while(sem->count == 0)
+	{
+		if(ticks_to_wait == 0 || !host_cond_wait(&sem->given, &sem->lock, deadline))
+		{
+			pthread_mutex_unlock(&sem->lock);
+			return pdFALSE;
+		}
+	}
+	sem->count--;
+	pthread_mutex_unlock(&sem->lock);
+
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	BaseType_t ret = pdFALSE;
+
+	pthread_mutex_lock(&sem->lock);
+	if(sem->count < sem->max_count)
+	{
+		sem->count++;
+		pthread_cond_signal(&sem->given);
+		ret = pdTRUE;
+	}
+	pthread_mutex_unlock(&sem->lock);
+
+	return ret;
+}
+
+/* Event groups */
+
+struct host_event_group {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+	struct host_event_group *group = calloc(1, sizeof(struct host_event_group));
+
+	if(group != NULL)
+	{
+		pthread_mutex_init(&group->lock, NULL);
+		host_cond_init(&group->changed);
+	}
+
+	return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group)
+{
+	if(group != NULL)
+	{
+		pthread_mutex_destroy(&group->lock);
+		pthread_cond_destroy(&group->changed);
+		free(group);
+	}
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	EventBits_t ret;
+
+	pthread_mutex_lock(&group->lock);
+	group->bits |= bits;
+	ret = group->bits;
+	pthread_cond_broadcast(&group->changed);
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	EventBits_t ret;
+
+	pthread_mutex_lock(&group->lock);
+	ret = group->bits;
+	group->bits &= ~bits;
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+	EventBits_t ret;
+
+	pthread_mutex_lock(&group->lock);
+	ret = group->bits;
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+								BaseType_t wait_for_all, TickType_t ticks_to_wait)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+	EventBits_t ret;
+
+	pthread_mutex_lock(&group->lock);
+	while(1)
+	{
+		bool done = wait_for_all ? ((group->bits & bits) == bits) : ((group->bits & bits) != 0);
+
+		if(done)
+		{
+			ret = group->bits;
+			if(clear_on_exit)
+			{
+				group->bits &= ~bits;
+			}
+			break;
+		}
+		if(ticks_to_wait == 0 || !host_cond_wait(&group->changed, &group->lock, deadline))
+		{
+			ret = group->bits;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	return ret;
+}
+
+/* Software timers, one thread per timer */
+
+struct host_timer {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t thread;
+	bool thread_started;
+	bool active;
+	bool auto_reload;
+	uint32_t generation;			// bumped on every start, stop and reset
+	TickType_t period;
+	struct timespec expiry;
+	void *id;
+	TimerCallbackFunction_t callback;
+};
+
+static void *timer_thread(void *arg)
+{
+	struct host_timer *timer = arg;
+
+	pthread_mutex_lock(&timer->lock);
+	while(1)
+	{
+		while(!timer->active)
+		{
+			pthread_cond_wait(&timer->changed, &timer->lock);
+		}
+
+		uint32_t generation = timer->generation;
+		struct timespec expiry = timer->expiry;
+
+		if(host_cond_wait(&timer->changed, &timer->lock, &expiry) || generation != timer->generation)
+		{
+			// Woken up by a start, stop or reset, look again
+			continue;
+		}
+
+		if(timer->auto_reload)
+		{
+			host_deadline(timer->period, &timer->expiry);
+		}
+		else
+		{
+			timer->active = false;
+		}
+		pthread_mutex_unlock(&timer->lock);
+		timer->callback(timer);
+		pthread_mutex_lock(&timer->lock);
+	}
+
+	return NULL;
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload,
+							void *id, TimerCallbackFunction_t callback)
+{
+	struct host_timer *timer = calloc(1, sizeof(struct host_timer));
+
+	(void)name;
+
+	if(timer != NULL)
+	{
+		pthread_mutex_init(&timer->lock, NULL);
+		host_cond_init(&timer->changed);
+		timer->period = period;
+		timer->auto_reload = auto_reload;
+		timer->id = id;
+		timer->callback = callback;
+	}
+
+	return timer;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks_to_wait)
+{
+	(void)ticks_to_wait;
+
+	pthread_mutex_lock(&timer->lock);
+	if(!timer->thread_started)
+	{
+		if(pthread_create(&timer->thread, NULL, timer_thread, timer) != 0)
+		{
+			pthread_mutex_unlock(&timer->lock);
+			return pdFAIL;
+		}
+		pthread_detach(timer->thread);
+		timer->thread_started = true;
+	}
+	host_deadline(timer->period, &timer->expiry);
+	timer->active = true;
+	timer->generation++;
+	pthread_cond_broadcast(&timer->changed);
+	pthread_mutex_unlock(&timer->lock);
+
+	return pdPASS;
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks_to_wait)
+{
+	return xTimerStart(timer, ticks_to_wait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks_to_wait)
+{
+	(void)ticks_to_wait;
+
+	pthread_mutex_lock(&timer->lock);
+	timer->active = false;
+	timer->generation++;
+	pthread_cond_broadcast(&timer->changed);
+	pthread_mutex_unlock(&timer->lock);
+
+	return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks_to_wait)
+{
+	pthread_mutex_lock(&timer->lock);
+	timer->period = period;
+	pthread_mutex_unlock(&timer->lock);
+
+	return xTimerStart(timer, ticks_to_wait);
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer)
+{
+	BaseType_t active;
+
+	pthread_mutex_lock(&timer->lock);
+	active = timer->active ? pdTRUE : pdFALSE;
+	pthread_mutex_unlock(&timer->lock);
+
+	return active;
+}
+
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticks_to_wait)
+{
+	// The thread keeps the timer, stopping it is all that is needed
+	return xTimerStop(timer, ticks_to_wait);
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer)
+{
+	return timer->id;
+}
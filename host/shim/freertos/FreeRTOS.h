@@ -0,0 +1,70 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Host stand-in for the ESP-IDF FreeRTOS port, tasks are pthreads and a
+// tick is one millisecond
+
+#ifndef __HOST_FREERTOS_H__
+#define __HOST_FREERTOS_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_bit_defs.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t StackType_t;
+
+#define pdTRUE						1
+#define pdFALSE						0
+#define pdPASS						pdTRUE
+#define pdFAIL						pdFALSE
+#define errQUEUE_FULL				pdFALSE
+#define portMAX_DELAY				((TickType_t)0xFFFFFFFF)
+#define configTICK_RATE_HZ			1000
+#define portTICK_PERIOD_MS			(1000 / configTICK_RATE_HZ)
+#define portTICK_RATE_MS			portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)			((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define pdTICKS_TO_MS(ticks)		((uint32_t)(((uint64_t)(ticks) * 1000) / configTICK_RATE_HZ))
+#define tskNO_AFFINITY				0x7FFFFFFF
+#define configMAX_PRIORITIES		25
+#define IRAM_ATTR
+#define portYIELD_FROM_ISR(x)		(void)(x)
+
+// Critical sections are one process wide recursive lock
+typedef struct {
+	int unused;
+}portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED	{0}
+#define portMUX_INITIALIZE(mux)			(void)(mux)
+
+void host_critical_enter(void);
+void host_critical_exit(void);
+
+#define taskENTER_CRITICAL(mux)			do{ (void)(mux); host_critical_enter(); }while(0)
+#define taskEXIT_CRITICAL(mux)			do{ (void)(mux); host_critical_exit(); }while(0)
+#define portENTER_CRITICAL(mux)			taskENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL(mux)			taskEXIT_CRITICAL(mux)
+#define taskENTER_CRITICAL_ISR(mux)		taskENTER_CRITICAL(mux)
+#define taskEXIT_CRITICAL_ISR(mux)		taskEXIT_CRITICAL(mux)
+
+#endif
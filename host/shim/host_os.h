@@ -0,0 +1,39 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Helpers shared by the host shims, not part of any ESP-IDF API
+
+#ifndef __HOST_OS_H__
+#define __HOST_OS_H__
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+
+// Condition variables on the monotonic clock, deadlines are absolute
+void host_cond_init(pthread_cond_t *cond);
+// Returns NULL for portMAX_DELAY, host_cond_wait then waits forever
+const struct timespec *host_deadline(TickType_t ticks_to_wait, struct timespec *deadline);
+void host_deadline_us(uint64_t us, struct timespec *deadline);
+// Returns false once the deadline has passed
+bool host_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline);
+int64_t host_time_us(void);
+
+#endif
@@ -0,0 +1,845 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "driver/twai.h"
+#include "twai_host.h"
+#include "host_os.h"
+
+#define TAG 		__func__
+
+// Frames the driver transmitted that the peer hasn't read yet
+#define TWAI_HOST_PEER_QUEUE_LEN	64
+
+typedef enum {
+	TWAI_HOST_PEER,
+	TWAI_HOST_REPLAY,
+	TWAI_HOST_SOCKETCAN
+}twai_host_backend_t;
+
+static pthread_mutex_t twai_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t twai_rx_cond;
+static pthread_cond_t twai_peer_cond;
+static pthread_once_t twai_once = PTHREAD_ONCE_INIT;
+
+static twai_host_backend_t backend = TWAI_HOST_PEER;
+static bool installed = false;
+static twai_state_t state = TWAI_STATE_STOPPED;
+static twai_general_config_t general_config;
+static twai_filter_config_t filter_config;
+static twai_host_stats_t stats;
+
+// Driver RX queue, filled by the peer backend
+static twai_message_t *rx_queue = NULL;
+static uint32_t rx_queue_head = 0;
+static uint32_t rx_queue_count = 0;
+
+static twai_message_t peer_queue[TWAI_HOST_PEER_QUEUE_LEN];
+static uint32_t peer_queue_head = 0;
+static uint32_t peer_queue_count = 0;
+
+static const twai_host_frame_t *replay_frames = NULL;
+static uint32_t replay_count = 0;
+static uint32_t replay_pos = 0;
+static uint32_t replay_loops_left = 0;
+
+static int can_socket = -1;
+
+static void twai_host_once(void)
+{
+	host_cond_init(&twai_rx_cond);
+	host_cond_init(&twai_peer_cond);
+}
+
+/*
+ * Acceptance filter as documented in the TWAI section of the TRM. A frame is
+ * accepted if every bit not set in the mask matches the code. Missing data
+ * bytes compare as 0.
+ */
+bool twai_host_filter_accepts(const twai_filter_config_t *filter, const twai_message_t *frame)
+{
+	uint32_t code = filter->acceptance_code;
+	uint32_t care = ~filter->acceptance_mask;
+	uint32_t rtr = frame->rtr ? 1 : 0;
+	uint8_t data0 = (frame->data_length_code > 0 && !frame->rtr) ? frame->data[0] : 0;
+	uint8_t data1 = (frame->data_length_code > 1 && !frame->rtr) ? frame->data[1] : 0;
+
+	if(filter->single_filter)
+	{
+		uint32_t value;
+
+		if(frame->extd)
+		{
+			value = (frame->identifier << 3) | (rtr << 2);
+			care &= 0xFFFFFFFC;
+		}
+		else
+		{
+			value = (frame->identifier << 21) | (rtr << 20) | (data0 << 8) | data1;
+			care &= 0xFFF0FFFF;
+		}
+
+		return ((value ^ code) & care) == 0;
+	}
+	else
+	{
+		uint32_t value1, value2;
+		uint32_t care1, care2;
+
+		if(frame->extd)
+		{
+			// Both filters see ID bits 28-13 only
+			value1 = (frame->identifier >> 13) << 16;
+			value2 = frame->identifier >> 13;
+			care1 = care & 0xFFFF0000;
+			care2 = care & 0x0000FFFF;
+		}
+		else
+		{
+			value1 = (frame->identifier << 21) | (rtr << 20) | ((data0 & 0xF0) << 12) | (data0 & 0x0F);
+			value2 = (frame->identifier << 5) | (rtr << 4);
+			care1 = care & 0xFFFF000F;
+			care2 = care & 0x0000FFF0;
+		}
+
+		return ((value1 ^ code) & care1) == 0 || ((value2 ^ code) & care2) == 0;
+	}
+}
+
+void twai_host_get_stats(twai_host_stats_t *out)
+{
+	pthread_mutex_lock(&twai_lock);
+	*out = stats;
+	pthread_mutex_unlock(&twai_lock);
+}
+
+void twai_host_reset_stats(void)
+{
+	pthread_mutex_lock(&twai_lock);
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&twai_lock);
+}
+
+static void twai_host_close_socket(void)
+{
+	if(can_socket >= 0)
+	{
+		close(can_socket);
+		can_socket = -1;
+	}
+}
+
+void twai_host_use_peer(void)
+{
+	pthread_once(&twai_once, twai_host_once);
+	pthread_mutex_lock(&twai_lock);
+	twai_host_close_socket();
+	backend = TWAI_HOST_PEER;
+	rx_queue_count = 0;
+	peer_queue_count = 0;
+	pthread_mutex_unlock(&twai_lock);
+}
+
+void twai_host_use_replay(const twai_host_frame_t *frames, uint32_t count, uint32_t loops)
+{
+	pthread_once(&twai_once, twai_host_once);
+	pthread_mutex_lock(&twai_lock);
+	twai_host_close_socket();
+	backend = TWAI_HOST_REPLAY;
+	replay_frames = frames;
+	replay_count = count;
+	replay_pos = 0;
+	replay_loops_left = (count != 0) ? loops : 0;
+	pthread_mutex_unlock(&twai_lock);
+}
+
+esp_err_t twai_host_use_socketcan(const char *ifname)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int fd;
+
+	pthread_once(&twai_once, twai_host_once);
+
+	fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if(fd < 0)
+	{
+		ESP_LOGE(TAG, "socket: %s", strerror(errno));
+		return ESP_FAIL;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if(ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+	{
+		ESP_LOGE(TAG, "%s: %s", ifname, strerror(errno));
+		close(fd);
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		ESP_LOGE(TAG, "bind %s: %s", ifname, strerror(errno));
+		close(fd);
+		return ESP_FAIL;
+	}
+
+	pthread_mutex_lock(&twai_lock);
+	twai_host_close_socket();
+	backend = TWAI_HOST_SOCKETCAN;
+	can_socket = fd;
+	pthread_mutex_unlock(&twai_lock);
+
+	return ESP_OK;
+}
+
+bool twai_host_replay_done(void)
+{
+	bool done;
+
+	pthread_mutex_lock(&twai_lock);
+	done = (replay_loops_left == 0);
+	pthread_mutex_unlock(&twai_lock);
+
+	return done;
+}
+
+// Called with twai_lock held
+static bool twai_host_replay_next(twai_message_t *frame)
+{
+	while(replay_loops_left != 0)
+	{
+		*frame = replay_frames[replay_pos++].frame;
+		if(replay_pos == replay_count)
+		{
+			replay_pos = 0;
+			replay_loops_left--;
+		}
+
+		if(twai_host_filter_accepts(&filter_config, frame))
+		{
+			return true;
+		}
+		stats.rx_filtered++;
+	}
+
+	return false;
+}
+
+esp_err_t twai_host_peer_send(const twai_message_t *frame)
+{
+	esp_err_t ret = ESP_OK;
+
+	pthread_mutex_lock(&twai_lock);
+	if(backend != TWAI_HOST_PEER || !installed || state != TWAI_STATE_RUNNING)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else if(!twai_host_filter_accepts(&filter_config, frame))
+	{
+		stats.rx_filtered++;
+	}
+	else if(rx_queue_count == general_config.rx_queue_len)
+	{
+		stats.rx_missed++;
+	}
+	else
+	{
+		rx_queue[(rx_queue_head + rx_queue_count) % general_config.rx_queue_len] = *frame;
+		rx_queue_count++;
+		pthread_cond_signal(&twai_rx_cond);
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+esp_err_t twai_host_peer_receive(twai_message_t *frame, TickType_t ticks_to_wait)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+
+	pthread_once(&twai_once, twai_host_once);
+	pthread_mutex_lock(&twai_lock);
+	while(peer_queue_count == 0)
+	{
+		if(ticks_to_wait == 0 || !host_cond_wait(&twai_peer_cond, &twai_lock, deadline))
+		{
+			pthread_mutex_unlock(&twai_lock);
+			return ESP_ERR_TIMEOUT;
+		}
+	}
+	*frame = peer_queue[peer_queue_head];
+	peer_queue_head = (peer_queue_head + 1) % TWAI_HOST_PEER_QUEUE_LEN;
+	peer_queue_count--;
+	pthread_mutex_unlock(&twai_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t twai_driver_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config,
+								const twai_filter_config_t *f_config)
+{
+	esp_err_t ret = ESP_OK;
+
+	(void)t_config;
+	pthread_once(&twai_once, twai_host_once);
+
+	if(g_config == NULL || f_config == NULL || g_config->rx_queue_len == 0)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pthread_mutex_lock(&twai_lock);
+	if(installed)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else if((rx_queue = calloc(g_config->rx_queue_len, sizeof(twai_message_t))) == NULL)
+	{
+		ret = ESP_ERR_NO_MEM;
+	}
+	else
+	{
+		general_config = *g_config;
+		filter_config = *f_config;
+		rx_queue_head = 0;
+		rx_queue_count = 0;
+		state = TWAI_STATE_STOPPED;
+		installed = true;
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+esp_err_t twai_driver_uninstall(void)
+{
+	esp_err_t ret = ESP_OK;
+
+	pthread_mutex_lock(&twai_lock);
+	if(!installed || state == TWAI_STATE_RUNNING)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else
+	{
+		free(rx_queue);
+		rx_queue = NULL;
+		installed = false;
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+esp_err_t twai_start(void)
+{
+	esp_err_t ret = ESP_OK;
+
+	pthread_mutex_lock(&twai_lock);
+	if(!installed || state != TWAI_STATE_STOPPED)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else
+	{
+		state = TWAI_STATE_RUNNING;
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+esp_err_t twai_stop(void)
+{
+	esp_err_t ret = ESP_OK;
+
+	pthread_mutex_lock(&twai_lock);
+	if(!installed || state != TWAI_STATE_RUNNING)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else
+	{
+		state = TWAI_STATE_STOPPED;
+		rx_queue_count = 0;
+		// Readers blocked in twai_receive return with an error, like the driver
+		pthread_cond_broadcast(&twai_rx_cond);
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+static void twai_host_from_socketcan(const struct can_frame *in, twai_message_t *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->extd = (in->can_id & CAN_EFF_FLAG) ? 1 : 0;
+	out->rtr = (in->can_id & CAN_RTR_FLAG) ? 1 : 0;
+	out->identifier = in->can_id & (out->extd ? CAN_EFF_MASK : CAN_SFF_MASK);
+	out->data_length_code = (in->can_dlc > TWAI_FRAME_MAX_DLC) ? TWAI_FRAME_MAX_DLC : in->can_dlc;
+	memcpy(out->data, in->data, out->data_length_code);
+}
+
+static esp_err_t twai_host_socketcan_receive(twai_message_t *message, TickType_t ticks_to_wait)
+{
+	int64_t deadline = (ticks_to_wait == portMAX_DELAY) ? INT64_MAX :
+						host_time_us() + (int64_t)pdTICKS_TO_MS(ticks_to_wait) * 1000;
+
+	while(1)
+	{
+		struct pollfd pfd = {.fd = can_socket, .events = POLLIN};
+		int64_t now = host_time_us();
+		int timeout_ms = (deadline == INT64_MAX) ? -1 : (int)((deadline > now) ? (deadline - now + 999) / 1000 : 0);
+		struct can_frame frame;
+
+		if(poll(&pfd, 1, timeout_ms) <= 0)
+		{
+			return ESP_ERR_TIMEOUT;
+		}
+		if(read(can_socket, &frame, sizeof(frame)) != sizeof(frame) || (frame.can_id & CAN_ERR_FLAG))
+		{
+			continue;
+		}
+
+		twai_host_from_socketcan(&frame, message);
+
+		pthread_mutex_lock(&twai_lock);
+		bool accepted = twai_host_filter_accepts(&filter_config, message);
+		if(accepted)
+		{
+			stats.rx++;
+		}
+		else
+		{
+			stats.rx_filtered++;
+		}
+		pthread_mutex_unlock(&twai_lock);
+
+		if(accepted)
+		{
+			return ESP_OK;
+		}
+	}
+}
+
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks_to_wait)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+	esp_err_t ret = ESP_ERR_TIMEOUT;
+
+	pthread_mutex_lock(&twai_lock);
+	if(!installed)
+	{
+		pthread_mutex_unlock(&twai_lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	switch(backend)
+	{
+		case TWAI_HOST_PEER:
+			while(state == TWAI_STATE_RUNNING && rx_queue_count == 0)
+			{
+				if(ticks_to_wait == 0 || !host_cond_wait(&twai_rx_cond, &twai_lock, deadline))
+				{
+					break;
+				}
+			}
+			if(state != TWAI_STATE_RUNNING)
+			{
+				ret = ESP_ERR_INVALID_STATE;
+			}
+			else if(rx_queue_count != 0)
+			{
+				*message = rx_queue[rx_queue_head];
+				rx_queue_head = (rx_queue_head + 1) % general_config.rx_queue_len;
+				rx_queue_count--;
+				stats.rx++;
+				ret = ESP_OK;
+			}
+			break;
+
+		case TWAI_HOST_REPLAY:
+			// An exhausted trace times out right away, nothing will arrive
+			if(state != TWAI_STATE_RUNNING)
+			{
+				ret = ESP_ERR_INVALID_STATE;
+			}
+			else if(twai_host_replay_next(message))
+			{
+				stats.rx++;
+				ret = ESP_OK;
+			}
+			break;
+
+		case TWAI_HOST_SOCKETCAN:
+			if(state != TWAI_STATE_RUNNING)
+			{
+				ret = ESP_ERR_INVALID_STATE;
+				break;
+			}
+			pthread_mutex_unlock(&twai_lock);
+			return twai_host_socketcan_receive(message, ticks_to_wait);
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks_to_wait)
+{
+	struct timespec buf;
+	const struct timespec *deadline = host_deadline(ticks_to_wait, &buf);
+	esp_err_t ret = ESP_OK;
+
+	if(message == NULL || message->data_length_code > TWAI_FRAME_MAX_DLC)
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	pthread_mutex_lock(&twai_lock);
+	if(!installed || state != TWAI_STATE_RUNNING)
+	{
+		ret = ESP_ERR_INVALID_STATE;
+	}
+	else if(general_config.mode == TWAI_MODE_LISTEN_ONLY)
+	{
+		ret = ESP_ERR_NOT_SUPPORTED;
+	}
+	else if(backend == TWAI_HOST_PEER)
+	{
+		while(peer_queue_count == TWAI_HOST_PEER_QUEUE_LEN)
+		{
+			if(ticks_to_wait == 0 || !host_cond_wait(&twai_peer_cond, &twai_lock, deadline))
+			{
+				ret = ESP_ERR_TIMEOUT;
+				break;
+			}
+		}
+		if(ret == ESP_OK)
+		{
+			peer_queue[(peer_queue_head + peer_queue_count) % TWAI_HOST_PEER_QUEUE_LEN] = *message;
+			peer_queue_count++;
+			pthread_cond_broadcast(&twai_peer_cond);
+		}
+	}
+	else if(backend == TWAI_HOST_SOCKETCAN)
+	{
+		struct can_frame frame;
+
+		memset(&frame, 0, sizeof(frame));
+		frame.can_id = message->identifier | (message->extd ? CAN_EFF_FLAG : 0) | (message->rtr ? CAN_RTR_FLAG : 0);
+		frame.can_dlc = message->data_length_code;
+		memcpy(frame.data, message->data, message->data_length_code);
+		if(write(can_socket, &frame, sizeof(frame)) != sizeof(frame))
+		{
+			ret = ESP_FAIL;
+		}
+	}
+	// Nobody listens to a replayed trace, the frame is just counted
+
+	if(ret == ESP_OK)
+	{
+		stats.tx++;
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ret;
+}
+
+esp_err_t twai_get_status_info(twai_status_info_t *status_info)
+{
+	memset(status_info, 0, sizeof(*status_info));
+
+	pthread_mutex_lock(&twai_lock);
+	if(!installed)
+	{
+		pthread_mutex_unlock(&twai_lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	status_info->state = state;
+	status_info->rx_missed_count = stats.rx_missed;
+	if(backend == TWAI_HOST_PEER)
+	{
+		status_info->msgs_to_rx = rx_queue_count;
+	}
+	else if(backend == TWAI_HOST_REPLAY && replay_loops_left != 0)
+	{
+		// What the driver would have queued up by now, the trace isn't paced
+		uint64_t left = (uint64_t)(replay_loops_left - 1) * replay_count + (replay_count - replay_pos);
+
+		status_info->msgs_to_rx = (left > general_config.rx_queue_len) ? general_config.rx_queue_len : (uint32_t)left;
+	}
+	else if(backend == TWAI_HOST_SOCKETCAN)
+	{
+		int bytes = 0;
+
+		// FIONREAD only gives the next datagram, there is at least one frame waiting
+		if(ioctl(can_socket, FIONREAD, &bytes) == 0 && bytes > 0)
+		{
+			status_info->msgs_to_rx = 1;
+		}
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t twai_clear_receive_queue(void)
+{
+	pthread_mutex_lock(&twai_lock);
+	if(!installed)
+	{
+		pthread_mutex_unlock(&twai_lock);
+		return ESP_ERR_INVALID_STATE;
+	}
+	rx_queue_count = 0;
+	if(backend == TWAI_HOST_SOCKETCAN)
+	{
+		struct can_frame frame;
+
+		while(recv(can_socket, &frame, sizeof(frame), MSG_DONTWAIT) > 0);
+	}
+	pthread_mutex_unlock(&twai_lock);
+
+	return ESP_OK;
+}
+
+esp_err_t twai_clear_transmit_queue(void)
+{
+	return installed ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t twai_read_alerts(uint32_t *alerts, TickType_t ticks_to_wait)
+{
+	*alerts = TWAI_ALERT_NONE;
+	vTaskDelay(ticks_to_wait == portMAX_DELAY ? pdMS_TO_TICKS(1000) : ticks_to_wait);
+
+	return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_reconfigure_alerts(uint32_t alerts_enabled, uint32_t *current_alerts)
+{
+	(void)alerts_enabled;
+	if(current_alerts != NULL)
+	{
+		*current_alerts = TWAI_ALERT_NONE;
+	}
+
+	return ESP_OK;
+}
+
+esp_err_t twai_initiate_recovery(void)
+{
+	return ESP_ERR_INVALID_STATE;
+}
+
+/* Traces */
+
+// candump -L lines: (1697040000.123456) can0 123#DEADBEEF, 123#R
+static bool twai_host_parse_candump(const char *line, twai_host_frame_t *out)
+{
+	unsigned long long sec, usec;
+	char id_text[16];
+	const char *hash;
+	size_t id_len;
+
+	if(sscanf(line, " (%llu.%llu) %*s %15[0-9A-Fa-f]#", &sec, &usec, id_text) != 3 || strchr(line, '#') == NULL)
+	{
+		return false;
+	}
+
+	memset(out, 0, sizeof(*out));
+	out->timestamp = (int64_t)(sec * 1000000 + usec);
+	id_len = strlen(id_text);
+	out->frame.extd = (id_len > 3) ? 1 : 0;
+	out->frame.identifier = strtoul(id_text, NULL, 16) & (out->frame.extd ? TWAI_EXTD_ID_MASK : TWAI_STD_ID_MASK);
+
+	hash = strchr(line, '#');
+	if(hash[1] == 'R' || hash[1] == 'r')
+	{
+		out->frame.rtr = 1;
+		out->frame.data_length_code = (hash[2] >= '0' && hash[2] <= '8') ? hash[2] - '0' : 0;
+		return true;
+	}
+
+	for(const char *p = hash + 1; out->frame.data_length_code < TWAI_FRAME_MAX_DLC && isxdigit((unsigned char)p[0]) &&
+		isxdigit((unsigned char)p[1]); p += 2)
+	{
+		char byte[3] = {p[0], p[1], 0};
+
+		out->frame.data[out->frame.data_length_code++] = strtoul(byte, NULL, 16);
+	}
+
+	return true;
+}
+
+uint32_t twai_host_load_candump(const char *path, twai_host_frame_t **frames)
+{
+	FILE *f = fopen(path, "r");
+	twai_host_frame_t *list = NULL;
+	uint32_t count = 0, size = 0;
+	char line[256];
+
+	*frames = NULL;
+	if(f == NULL)
+	{
+		ESP_LOGE(TAG, "%s: %s", path, strerror(errno));
+		return 0;
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		if(count == size)
+		{
+			twai_host_frame_t *grown = realloc(list, sizeof(twai_host_frame_t) * (size ? size * 2 : 4096));
+
+			if(grown == NULL)
+			{
+				free(list);
+				fclose(f);
+				return 0;
+			}
+			list = grown;
+			size = size ? size * 2 : 4096;
+		}
+		if(twai_host_parse_candump(line, &list[count]))
+		{
+			count++;
+		}
+	}
+	fclose(f);
+
+	if(count == 0)
+	{
+		free(list);
+		return 0;
+	}
+	*frames = list;
+
+	return count;
+}
+
+/*
+ * A vehicle bus made up: 48 standard IDs sent every 10 to 1000 ms, a few
+ * extended ones and the OBD-II responses of a poller, with rolling counters
+ * and slowly changing signals in the data. Deterministic for a given seed.
+ */
+uint32_t twai_host_synth_trace(uint32_t count, uint32_t seed, twai_host_frame_t **frames)
+{
+	static const uint16_t periods_ms[] = {10, 20, 20, 50, 100, 100, 100, 200, 500, 1000};
+	typedef struct {
+		uint32_t id;
+		bool extd;
+		uint8_t dlc;
+		uint16_t period_ms;
+		uint8_t counter;
+	}synth_id_t;
+	synth_id_t ids[56];
+	uint32_t id_count = 0;
+	uint32_t state = seed ? seed : 1;
+	twai_host_frame_t *list;
+	uint32_t n = 0;
+
+	#define SYNTH_RAND()	(state = state * 1103515245 + 12345, (state >> 16) & 0x7FFF)
+
+	*frames = NULL;
+	list = malloc(sizeof(twai_host_frame_t) * (count ? count : 1));
+	if(list == NULL || count == 0)
+	{
+		free(list);
+		return 0;
+	}
+
+	for(uint32_t i = 0; i < 48; i++)
+	{
+		ids[id_count++] = (synth_id_t){.id = 0x080 + i * 0x1F + (SYNTH_RAND() & 0x0F), .extd = false,
+										.dlc = (SYNTH_RAND() % 4 == 0) ? 4 + (SYNTH_RAND() % 4) : 8,
+										.period_ms = periods_ms[SYNTH_RAND() % 10]};
+	}
+	for(uint32_t i = 0; i < 6; i++)
+	{
+		ids[id_count++] = (synth_id_t){.id = 0x18FF0000 | (i << 8) | 0x21, .extd = true, .dlc = 8, .period_ms = 100};
+	}
+	ids[id_count++] = (synth_id_t){.id = 0x7E8, .extd = false, .dlc = 8, .period_ms = 50};
+	ids[id_count++] = (synth_id_t){.id = 0x7EC, .extd = false, .dlc = 8, .period_ms = 200};
+
+	for(uint32_t ms = 0; n < count; ms++)
+	{
+		for(uint32_t i = 0; i < id_count && n < count; i++)
+		{
+			synth_id_t *s = &ids[i];
+			twai_host_frame_t *out;
+
+			if(ms % s->period_ms != 0)
+			{
+				continue;
+			}
+
+			out = &list[n++];
+			memset(out, 0, sizeof(*out));
+			out->timestamp = (int64_t)ms * 1000 + (i * 37) % 1000;
+			out->frame.identifier = s->id;
+			out->frame.extd = s->extd;
+			out->frame.data_length_code = s->dlc;
+			if(s->id == 0x7E8 || s->id == 0x7EC)
+			{
+				// Mode 01 answer, PID 0x0C (RPM) or 0x05 (coolant)
+				uint16_t value = 800 + (ms / 10) % 3000;
+				uint8_t answer[8] = {0x04, 0x41, (s->id == 0x7E8) ? 0x0C : 0x05, value >> 8, value & 0xFF, 0x55, 0x55, 0x55};
+
+				memcpy(out->frame.data, answer, 8);
+				continue;
+			}
+			for(uint8_t b = 0; b < s->dlc; b++)
+			{
+				out->frame.data[b] = (uint8_t)((s->id >> (b & 3)) + (ms / (s->period_ms * (b + 1))));
+			}
+			out->frame.data[s->dlc - 1] = (s->counter++ & 0x0F) | (SYNTH_RAND() & 0xF0);
+		}
+	}
+	#undef SYNTH_RAND
+
+	*frames = list;
+
+	return n;
+}
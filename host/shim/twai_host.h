@@ -0,0 +1,68 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bus behind the host TWAI driver
+ *
+ * - peer:      an in-process bus, the test plays the other nodes with
+ *              twai_host_peer_send() and twai_host_peer_receive()
+ * - replay:    frames from a candump log or a synthetic trace are received
+ *              back to back, as fast as the reader takes them
+ * - socketcan: a Linux CAN interface, e.g. vcan0
+ *
+ * The acceptance filter passed to twai_driver_install() is applied to
+ * received frames the way the controller does it, whatever the backend.
+ */
+
+#ifndef __TWAI_HOST_H__
+#define __TWAI_HOST_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/twai.h"
+
+typedef struct {
+	twai_message_t frame;
+	int64_t timestamp;				// microseconds, from the trace
+}twai_host_frame_t;
+
+typedef struct {
+	uint32_t rx;					// frames handed to twai_receive callers
+	uint32_t rx_filtered;			// frames dropped by the acceptance filter
+	uint32_t rx_missed;				// frames dropped because the RX queue was full
+	uint32_t tx;
+}twai_host_stats_t;
+
+void twai_host_use_peer(void);
+void twai_host_use_replay(const twai_host_frame_t *frames, uint32_t count, uint32_t loops);
+esp_err_t twai_host_use_socketcan(const char *ifname);
+bool twai_host_replay_done(void);
+
+esp_err_t twai_host_peer_send(const twai_message_t *frame);
+esp_err_t twai_host_peer_receive(twai_message_t *frame, TickType_t ticks_to_wait);
+
+bool twai_host_filter_accepts(const twai_filter_config_t *filter, const twai_message_t *frame);
+void twai_host_get_stats(twai_host_stats_t *stats);
+void twai_host_reset_stats(void);
+
+// Both return the frame count and a malloc'd array, 0 and NULL on error
+uint32_t twai_host_load_candump(const char *path, twai_host_frame_t **frames);
+uint32_t twai_host_synth_trace(uint32_t count, uint32_t seed, twai_host_frame_t **frames);
+
+#endif
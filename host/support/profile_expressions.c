@@ -0,0 +1,245 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "profile_expressions.h"
+
+// Reads a JSON string starting after its opening quote, the escapes used in
+// the profiles are enough here
+static char *json_string_dup(const char *p, const char **end)
+{
+	size_t len = 0;
+	char *out = malloc(strlen(p) + 1);
+
+	if(out == NULL)
+	{
+		return NULL;
+	}
+
+	while(*p != '\0' && *p != '"')
+	{
+		if(*p == '\\' && p[1] != '\0')
+		{
+			p++;
+			switch(*p)
+			{
+				case 'n': out[len++] = '\n'; break;
+				case 't': out[len++] = '\t'; break;
+				default: out[len++] = *p; break;
+			}
+			p++;
+			continue;
+		}
+		out[len++] = *p++;
+	}
+	out[len] = '\0';
+	*end = p;
+
+	return out;
+}
+
+static char *profile_read_file(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char *text = NULL;
+	long length;
+
+	if(f == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	text = malloc(length + 1);
+	if(text == NULL || fread(text, 1, length, f) != (size_t)length)
+	{
+		fclose(f);
+		free(text);
+		return NULL;
+	}
+	text[length] = '\0';
+	fclose(f);
+
+	return text;
+}
+
+// Finds the next "key": "value" at or after p and stops before limit (NULL
+// for the end of the text). Returns the malloc'd value, *next points after it.
+static char *profile_next_string(const char *p, const char *limit, const char *key, const char **next)
+{
+	size_t key_len = strlen(key);
+
+	for(p = strstr(p, key); p != NULL && (limit == NULL || p < limit); p = strstr(p, key))
+	{
+		const char *end;
+		char *value;
+
+		p += key_len;
+		p += strspn(p, " \t\r\n");
+		if(*p != ':')
+		{
+			continue;
+		}
+		p++;
+		p += strspn(p, " \t\r\n");
+		if(*p != '"')
+		{
+			continue;
+		}
+
+		value = json_string_dup(p + 1, &end);
+		*next = value ? end : p;
+		return value;
+	}
+
+	return NULL;
+}
+
+// Adds expression to the list unless it is empty or already there, takes
+// ownership of it either way
+static bool profile_add_expression(char ***list, uint32_t *count, uint32_t *size, char *expression)
+{
+	for(uint32_t i = 0; i < *count; i++)
+	{
+		if(strcmp((*list)[i], expression) == 0)
+		{
+			free(expression);
+			return true;
+		}
+	}
+	if(expression[0] == '\0')
+	{
+		free(expression);
+		return true;
+	}
+
+	if(*count == *size)
+	{
+		char **grown = realloc(*list, sizeof(char *) * (*size ? *size * 2 : 256));
+
+		if(grown == NULL)
+		{
+			free(expression);
+			return false;
+		}
+		*list = grown;
+		*size = *size ? *size * 2 : 256;
+	}
+	(*list)[(*count)++] = expression;
+
+	return true;
+}
+
+uint32_t profile_expressions_load(const char *path, char ***expressions)
+{
+	char *text = profile_read_file(path);
+	char **list = NULL;
+	uint32_t count = 0, size = 0;
+	char *expression;
+
+	*expressions = NULL;
+	if(text == NULL)
+	{
+		return 0;
+	}
+
+	for(const char *p = text; (expression = profile_next_string(p, NULL, "\"expression\"", &p)) != NULL; )
+	{
+		if(!profile_add_expression(&list, &count, &size, expression))
+		{
+			break;
+		}
+	}
+	free(text);
+
+	*expressions = list;
+
+	return count;
+}
+
+uint32_t profile_expressions_load_profiles(const char *path, vehicle_profile_t **profiles)
+{
+	char *text = profile_read_file(path);
+	vehicle_profile_t *list = NULL;
+	uint32_t count = 0;
+	const char *p;
+	char *name;
+
+	*profiles = NULL;
+	if(text == NULL)
+	{
+		return 0;
+	}
+
+	for(p = text; (name = profile_next_string(p, NULL, "\"car_model\"", &p)) != NULL; )
+	{
+		vehicle_profile_t *grown = realloc(list, sizeof(vehicle_profile_t) * (count + 1));
+		const char *limit = strstr(p, "\"car_model\"");
+		uint32_t size = 0;
+		char *expression;
+
+		if(grown == NULL)
+		{
+			free(name);
+			break;
+		}
+		list = grown;
+		list[count] = (vehicle_profile_t){.name = name};
+
+		// The expressions up to the next profile belong to this one
+		while((expression = profile_next_string(p, limit, "\"expression\"", &p)) != NULL)
+		{
+			if(!profile_add_expression(&list[count].expressions, &list[count].count, &size, expression))
+			{
+				break;
+			}
+		}
+		count++;
+	}
+	free(text);
+
+	*profiles = list;
+
+	return count;
+}
+
+void profile_expressions_free(char **expressions, uint32_t count)
+{
+	for(uint32_t i = 0; i < count; i++)
+	{
+		free(expressions[i]);
+	}
+	free(expressions);
+}
+
+void profile_expressions_free_profiles(vehicle_profile_t *profiles, uint32_t count)
+{
+	for(uint32_t i = 0; i < count; i++)
+	{
+		free(profiles[i].name);
+		profile_expressions_free(profiles[i].expressions, profiles[i].count);
+	}
+	free(profiles);
+}
@@ -0,0 +1,41 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROFILE_EXPRESSIONS_H__
+#define __PROFILE_EXPRESSIONS_H__
+#include <stdint.h>
+
+// Every distinct "expression" string in vehicle_profiles.json, in file order.
+// Returns the count and a malloc'd array of malloc'd strings, 0 on error.
+uint32_t profile_expressions_load(const char *path, char ***expressions);
+void profile_expressions_free(char **expressions, uint32_t count);
+
+typedef struct {
+	char *name;						// car_model
+	char **expressions;				// distinct within the profile
+	uint32_t count;
+}vehicle_profile_t;
+
+// The expressions of each profile, in file order. Returns the profile count
+// and a malloc'd array, 0 on error.
+uint32_t profile_expressions_load_profiles(const char *path, vehicle_profile_t **profiles);
+void profile_expressions_free_profiles(vehicle_profile_t *profiles, uint32_t count);
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Minimal test runner for the host tests, one executable per module
+
+#ifndef __HOST_TEST_H__
+#define __HOST_TEST_H__
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+static int test_failures = 0;
+static int test_checks = 0;
+
+#define TEST_ASSERT(cond) do {																\
+		test_checks++;																		\
+		if(!(cond)) {																		\
+			test_failures++;																\
+			fprintf(stderr, "%s:%d: %s: failed: %s\n", __FILE__, __LINE__, __func__, #cond);	\
+		}																					\
+	} while(0)
+
+#define TEST_ASSERT_EQUAL(expected, actual) do {											\
+		long long e_ = (long long)(expected), a_ = (long long)(actual);						\
+		test_checks++;																		\
+		if(e_ != a_) {																		\
+			test_failures++;																\
+			fprintf(stderr, "%s:%d: %s: %s: expected %lld, got %lld\n",						\
+					__FILE__, __LINE__, __func__, #actual, e_, a_);							\
+		}																					\
+	} while(0)
+
+#define TEST_ASSERT_DOUBLE(expected, actual, tolerance) do {								\
+		double e_ = (expected), a_ = (actual);												\
+		test_checks++;																		\
+		if(!(fabs(e_ - a_) <= (tolerance))) {												\
+			test_failures++;																\
+			fprintf(stderr, "%s:%d: %s: %s: expected %.9g, got %.9g\n",						\
+					__FILE__, __LINE__, __func__, #actual, e_, a_);							\
+		}																					\
+	} while(0)
+
+#define TEST_ASSERT_STRING(expected, actual) do {											\
+		const char *e_ = (expected), *a_ = (actual);										\
+		test_checks++;																		\
+		if(a_ == NULL || strcmp(e_, a_) != 0) {												\
+			test_failures++;																\
+			fprintf(stderr, "%s:%d: %s: %s: expected \"%s\", got \"%s\"\n",					\
+					__FILE__, __LINE__, __func__, #actual, e_, a_ ? a_ : "(null)");			\
+		}																					\
+	} while(0)
+
+#define TEST_ASSERT_MEMORY(expected, actual, length) do {									\
+		test_checks++;																		\
+		if(memcmp((expected), (actual), (length)) != 0) {									\
+			test_failures++;																\
+			fprintf(stderr, "%s:%d: %s: %s differs\n", __FILE__, __LINE__, __func__, #actual);	\
+		}																					\
+	} while(0)
+
+#define TEST_RUN(test) do {																	\
+		int before_ = test_failures;														\
+		test();																				\
+		printf("%-48s %s\n", #test, (test_failures == before_) ? "ok" : "FAILED");			\
+	} while(0)
+
+static inline int test_report(void)
+{
+	printf("%d checks, %d failed\n", test_checks, test_failures);
+	return test_failures ? 1 : 0;
+}
+
+#endif
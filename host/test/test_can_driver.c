@@ -0,0 +1,354 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// can.c and can_ring.c over the host TWAI driver
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/twai.h"
+#include "driver/gpio.h"
+#include "twai_host.h"
+#include "hw_config.h"
+#include "can.h"
+#include "can_ring.h"
+#include "test.h"
+
+static twai_message_t make_frame(uint32_t id, bool extd, uint8_t dlc, uint8_t fill)
+{
+	twai_message_t frame = {0};
+
+	frame.identifier = id;
+	frame.extd = extd;
+	frame.data_length_code = dlc;
+	for(uint8_t i = 0; i < dlc; i++)
+	{
+		frame.data[i] = fill + i;
+	}
+
+	return frame;
+}
+
+static bool frames_equal(const twai_message_t *a, const twai_message_t *b)
+{
+	return a->identifier == b->identifier && a->extd == b->extd && a->rtr == b->rtr &&
+			a->data_length_code == b->data_length_code && memcmp(a->data, b->data, a->data_length_code) == 0;
+}
+
+// can_enable() lets TX/RX through after a 10 ms timer
+static void can_start(void)
+{
+	can_enable();
+	vTaskDelay(pdMS_TO_TICKS(30));
+}
+
+static void test_peer_send_receive(void)
+{
+	twai_message_t tx = make_frame(0x7DF, false, 8, 0x02);
+	twai_message_t rx = make_frame(0x18DAF110, true, 8, 0x10);
+	twai_message_t out;
+
+	twai_host_use_peer();
+	can_start();
+	TEST_ASSERT(can_is_enabled());
+	TEST_ASSERT_EQUAL(0, gpio_get_level(CAN_STDBY_GPIO_NUM));
+
+	TEST_ASSERT_EQUAL(ESP_OK, can_send(&tx, 0));
+	TEST_ASSERT_EQUAL(ESP_OK, twai_host_peer_receive(&out, pdMS_TO_TICKS(100)));
+	TEST_ASSERT(frames_equal(&tx, &out));
+
+	TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, can_receive(&out, pdMS_TO_TICKS(5)));
+	TEST_ASSERT_EQUAL(ESP_OK, twai_host_peer_send(&rx));
+	TEST_ASSERT_EQUAL(1, can_msgs_to_rx());
+	TEST_ASSERT_EQUAL(ESP_OK, can_receive(&out, pdMS_TO_TICKS(100)));
+	TEST_ASSERT(frames_equal(&rx, &out));
+
+	can_disable();
+	TEST_ASSERT(!can_is_enabled());
+	TEST_ASSERT_EQUAL(1, gpio_get_level(CAN_STDBY_GPIO_NUM));
+}
+
+static void test_rx_queue_overrun(void)
+{
+	twai_host_stats_t stats;
+	twai_message_t out;
+	uint32_t received = 0;
+
+	twai_host_use_peer();
+	twai_host_reset_stats();
+	can_start();
+
+	// The firmware installs the driver with the default queue of 5 frames
+	for(uint8_t i = 0; i < 8; i++)
+	{
+		twai_message_t frame = make_frame(0x100 + i, false, 2, i);
+		twai_host_peer_send(&frame);
+	}
+	while(can_receive(&out, 0) == ESP_OK)
+	{
+		received++;
+	}
+	twai_host_get_stats(&stats);
+	TEST_ASSERT_EQUAL(5, received);
+	TEST_ASSERT_EQUAL(3, stats.rx_missed);
+
+	can_disable();
+}
+
+static void test_acceptance_filter(void)
+{
+	twai_filter_config_t filter = {.acceptance_code = 0x7E8 << 21, .acceptance_mask = 0x1FFFFF, .single_filter = true};
+	twai_message_t wanted = make_frame(0x7E8, false, 8, 0);
+	twai_message_t other = make_frame(0x7E9, false, 8, 0);
+	twai_host_stats_t stats;
+	twai_message_t out;
+
+	twai_host_use_peer();
+	twai_host_reset_stats();
+	can_set_filter_config(&filter);
+	can_start();
+
+	twai_host_peer_send(&other);
+	twai_host_peer_send(&wanted);
+	TEST_ASSERT_EQUAL(ESP_OK, can_receive(&out, pdMS_TO_TICKS(100)));
+	TEST_ASSERT(frames_equal(&wanted, &out));
+	TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, can_receive(&out, 0));
+	twai_host_get_stats(&stats);
+	TEST_ASSERT_EQUAL(1, stats.rx_filtered);
+
+	can_disable();
+	filter = (twai_filter_config_t)TWAI_FILTER_CONFIG_ACCEPT_ALL();
+	can_set_filter_config(&filter);
+}
+
+static void test_filter_model(void)
+{
+	twai_message_t std = make_frame(0x7E8, false, 8, 0xA0);
+	twai_message_t ext = make_frame(0x18DAF110, true, 8, 0);
+	twai_filter_config_t filter;
+
+	// Single extended: bits 31-3 ID
+	filter = (twai_filter_config_t){.acceptance_code = 0x18DAF110 << 3, .acceptance_mask = 0x7, .single_filter = true};
+	TEST_ASSERT(twai_host_filter_accepts(&filter, &ext));
+	TEST_ASSERT(!twai_host_filter_accepts(&filter, &std));
+
+	// Single standard matching the first data byte as well
+	filter = (twai_filter_config_t){.acceptance_code = (0x7E8 << 21) | (0xA0 << 8), .acceptance_mask = 0x1000FF, .single_filter = true};
+	TEST_ASSERT(twai_host_filter_accepts(&filter, &std));
+	std.data[0] = 0xA1;
+	TEST_ASSERT(!twai_host_filter_accepts(&filter, &std));
+
+	// Dual standard: 0x7E8 in filter 1, 0x123 in filter 2
+	filter = (twai_filter_config_t){.acceptance_code = (0x7E8 << 21) | (0x123 << 5),
+									.acceptance_mask = (0x1F << 16) | 0x1F | 0x000F, .single_filter = false};
+	TEST_ASSERT(twai_host_filter_accepts(&filter, &std));
+	std.identifier = 0x123;
+	TEST_ASSERT(twai_host_filter_accepts(&filter, &std));
+	std.identifier = 0x124;
+	TEST_ASSERT(!twai_host_filter_accepts(&filter, &std));
+
+	// Dual extended compares ID bits 28-13 only
+	filter = (twai_filter_config_t){.acceptance_code = (0x18DAF110 >> 13) << 16, .acceptance_mask = 0, .single_filter = false};
+	TEST_ASSERT(twai_host_filter_accepts(&filter, &ext));
+	ext.identifier = 0x18DAF1FF;
+	TEST_ASSERT(twai_host_filter_accepts(&filter, &ext));
+	ext.identifier = 0x18DBF110;
+	TEST_ASSERT(!twai_host_filter_accepts(&filter, &ext));
+}
+
+static void test_listen_only_refuses_tx(void)
+{
+	twai_message_t tx = make_frame(0x7DF, false, 8, 0);
+
+	twai_host_use_peer();
+	can_set_silent(1);
+	can_start();
+	TEST_ASSERT_EQUAL(ESP_ERR_NOT_SUPPORTED, can_send(&tx, 0));
+	can_disable();
+	can_set_silent(0);
+}
+
+static void test_replay(void)
+{
+	twai_host_frame_t *trace;
+	uint32_t count = twai_host_synth_trace(1000, 7, &trace);
+	twai_message_t out;
+	uint32_t received = 0, mismatches = 0;
+
+	TEST_ASSERT_EQUAL(1000, count);
+
+	twai_host_use_replay(trace, count, 2);
+	can_start();
+	while(can_receive(&out, 0) == ESP_OK)
+	{
+		if(!frames_equal(&trace[received % count].frame, &out))
+		{
+			mismatches++;
+		}
+		received++;
+	}
+	TEST_ASSERT_EQUAL(2000, received);
+	TEST_ASSERT_EQUAL(0, mismatches);
+	TEST_ASSERT(twai_host_replay_done());
+	can_disable();
+
+	free(trace);
+}
+
+static void test_load_candump(void)
+{
+	const char *path = FS_MOUNT_POINT"/test.log";
+	FILE *f = fopen(path, "w");
+	twai_host_frame_t *trace;
+	uint32_t count;
+
+	TEST_ASSERT(f != NULL);
+	fprintf(f, "(1697040000.000100) can0 7E8#0441 0C1AF8\n");
+	fprintf(f, "(1697040000.000100) can0 7E8#04410C1AF8\n");
+	fprintf(f, "(1697040000.002000) vcan0 18DAF110#1014620D00\n");
+	fprintf(f, "garbage\n");
+	fprintf(f, "(1697040001.500000) can0 123#R\n");
+	fprintf(f, "(1697040001.600000) can0 456#\n");
+	fclose(f);
+
+	count = twai_host_load_candump(path, &trace);
+	TEST_ASSERT_EQUAL(5, count);
+	if(count == 5)
+	{
+		// A space ends the data, like in candump's own parser
+		TEST_ASSERT_EQUAL(2, trace[0].frame.data_length_code);
+		TEST_ASSERT_EQUAL(1697040000000100LL, trace[1].timestamp);
+		TEST_ASSERT_EQUAL(0x7E8, trace[1].frame.identifier);
+		TEST_ASSERT_EQUAL(5, trace[1].frame.data_length_code);
+		TEST_ASSERT_EQUAL(0xF8, trace[1].frame.data[4]);
+		TEST_ASSERT(trace[2].frame.extd);
+		TEST_ASSERT_EQUAL(0x18DAF110, trace[2].frame.identifier);
+		TEST_ASSERT(trace[3].frame.rtr);
+		TEST_ASSERT_EQUAL(0, trace[4].frame.data_length_code);
+	}
+	free(trace);
+	remove(path);
+}
+
+static void test_ring_lapped_reader(void)
+{
+	can_ring_reader_t reader;
+	can_ring_frame_t out;
+	uint32_t first = 0;
+
+	can_ring_init();
+	TEST_ASSERT(can_ring_reader_init(&reader));
+
+	for(uint32_t i = 0; i < CAN_RING_SIZE + 44; i++)
+	{
+		twai_message_t frame = make_frame(i & 0x7FF, false, 4, (uint8_t)i);
+		can_ring_push(&frame, i);
+	}
+	can_ring_notify();
+
+	TEST_ASSERT_EQUAL(CAN_RING_SIZE, can_ring_available(&reader));
+	// The oldest slot may be rewritten while read, so one more than the lap is skipped
+	TEST_ASSERT(can_ring_read(&reader, &out, 0));
+	first = (uint32_t)out.timestamp;
+	TEST_ASSERT_EQUAL(45, first);
+	TEST_ASSERT_EQUAL(45, reader.overflows);
+	for(uint32_t i = first + 1; i < CAN_RING_SIZE + 44; i++)
+	{
+		TEST_ASSERT(can_ring_read(&reader, &out, 0));
+		TEST_ASSERT_EQUAL(i, out.timestamp);
+	}
+	TEST_ASSERT(!can_ring_read(&reader, &out, 0));
+	TEST_ASSERT(!can_ring_wait(&reader, pdMS_TO_TICKS(5)));
+}
+
+#define TEST_RING_FRAMES	1000000
+
+static volatile bool ring_writer_done;
+
+static void ring_writer_task(void *param)
+{
+	for(uint32_t i = 0; i < TEST_RING_FRAMES; i++)
+	{
+		twai_message_t frame = {.identifier = i & 0x7FF, .data_length_code = 8};
+
+		memset(frame.data, (uint8_t)i, sizeof(frame.data));
+		can_ring_push(&frame, i);
+		if((i & 31) == 31)
+		{
+			can_ring_notify();
+		}
+	}
+	can_ring_notify();
+	__atomic_store_n(&ring_writer_done, true, __ATOMIC_RELEASE);
+	vTaskDelete(NULL);
+}
+
+// Every copy the reader returns must be one whole frame, however the writer
+// interleaves with it
+static void test_ring_concurrent_reader(void)
+{
+	can_ring_reader_t reader;
+	can_ring_frame_t out;
+	uint32_t frames = 0, torn = 0, out_of_order = 0;
+	int64_t last = -1;
+
+	TEST_ASSERT(can_ring_reader_init(&reader));
+	ring_writer_done = false;
+	xTaskCreate(ring_writer_task, "ring_writer", 4096, NULL, 5, NULL);
+
+	while(!__atomic_load_n(&ring_writer_done, __ATOMIC_ACQUIRE) || can_ring_available(&reader) != 0)
+	{
+		if(!can_ring_read(&reader, &out, pdMS_TO_TICKS(10)))
+		{
+			continue;
+		}
+		frames++;
+		for(uint32_t b = 0; b < 8; b++)
+		{
+			torn += (out.frame.data[b] != (uint8_t)out.timestamp);
+		}
+		torn += (out.frame.identifier != ((uint32_t)out.timestamp & 0x7FF));
+		out_of_order += (out.timestamp <= last);
+		last = out.timestamp;
+	}
+
+	TEST_ASSERT_EQUAL(0, torn);
+	TEST_ASSERT_EQUAL(0, out_of_order);
+	TEST_ASSERT_EQUAL(TEST_RING_FRAMES, frames + reader.overflows);
+	printf("  %lu frames read, %lu overwritten\n", (unsigned long)frames, (unsigned long)reader.overflows);
+}
+
+int main(void)
+{
+	can_init(CAN_500K);
+
+	TEST_RUN(test_peer_send_receive);
+	TEST_RUN(test_rx_queue_overrun);
+	TEST_RUN(test_acceptance_filter);
+	TEST_RUN(test_filter_model);
+	TEST_RUN(test_listen_only_refuses_tx);
+	TEST_RUN(test_replay);
+	TEST_RUN(test_load_candump);
+	TEST_RUN(test_ring_lapped_reader);
+	TEST_RUN(test_ring_concurrent_reader);
+
+	return test_report();
+}
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// can_plan_filter() checked against the controller's filter model: every
+// requested identifier must pass, and the plan should not let much else in
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "driver/twai.h"
+#include "twai_host.h"
+#include "can.h"
+#include "esp_log.h"
+#include "test.h"
+
+#define TEST_STD_IDS		(TWAI_STD_ID_MASK + 1)
+
+static uint32_t rand_state = 1;
+
+static uint32_t test_rand(void)
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 1;
+}
+
+// The filter must not depend on RTR or the data bytes
+static bool accepts_any_payload(const twai_filter_config_t *plan, uint32_t id, bool extd)
+{
+	twai_message_t frame = {.identifier = id, .extd = extd, .data_length_code = 8};
+
+	for(uint32_t i = 0; i < 4; i++)
+	{
+		frame.rtr = (i == 3);
+		for(uint32_t b = 0; b < 8; b++)
+		{
+			frame.data[b] = (i == 0) ? 0x00 : (i == 1) ? 0xFF : (uint8_t)test_rand();
+		}
+		if(!twai_host_filter_accepts(plan, &frame))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Checks every identifier in each requested range, returns how many were missed
+static uint32_t missed_ids(const twai_filter_config_t *plan, const can_filter_id_t *ids, uint32_t count)
+{
+	uint32_t missed = 0;
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		uint32_t width = ids[i].extd ? TWAI_EXTD_ID_MASK : TWAI_STD_ID_MASK;
+		uint32_t mask = ids[i].mask & width;
+		uint32_t sub = 0;
+
+		// Walks the subsets of the don't care bits, capped for wide extended ranges
+		for(uint32_t n = 0; n < 4096; n++)
+		{
+			missed += !accepts_any_payload(plan, ((ids[i].id & width) & ~mask) | sub, ids[i].extd);
+			sub = (sub - mask) & mask;
+			if(sub == 0)
+			{
+				break;
+			}
+		}
+	}
+
+	return missed;
+}
+
+static uint32_t accepted_std_ids(const twai_filter_config_t *plan)
+{
+	uint32_t accepted = 0;
+
+	for(uint32_t id = 0; id < TEST_STD_IDS; id++)
+	{
+		twai_message_t frame = {.identifier = id, .data_length_code = 8};
+
+		accepted += twai_host_filter_accepts(plan, &frame);
+	}
+
+	return accepted;
+}
+
+static void test_rejects_empty_and_oversized(void)
+{
+	static can_filter_id_t ids[CAN_FILTER_PLAN_MAX_IDS + 1];
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(!can_plan_filter(ids, 0, &plan));
+	TEST_ASSERT(!can_plan_filter(ids, CAN_FILTER_PLAN_MAX_IDS + 1, &plan));
+	TEST_ASSERT(can_plan_filter(ids, CAN_FILTER_PLAN_MAX_IDS, &plan));
+}
+
+static void test_single_standard_id(void)
+{
+	can_filter_id_t id = {.id = 0x7E8};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(&id, 1, &plan));
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, &id, 1));
+	TEST_ASSERT_EQUAL(1, accepted_std_ids(&plan));
+}
+
+// The OBD response range the autopid asks for
+static void test_standard_range(void)
+{
+	can_filter_id_t id = {.id = 0x7E8, .mask = 0x7};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(&id, 1, &plan));
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, &id, 1));
+	TEST_ASSERT_EQUAL(8, accepted_std_ids(&plan));
+}
+
+// Two IDs that differ in most bits take one filter each instead of a wide merge
+static void test_two_distant_standard_ids(void)
+{
+	can_filter_id_t ids[2] = {{.id = 0x100}, {.id = 0x6FF}};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(ids, 2, &plan));
+	TEST_ASSERT(!plan.single_filter);
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, ids, 2));
+	TEST_ASSERT_EQUAL(2, accepted_std_ids(&plan));
+}
+
+static void test_standard_merge_cost(void)
+{
+	// 0x7E0-0x7E3 and 0x120: a 4 ID group and a single ID
+	can_filter_id_t ids[5] = {{.id = 0x7E0}, {.id = 0x7E1}, {.id = 0x7E2}, {.id = 0x7E3}, {.id = 0x120}};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(ids, 5, &plan));
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, ids, 5));
+	TEST_ASSERT_EQUAL(5, accepted_std_ids(&plan));
+}
+
+static void test_single_extended_id(void)
+{
+	can_filter_id_t id = {.id = 0x18DAF110, .extd = true};
+	twai_message_t other = {.identifier = 0x18DAF111, .extd = true, .data_length_code = 8};
+	twai_message_t std = {.identifier = 0x7E8, .data_length_code = 8};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(&id, 1, &plan));
+	TEST_ASSERT(plan.single_filter);
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, &id, 1));
+	// The single extended layout compares all 29 bits
+	TEST_ASSERT(!twai_host_filter_accepts(&plan, &other));
+	TEST_ASSERT(!twai_host_filter_accepts(&plan, &std));
+}
+
+static void test_extended_range(void)
+{
+	can_filter_id_t ids[2] = {{.id = 0x18DAF100, .mask = 0xFF, .extd = true}, {.id = 0x18FEEE00, .extd = true}};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(ids, 2, &plan));
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, ids, 2));
+	TEST_ASSERT_EQUAL(0, accepted_std_ids(&plan));
+}
+
+// Filter 1 takes the standard IDs, filter 2 the extended ones
+static void test_mixed_standard_and_extended(void)
+{
+	can_filter_id_t ids[4] = {
+		{.id = 0x7E8, .mask = 0x7},
+		{.id = 0x18DAF100, .mask = 0xFF, .extd = true},
+		{.id = 0x3B4},
+		{.id = 0x18FF0021, .extd = true},
+	};
+	twai_filter_config_t plan;
+
+	TEST_ASSERT(can_plan_filter(ids, 4, &plan));
+	TEST_ASSERT(!plan.single_filter);
+	TEST_ASSERT_EQUAL(0, missed_ids(&plan, ids, 4));
+	// 0x7E8-0x7EF and 0x3B4 merge into one group of 2^8 IDs at most
+	TEST_ASSERT(accepted_std_ids(&plan) <= 256);
+}
+
+// Random sets of up to the maximum size, standard, extended or both
+static void test_random_sets_are_covered(void)
+{
+	static can_filter_id_t ids[CAN_FILTER_PLAN_MAX_IDS];
+	twai_filter_config_t plan;
+	uint32_t missed = 0, planned = 0;
+
+	for(uint32_t set = 0; set < 300; set++)
+	{
+		uint32_t count = 1 + test_rand() % CAN_FILTER_PLAN_MAX_IDS;
+		uint32_t kind = set % 3;
+
+		for(uint32_t i = 0; i < count; i++)
+		{
+			bool extd = (kind == 1) || (kind == 2 && (test_rand() & 1));
+			uint32_t width = extd ? TWAI_EXTD_ID_MASK : TWAI_STD_ID_MASK;
+
+			ids[i].extd = extd;
+			ids[i].id = test_rand() & width;
+			// Now and then a small range
+			ids[i].mask = (test_rand() % 4 == 0) ? (test_rand() & 0x7) : 0;
+		}
+
+		planned += can_plan_filter(ids, count, &plan);
+		missed += missed_ids(&plan, ids, count);
+	}
+
+	TEST_ASSERT_EQUAL(300, planned);
+	TEST_ASSERT_EQUAL(0, missed);
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	TEST_RUN(test_rejects_empty_and_oversized);
+	TEST_RUN(test_single_standard_id);
+	TEST_RUN(test_standard_range);
+	TEST_RUN(test_two_distant_standard_ids);
+	TEST_RUN(test_standard_merge_cost);
+	TEST_RUN(test_single_extended_id);
+	TEST_RUN(test_extended_range);
+	TEST_RUN(test_mixed_standard_and_extended);
+	TEST_RUN(test_random_sets_are_covered);
+
+	return test_report();
+}
@@ -0,0 +1,215 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The CAN trace recorder fed from a synthetic bus trace: the segment it
+// writes must match the checked-in fixture byte for byte. The tests of
+// tools/wican-trace decode the same fixture and compare it with the candump
+// log of the input frames, so a change on either side of the format fails.
+//
+// After an intended format change, regenerate both files with
+//   WICAN_UPDATE_FIXTURES=1 ./test_can_trace
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "twai_host.h"
+#include "can_ring.h"
+#include "can_trace.h"
+#include "esp_log.h"
+#include "test.h"
+
+#define TRACE_DIR			FS_MOUNT_POINT"/trace"
+#define FIXTURE_SEGMENT		WICAN_TRACE_FIXTURES"/synth.trc"
+#define FIXTURE_LOG			WICAN_TRACE_FIXTURES"/synth.log"
+#define FRAME_COUNT			400
+#define PUSH_BURST			32				// well below CAN_RING_SIZE, nothing is lost
+#define SEGMENT_MAX			(CAN_TRACE_BLOCK_SIZE * CAN_TRACE_SEGMENT_BLOCKS)
+
+static twai_host_frame_t *frames;
+static uint8_t segment[SEGMENT_MAX];
+static int32_t segment_len;
+
+static void remove_segments(void)
+{
+	DIR *dir = opendir(TRACE_DIR);
+	struct dirent *entry;
+	char path[512];
+
+	while(dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		if(strstr(entry->d_name, ".trc") != NULL)
+		{
+			snprintf(path, sizeof(path), TRACE_DIR"/%s", entry->d_name);
+			unlink(path);
+		}
+	}
+	if(dir != NULL)
+	{
+		closedir(dir);
+	}
+}
+
+static int compare_timestamp(const void *a, const void *b)
+{
+	int64_t ta = ((const twai_host_frame_t*)a)->timestamp;
+	int64_t tb = ((const twai_host_frame_t*)b)->timestamp;
+
+	return (ta > tb) - (ta < tb);
+}
+
+// The synthetic trace jitters the frames of one millisecond, a bus delivers
+// them in time order. Some become remote frames and one has a DLC above 8.
+static void load_frames(void)
+{
+	uint32_t count = twai_host_synth_trace(FRAME_COUNT, 7, &frames);
+
+	TEST_ASSERT_EQUAL(FRAME_COUNT, count);
+	qsort(frames, count, sizeof(twai_host_frame_t), compare_timestamp);
+	for(uint32_t i = 0; i < count; i += 37)
+	{
+		frames[i].frame.rtr = 1;
+	}
+	frames[100].frame.data_length_code = 12;
+}
+
+// Same text as wican-trace --format candump
+static void write_log(const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	TEST_ASSERT(f != NULL);
+	for(uint32_t i = 0; f != NULL && i < FRAME_COUNT; i++)
+	{
+		const twai_message_t *frame = &frames[i].frame;
+		int64_t ts = frames[i].timestamp;
+
+		fprintf(f, "(%lld.%06lld) can0 ", (long long)(ts / 1000000), (long long)(ts % 1000000));
+		fprintf(f, frame->extd ? "%08X#" : "%03X#", (unsigned)frame->identifier);
+		if(frame->rtr)
+		{
+			fprintf(f, "R");
+		}
+		else
+		{
+			for(uint8_t b = 0; b < frame->data_length_code && b < 8; b++)
+			{
+				fprintf(f, "%02X", frame->data[b]);
+			}
+		}
+		fprintf(f, "\n");
+	}
+	if(f != NULL)
+	{
+		fclose(f);
+	}
+}
+
+static void test_record(void)
+{
+	can_trace_stats_t stats;
+	can_trace_segment_t list[4];
+
+	for(uint32_t i = 0; i < FRAME_COUNT; i++)
+	{
+		can_ring_push(&frames[i].frame, frames[i].timestamp);
+		if((i % PUSH_BURST) == PUSH_BURST - 1)
+		{
+			can_ring_notify();
+			vTaskDelay(pdMS_TO_TICKS(5));
+		}
+	}
+	can_ring_notify();
+
+	// The last block goes out once the bus has been idle for a second
+	for(uint32_t ms = 0; ms < 5000; ms += 50)
+	{
+		can_trace_get_stats(&stats);
+		if(stats.frames == FRAME_COUNT)
+		{
+			break;
+		}
+		vTaskDelay(pdMS_TO_TICKS(50));
+	}
+	TEST_ASSERT_EQUAL(FRAME_COUNT, stats.frames);
+	TEST_ASSERT_EQUAL(0, stats.lost);
+	TEST_ASSERT_EQUAL(0, stats.write_errors);
+
+	TEST_ASSERT_EQUAL(1, can_trace_list(list, 4));
+	TEST_ASSERT_EQUAL(frames[0].timestamp, list[0].first_timestamp);
+	TEST_ASSERT(list[0].active);
+
+	segment_len = can_trace_read(list[0].seq, 0, segment, sizeof(segment));
+	TEST_ASSERT_EQUAL(stats.blocks * CAN_TRACE_BLOCK_SIZE, segment_len);
+	TEST_ASSERT(stats.blocks > 1);
+}
+
+static void test_fixture(void)
+{
+	static uint8_t fixture[SEGMENT_MAX];
+	FILE *f;
+
+	if(getenv("WICAN_UPDATE_FIXTURES") != NULL)
+	{
+		f = fopen(FIXTURE_SEGMENT, "wb");
+		TEST_ASSERT(f != NULL);
+		if(f != NULL)
+		{
+			TEST_ASSERT_EQUAL(segment_len, fwrite(segment, 1, segment_len, f));
+			fclose(f);
+		}
+		write_log(FIXTURE_LOG);
+		return;
+	}
+
+	f = fopen(FIXTURE_SEGMENT, "rb");
+	TEST_ASSERT(f != NULL);
+	if(f != NULL)
+	{
+		size_t len = fread(fixture, 1, sizeof(fixture), f);
+
+		fclose(f);
+		TEST_ASSERT_EQUAL(segment_len, len);
+		TEST_ASSERT_MEMORY(fixture, segment, len);
+	}
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	remove_segments();
+	can_ring_init();
+	if(!can_trace_init())
+	{
+		fprintf(stderr, "can_trace_init failed\n");
+		return 1;
+	}
+
+	TEST_RUN(load_frames);
+	TEST_RUN(test_record);
+	TEST_RUN(test_fixture);
+
+	free(frames);
+	return test_report();
+}
@@ -0,0 +1,137 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// TX segment pool, per queue quotas and draining a queue whose sink went away
+
+#include <stdio.h>
+#include "esp_log.h"
+#include "dev_buffer.h"
+#include "test.h"
+
+static void test_alloc_copy_free(void)
+{
+	uint8_t data[300], out[300];
+
+	dev_buffer_init();
+	for(uint32_t i = 0; i < sizeof(data); i++)
+	{
+		data[i] = (uint8_t)i;
+	}
+
+	dev_buffer_t *buf = dev_buffer_alloc(data, sizeof(data), 0);
+	TEST_ASSERT(buf != NULL);
+	TEST_ASSERT_EQUAL(sizeof(data), buf->total_len);
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE - 3, dev_buffer_free_segments());
+	TEST_ASSERT_EQUAL(100, dev_buffer_copy(buf, 200, out, sizeof(out)));
+	TEST_ASSERT_MEMORY(&data[200], out, 100);
+
+	dev_buffer_free(buf);
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE, dev_buffer_free_segments());
+}
+
+static void test_quota_drops_per_queue(void)
+{
+	dev_buffer_init();
+	QueueHandle_t slow = dev_buffer_queue_create(100, 12);
+	QueueHandle_t fast = dev_buffer_queue_create(16, 16);
+
+	// The slow sink never reads, it gets 12 segments and no more
+	uint32_t queued = 0;
+	for(int i = 0; i < 40; i++)
+	{
+		dev_buffer_t *buf = dev_buffer_alloc(NULL, 0, 0);
+		TEST_ASSERT(buf != NULL);
+		dev_buffer_commit(buf, 1);
+		queued += dev_buffer_send(slow, buf, 0);
+		dev_buffer_free(buf);
+	}
+	TEST_ASSERT_EQUAL(12, queued);
+	TEST_ASSERT_EQUAL(28, dev_buffer_dropped());
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE - 12, dev_buffer_free_segments());
+
+	// The other sink still gets every message while it keeps reading
+	for(int i = 0; i < 100; i++)
+	{
+		dev_buffer_t *buf = dev_buffer_alloc(NULL, 0, 0), *rx;
+		TEST_ASSERT(buf != NULL);
+		TEST_ASSERT(dev_buffer_send(fast, buf, 0));
+		dev_buffer_free(buf);
+		TEST_ASSERT(dev_buffer_receive(fast, &rx, 0));
+		dev_buffer_free(rx);
+	}
+	TEST_ASSERT_EQUAL(28, dev_buffer_dropped());
+
+	// A multi segment message counts all its segments
+	dev_buffer_flush(slow);
+	dev_buffer_t *big = dev_buffer_alloc(NULL, 10 * DEV_SEGMENT_SIZE, 0);
+	TEST_ASSERT(dev_buffer_send(slow, big, 0));
+	TEST_ASSERT(!dev_buffer_send(slow, big, 0));
+	dev_buffer_free(big);
+	dev_buffer_flush(slow);
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE, dev_buffer_free_segments());
+}
+
+static void test_quota_total_bounded(void)
+{
+	dev_buffer_init();
+	dev_buffer_queue_create(8, 30);
+	QueueHandle_t q = dev_buffer_queue_create(32, 30);
+
+	// Only what is left below the reserve is given to the second queue
+	uint32_t queued = 0;
+	for(int i = 0; i < 30; i++)
+	{
+		dev_buffer_t *buf = dev_buffer_alloc(NULL, 0, 0);
+		queued += dev_buffer_send(q, buf, 0);
+		dev_buffer_free(buf);
+	}
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE - DEV_SEGMENT_RESERVE - 30, queued);
+}
+
+static void test_flush_frees_shared(void)
+{
+	dev_buffer_init();
+	QueueHandle_t a = dev_buffer_queue_create(8, 8);
+	QueueHandle_t b = dev_buffer_queue_create(8, 8);
+
+	// The same message on two queues goes back to the pool with the last one
+	dev_buffer_t *buf = dev_buffer_alloc((const uint8_t*)"t123", 4, 0);
+	TEST_ASSERT(dev_buffer_send(a, buf, 0));
+	TEST_ASSERT(dev_buffer_send(b, buf, 0));
+	dev_buffer_free(buf);
+
+	dev_buffer_flush(a);
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE - 1, dev_buffer_free_segments());
+	dev_buffer_flush(b);
+	TEST_ASSERT_EQUAL(DEV_SEGMENT_POOL_SIZE, dev_buffer_free_segments());
+	TEST_ASSERT_EQUAL(0, uxQueueMessagesWaiting(b));
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	TEST_RUN(test_alloc_copy_free);
+	TEST_RUN(test_quota_drops_per_queue);
+	TEST_RUN(test_quota_total_bounded);
+	TEST_RUN(test_flush_frees_shared);
+
+	return test_report();
+}
@@ -0,0 +1,216 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ELM327 interpreter over can.c and the in-process bus, a task plays the ECU
+// and the frames come back through the CAN ring like in the firmware
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/twai.h"
+#include "twai_host.h"
+#include "can.h"
+#include "can_ring.h"
+#include "elm327.h"
+#include "test.h"
+
+#define TEST_RSP_SIZE		1024
+
+static char test_rsp[TEST_RSP_SIZE];
+static uint32_t test_rsp_len;
+static uint32_t test_fc_count;
+static twai_message_t test_last_fc;
+
+static void test_send_to_host(char *str, uint32_t len, QueueHandle_t *q)
+{
+	if(len == 0)
+	{
+		len = strlen(str);
+	}
+	if(test_rsp_len + len < sizeof(test_rsp))
+	{
+		memcpy(&test_rsp[test_rsp_len], str, len);
+		test_rsp_len += len;
+		test_rsp[test_rsp_len] = 0;
+	}
+}
+
+static void ecu_send(uint32_t id, const uint8_t data[8])
+{
+	twai_message_t frame = {0};
+
+	frame.identifier = id;
+	frame.data_length_code = 8;
+	memcpy(frame.data, data, 8);
+	twai_host_peer_send(&frame);
+}
+
+// Engine ECU at 7E0/7E8: 01 00 in a single frame, the VIN (09 02) in three
+// frames after our flow control, as many consecutive frames per flow control
+// as its block size allows
+static void ecu_task(void *arg)
+{
+	static const uint8_t vin_cf[2][8] = {
+		{0x21, 0x57, 0x30, 0x4C, 0x30, 0x30, 0x30, 0x30},
+		{0x22, 0x34, 0x33, 0x4D, 0x42, 0x35, 0x34, 0x31},
+	};
+	twai_message_t req;
+	uint8_t vin_next = 2;
+
+	while(1)
+	{
+		if(twai_host_peer_receive(&req, pdMS_TO_TICKS(10)) != ESP_OK)
+		{
+			continue;
+		}
+
+		if((req.data[0] & 0xF0) == 0x30)
+		{
+			uint8_t block = (req.data[1] == 0) ? 2 : req.data[1];
+
+			test_last_fc = req;
+			test_fc_count++;
+			while(block-- > 0 && vin_next < 2)
+			{
+				ecu_send(0x7E8, vin_cf[vin_next++]);
+			}
+		}
+		else if(req.data[0] == 0x02 && req.data[1] == 0x01 && req.data[2] == 0x00)
+		{
+			ecu_send(0x7E8, (const uint8_t[8]){0x06, 0x41, 0x00, 0xBE, 0x1F, 0xA8, 0x13, 0xAA});
+		}
+		else if(req.data[0] == 0x02 && req.data[1] == 0x09 && req.data[2] == 0x02)
+		{
+			vin_next = 0;
+			ecu_send(0x7E8, (const uint8_t[8]){0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31});
+		}
+	}
+}
+
+// What can_rx_task does in the firmware
+static void rx_task(void *arg)
+{
+	twai_message_t frame;
+
+	while(1)
+	{
+		if(can_receive(&frame, pdMS_TO_TICKS(10)) == ESP_OK)
+		{
+			can_ring_push(&frame, esp_timer_get_time());
+			can_ring_notify();
+		}
+	}
+}
+
+static const char *elm327_cmd(const char *cmd)
+{
+	test_rsp_len = 0;
+	test_rsp[0] = 0;
+	elm327_process_cmd((uint8_t*)cmd, strlen(cmd), NULL, NULL);
+
+	return test_rsp;
+}
+
+static void test_at_commands(void)
+{
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATE0\r"));
+	TEST_ASSERT_STRING("?\r\n\r>", elm327_cmd("ATXX\r"));
+	// Split over two calls like a slow serial link
+	elm327_cmd("ATS");
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("0\r"));
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATS1\r"));
+}
+
+static void test_single_frame_request(void)
+{
+	TEST_ASSERT_STRING(" 41 00 BE 1F A8 13\r\r>", elm327_cmd("0100\r"));
+	// The expected frame count ends the wait at the first answer
+	TEST_ASSERT_STRING(" 41 00 BE 1F A8 13\r\r>", elm327_cmd("01001\r"));
+	TEST_ASSERT_STRING("NO DATA\r\r>", elm327_cmd("0105\r"));
+
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATH1\r"));
+	TEST_ASSERT_STRING("7E8 06 41 00 BE 1F A8 13\r\r>", elm327_cmd("0100\r"));
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATH0\r"));
+}
+
+static void test_multi_frame_request(void)
+{
+	test_fc_count = 0;
+	const char *rsp = elm327_cmd("0902\r");
+
+	TEST_ASSERT_EQUAL(1, test_fc_count);
+	TEST_ASSERT_EQUAL(0x7E0, test_last_fc.identifier);
+	TEST_ASSERT_EQUAL(0x30, test_last_fc.data[0]);
+	// Without headers the PCI byte of each frame is left out
+	TEST_ASSERT_STRING(" 14 49 02 01 31 47 31\r 57 30 4C 30 30 30 30\r 34 33 4D 42 35 34 31\r\r>", rsp);
+}
+
+// ATFCSD with a block size of 1: the ECU waits for a flow control after
+// every consecutive frame, so the engine has to send one per frame
+static void test_client_flow_control(void)
+{
+	static const char *vin = " 14 49 02 01 31 47 31\r 57 30 4C 30 30 30 30\r 34 33 4D 42 35 34 31\r\r>";
+
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATFCSD300100\r"));
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATFCSM2\r"));
+	test_fc_count = 0;
+	TEST_ASSERT_STRING(vin, elm327_cmd("0902\r"));
+	TEST_ASSERT_EQUAL(2, test_fc_count);
+	TEST_ASSERT_EQUAL(0x7E0, test_last_fc.identifier);
+	TEST_ASSERT_EQUAL(0x01, test_last_fc.data[1]);
+
+	// Mode 1, the block size is kept for the ECU behind the flow control header
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATFCSH7E0\r"));
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATFCSM1\r"));
+	test_fc_count = 0;
+	TEST_ASSERT_STRING(vin, elm327_cmd("0902\r"));
+	TEST_ASSERT_EQUAL(2, test_fc_count);
+
+	TEST_ASSERT_STRING("OK\r\n\r>", elm327_cmd("ATFCSM0\r"));
+	test_fc_count = 0;
+	TEST_ASSERT_STRING(vin, elm327_cmd("0902\r"));
+	TEST_ASSERT_EQUAL(1, test_fc_count);
+	TEST_ASSERT_EQUAL(0x00, test_last_fc.data[1]);
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	can_init(CAN_500K);
+	twai_host_use_peer();
+	can_ring_init();
+	can_enable();
+	vTaskDelay(pdMS_TO_TICKS(30));
+	elm327_init(test_send_to_host, NULL);
+	xTaskCreate(ecu_task, "ecu_task", 4096, NULL, 5, NULL);
+	xTaskCreate(rx_task, "rx_task", 4096, NULL, 5, NULL);
+
+	TEST_RUN(test_at_commands);
+	TEST_RUN(test_single_frame_request);
+	TEST_RUN(test_multi_frame_request);
+	TEST_RUN(test_client_flow_control);
+
+	return test_report();
+}
@@ -0,0 +1,242 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compiled expressions against the interpreter and the compiler's limits
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "expression_parser.h"
+#include "profile_expressions.h"
+#include "test.h"
+
+#define TEST_DATA_LEN		1024
+
+static uint8_t test_data[4][TEST_DATA_LEN];
+
+static void fill_data(void)
+{
+	uint32_t state = 12345;
+
+	for(uint32_t set = 0; set < 4; set++)
+	{
+		for(uint32_t i = 0; i < TEST_DATA_LEN; i++)
+		{
+			state = state * 1103515245 + 12345;
+			// Set 0 is all zero, the others random
+			test_data[set][i] = set ? (uint8_t)(state >> 16) : 0;
+		}
+	}
+}
+
+static bool same_result(bool ok_a, double a, bool ok_b, double b)
+{
+	if(ok_a != ok_b)
+	{
+		return false;
+	}
+	if(!ok_a)
+	{
+		return true;
+	}
+
+	return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(double)) == 0 || a == b;
+}
+
+static void test_profile_expressions_match_interpreter(void)
+{
+	static const double v_values[] = {0, 1234.5};
+	char **expressions;
+	uint32_t count = profile_expressions_load(WICAN_VEHICLE_PROFILES, &expressions);
+	uint32_t compile_failures = 0, mismatches = 0;
+
+	TEST_ASSERT(count > 400);
+
+	for(uint32_t e = 0; e < count; e++)
+	{
+		expr_program_t *program = compile_expression(expressions[e]);
+
+		if(program == NULL)
+		{
+			fprintf(stderr, "doesn't compile: %s\n", expressions[e]);
+			compile_failures++;
+			continue;
+		}
+
+		for(uint32_t set = 0; set < 4; set++)
+		{
+			for(uint32_t v = 0; v < 2; v++)
+			{
+				char copy[256];
+				double interpreted = 0, compiled = 0;
+				bool ok_interpreted, ok_compiled;
+
+				snprintf(copy, sizeof(copy), "%s", expressions[e]);
+				ok_interpreted = evaluate_expression((uint8_t *)copy, test_data[set], v_values[v], &interpreted);
+				ok_compiled = evaluate_compiled_expression(program, test_data[set], TEST_DATA_LEN, v_values[v], &compiled);
+				if(!same_result(ok_interpreted, interpreted, ok_compiled, compiled))
+				{
+					if(mismatches < 10)
+					{
+						fprintf(stderr, "%s: data %lu V %g: interpreted %d %.17g, compiled %d %.17g\n", expressions[e],
+								(unsigned long)set, v_values[v], ok_interpreted, interpreted, ok_compiled, compiled);
+					}
+					mismatches++;
+				}
+			}
+		}
+		free_compiled_expression(program);
+	}
+
+	printf("%lu profile expressions\n", (unsigned long)count);
+	TEST_ASSERT_EQUAL(0, compile_failures);
+	TEST_ASSERT_EQUAL(0, mismatches);
+	profile_expressions_free(expressions, count);
+}
+
+static void test_short_data_rejected(void)
+{
+	expr_program_t *program = compile_expression("[B3:B4]*0.25+B10:2");
+	uint8_t data[16] = {0, 0, 0, 0x1A, 0xF8, 0, 0, 0, 0, 0, 0x04};
+	double result = -1;
+
+	TEST_ASSERT(program != NULL);
+	TEST_ASSERT_EQUAL(11, program->data_len);
+	TEST_ASSERT(!evaluate_compiled_expression(program, data, 10, 0, &result));
+	TEST_ASSERT_DOUBLE(-1, result, 0);
+	TEST_ASSERT(evaluate_compiled_expression(program, data, 11, 0, &result));
+	TEST_ASSERT_DOUBLE(1726 + 1, result, 0);
+	free_compiled_expression(program);
+
+	// Nothing read from the data, any length will do
+	program = compile_expression("V*2-40");
+	TEST_ASSERT(program != NULL);
+	TEST_ASSERT_EQUAL(0, program->data_len);
+	TEST_ASSERT(evaluate_compiled_expression(program, data, 0, 30, &result));
+	TEST_ASSERT_DOUBLE(20, result, 0);
+	free_compiled_expression(program);
+}
+
+static void test_leading_minus(void)
+{
+	expr_program_t *program = compile_expression("-40+B0");
+	uint8_t data[1] = {100};
+	double result = 0;
+
+	TEST_ASSERT(program != NULL);
+	TEST_ASSERT(evaluate_compiled_expression(program, data, 1, 0, &result));
+	TEST_ASSERT_DOUBLE(60, result, 0);
+	free_compiled_expression(program);
+}
+
+static void test_register_hoisting(void)
+{
+	uint8_t data[8] = {0, 0, 0, 0x12, 0x34};
+	expr_program_t *program;
+	double result = 0;
+
+	// A single byte load used twice is simply loaded again
+	program = compile_expression("B3*B3+S3");
+	TEST_ASSERT(program != NULL);
+	TEST_ASSERT_EQUAL(0, program->regs_used);
+	TEST_ASSERT_EQUAL(program->unoptimized_len, program->code_len);
+	TEST_ASSERT(evaluate_compiled_expression(program, data, 8, 0, &result));
+	TEST_ASSERT_DOUBLE(0x12 * 0x12 + 0x12, result, 0);
+	free_compiled_expression(program);
+
+	// Used three times it is kept in a register: B3 TEE REG MUL REG ADD
+	program = compile_expression("B3*B3+B3");
+	TEST_ASSERT(program != NULL);
+	TEST_ASSERT_EQUAL(1, program->regs_used);
+	TEST_ASSERT_EQUAL(program->unoptimized_len + 1, program->code_len);
+	TEST_ASSERT(evaluate_compiled_expression(program, data, 8, 0, &result));
+	TEST_ASSERT_DOUBLE(0x12 * 0x12 + 0x12, result, 0);
+	free_compiled_expression(program);
+
+	// A repeated range load is kept in a register
+	program = compile_expression("[B3:B4]*0.1+[B3:B4]");
+	TEST_ASSERT(program != NULL);
+	TEST_ASSERT_EQUAL(1, program->regs_used);
+	TEST_ASSERT(evaluate_compiled_expression(program, data, 8, 0, &result));
+	TEST_ASSERT_DOUBLE(0x1234 * 0.1 + 0x1234, result, 0);
+	free_compiled_expression(program);
+}
+
+// Nests n byte loads to the right: B0+(B1+(...+(Bn-1)))
+static void nested_expression(char *out, size_t size, const char *prefix, int n)
+{
+	size_t len = snprintf(out, size, "%s", prefix);
+
+	for(int i = 0; i < n - 1; i++)
+	{
+		len += snprintf(out + len, size - len, "B%d+(", i);
+	}
+	len += snprintf(out + len, size - len, "B%d", n - 1);
+	for(int i = 0; i < n - 1; i++)
+	{
+		len += snprintf(out + len, size - len, ")");
+	}
+}
+
+static void test_stack_limit(void)
+{
+	char expression[512];
+	expr_program_t *program;
+
+	nested_expression(expression, sizeof(expression), "", 32);
+	program = compile_expression(expression);
+	TEST_ASSERT(program != NULL);
+	if(program != NULL)
+	{
+		TEST_ASSERT_EQUAL(32, program->stack_depth);
+		free_compiled_expression(program);
+	}
+
+	// The seeded 0 of a leading minus is one more slot under all of it
+	nested_expression(expression, sizeof(expression), "-(", 32);
+	strcat(expression, ")");
+	program = compile_expression(expression);
+	TEST_ASSERT(program == NULL);
+	free_compiled_expression(program);
+
+	nested_expression(expression, sizeof(expression), "-(", 31);
+	strcat(expression, ")");
+	program = compile_expression(expression);
+	TEST_ASSERT(program != NULL);
+	if(program != NULL)
+	{
+		TEST_ASSERT_EQUAL(32, program->stack_depth);
+		free_compiled_expression(program);
+	}
+}
+
+int main(void)
+{
+	fill_data();
+
+	TEST_RUN(test_profile_expressions_match_interpreter);
+	TEST_RUN(test_short_data_rejected);
+	TEST_RUN(test_leading_minus);
+	TEST_RUN(test_register_hoisting);
+	TEST_RUN(test_stack_limit);
+
+	return test_report();
+}
@@ -0,0 +1,446 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ISO-TP state machine, fed with hand made frame sequences and explicit times
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "isotp.h"
+#include "test.h"
+
+#define TEST_TX_ID		0x7E0
+#define TEST_RX_ID		0x7E8
+#define TEST_SENT_MAX	64
+
+static twai_message_t test_sent[TEST_SENT_MAX];
+static uint32_t test_sent_count;
+
+static void test_send(twai_message_t *frame, void *ctx)
+{
+	if(test_sent_count < TEST_SENT_MAX)
+	{
+		test_sent[test_sent_count] = *frame;
+	}
+	test_sent_count++;
+}
+
+static void test_link_init(isotp_link_t *link)
+{
+	isotp_init(link, test_send, NULL);
+	test_sent_count = 0;
+}
+
+static twai_message_t ecu_frame(const uint8_t *data, uint8_t dlc)
+{
+	twai_message_t frame = {0};
+
+	frame.identifier = TEST_RX_ID;
+	frame.data_length_code = dlc;
+	memcpy(frame.data, data, dlc);
+
+	return frame;
+}
+
+static void fill_payload(uint8_t *payload, uint16_t length)
+{
+	for(uint16_t i = 0; i < length; i++)
+	{
+		payload[i] = (uint8_t)(i * 7 + 3);
+	}
+}
+
+// Feeds the first frame of payload, returns the offset of the next byte
+static uint16_t send_first_frame(isotp_link_t *link, const uint8_t *payload, uint16_t length, int64_t now)
+{
+	uint8_t data[8] = {0x10 | (length >> 8), length & 0xFF};
+	twai_message_t frame;
+
+	memcpy(&data[2], payload, 6);
+	frame = ecu_frame(data, 8);
+	isotp_on_frame(link, &frame, now);
+
+	return 6;
+}
+
+static isotp_session_t *send_consecutive_frame(isotp_link_t *link, uint8_t seq, const uint8_t *payload, uint16_t n, int64_t now)
+{
+	uint8_t data[8];
+	twai_message_t frame;
+
+	memset(data, 0xAA, sizeof(data));
+	data[0] = 0x20 | (seq & 0x0F);
+	memcpy(&data[1], payload, n);
+	frame = ecu_frame(data, 8);
+
+	return isotp_on_frame(link, &frame, now);
+}
+
+static void test_st_min_conversion(void)
+{
+	TEST_ASSERT_EQUAL(0, isotp_st_min_to_us(0x00));
+	TEST_ASSERT_EQUAL(127000, isotp_st_min_to_us(0x7F));
+	TEST_ASSERT_EQUAL(100, isotp_st_min_to_us(0xF1));
+	TEST_ASSERT_EQUAL(900, isotp_st_min_to_us(0xF9));
+	// Reserved values
+	TEST_ASSERT_EQUAL(127000, isotp_st_min_to_us(0x80));
+	TEST_ASSERT_EQUAL(127000, isotp_st_min_to_us(0xFA));
+}
+
+static void test_single_frame(void)
+{
+	isotp_link_t link;
+	uint8_t buf[16];
+	uint8_t sf[8] = {0x04, 0x41, 0x0C, 0x1A, 0xF8, 0xAA, 0xAA, 0xAA};
+	twai_message_t frame = ecu_frame(sf, 8);
+
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, buf, sizeof(buf));
+
+	TEST_ASSERT(isotp_on_frame(&link, &frame, 0) == session);
+	TEST_ASSERT_EQUAL(ISOTP_RX_DONE, session->state);
+	TEST_ASSERT_EQUAL(4, session->length);
+	TEST_ASSERT_MEMORY(&sf[1], buf, 4);
+	TEST_ASSERT_EQUAL(0, test_sent_count);
+
+	// Frames of other IDs are not ours
+	frame.identifier = 0x7E9;
+	TEST_ASSERT(isotp_on_frame(&link, &frame, 0) == NULL);
+}
+
+static void test_malformed_frames(void)
+{
+	isotp_link_t link;
+	uint8_t sf_long[8] = {0x08, 1, 2, 3, 4, 5, 6, 7};
+	uint8_t sf_short[3] = {0x05, 1, 2};
+	uint8_t ff_short[8] = {0x10, 0x07, 1, 2, 3, 4, 5, 6};
+	uint8_t ff_dlc[6] = {0x10, 0x20, 1, 2, 3, 4};
+	twai_message_t frame;
+
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, NULL, 0);
+
+	frame = ecu_frame(sf_long, 8);
+	isotp_on_frame(&link, &frame, 0);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_FRAME, session->error);
+
+	// Length beyond the frame's DLC
+	session->error = ISOTP_ERR_NONE;
+	frame = ecu_frame(sf_short, sizeof(sf_short));
+	isotp_on_frame(&link, &frame, 0);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_FRAME, session->error);
+
+	// A first frame for a message that fits a single frame
+	session->error = ISOTP_ERR_NONE;
+	frame = ecu_frame(ff_short, 8);
+	isotp_on_frame(&link, &frame, 0);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_FRAME, session->error);
+
+	session->error = ISOTP_ERR_NONE;
+	frame = ecu_frame(ff_dlc, sizeof(ff_dlc));
+	isotp_on_frame(&link, &frame, 0);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_FRAME, session->error);
+	TEST_ASSERT_EQUAL(0, test_sent_count);
+}
+
+// 300 bytes take 42 consecutive frames, the sequence number wraps twice
+static void test_multi_frame_sequence_wrap(void)
+{
+	isotp_link_t link;
+	uint8_t payload[300];
+	uint8_t buf[ISOTP_MAX_LENGTH];
+	isotp_session_t *last = NULL;
+	uint8_t seq = 1;
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, buf, sizeof(buf));
+
+	uint16_t offset = send_first_frame(&link, payload, sizeof(payload), 0);
+	TEST_ASSERT_EQUAL(ISOTP_RX, session->state);
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+	TEST_ASSERT_EQUAL(TEST_TX_ID, test_sent[0].identifier);
+	TEST_ASSERT_EQUAL(0x30, test_sent[0].data[0]);
+
+	while(offset < sizeof(payload))
+	{
+		uint16_t n = (sizeof(payload) - offset > 7) ? 7 : sizeof(payload) - offset;
+
+		last = send_consecutive_frame(&link, seq++, &payload[offset], n, 1000);
+		offset += n;
+	}
+
+	TEST_ASSERT(last == session);
+	TEST_ASSERT_EQUAL(ISOTP_RX_DONE, session->state);
+	TEST_ASSERT_EQUAL(sizeof(payload), session->length);
+	TEST_ASSERT_MEMORY(payload, buf, sizeof(payload));
+	// Block size 0, the single flow control after the first frame
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+	TEST_ASSERT_EQUAL(0, link.seq_errors);
+
+	// More consecutive frames after the message are ignored
+	TEST_ASSERT(send_consecutive_frame(&link, seq, payload, 7, 1000) == NULL);
+}
+
+static void test_bad_sequence_number(void)
+{
+	isotp_link_t link;
+	uint8_t payload[40];
+	uint8_t buf[64];
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, buf, sizeof(buf));
+
+	send_first_frame(&link, payload, sizeof(payload), 0);
+	send_consecutive_frame(&link, 1, &payload[6], 7, 0);
+	// Frame 2 lost
+	send_consecutive_frame(&link, 3, &payload[20], 7, 0);
+	TEST_ASSERT_EQUAL(ISOTP_ERROR, session->state);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_SEQ, session->error);
+	TEST_ASSERT_EQUAL(1, link.seq_errors);
+
+	// The rest of the broken message is dropped, the next one starts over
+	TEST_ASSERT(send_consecutive_frame(&link, 4, &payload[27], 7, 0) == NULL);
+	send_first_frame(&link, payload, sizeof(payload), 0);
+	TEST_ASSERT_EQUAL(ISOTP_RX, session->state);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_NONE, session->error);
+}
+
+// Our flow control asks for blocks of 4 frames, 10 ms apart
+static void test_rx_block_size(void)
+{
+	isotp_link_t link;
+	uint8_t payload[100];
+	uint8_t buf[128];
+	uint8_t seq = 1;
+	uint32_t frames = 0;
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	TEST_ASSERT(isotp_set_fc_params(&link, TEST_RX_ID, 4, 0x0A));
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, buf, sizeof(buf));
+
+	uint16_t offset = send_first_frame(&link, payload, sizeof(payload), 0);
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+	TEST_ASSERT_EQUAL(0x30, test_sent[0].data[0]);
+	TEST_ASSERT_EQUAL(4, test_sent[0].data[1]);
+	TEST_ASSERT_EQUAL(0x0A, test_sent[0].data[2]);
+	TEST_ASSERT_EQUAL(ISOTP_PADDING, test_sent[0].data[3]);
+
+	while(offset < sizeof(payload))
+	{
+		uint16_t n = (sizeof(payload) - offset > 7) ? 7 : sizeof(payload) - offset;
+
+		send_consecutive_frame(&link, seq++, &payload[offset], n, 0);
+		offset += n;
+		frames++;
+		// A new flow control after every complete block, none after the last frame
+		TEST_ASSERT_EQUAL(1 + ((offset < sizeof(payload)) ? frames / 4 : (frames - 1) / 4), test_sent_count);
+	}
+
+	TEST_ASSERT_EQUAL(14, frames);
+	TEST_ASSERT_EQUAL(ISOTP_RX_DONE, session->state);
+	TEST_ASSERT_MEMORY(payload, buf, sizeof(payload));
+}
+
+static void test_rx_overflow(void)
+{
+	isotp_link_t link;
+	uint8_t payload[100];
+	uint8_t buf[64];
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, buf, sizeof(buf));
+
+	send_first_frame(&link, payload, sizeof(payload), 0);
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+	TEST_ASSERT_EQUAL(0x32, test_sent[0].data[0]);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_OVERFLOW, session->error);
+	TEST_ASSERT_EQUAL(1, link.overflows);
+
+	// Without a buffer the transfer is only tracked, any length goes
+	test_link_init(&link);
+	session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, NULL, 0);
+	send_first_frame(&link, payload, sizeof(payload), 0);
+	TEST_ASSERT_EQUAL(ISOTP_RX, session->state);
+	TEST_ASSERT_EQUAL(0x30, test_sent[0].data[0]);
+}
+
+static void test_rx_timeout(void)
+{
+	isotp_link_t link;
+	uint8_t payload[40];
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, NULL, 0);
+
+	send_first_frame(&link, payload, sizeof(payload), 1000);
+	TEST_ASSERT_EQUAL(1000 + ISOTP_TIMEOUT_US, isotp_poll(&link, 2000));
+
+	// Every consecutive frame restarts N_Cr
+	send_consecutive_frame(&link, 1, &payload[6], 7, 500000);
+	TEST_ASSERT_EQUAL(500000 + ISOTP_TIMEOUT_US, isotp_poll(&link, 1000 + ISOTP_TIMEOUT_US));
+	TEST_ASSERT_EQUAL(ISOTP_RX, session->state);
+
+	TEST_ASSERT_EQUAL(INT64_MAX, isotp_poll(&link, 500000 + ISOTP_TIMEOUT_US));
+	TEST_ASSERT_EQUAL(ISOTP_ERROR, session->state);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_TIMEOUT, session->error);
+	TEST_ASSERT_EQUAL(1, link.timeouts);
+}
+
+static void send_flow_control(isotp_link_t *link, uint8_t status, uint8_t block_size, uint8_t st_min, int64_t now)
+{
+	uint8_t fc[8] = {0x30 | status, block_size, st_min, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA};
+	twai_message_t frame = ecu_frame(fc, 8);
+
+	isotp_on_frame(link, &frame, now);
+}
+
+// 40 bytes: first frame and 5 consecutive frames, paced by the ECU's flow control
+static void test_tx_flow_control(void)
+{
+	isotp_link_t link;
+	uint8_t payload[40];
+	uint8_t sent[40];
+	uint16_t offset = 0;
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, NULL, 0);
+
+	TEST_ASSERT(isotp_send(&link, session, payload, sizeof(payload), 0));
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+	TEST_ASSERT_EQUAL(0x10, test_sent[0].data[0]);
+	TEST_ASSERT_EQUAL(40, test_sent[0].data[1]);
+	memcpy(sent, &test_sent[0].data[2], 6);
+	offset = 6;
+	TEST_ASSERT_EQUAL(ISOTP_TX_WAIT_FC, session->state);
+	TEST_ASSERT_EQUAL(ISOTP_TIMEOUT_US, isotp_poll(&link, 0));
+
+	// WAIT restarts N_Bs and sends nothing
+	send_flow_control(&link, 1, 0, 0, 800000);
+	TEST_ASSERT_EQUAL(ISOTP_TX_WAIT_FC, session->state);
+	TEST_ASSERT_EQUAL(800000 + ISOTP_TIMEOUT_US, isotp_poll(&link, ISOTP_TIMEOUT_US));
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+
+	// Blocks of 2 frames, 5 ms apart
+	send_flow_control(&link, 0, 2, 5, 1000000);
+	TEST_ASSERT_EQUAL(1005000, isotp_poll(&link, 1000000));
+	TEST_ASSERT_EQUAL(2, test_sent_count);
+	TEST_ASSERT_EQUAL(1005000, isotp_poll(&link, 1004999));
+	TEST_ASSERT_EQUAL(2, test_sent_count);
+	// Second frame of the block, then wait for the next flow control
+	TEST_ASSERT_EQUAL(1005000 + ISOTP_TIMEOUT_US, isotp_poll(&link, 1005000));
+	TEST_ASSERT_EQUAL(3, test_sent_count);
+	TEST_ASSERT_EQUAL(ISOTP_TX_WAIT_FC, session->state);
+
+	// 100 us separation time, no block limit
+	send_flow_control(&link, 0, 0, 0xF1, 1010000);
+	TEST_ASSERT_EQUAL(1010100, isotp_poll(&link, 1010000));
+	TEST_ASSERT_EQUAL(1010200, isotp_poll(&link, 1010100));
+	TEST_ASSERT_EQUAL(INT64_MAX, isotp_poll(&link, 1010200));
+	TEST_ASSERT_EQUAL(ISOTP_TX_DONE, session->state);
+	TEST_ASSERT_EQUAL(6, test_sent_count);
+
+	for(uint32_t i = 1; i < test_sent_count; i++)
+	{
+		uint16_t n = (sizeof(payload) - offset > 7) ? 7 : sizeof(payload) - offset;
+
+		TEST_ASSERT_EQUAL(0x20 | i, test_sent[i].data[0]);
+		memcpy(&sent[offset], &test_sent[i].data[1], n);
+		offset += n;
+	}
+	TEST_ASSERT_EQUAL(sizeof(payload), offset);
+	TEST_ASSERT_MEMORY(payload, sent, sizeof(payload));
+	// The last frame is padded
+	TEST_ASSERT_EQUAL(ISOTP_PADDING, test_sent[5].data[7]);
+}
+
+static void test_tx_overflow_and_timeout(void)
+{
+	isotp_link_t link;
+	uint8_t payload[20];
+
+	fill_payload(payload, sizeof(payload));
+	test_link_init(&link);
+	isotp_session_t *session = isotp_open(&link, TEST_TX_ID, TEST_RX_ID, false, NULL, 0);
+
+	// The ECU can't take the message
+	isotp_send(&link, session, payload, sizeof(payload), 0);
+	send_flow_control(&link, 2, 0, 0, 1000);
+	TEST_ASSERT_EQUAL(ISOTP_ERROR, session->state);
+	TEST_ASSERT_EQUAL(ISOTP_ERR_ABORTED, session->error);
+	TEST_ASSERT(!isotp_tx_active(session));
+	TEST_ASSERT_EQUAL(INT64_MAX, isotp_poll(&link, 2000));
+	TEST_ASSERT_EQUAL(1, test_sent_count);
+
+	// No flow control at all
+	isotp_send(&link, session, payload, sizeof(payload), 0);
+	TEST_ASSERT(isotp_tx_active(session));
+	TEST_ASSERT_EQUAL(INT64_MAX, isotp_poll(&link, ISOTP_TIMEOUT_US));
+	TEST_ASSERT_EQUAL(ISOTP_ERR_TIMEOUT, session->error);
+	TEST_ASSERT_EQUAL(1, link.timeouts);
+
+	// Too long for a first frame
+	TEST_ASSERT(!isotp_send(&link, session, payload, ISOTP_MAX_LENGTH + 1, 0));
+}
+
+static void test_sessions(void)
+{
+	isotp_link_t link;
+
+	test_link_init(&link);
+	for(uint32_t i = 0; i < ISOTP_MAX_SESSIONS; i++)
+	{
+		TEST_ASSERT(isotp_open(&link, TEST_TX_ID, 0x100 + i, false, NULL, 0) != NULL);
+	}
+	TEST_ASSERT(isotp_open(&link, TEST_TX_ID, 0x200, false, NULL, 0) == NULL);
+	// Opening an ID again reuses its session
+	TEST_ASSERT(isotp_open(&link, TEST_TX_ID, 0x103, false, NULL, 0) == &link.sessions[3]);
+
+	isotp_close(&link.sessions[3]);
+	TEST_ASSERT(isotp_find(&link, 0x103) == NULL);
+	TEST_ASSERT(isotp_open(&link, TEST_TX_ID, 0x200, false, NULL, 0) == &link.sessions[3]);
+
+	isotp_close_all(&link);
+	TEST_ASSERT(isotp_find(&link, 0x200) == NULL);
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	TEST_RUN(test_st_min_conversion);
+	TEST_RUN(test_single_frame);
+	TEST_RUN(test_malformed_frames);
+	TEST_RUN(test_multi_frame_sequence_wrap);
+	TEST_RUN(test_bad_sequence_number);
+	TEST_RUN(test_rx_block_size);
+	TEST_RUN(test_rx_overflow);
+	TEST_RUN(test_rx_timeout);
+	TEST_RUN(test_tx_flow_control);
+	TEST_RUN(test_tx_overflow_and_timeout);
+	TEST_RUN(test_sessions);
+
+	return test_report();
+}
@@ -0,0 +1,273 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// json_writer checked against the text the cJSON tree printed before it:
+// limitJsonDecimalPrecision() and cJSON's print_number(), copied below
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include "json_writer.h"
+#include "esp_log.h"
+#include "test.h"
+
+static uint64_t rand_state = 1;
+
+static uint64_t test_rand(void)
+{
+	rand_state = rand_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return rand_state >> 11;
+}
+
+// Uniform in [0, 1)
+static double test_rand_unit(void)
+{
+	return (double)test_rand() / (double)(1ULL << 53);
+}
+
+// formatNumberPrecision(), atof() and print_number() as the firmware had them
+static const char *baseline_number(double value)
+{
+	static char buf[32];
+	static char out[26];
+	int valueint;
+
+	if(value >= INT_MAX)
+	{
+		valueint = INT_MAX;
+	}
+	else if(value <= (double)INT_MIN)
+	{
+		valueint = INT_MIN;
+	}
+	else
+	{
+		valueint = (int)value;
+	}
+
+	snprintf(buf, sizeof(buf), "%.2f", value);
+	size_t len = strlen(buf);
+	if(strchr(buf, '.'))
+	{
+		while(len > 0 && buf[len - 1] == '0')
+		{
+			buf[--len] = '\0';
+		}
+		if(len > 0 && buf[len - 1] == '.')
+		{
+			buf[--len] = '\0';
+		}
+	}
+	double d = atof(buf);
+
+	if(isnan(d) || isinf(d))
+	{
+		return "null";
+	}
+	if(d == (double)valueint)
+	{
+		sprintf(out, "%d", valueint);
+		return out;
+	}
+	sprintf(out, "%1.15g", d);
+	double test = strtod(out, NULL);
+	if(fabs(test - d) > fmax(fabs(test), fabs(d)) * DBL_EPSILON)
+	{
+		sprintf(out, "%1.17g", d);
+	}
+	return out;
+}
+
+static const char *format(double value)
+{
+	static char out[JSON_NUMBER_MAX_LEN];
+	size_t len = json_format_number(out, value);
+
+	TEST_ASSERT(len < JSON_NUMBER_MAX_LEN);
+	TEST_ASSERT_EQUAL(strlen(out), len);
+	return out;
+}
+
+// Counts the values that print differently from the baseline, shows the first few
+static uint32_t mismatches(double value, uint32_t *shown)
+{
+	const char *expected = baseline_number(value);
+	const char *actual = format(value);
+
+	if(strcmp(expected, actual) == 0)
+	{
+		return 0;
+	}
+	if((*shown)++ < 5)
+	{
+		fprintf(stderr, "%.17g: expected \"%s\", got \"%s\"\n", value, expected, actual);
+	}
+	return 1;
+}
+
+static void test_number_examples(void)
+{
+	TEST_ASSERT_STRING("0", format(0.0));
+	TEST_ASSERT_STRING("0", format(-0.0));
+	TEST_ASSERT_STRING("0", format(-0.001));
+	TEST_ASSERT_STRING("12", format(12.0));
+	TEST_ASSERT_STRING("-3.5", format(-3.5));
+	TEST_ASSERT_STRING("0.1", format(0.1));
+	TEST_ASSERT_STRING("14.7", format(14.699999));
+	// Rounds the exact value: 630.845 is stored slightly above, 0.125 is a tie
+	TEST_ASSERT_STRING("630.85", format(630.845));
+	TEST_ASSERT_STRING("0.01", format(0.005));
+	TEST_ASSERT_STRING("0.12", format(0.125));
+	TEST_ASSERT_STRING("0.38", format(0.375));
+	// 1.005 and -2.675 are stored slightly toward zero
+	TEST_ASSERT_STRING("1", format(1.005));
+	TEST_ASSERT_STRING("-2.67", format(-2.675));
+	TEST_ASSERT_STRING("123456.79", format(123456.789));
+	TEST_ASSERT_STRING("9999999999999.99", format(9999999999999.99));
+	TEST_ASSERT_STRING("1e+15", format(1e15));
+	TEST_ASSERT_STRING("null", format(NAN));
+	TEST_ASSERT_STRING("null", format(INFINITY));
+	TEST_ASSERT_STRING("null", format(-INFINITY));
+}
+
+// The values autopid publishes: sensor readings with a few decimals
+static void test_number_random_readings(void)
+{
+	uint32_t shown = 0, bad = 0;
+
+	for(uint32_t i = 0; i < 300000; i++)
+	{
+		double scale = pow(10, (double)(test_rand() % 9) - 2);
+		double value = (test_rand_unit() * 2 - 1) * scale;
+
+		bad += mismatches(value, &shown);
+	}
+
+	TEST_ASSERT_EQUAL(0, bad);
+}
+
+// Ties and near ties in hundredths, where the rounding direction matters
+static void test_number_half_hundredths(void)
+{
+	uint32_t shown = 0, bad = 0;
+
+	for(int64_t k = -200000; k <= 200000; k++)
+	{
+		double value = (k * 2 + 1) / 200.0;
+
+		bad += mismatches(value, &shown);
+		bad += mismatches(nextafter(value, INFINITY), &shown);
+		bad += mismatches(nextafter(value, -INFINITY), &shown);
+	}
+
+	for(uint32_t i = 0; i < 200000; i++)
+	{
+		double value = ((double)(test_rand() % 2000000000000ULL) * 2 + 1) / 200.0;
+
+		bad += mismatches(value, &shown);
+		bad += mismatches(-value, &shown);
+	}
+
+	TEST_ASSERT_EQUAL(0, bad);
+}
+
+// Around 1e13 where the fast path hands over to printf
+static void test_number_large(void)
+{
+	uint32_t shown = 0, bad = 0;
+
+	for(uint32_t i = 0; i < 200000; i++)
+	{
+		double value = pow(10, 11 + test_rand_unit() * 4);
+
+		bad += mismatches(value, &shown);
+		bad += mismatches(-value, &shown);
+	}
+
+	double value = 1e13;
+	for(uint32_t i = 0; i < 1000; i++)
+	{
+		bad += mismatches(value, &shown);
+		value = nextafter(value, 0);
+	}
+
+	TEST_ASSERT_EQUAL(0, bad);
+	// "%.2f" is skipped from 1e15 on, the baseline's 32 byte buffer cut those short
+	TEST_ASSERT_STRING("1e+300", format(1e300));
+	TEST_ASSERT_STRING("-1.79769313486232e+308", format(-DBL_MAX));
+}
+
+static void test_writer_object(void)
+{
+	char buf[128];
+	json_writer_t w;
+	char *speed = json_writer_make_key("speed");
+	char *odd = json_writer_make_key("a\"b\\c\n");
+
+	TEST_ASSERT_STRING("\"speed\":", speed);
+	TEST_ASSERT_STRING("\"a\\\"b\\\\c\\u000a\":", odd);
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_key(&w, speed);
+	json_writer_number(&w, 630.845);
+	json_writer_key(&w, odd);
+	json_writer_string(&w, "km/h");
+	json_writer_end_object(&w);
+	TEST_ASSERT_STRING("{\"speed\":630.85,\"a\\\"b\\\\c\\u000a\":\"km/h\"}", json_writer_finish(&w));
+
+	free(speed);
+	free(odd);
+}
+
+static void test_writer_overflow(void)
+{
+	char buf[16];
+	json_writer_t w;
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "\"value\":");
+	json_writer_number(&w, 123456.78);
+	json_writer_end_object(&w);
+	TEST_ASSERT(json_writer_finish(&w) == NULL);
+
+	json_writer_init(&w, buf, sizeof(buf));
+	json_writer_begin_object(&w);
+	json_writer_key(&w, "\"v\":");
+	json_writer_number(&w, 1.5);
+	json_writer_end_object(&w);
+	TEST_ASSERT_STRING("{\"v\":1.5}", json_writer_finish(&w));
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	TEST_RUN(test_number_examples);
+	TEST_RUN(test_number_random_readings);
+	TEST_RUN(test_number_half_hundredths);
+	TEST_RUN(test_number_large);
+	TEST_RUN(test_writer_object);
+	TEST_RUN(test_writer_overflow);
+
+	return test_report();
+}
@@ -0,0 +1,189 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Merging of JSON objects published to the same topic: only well formed
+// objects are merged, and a batch is sent before any top-level key would
+// repeat, whether it is the first key of the new message or not
+
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_batch.h"
+#include "esp_log.h"
+#include "test.h"
+
+#define WINDOW_US		100000
+
+static char sent[8][MQTT_BATCH_SIZE + 1];
+static uint16_t sent_count[8];
+static uint32_t sent_len;
+static mqtt_batcher_t batcher;
+
+static void record_send(const mqtt_batch_t *batch, void *ctx)
+{
+	if(sent_len < 8)
+	{
+		memcpy(sent[sent_len], batch->buf, batch->len);
+		sent[sent_len][batch->len] = 0;
+		sent_count[sent_len] = batch->count;
+	}
+	sent_len++;
+}
+
+static void reset(void)
+{
+	sent_len = 0;
+	mqtt_batch_init(&batcher, WINDOW_US, record_send, NULL);
+}
+
+// Due batches go out in slot order, not in the order they were started
+static bool was_sent(const char *payload)
+{
+	for(uint32_t i = 0; i < sent_len && i < 8; i++)
+	{
+		if(strcmp(sent[i], payload) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static void add(const char *topic, const char *payload, uint8_t qos)
+{
+	TEST_ASSERT(mqtt_batch_mergeable(topic, payload, strlen(payload)));
+	mqtt_batch_add(&batcher, topic, payload, strlen(payload), qos, 0, 0, 0);
+}
+
+static void test_mergeable(void)
+{
+	const char *merge[] = {
+		"{\"a\":1}",
+		"{ \"a\" : 1 , \"b\" : [1, {\"c\": 2}] }",
+		"{\"a\":\"}\",\"b\":\"\\\"}\"}",
+		"{\"a\":{\"b\":{\"c\":null}}}",
+	};
+	const char *keep[] = {
+		"{}",
+		"{ }",
+		"[1,2]",
+		"{\"a\":1,}",
+		"{\"a\"}",
+		"{\"a\":}",
+		"{\"a\":\"}",
+		"{\"a\":1}{\"b\":2}",
+		"{,\"a\":1}",
+	};
+
+	for(uint32_t i = 0; i < sizeof(merge) / sizeof(merge[0]); i++)
+	{
+		TEST_ASSERT(mqtt_batch_mergeable("t", merge[i], strlen(merge[i])));
+	}
+	for(uint32_t i = 0; i < sizeof(keep) / sizeof(keep[0]); i++)
+	{
+		TEST_ASSERT(!mqtt_batch_mergeable("t", keep[i], strlen(keep[i])));
+	}
+}
+
+static void test_merge(void)
+{
+	reset();
+	add("t", "{\"a\":1}", 0);
+	add("t", "{\"b\":2,\"c\":3}", 0);
+	TEST_ASSERT_EQUAL(0, sent_len);
+
+	mqtt_batch_flush_due(&batcher, WINDOW_US);
+	TEST_ASSERT_EQUAL(1, sent_len);
+	TEST_ASSERT_STRING("{\"a\":1,\"b\":2,\"c\":3}", sent[0]);
+	TEST_ASSERT_EQUAL(2, sent_count[0]);
+}
+
+// The repeated key is not the first key of the new message
+static void test_repeated_later_key(void)
+{
+	reset();
+	add("t", "{\"a\":1,\"b\":2}", 0);
+	add("t", "{\"c\":3,\"b\":4}", 0);
+	TEST_ASSERT_EQUAL(1, sent_len);
+	TEST_ASSERT_STRING("{\"a\":1,\"b\":2}", sent[0]);
+
+	mqtt_batch_flush_topic(&batcher, "t");
+	TEST_ASSERT_EQUAL(2, sent_len);
+	TEST_ASSERT_STRING("{\"c\":3,\"b\":4}", sent[1]);
+}
+
+// A key name inside a string value or a nested object is not a key of the batch
+static void test_key_in_value(void)
+{
+	reset();
+	add("t", "{\"a\":\"\\\"b\\\":\",\"n\":{\"b\":1}}", 0);
+	add("t", "{\"b\":2}", 0);
+	TEST_ASSERT_EQUAL(0, sent_len);
+
+	mqtt_batch_flush_topic(&batcher, "t");
+	TEST_ASSERT_EQUAL(1, sent_len);
+	TEST_ASSERT_STRING("{\"a\":\"\\\"b\\\":\",\"n\":{\"b\":1},\"b\":2}", sent[0]);
+}
+
+static void test_full(void)
+{
+	char payload[600];
+
+	reset();
+	memset(payload, 'x', sizeof(payload));
+	memcpy(payload, "{\"a\":\"", 6);
+	strcpy(&payload[sizeof(payload) - 3], "\"}");
+	add("t", payload, 0);
+	payload[2] = 'b';
+	add("t", payload, 0);
+	TEST_ASSERT_EQUAL(1, sent_len);
+	TEST_ASSERT_EQUAL(strlen(payload), strlen(sent[0]));
+}
+
+// Topics and QoS levels are batched apart
+static void test_topics(void)
+{
+	reset();
+	add("t1", "{\"a\":1}", 0);
+	add("t2", "{\"b\":1}", 0);
+	add("t1", "{\"c\":1}", 1);
+	add("t1", "{\"d\":1}", 0);
+	TEST_ASSERT_EQUAL(0, sent_len);
+	TEST_ASSERT_EQUAL(0, mqtt_batch_next_deadline(&batcher, WINDOW_US * 2) - WINDOW_US);
+
+	mqtt_batch_flush_due(&batcher, WINDOW_US);
+	TEST_ASSERT_EQUAL(3, sent_len);
+	TEST_ASSERT(was_sent("{\"a\":1,\"d\":1}"));
+	TEST_ASSERT(was_sent("{\"b\":1}"));
+	TEST_ASSERT(was_sent("{\"c\":1}"));
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	TEST_RUN(test_mergeable);
+	TEST_RUN(test_merge);
+	TEST_RUN(test_repeated_later_key);
+	TEST_RUN(test_key_in_value);
+	TEST_RUN(test_full);
+	TEST_RUN(test_topics);
+
+	return test_report();
+}
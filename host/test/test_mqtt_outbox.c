@@ -0,0 +1,212 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The MQTT outbox on the host filesystem: records come back in order and
+// once each, and replaying while new messages arrive doesn't turn every
+// replay tick into a new segment file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "mqtt_outbox.h"
+#include "esp_log.h"
+#include "test.h"
+
+#define OUTBOX_DIR			FS_MOUNT_POINT"/outbox"
+#define REPLAY_BURST		10				// records per tick, fewer than mqtt_pub_replay() sends
+
+static uint32_t next_write = 0;
+static uint32_t next_read = 0;
+static uint32_t out_of_order = 0;
+
+static uint32_t segment_files(void)
+{
+	DIR *dir = opendir(OUTBOX_DIR);
+	uint32_t count = 0;
+	struct dirent *entry;
+
+	while(dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		count += (strstr(entry->d_name, ".seg") != NULL);
+	}
+	if(dir != NULL)
+	{
+		closedir(dir);
+	}
+
+	return count;
+}
+
+static void remove_segments(void)
+{
+	DIR *dir = opendir(OUTBOX_DIR);
+	struct dirent *entry;
+	char path[512];
+
+	while(dir != NULL && (entry = readdir(dir)) != NULL)
+	{
+		if(strstr(entry->d_name, ".seg") != NULL)
+		{
+			snprintf(path, sizeof(path), OUTBOX_DIR"/%s", entry->d_name);
+			unlink(path);
+		}
+	}
+	if(dir != NULL)
+	{
+		closedir(dir);
+	}
+}
+
+// Payloads of a few sizes carrying their sequence number, small ones like
+// a single parameter or up to 520 bytes
+static void write_records(uint32_t count, bool small)
+{
+	char payload[600];
+
+	for(uint32_t i = 0; i < count; i++, next_write++)
+	{
+		size_t len = 40 + (next_write % 7) * (small ? 4 : 80);
+
+		memset(payload, 'x', len);
+		int n = snprintf(payload, sizeof(payload), "{\"seq\":%lu}", (unsigned long)next_write);
+		payload[n] = ' ';
+		TEST_ASSERT(mqtt_outbox_write("wican/test/rx", payload, len, 1, 0));
+	}
+}
+
+static uint32_t replay(uint32_t max)
+{
+	mqtt_outbox_record_t record;
+	uint32_t count = 0;
+
+	while(count < max && mqtt_outbox_peek(&record))
+	{
+		unsigned long seq = strtoul(record.payload + 7, NULL, 10);
+
+		if(seq != next_read || strcmp(record.topic, "wican/test/rx") != 0 || record.qos != 1)
+		{
+			out_of_order++;
+		}
+		next_read = seq + 1;
+		mqtt_outbox_pop();
+		count++;
+	}
+
+	return count;
+}
+
+static void test_offline_then_replay(void)
+{
+	write_records(300, false);
+	mqtt_outbox_flush();
+	TEST_ASSERT(!mqtt_outbox_empty());
+	TEST_ASSERT(segment_files() >= 2);
+
+	while(replay(REPLAY_BURST) != 0)
+	{
+	}
+
+	TEST_ASSERT_EQUAL(0, out_of_order);
+	TEST_ASSERT_EQUAL(next_write, next_read);
+	TEST_ASSERT(mqtt_outbox_empty());
+	TEST_ASSERT_EQUAL(0, segment_files());
+}
+
+// Connected: new messages queue behind the stored ones while they replay
+static void test_replay_while_publishing(void)
+{
+	uint32_t max_files = 0;
+	mqtt_outbox_stats_t before, after;
+
+	write_records(100, false);
+	mqtt_outbox_flush();
+	uint32_t stored_files = segment_files();
+	mqtt_outbox_get_stats(&before);
+
+	for(uint32_t tick = 0; tick < 500 && !mqtt_outbox_empty(); tick++)
+	{
+		// Slower than the replay, the outbox drains
+		write_records(tick < 400 ? 3 : 0, true);
+		replay(REPLAY_BURST);
+
+		uint32_t files = segment_files();
+		max_files = (files > max_files) ? files : max_files;
+	}
+
+	TEST_ASSERT(mqtt_outbox_empty());
+	TEST_ASSERT_EQUAL(0, out_of_order);
+	TEST_ASSERT_EQUAL(next_write, next_read);
+	TEST_ASSERT(max_files <= stored_files);
+	TEST_ASSERT_EQUAL(0, segment_files());
+	// The new messages were replayed from RAM
+	mqtt_outbox_get_stats(&after);
+	TEST_ASSERT_EQUAL(before.created, after.created);
+}
+
+// Bursts larger than the write buffer reach the segment the reader is in
+static void test_replay_follows_the_tail(void)
+{
+	write_records(20, false);
+	mqtt_outbox_flush();
+
+	for(uint32_t tick = 0; tick < 200; tick++)
+	{
+		write_records(tick < 100 ? 6 : 0, false);
+		replay(REPLAY_BURST);
+	}
+	replay(UINT32_MAX);
+
+	TEST_ASSERT(mqtt_outbox_empty());
+	TEST_ASSERT_EQUAL(0, out_of_order);
+	TEST_ASSERT_EQUAL(next_write, next_read);
+	TEST_ASSERT_EQUAL(0, segment_files());
+}
+
+static void test_stats(void)
+{
+	mqtt_outbox_stats_t stats;
+
+	mqtt_outbox_get_stats(&stats);
+	TEST_ASSERT_EQUAL(next_write, stats.stored);
+	TEST_ASSERT_EQUAL(next_read, stats.replayed);
+	TEST_ASSERT_EQUAL(0, stats.dropped);
+	TEST_ASSERT_EQUAL(0, stats.corrupt);
+	TEST_ASSERT_EQUAL(0, stats.segments);
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+
+	remove_segments();
+	if(!mqtt_outbox_init())
+	{
+		fprintf(stderr, "mqtt_outbox_init failed\n");
+		return 1;
+	}
+
+	TEST_RUN(test_offline_then_replay);
+	TEST_RUN(test_replay_while_publishing);
+	TEST_RUN(test_replay_follows_the_tail);
+	TEST_RUN(test_stats);
+
+	return test_report();
+}
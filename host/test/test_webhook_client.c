@@ -0,0 +1,270 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// webhook_post_json() against a stand-in HTTP server on the loopback
+// interface, counting the connections it accepts
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include "lwip/sockets.h"
+#include "webhook_client.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "test.h"
+
+#define TEST_POSTS			50
+
+typedef enum {
+	SERVER_KEEP_ALIVE,			// HTTP/1.1 with Content-Length
+	SERVER_CLOSE,				// Connection: close on every response
+	SERVER_CHUNKED,				// Transfer-Encoding: chunked
+}server_mode_t;
+
+typedef struct {
+	int listen_sock;
+	int port;
+	server_mode_t mode;
+	uint32_t close_after;		// silently close after this many requests on a connection, 0 never
+	uint32_t accepts;
+	uint32_t requests;
+	pthread_t thread;
+}test_server_t;
+
+// Reads one request, returns false when the client closed the connection
+static bool server_read_request(int sock)
+{
+	char buf[2048];
+	size_t len = 0;
+	char *end = NULL;
+
+	while(end == NULL)
+	{
+		if(len == sizeof(buf) - 1)
+		{
+			return false;
+		}
+		ssize_t r = recv(sock, buf + len, sizeof(buf) - 1 - len, 0);
+		if(r <= 0)
+		{
+			return false;
+		}
+		len += r;
+		buf[len] = '\0';
+		end = strstr(buf, "\r\n\r\n");
+	}
+
+	const char *cl = strstr(buf, "Content-Length:");
+	long body = (cl != NULL) ? strtol(cl + 15, NULL, 10) : 0;
+	body -= (long)(len - (end + 4 - buf));
+	while(body > 0)
+	{
+		ssize_t r = recv(sock, buf, (body < (long)sizeof(buf)) ? (size_t)body : sizeof(buf), 0);
+		if(r <= 0)
+		{
+			return false;
+		}
+		body -= r;
+	}
+
+	return true;
+}
+
+static void *server_task(void *arg)
+{
+	test_server_t *server = arg;
+
+	while(1)
+	{
+		int sock = accept(server->listen_sock, NULL, NULL);
+		if(sock < 0)
+		{
+			break;
+		}
+		__atomic_add_fetch(&server->accepts, 1, __ATOMIC_RELAXED);
+
+		uint32_t served = 0;
+		while(server_read_request(sock))
+		{
+			static const char *responses[] = {
+				[SERVER_KEEP_ALIVE] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nok",
+				[SERVER_CLOSE] = "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok",
+				[SERVER_CHUNKED] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nok\r\n0\r\n\r\n",
+			};
+			const char *rsp = responses[server->mode];
+
+			__atomic_add_fetch(&server->requests, 1, __ATOMIC_RELAXED);
+			send(sock, rsp, strlen(rsp), MSG_NOSIGNAL);
+			served++;
+			if(server->mode != SERVER_KEEP_ALIVE || served == server->close_after)
+			{
+				break;
+			}
+		}
+		close(sock);
+	}
+
+	return NULL;
+}
+
+static void server_start(test_server_t *server, server_mode_t mode, uint32_t close_after)
+{
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t addr_len = sizeof(addr);
+
+	memset(server, 0, sizeof(*server));
+	server->mode = mode;
+	server->close_after = close_after;
+	server->listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	TEST_ASSERT(bind(server->listen_sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	TEST_ASSERT(listen(server->listen_sock, 4) == 0);
+	getsockname(server->listen_sock, (struct sockaddr *)&addr, &addr_len);
+	server->port = ntohs(addr.sin_port);
+	pthread_create(&server->thread, NULL, server_task, server);
+}
+
+static void server_stop(test_server_t *server)
+{
+	webhook_conn_close();
+	shutdown(server->listen_sock, SHUT_RDWR);
+	pthread_join(server->thread, NULL);
+	close(server->listen_sock);
+}
+
+// Posts count payloads, returns how many got a 200
+static uint32_t post_many(const test_server_t *server, uint32_t count, uint32_t *connects)
+{
+	char url[64];
+	char snippet[96];
+	uint32_t ok = 0, before;
+
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/api/webhook/wican", server->port);
+	webhook_conn_get_stats(&before, NULL);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		char body[64];
+		int status;
+		int len = snprintf(body, sizeof(body), "{\"SOC\":%u.5,\"SPEED\":%u}", i, i * 3);
+
+		if(webhook_post_json(url, body, len, 1000, &status, snippet, sizeof(snippet)) == ESP_OK && status == 200)
+		{
+			ok++;
+		}
+	}
+	webhook_conn_get_stats(connects, NULL);
+	*connects -= before;
+
+	return ok;
+}
+
+static void test_keep_alive_reuses_connection(void)
+{
+	test_server_t server;
+	uint32_t connects;
+
+	server_start(&server, SERVER_KEEP_ALIVE, 0);
+	TEST_ASSERT_EQUAL(TEST_POSTS, post_many(&server, TEST_POSTS, &connects));
+	server_stop(&server);
+
+	TEST_ASSERT_EQUAL(1, connects);
+	TEST_ASSERT_EQUAL(1, server.accepts);
+	TEST_ASSERT_EQUAL(TEST_POSTS, server.requests);
+}
+
+// The server drops idle connections, the post is retried on a new one
+static void test_server_close_is_retried(void)
+{
+	test_server_t server;
+	uint32_t connects;
+
+	server_start(&server, SERVER_KEEP_ALIVE, 5);
+	TEST_ASSERT_EQUAL(TEST_POSTS, post_many(&server, TEST_POSTS, &connects));
+	server_stop(&server);
+
+	TEST_ASSERT_EQUAL(TEST_POSTS / 5, connects);
+	TEST_ASSERT_EQUAL(TEST_POSTS / 5, server.accepts);
+	TEST_ASSERT_EQUAL(TEST_POSTS, server.requests);
+}
+
+// Connection: close and bodies without a length end the connection
+static void test_close_responses_reconnect(void)
+{
+	test_server_t server;
+	uint32_t connects;
+
+	server_start(&server, SERVER_CLOSE, 0);
+	TEST_ASSERT_EQUAL(10, post_many(&server, 10, &connects));
+	server_stop(&server);
+	TEST_ASSERT_EQUAL(10, connects);
+	TEST_ASSERT_EQUAL(10, server.accepts);
+
+	server_start(&server, SERVER_CHUNKED, 0);
+	TEST_ASSERT_EQUAL(10, post_many(&server, 10, &connects));
+	server_stop(&server);
+	TEST_ASSERT_EQUAL(10, connects);
+	TEST_ASSERT_EQUAL(10, server.accepts);
+}
+
+// Runs last, the backoff holds for every URL
+static void test_connect_failure_backs_off(void)
+{
+	test_server_t server;
+	char url[64];
+	char snippet[96];
+	int status;
+
+	// A port nobody listens on anymore
+	server_start(&server, SERVER_KEEP_ALIVE, 0);
+	server_stop(&server);
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/", server.port);
+
+	TEST_ASSERT_EQUAL(ESP_FAIL, webhook_post_json(url, "{}", 2, 1000, &status, snippet, sizeof(snippet)));
+	TEST_ASSERT_EQUAL(-1, status);
+	TEST_ASSERT(strncmp(snippet, "connect failed", 14) == 0);
+
+	TEST_ASSERT_EQUAL(ESP_FAIL, webhook_post_json(url, "{}", 2, 1000, &status, snippet, sizeof(snippet)));
+	TEST_ASSERT(strncmp(snippet, "connect backoff", 15) == 0);
+}
+
+static void test_rejects_bad_urls(void)
+{
+	int status;
+
+	TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, webhook_post_json("https://example.com/", "{}", 2, 1000, &status, NULL, 0));
+	TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, webhook_post_json("http://:80/", "{}", 2, 1000, &status, NULL, 0));
+	TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, webhook_post_json("http://host:99999/", "{}", 2, 1000, &status, NULL, 0));
+	TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, webhook_post_json(NULL, "{}", 2, 1000, &status, NULL, 0));
+}
+
+int main(void)
+{
+	esp_log_level_set("*", ESP_LOG_NONE);
+	// lwIP has no SIGPIPE, a send on a closed socket just fails
+	signal(SIGPIPE, SIG_IGN);
+
+	TEST_RUN(test_rejects_bad_urls);
+	TEST_RUN(test_keep_alive_reuses_connection);
+	TEST_RUN(test_server_close_is_retried);
+	TEST_RUN(test_close_responses_reconnect);
+	TEST_RUN(test_connect_failure_backs_off);
+
+	return test_report();
+}
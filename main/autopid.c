@@ -42,6 +42,7 @@
 #include <float.h>
 #include "hw_config.h"
 #include "dev_status.h"
+#include "can.h"
 #include "debug_logs.h"
 #include "ha_webhooks.h"
 #include "wifi_network.h"
@@ -52,6 +53,9 @@
 #include "lwip/netdb.h"
 #include "lwip/err.h"
 #include <errno.h>
+#include "block_pool.h"
+#include "json_writer.h"
+#include "webhook_client.h"
 
 #define TAG "AUTOPID"
 
@@ -65,10 +69,13 @@ static QueueHandle_t autopidQueue;
 static char* device_id;
 static EventGroupHandle_t xautopid_event_group = NULL;
 static all_pids_t* all_pids = NULL;
-static response_t elm327_response;
+static block_pool_t autopid_response_pool;
+static char *autopid_json_buf = NULL;      // publish payloads, sized for every parameter at init
+static size_t autopid_json_buf_size = 0;
 static autopid_value_t *autopid_values = NULL;
 static uint32_t autopid_values_count = 0;
 static SemaphoreHandle_t autopid_values_mutex = NULL;
+static uint32_t autopid_values_version = 0;     // bumped by the poller on every value change
 
 //Helper functions
 // Custom printer function to format numbers with 2 decimal places
@@ -125,25 +132,61 @@ static void webhook_format_utc(char out[32])
     strftime(out, 32, "%Y-%m-%dT%H:%M:%SZ", &t);
 }
 
-static void webhook_sanitize_snippet(char *s)
+// Webhook diff state, one hash pair per scalar key of the last posted object
+// so changed keys are found without keeping or re-parsing the previous JSON
+typedef struct
 {
-    if (!s)
-        return;
-    for (size_t i = 0; s[i]; i++)
+    uint32_t key;
+    uint32_t value;
+} json_digest_entry_t;
+
+typedef struct
+{
+    json_digest_entry_t *entries;
+    uint32_t count;
+} json_digest_t;
+
+#define JSON_DIGEST_SEED    2166136261u
+
+static uint32_t json_digest_hash(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    for (size_t i = 0; i < len; i++)
     {
-        unsigned char c = (unsigned char)s[i];
-        if (c == '\r' || c == '\n' || c == '\t')
-        {
-            s[i] = ' ';
-        }
-        else if (c < 32 || c > 126)
-        {
-            s[i] = ' ';
-        }
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t json_digest_value(const cJSON *item)
+{
+    uint32_t hash = json_digest_hash(JSON_DIGEST_SEED, &item->type, sizeof(item->type));
+
+    if (cJSON_IsString(item))
+    {
+        const char *str = item->valuestring ? item->valuestring : "";
+        hash = json_digest_hash(hash, str, strlen(str));
     }
+    else if (cJSON_IsNumber(item))
+    {
+        hash = json_digest_hash(hash, &item->valuedouble, sizeof(item->valuedouble));
+    }
+    return hash;
+}
+
+static void json_digest_free(json_digest_t *digest)
+{
+    free(digest->entries);
+    digest->entries = NULL;
+    digest->count = 0;
 }
 
-static cJSON *json_object_diff_simple(const cJSON *curr_obj, const cJSON *prev_obj)
+// Returns the scalar keys of curr_obj that are new or changed since digest
+// and fills next with the current values. The caller makes next the digest
+// once the diff was delivered, so a failed post sends the keys again.
+static cJSON *json_object_diff_digest(const cJSON *curr_obj, const json_digest_t *digest, json_digest_t *next)
 {
     cJSON *diff = cJSON_CreateObject();
     if (!diff)
@@ -152,6 +195,10 @@ static cJSON *json_object_diff_simple(const cJSON *curr_obj, const cJSON *prev_o
     if (!curr_obj || !cJSON_IsObject(curr_obj))
         return diff;
 
+    uint32_t size = (uint32_t)cJSON_GetArraySize(curr_obj);
+    json_digest_entry_t *entries = size ? (json_digest_entry_t *)malloc(size * sizeof(json_digest_entry_t)) : NULL;
+    uint32_t count = 0;
+
     const cJSON *it = NULL;
     cJSON_ArrayForEach(it, curr_obj)
     {
@@ -164,35 +211,26 @@ static cJSON *json_object_diff_simple(const cJSON *curr_obj, const cJSON *prev_o
         if (!is_simple)
             continue;
 
+        uint32_t key_hash = json_digest_hash(JSON_DIGEST_SEED, key, strlen(key));
+        uint32_t value_hash = json_digest_value(it);
+
         bool changed = true;
-        if (prev_obj && cJSON_IsObject(prev_obj))
+        for (uint32_t i = 0; i < digest->count; i++)
         {
-            const cJSON *prev_it = cJSON_GetObjectItemCaseSensitive((cJSON *)prev_obj, key);
-            if (prev_it)
+            if (digest->entries[i].key == key_hash)
             {
-                if (cJSON_IsString(it) && cJSON_IsString(prev_it))
-                {
-                    const char *cs = it->valuestring ? it->valuestring : "";
-                    const char *ps = prev_it->valuestring ? prev_it->valuestring : "";
-                    changed = (strcmp(cs, ps) != 0);
-                }
-                else if (cJSON_IsNumber(it) && cJSON_IsNumber(prev_it))
-                {
-                    changed = (it->valuedouble != prev_it->valuedouble);
-                }
-                else if (cJSON_IsBool(it) && cJSON_IsBool(prev_it))
-                {
-                    int cv = cJSON_IsTrue(it) ? 1 : 0;
-                    int pv = cJSON_IsTrue(prev_it) ? 1 : 0;
-                    changed = (cv != pv);
-                }
-                else
-                {
-                    changed = true;
-                }
+                changed = (digest->entries[i].value != value_hash);
+                break;
             }
         }
 
+        if (entries && count < size)
+        {
+            entries[count].key = key_hash;
+            entries[count].value = value_hash;
+            count++;
+        }
+
         if (changed)
         {
             if (cJSON_IsString(it) && it->valuestring)
@@ -204,6 +242,10 @@ static cJSON *json_object_diff_simple(const cJSON *curr_obj, const cJSON *prev_o
         }
     }
 
+    // Without memory for the new digest the next diff sends every key again
+    next->entries = entries;
+    next->count = count;
+
     return diff;
 }
 
@@ -235,232 +277,6 @@ typedef struct
     char snippet[96];
 } webhook_http_ctx_t;
 
-// static void webhook_printf_post_body(const char *url, const char *body, size_t body_len)
-// {
-//     if (!url || !body)
-//         return;
-
-//     // Print URL + full JSON payload in bounded chunks (avoids extremely long single-line prints).
-//     printf("WEBHOOK POST url=%s len=%u\n", url, (unsigned)body_len);
-//     size_t off = 0;
-//     while (off < body_len)
-//     {
-//         size_t chunk = body_len - off;
-//         if (chunk > 256)
-//             chunk = 256;
-//         printf("%.*s", (int)chunk, body + off);
-//         off += chunk;
-//     }
-//     printf("\n");
-// }
-
-static bool webhook_parse_http_url(const char *url, char *host, size_t host_len, int *out_port, char *path, size_t path_len)
-{
-    if (!url || !host || !path || !out_port)
-        return false;
-
-    // HTTP only
-    if (strncasecmp(url, "http://", 7) != 0)
-        return false;
-
-    const char *p = url + 7;
-    // host[:port][/path]
-    const char *host_end = p;
-    while (*host_end && *host_end != '/' && *host_end != ':')
-        host_end++;
-
-    size_t hlen = (size_t)(host_end - p);
-    if (hlen == 0 || hlen >= host_len)
-        return false;
-    memcpy(host, p, hlen);
-    host[hlen] = '\0';
-
-    int port = 80;
-    const char *after_host = host_end;
-    if (*after_host == ':')
-    {
-        after_host++;
-        port = 0;
-        while (*after_host && isdigit((unsigned char)*after_host))
-        {
-            port = (port * 10) + (*after_host - '0');
-            after_host++;
-        }
-        if (port <= 0 || port > 65535)
-            return false;
-    }
-
-    if (*after_host == '\0')
-    {
-        strlcpy(path, "/", path_len);
-    }
-    else if (*after_host == '/')
-    {
-        strlcpy(path, after_host, path_len);
-    }
-    else
-    {
-        // Unexpected character after host/port
-        return false;
-    }
-
-    *out_port = port;
-    return true;
-}
-
-static esp_err_t webhook_post_json(const char *url, const char *body, size_t body_len, int timeout_ms, int *out_status, char *out_snippet, size_t out_snippet_len)
-{
-    if (!url || !body)
-        return ESP_ERR_INVALID_ARG;
-
-    // webhook_printf_post_body(url, body, body_len);
-
-    if (out_status)
-        *out_status = -1;
-    if (out_snippet && out_snippet_len)
-        out_snippet[0] = '\0';
-
-    char host[96] = {0};
-    char path[192] = {0};
-    int port = 80;
-    if (!webhook_parse_http_url(url, host, sizeof(host), &port, path, sizeof(path)))
-        return ESP_ERR_INVALID_ARG;
-
-    char port_str[8];
-    snprintf(port_str, sizeof(port_str), "%d", port);
-
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    struct addrinfo *res = NULL;
-    int gai = getaddrinfo(host, port_str, &hints, &res);
-    if (gai != 0 || !res)
-    {
-        if (out_snippet && out_snippet_len)
-        {
-            // Keep message short and always bounded (build uses -Werror=format-truncation)
-            snprintf(out_snippet, out_snippet_len, "getaddrinfo failed gai=%d", gai);
-        }
-        return ESP_FAIL;
-    }
-
-    int sock = -1;
-    int last_errno = 0;
-    struct addrinfo *ai = res;
-    for (; ai; ai = ai->ai_next)
-    {
-        sock = (int)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if (sock < 0)
-            continue;
-
-        struct timeval tv;
-        tv.tv_sec = timeout_ms / 1000;
-        tv.tv_usec = (timeout_ms % 1000) * 1000;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-        if (connect(sock, ai->ai_addr, (socklen_t)ai->ai_addrlen) == 0)
-            break;
-
-        last_errno = errno;
-        close(sock);
-        sock = -1;
-    }
-    freeaddrinfo(res);
-
-    if (sock < 0)
-    {
-        if (out_snippet && out_snippet_len)
-        {
-            // Keep message short and always bounded (build uses -Werror=format-truncation)
-            snprintf(out_snippet, out_snippet_len, "connect failed errno=%d", last_errno);
-        }
-        return ESP_FAIL;
-    }
-
-    // Build HTTP request
-    const char *fmt =
-        "POST %s HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Content-Type: application/json\r\n"
-        "Connection: close\r\n"
-        "Content-Length: %u\r\n"
-        "\r\n";
-
-    int hdr_len = snprintf(NULL, 0, fmt, path, host, (unsigned)body_len);
-    if (hdr_len <= 0)
-    {
-        close(sock);
-        return ESP_FAIL;
-    }
-
-    size_t req_len = (size_t)hdr_len + body_len;
-    char *req = (char *)malloc(req_len + 1);
-    if (!req)
-    {
-        close(sock);
-        return ESP_ERR_NO_MEM;
-    }
-
-    int w = snprintf(req, (size_t)hdr_len + 1, fmt, path, host, (unsigned)body_len);
-    if (w != hdr_len)
-    {
-        free(req);
-        close(sock);
-        return ESP_FAIL;
-    }
-    memcpy(req + hdr_len, body, body_len);
-    req[req_len] = '\0';
-
-    // Send all
-    size_t sent = 0;
-    while (sent < req_len)
-    {
-        int n = (int)send(sock, req + sent, (int)(req_len - sent), 0);
-        if (n <= 0)
-        {
-            free(req);
-            close(sock);
-            return ESP_FAIL;
-        }
-        sent += (size_t)n;
-    }
-    free(req);
-
-    // Read response (small)
-    char resp[512];
-    int r = (int)recv(sock, resp, sizeof(resp) - 1, 0);
-    close(sock);
-    if (r <= 0)
-        return ESP_FAIL;
-    resp[r] = '\0';
-
-    // Parse status code
-    int status = -1;
-    const char *sp = strstr(resp, "HTTP/");
-    if (sp)
-    {
-        const char *code = strchr(sp, ' ');
-        if (code)
-            status = atoi(code + 1);
-    }
-    if (out_status)
-        *out_status = status;
-
-    // Extract a snippet after headers if possible
-    if (out_snippet && out_snippet_len > 0)
-    {
-        const char *body_start = strstr(resp, "\r\n\r\n");
-        body_start = body_start ? (body_start + 4) : resp;
-        strlcpy(out_snippet, body_start, out_snippet_len);
-        webhook_sanitize_snippet(out_snippet);
-    }
-
-    return ESP_OK;
-}
-
 // Recursively limit decimal precision in the JSON structure
 void limitJsonDecimalPrecision(cJSON* item) 
 {
@@ -586,6 +402,30 @@ static void merge_response_frames(uint8_t* data, uint32_t length, uint8_t* merge
     }
 }
 
+// Waits for the next reply, the caller gives it back with block_pool_free()
+static response_t *autopid_receive(TickType_t ticks_to_wait)
+{
+    response_t *response = NULL;
+
+    if (xQueueReceive(autopidQueue, &response, ticks_to_wait) != pdPASS)
+    {
+        return NULL;
+    }
+
+    return response;
+}
+
+// Drops replies until none arrives for ticks_to_wait
+static void autopid_drain(TickType_t ticks_to_wait)
+{
+    response_t *response;
+
+    while ((response = autopid_receive(ticks_to_wait)) != NULL)
+    {
+        block_pool_free(&autopid_response_pool, response);
+    }
+}
+
 esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint32_t available_pids_size) 
 {
     twai_message_t frame;
@@ -603,15 +443,6 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
                                                 "ATSP9\rATSH18DB33F1\rATCRA\r",
                                                 };
 
-    response = (response_t *)malloc(sizeof(response_t)); 
-    
-    if (response == NULL)
-    {
-        ESP_LOGE(TAG, "Failed to allocate memory for response");
-        DEBUG_LOGE(TAG, "Failed to allocate memory for response");
-        return ESP_ERR_NO_MEM;
-    }
-
     if(current_rxheader == 0)
     {
         snprintf(restore_cmd, sizeof(restore_cmd), "ATSP%u\rATSH%03lX\r",
@@ -642,13 +473,13 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
 
         static const char *elm327_config = "ate0\rath1\ratl0\rats1\ratst96\r";
         elm327_process_cmd((uint8_t*)elm327_config, strlen(elm327_config), &frame, &autopidQueue);
-        while (xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) == pdPASS);
+        autopid_drain(pdMS_TO_TICKS(1000));
 
         const char* protocol_cmds = supported_protocols[protocol-6];
         ESP_LOGI(TAG, "Sending protocol commands: %s", protocol_cmds);
     DEBUG_LOGI(TAG, "Sending protocol commands: %s", protocol_cmds);
         elm327_process_cmd((uint8_t*)protocol_cmds, strlen(protocol_cmds), &frame, &autopidQueue);
-        while (xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) == pdPASS);
+        autopid_drain(pdMS_TO_TICKS(1000));
         ESP_LOGI(TAG, "Protocol %d set successfully", protocol);
     DEBUG_LOGI(TAG, "Protocol %d set successfully", protocol);
     }
@@ -657,11 +488,10 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
         ESP_LOGE(TAG, "Invalid protocol number: %d", protocol);
     DEBUG_LOGE(TAG, "Invalid protocol number: %d", protocol);
         elm327_unlock();
-        free(response);
         return ESP_FAIL;
     }
     
-    xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000));
+    block_pool_free(&autopid_response_pool, autopid_receive(pdMS_TO_TICKS(1000)));
 
     const char *pid_support_cmds[] = {
         "0100\r",  // PIDs 0x01-0x20
@@ -683,7 +513,7 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
             continue;
         }
 
-    if (xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) == pdPASS) {
+    if ((response = autopid_receive(pdMS_TO_TICKS(1000))) != NULL) {
         ESP_LOGI(TAG, "Raw response length: %lu", response->length);
     DEBUG_LOGI(TAG, "Raw response length: %lu", response->length);
         ESP_LOG_BUFFER_HEX(TAG, response->data, response->length);
@@ -748,6 +578,7 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
                 ESP_LOGW(TAG, "Response length too short: %lu", response->length);
                 DEBUG_LOGW(TAG, "Response length too short: %lu", response->length);
             }
+            block_pool_free(&autopid_response_pool, response);
         } else {
             ESP_LOGW(TAG, "No response received for PID support command: %s", pid_support_cmds[i]);
             DEBUG_LOGW(TAG, "No response received for PID support command: %s", pid_support_cmds[i]);
@@ -772,9 +603,8 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
             ESP_LOGI(TAG, "Restoring protocol settings");
             DEBUG_LOGI(TAG, "Restoring protocol settings");
             elm327_process_cmd((uint8_t*)restore_cmd, strlen(restore_cmd), &frame, &autopidQueue);
-            while (xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) == pdPASS);
+            autopid_drain(pdMS_TO_TICKS(1000));
 
-            free(response);
             elm327_unlock();
             return ESP_OK;
         }
@@ -789,10 +619,9 @@ esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint
     ESP_LOGI(TAG, "Restoring protocol settings");
     DEBUG_LOGI(TAG, "Restoring protocol settings");
     elm327_process_cmd((uint8_t*)restore_cmd, strlen(restore_cmd), &frame, &autopidQueue);
-    while (xQueueReceive(autopidQueue, response, pdMS_TO_TICKS(1000)) == pdPASS);
+    autopid_drain(pdMS_TO_TICKS(1000));
     
     cJSON_Delete(root);
-    free(response);
     elm327_unlock();
     return ESP_FAIL;
 }
@@ -895,6 +724,7 @@ void autopid_update_values(void)
                     // Update the value and sensor type
                     autopid_values[value_index].value = param->value;
                     autopid_values[value_index].sensor_type = param->sensor_type;
+                    autopid_values[value_index].version = param->version;
                     ESP_LOGD(TAG, "Updated autopid_values[%lu]: %s = %.2f", 
                             value_index, param->name, param->value);
                     DEBUG_LOGD(TAG, "Updated autopid_values[%lu]: %s = %.2f", 
@@ -923,16 +753,8 @@ void autopid_request_data(void)
 }
 
 
-char *autopid_data_read(void)
+static void autopid_wait_values(void)
 {
-    static char *json_str = NULL;
-    
-    if (!autopid_values || !autopid_values_mutex) {
-        ESP_LOGE(TAG, "Invalid autopid_values or mutex");
-        DEBUG_LOGE(TAG, "Invalid autopid_values or mutex");
-        return NULL;
-    }
-
     // Only set request bit and wait if polling is disabled
     if (xEventGroupGetBits(xautopid_event_group) & AUTOPID_POLLING_DISABLED_BIT) {
         // Set the request bit to signal autopid task
@@ -942,23 +764,84 @@ char *autopid_data_read(void)
             vTaskDelay(pdMS_TO_TICKS(100)); // Small delay to prevent busy waiting
         }
     }
+}
+
+// Values that changed after version since, latest receives the newest version
+// included. Same keys and formatting as autopid_data_read()
+static cJSON *autopid_data_diff(uint32_t since, uint32_t *latest)
+{
+    cJSON *diff = cJSON_CreateObject();
+
+    *latest = since;
+    if (!diff || !autopid_values || !autopid_values_mutex) {
+        return diff;
+    }
+
+    autopid_wait_values();
+
+    if (xSemaphoreTake(autopid_values_mutex, portMAX_DELAY) == pdTRUE) {
+        for (uint32_t i = 0; i < autopid_values_count; i++) {
+            autopid_value_t *value = &autopid_values[i];
+
+            if (!value->name || value->version == 0 || (int32_t)(value->version - since) <= 0) {
+                continue;
+            }
+            if ((int32_t)(value->version - *latest) > 0) {
+                *latest = value->version;
+            }
+            if (value->value == FLT_MAX) {
+                continue;
+            }
+            if (value->sensor_type == BINARY_SENSOR) {
+                cJSON_AddStringToObject(diff, value->name, value->value > 0 ? "on" : "off");
+            } else {
+                cJSON_AddNumberToObject(diff, value->name, value->value);
+            }
+        }
+        xSemaphoreGive(autopid_values_mutex);
+    }
+    return diff;
+}
+
+char *autopid_data_read(void)
+{
+    static char *json_str = NULL;
+    
+    if (!autopid_values || !autopid_values_mutex) {
+        ESP_LOGE(TAG, "Invalid autopid_values or mutex");
+        DEBUG_LOGE(TAG, "Invalid autopid_values or mutex");
+        return NULL;
+    }
+
+    autopid_wait_values();
 
     if (xSemaphoreTake(autopid_values_mutex, portMAX_DELAY) == pdTRUE) {
-        cJSON *root = cJSON_CreateObject();
-        if (root) {
+        // Callers free the string, size it once instead of building a cJSON tree
+        size_t size = 3;
+        for (uint32_t i = 0; i < autopid_values_count; i++) {
+            if (autopid_values[i].json_key) {
+                size += strlen(autopid_values[i].json_key) + JSON_NUMBER_MAX_LEN + 1;
+            }
+        }
+
+        json_str = malloc(size);
+        if (json_str) {
+            json_writer_t writer;
+            json_writer_init(&writer, json_str, size);
+            json_writer_begin_object(&writer);
             for (uint32_t i = 0; i < autopid_values_count; i++) {
                 autopid_value_t *value = &autopid_values[i];
-                if (value->name && value->value != FLT_MAX) {
+                if (value->json_key && value->value != FLT_MAX) {
+                    json_writer_key(&writer, value->json_key);
                     if (value->sensor_type == BINARY_SENSOR) {
-                        cJSON_AddStringToObject(root, value->name, value->value > 0 ? "on" : "off");
+                        json_writer_string(&writer, value->value > 0 ? "on" : "off");
                     } else {
-                        cJSON_AddNumberToObject(root, value->name, value->value);
+                        json_writer_number(&writer, value->value);
                     }
                 }
             }
-            limitJsonDecimalPrecision(root);
-            json_str = cJSON_PrintUnformatted(root);
-            cJSON_Delete(root);
+            json_writer_end_object(&writer);
+            json_writer_finish(&writer);
         }
         xSemaphoreGive(autopid_values_mutex);
     }
@@ -972,43 +855,46 @@ void autopid_data_publish(void) {
         return;
     }
 
+    if (!autopid_json_buf) {
+        return;
+    }
+
     if (xSemaphoreTake(all_pids->mutex, portMAX_DELAY) == pdTRUE) {
-        cJSON *root = cJSON_CreateObject();
-        if (root) {
-            for (uint32_t i = 0; i < all_pids->pid_count; i++) {
-                pid_data2_t *curr_pid = &all_pids->pids[i];
-                for (uint32_t j = 0; j < curr_pid->parameters_count; j++) {
-                    parameter_t *param = &curr_pid->parameters[j];
-                    if (param->name && param->value != FLT_MAX) {
-                        if (param->sensor_type == BINARY_SENSOR) {
-                            cJSON_AddStringToObject(root, param->name, param->value > 0 ? "on" : "off");
-                        } else {
-                            cJSON_AddNumberToObject(root, param->name, param->value);
-                        }
-                    }
-                }
-            }
+        json_writer_t writer;
+        uint32_t count = 0;
 
-            if (root->child) {
-                limitJsonDecimalPrecision(root);
-                char *json_str = cJSON_PrintUnformatted(root);
-                if (json_str) {
-                    if(all_pids->group_destination && strlen(all_pids->group_destination) > 0)
-                    {
-                        mqtt_publish(all_pids->group_destination, json_str, 0, 0, 1);
-                        ESP_LOGI(TAG, "Published to %s", all_pids->group_destination);
-                        DEBUG_LOGI(TAG, "Published to %s", all_pids->group_destination);
-                    }else{
-                        mqtt_publish(config_server_get_mqtt_rx_topic(), json_str, 0, 0, 1);
+        json_writer_init(&writer, autopid_json_buf, autopid_json_buf_size);
+        json_writer_begin_object(&writer);
+        for (uint32_t i = 0; i < all_pids->pid_count; i++) {
+            pid_data2_t *curr_pid = &all_pids->pids[i];
+            for (uint32_t j = 0; j < curr_pid->parameters_count; j++) {
+                parameter_t *param = &curr_pid->parameters[j];
+                if (param->json_key && param->value != FLT_MAX) {
+                    json_writer_key(&writer, param->json_key);
+                    if (param->sensor_type == BINARY_SENSOR) {
+                        json_writer_string(&writer, param->value > 0 ? "on" : "off");
+                    } else {
+                        json_writer_number(&writer, param->value);
                     }
-                    free(json_str);
+                    count++;
                 }
-            } else {
-                ESP_LOGW(TAG, "No valid parameters found to publish");
-                DEBUG_LOGW(TAG, "No valid parameters found to publish");
             }
-
-            cJSON_Delete(root);
+        }
+        json_writer_end_object(&writer);
+        const char *json_str = json_writer_finish(&writer);
+
+        if (count == 0) {
+            ESP_LOGW(TAG, "No valid parameters found to publish");
+            DEBUG_LOGW(TAG, "No valid parameters found to publish");
+        } else if (json_str) {
+            if(all_pids->group_destination && strlen(all_pids->group_destination) > 0)
+            {
+                mqtt_publish(all_pids->group_destination, (char*)json_str, writer.len, 0, 1);
+                ESP_LOGI(TAG, "Published to %s", all_pids->group_destination);
+                DEBUG_LOGI(TAG, "Published to %s", all_pids->group_destination);
+            }else{
+                mqtt_publish(config_server_get_mqtt_rx_topic(), (char*)json_str, writer.len, 0, 1);
+            }
         }
         xSemaphoreGive(all_pids->mutex);
     }
@@ -1218,7 +1104,6 @@ void parse_elm327_response(char *buffer, response_t *response) {
     uint32_t highest_header = 0;          // Track highest header
     uint32_t first_header = 0;
     bool all_headers_same = true;
-    uint8_t *lowest_header_data = NULL;   // Store the actual data pointer
     uint8_t lowest_header_length = 0;
 
     frame = strtok(buffer, "\r\n");
@@ -1296,18 +1181,14 @@ void parse_elm327_response(char *buffer, response_t *response) {
             if (current_header < lowest_header) {
                 ESP_LOGD(TAG, "New lowest header found: 0x%lX (previous: 0x%lX)", current_header, lowest_header);
                 lowest_header = current_header;
-                lowest_header_length = current_length;
-                
-                // Allocate space and copy data for lowest header frame
-                if (lowest_header_data == NULL) {
-                    lowest_header_data = (uint8_t*)malloc(current_length);
-                } else {
-                    lowest_header_data = (uint8_t*)realloc(lowest_header_data, current_length);
+                if (current_length > sizeof(response->priority_buf)) {
+                    current_length = sizeof(response->priority_buf);
                 }
+                lowest_header_length = current_length;
                 
                 // Parse and store the data bytes for this frame
                 int idx = 0;
-                while (*current_data_start != '\0') {
+                while (*current_data_start != '\0' && idx < current_length) {
                     if (*current_data_start == ' ') {
                         current_data_start++;
                         continue;
@@ -1315,7 +1196,7 @@ void parse_elm327_response(char *buffer, response_t *response) {
                     if (strlen(current_data_start) < 2) break;
                     
                     char byte_str[3] = {current_data_start[0], current_data_start[1], 0};
-                    lowest_header_data[idx++] = (unsigned char)strtol(byte_str, NULL, 16);
+                    response->priority_buf[idx++] = (unsigned char)strtol(byte_str, NULL, 16);
                     current_data_start += 2;
                 }
                 ESP_LOGD(TAG, "Stored %d bytes from lowest header frame", idx);
@@ -1333,6 +1214,10 @@ void parse_elm327_response(char *buffer, response_t *response) {
                     break;
                 }
                 
+                if (k >= sizeof(response->data)) {
+                    ESP_LOGW(TAG, "Response buffer full, byte dropped");
+                    break;
+                }
                 char byte_str[3] = {data_start[0], data_start[1], 0};
                 response->data[k] = (unsigned char)strtol(byte_str, NULL, 16);
                 ESP_LOGV(TAG, "Parsed byte %d: 0x%02X from %s", k, response->data[k], byte_str);
@@ -1351,13 +1236,10 @@ void parse_elm327_response(char *buffer, response_t *response) {
     if (frame_count <= 2 || all_headers_same) {
         response->priority_data = NULL;
         response->priority_data_len = 0;
-        if (lowest_header_data != NULL) {
-            free(lowest_header_data);
-        }
         ESP_LOGI(TAG, "Null priority data set - frames: %d, all headers same: %d", 
                 frame_count, all_headers_same);
     } else {
-        response->priority_data = lowest_header_data;
+        response->priority_data = response->priority_buf;
         response->priority_data_len = lowest_header_length;
         ESP_LOGI(TAG, "Priority data set - length: %u, starting with byte: 0x%02X", 
                 response->priority_data_len, 
@@ -1383,7 +1265,6 @@ static void append_to_buffer(char *buffer, const char *new_data)
 
 void autopid_parser(char *str, uint32_t len, QueueHandle_t *q)
 {
-    static response_t response;
     if (str != NULL && strlen(str) != 0)
     {
         ESP_LOGI(TAG, "%s", str);
@@ -1393,27 +1274,33 @@ void autopid_parser(char *str, uint32_t len, QueueHandle_t *q)
 
         if (strchr(str, '>') != NULL) 
         {
-            if(strstr(str, "NO DATA") == NULL && strstr(str, "ERROR") == NULL)
+            response_t *response = (response_t*)block_pool_alloc(&autopid_response_pool);
+
+            if (response == NULL)
+            {
+                ESP_LOGE(TAG, "Response pool empty, reply dropped");
+                DEBUG_LOGE(TAG, "Response pool empty, reply dropped");
+            }
+            else if(strstr(str, "NO DATA") == NULL && strstr(str, "ERROR") == NULL)
             {
                 // Parse the accumulated buffer
-                parse_elm327_response(auto_pid_buf, &response);
-                if (xQueueSend(autopidQueue, &response, pdMS_TO_TICKS(1000)) != pdPASS)
-                {
-                    ESP_LOGE(TAG, "Failed to send to queue");
-                    DEBUG_LOGE(TAG, "Failed to send to queue");
-                }
+                parse_elm327_response(auto_pid_buf, response);
             }
             else
             {
-                sprintf((char*)response.data, "error");
-                response.length = strlen((char*)response.data);
+                sprintf((char*)response->data, "error");
+                response->length = strlen((char*)response->data);
+                response->priority_data = NULL;
+                response->priority_data_len = 0;
                 ESP_LOGE(TAG, "Error response: %s", auto_pid_buf);
                 DEBUG_LOGE(TAG, "Error response: %s", auto_pid_buf);
-                if (xQueueSend(autopidQueue, &response, pdMS_TO_TICKS(1000)) != pdPASS)
-                {
-                    ESP_LOGE(TAG, "Failed to send to queue");
-                    DEBUG_LOGE(TAG, "Failed to send to queue");
-                }
+            }
+
+            if (response != NULL && xQueueSend(autopidQueue, &response, pdMS_TO_TICKS(1000)) != pdPASS)
+            {
+                ESP_LOGE(TAG, "Failed to send to queue");
+                DEBUG_LOGE(TAG, "Failed to send to queue");
+                block_pool_free(&autopid_response_pool, response);
             }
             // Clear the buffer after parsing
             auto_pid_buf[0] = '\0';
@@ -1438,7 +1325,7 @@ static void send_commands(char *commands, uint32_t delay_ms)
             (strstr(str_send, "ate1") == NULL && strstr(str_send, "ATE1") == NULL && strstr(str_send, "at e1") == NULL && strstr(str_send, "AT E1") == NULL))
         {
             elm327_process_cmd((uint8_t *)str_send, cmd_len, &tx_msg, &autopidQueue);
-            while ((xQueueReceive(autopidQueue, &elm327_response, pdMS_TO_TICKS(10)) == pdPASS));
+            autopid_drain(pdMS_TO_TICKS(10));
         }
         
         cmd_start = cmd_end + 1; // Move to the start of the next command
@@ -1471,53 +1358,1012 @@ static bool all_parameters_failed(all_pids_t* all_pids) {
     return !any_success;
 }
 
+// A parameter without a deadband is published on every read. Otherwise only
+// when it leaves the band around the last published value, or when the
+// heartbeat expires.
+static bool autopid_should_publish(parameter_t *param)
+{
+    if (param->deadband <= 0 && param->deadband_pct <= 0)
+    {
+        return true;
+    }
+
+    if (param->published_value == FLT_MAX)
+    {
+        return true;
+    }
+
+    // Into or out of NaN/inf, or from one inf to the other, is outside any
+    // band; the float arithmetic below would call some of those unchanged
+    if (!isfinite(param->value) || !isfinite(param->published_value))
+    {
+        bool same = (isnan(param->value) && isnan(param->published_value)) ||
+                    param->value == param->published_value;
+        if (!same)
+        {
+            return true;
+        }
+        return param->heartbeat != 0 && wc_timer_is_expired(&param->heartbeat_timer);
+    }
+
+    float band = param->deadband;
+    float pct_band = fabsf(param->published_value) * param->deadband_pct / 100.0f;
+    if (pct_band > band)
+    {
+        band = pct_band;
+    }
+
+    if (fabsf(param->value - param->published_value) > band)
+    {
+        return true;
+    }
+
+    return param->heartbeat != 0 && wc_timer_is_expired(&param->heartbeat_timer);
+}
+
+// Runs in autopid_task like autopid_data_publish(), both use autopid_json_buf
 static void publish_parameter_mqtt(parameter_t *param) {
-    if (!param) return;
-    
-    char *payload = NULL;
+    if (!param || !autopid_json_buf) return;
+
+    if (!autopid_should_publish(param)) {
+        ESP_LOGD(TAG, "Parameter %s within deadband, not published", param->name);
+        return;
+    }
+    const char *payload = NULL;
+    json_writer_t writer;
     
     switch(param->destination_type) {
         case DEST_MQTT_TOPIC:
             // JSON format
-            cJSON *param_json = cJSON_CreateObject();
-            if (param_json) {
+            if (param->json_key) {
+                json_writer_init(&writer, autopid_json_buf, autopid_json_buf_size);
+                json_writer_begin_object(&writer);
+                json_writer_key(&writer, param->json_key);
                 if (param->sensor_type == BINARY_SENSOR) {
-                    cJSON_AddStringToObject(param_json, param->name, param->value > 0 ? "on" : "off");
+                    json_writer_string(&writer, param->value > 0 ? "on" : "off");
                 } else {
-                    cJSON_AddNumberToObject(param_json, param->name, param->value);
+                    json_writer_number(&writer, param->value);
                 }
-                limitJsonDecimalPrecision(param_json);
-                payload = cJSON_PrintUnformatted(param_json);
-                cJSON_Delete(param_json);
+                json_writer_end_object(&writer);
+                payload = json_writer_finish(&writer);
             }
             break;
             
         case DEST_MQTT_WALLBOX:
             // Simple value format
-            asprintf(&payload, "%.2f", param->value);
+            snprintf(autopid_json_buf, autopid_json_buf_size, "%.2f", param->value);
+            payload = autopid_json_buf;
             break;
         default:
             break;
     }
 
     if (payload) {
+        bool accepted;
+
         // Publish to specified destination or default topic
         if (param->destination && strlen(param->destination) > 0) {
-            mqtt_publish(param->destination, payload, 0, 0, 1);
+            accepted = mqtt_publish(param->destination, (char*)payload, 0, 0, 1);
             ESP_LOGI(TAG, "Published to %s", param->destination);
         } else {
-            mqtt_publish(config_server_get_mqtt_rx_topic(), payload, 0, 0, 1);
+            accepted = mqtt_publish(config_server_get_mqtt_rx_topic(), (char*)payload, 0, 0, 1);
         }
-        free(payload);
-    }
+
+        // A dropped message leaves the band where it was, the next read retries
+        if (accepted) {
+            param->published_value = param->value;
+            if (param->heartbeat != 0) {
+                wc_timer_set(&param->heartbeat_timer, param->heartbeat);
+            }
+        }
+    }
+}
+
+
+static bool autopid_pid_enabled(const pid_data2_t *pid)
+{
+    return !((pid->pid_type == PID_STD && !all_pids->pid_std_en) ||
+            (pid->pid_type == PID_CUSTOM && !all_pids->pid_custom_en) ||
+            (pid->pid_type == PID_SPECIFIC && !all_pids->pid_specific_en));
+}
+
+static bool autopid_str_equal(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+    {
+        return a == b;
+    }
+    return strcmp(a, b) == 0;
+}
+
+// Two PIDs can share one ELM327 transaction when they send the same command
+// with the same header setup
+static bool autopid_same_request(const pid_data2_t *a, const pid_data2_t *b)
+{
+    return a->pid_type == b->pid_type &&
+            a->cmd != NULL && strlen(a->cmd) > 0 &&
+            autopid_str_equal(a->cmd, b->cmd) &&
+            autopid_str_equal(a->init, b->init) &&
+            autopid_str_equal(a->rxheader, b->rxheader);
+}
+
+static void autopid_decode_parameter(pid_data2_t *curr_pid, parameter_t *param, response_t *response)
+{
+    double result;
+    float previous = param->value;
+
+    // Process response based on PID type
+    if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
+    {
+        ESP_LOGI(TAG, "Processing custom/specific PID");
+        if(param->program && 
+        evaluate_compiled_expression(param->program, 
+                            response->data, response->length, 0, &result))
+        {
+            if (param->min != FLT_MAX && result < param->min) {
+                ESP_LOGW(TAG, "Parameter %s value %.2f below min %.2f - ignoring", 
+                        param->name, result, param->min);
+            } else if (param->max != FLT_MAX && result > param->max) {
+                ESP_LOGW(TAG, "Parameter %s value %.2f above max %.2f - ignoring", 
+                        param->name, result, param->max);
+            } else {
+                result = round(result * 100.0) / 100.0;
+                ESP_LOGI(TAG, "Parameter %s result: %.2f", 
+                        param->name, result);
+                param->value = result;
+                publish_parameter_mqtt(param);
+            }
+        }
+    }
+    else if(curr_pid->pid_type == PID_STD) 
+    {
+        ESP_LOGI(TAG, "Processing standard PID");
+        const std_pid_t* pid_info = get_pid_from_string(param->name);
+        if(pid_info)
+        {
+            ESP_LOGI(TAG, "Found PID info for: %s", param->name);
+            // Find matching parameter in pid_info
+            for(int p = 0; p < pid_info->num_params; p++)
+            {
+                // Match parameter name after the dash
+                const char* param_name = strchr(param->name, '-');
+                if(param_name && strcmp(param_name + 1, pid_info->params[p].name) == 0)
+                {
+                    esp_err_t err = ESP_FAIL;
+
+                    ESP_LOGI(TAG, "Processing parameter: %s", pid_info->params[p].name);
+                    if(response->priority_data != NULL && response->priority_data != 0)
+                    {
+                        err = extract_signal_value(
+                            response->priority_data,           // Your CAN response data buffer
+                            response->priority_data_len,         // Length of your CAN response data
+                            &pid_info->params[p],    // Parameter definition from pid_info
+                            &param->value            // Where to store the result
+                        );
+                    }
+                    else
+                    {
+                        err = extract_signal_value(
+                            response->data,           // Your CAN response data buffer
+                            response->length,         // Length of your CAN response data
+                            &pid_info->params[p],    // Parameter definition from pid_info
+                            &param->value            // Where to store the result
+                        );
+                    }
+
+                    if (err != ESP_OK) {
+                        ESP_LOGE(TAG, "Failed to extract signal: %s", esp_err_to_name(err));
+                        break;
+                    }
+                    param->value = roundf(param->value * 100.0) / 100.0;
+                    ESP_LOGI(TAG, "Parameter %s result: %.2f %s", 
+                                    param->name, 
+                                    param->value, 
+                                    pid_info->params[p].unit);
+                    publish_parameter_mqtt(param);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Only the poller task writes values, diff mode webhooks send the
+    // parameters whose version is newer than the last posted one
+    if (param->value != previous)
+    {
+        param->version = ++autopid_values_version;
+        if (param->version == 0)
+        {
+            param->version = ++autopid_values_version;
+        }
+    }
+}
+
+// PID scheduler
+//
+// Every enabled PID sits in the min-heap of its priority class, keyed on the
+// earliest timer of its parameters. The task serves the most urgent class that
+// has a due PID, one request at a time, and sleeps until the next deadline.
+#define AUTOPID_SCHED_MAX_SLEEP_MS      1000
+#define AUTOPID_SCHED_NOT_QUEUED        UINT32_MAX
+#define AUTOPID_JITTER_AVG_SHIFT        3
+
+static uint32_t *sched_heap[PID_PRIORITY_MAX];
+static uint32_t sched_heap_len[PID_PRIORITY_MAX];
+
+static const char *autopid_priority_str(pid_priority_t priority)
+{
+    switch(priority)
+    {
+        case PID_PRIORITY_HIGH: return "high";
+        case PID_PRIORITY_LOW: return "low";
+        default: return "normal";
+    }
+}
+
+static pid_priority_t autopid_priority_from_json(const cJSON *item)
+{
+    if(item && cJSON_IsString(item) && item->valuestring)
+    {
+        if(strcasecmp(item->valuestring, "high") == 0) return PID_PRIORITY_HIGH;
+        if(strcasecmp(item->valuestring, "low") == 0) return PID_PRIORITY_LOW;
+    }
+    return PID_PRIORITY_NORMAL;
+}
+
+static int64_t autopid_pid_deadline(const pid_data2_t *pid)
+{
+    int64_t deadline = INT64_MAX;
+
+    for(uint32_t p = 0; p < pid->parameters_count; p++)
+    {
+        if(pid->parameters[p].timer < deadline)
+        {
+            deadline = pid->parameters[p].timer;
+        }
+    }
+    return deadline;
+}
+
+static bool autopid_sched_less(const uint32_t *heap, uint32_t a, uint32_t b)
+{
+    return all_pids->pids[heap[a]].sched.deadline < all_pids->pids[heap[b]].sched.deadline;
+}
+
+static void autopid_sched_swap(uint32_t *heap, uint32_t a, uint32_t b)
+{
+    uint32_t tmp = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    all_pids->pids[heap[a]].sched.heap_index = a;
+    all_pids->pids[heap[b]].sched.heap_index = b;
+}
+
+// Restores the heap order after the deadline at index changed in either direction
+static void autopid_sched_sift(pid_priority_t priority, uint32_t index)
+{
+    uint32_t *heap = sched_heap[priority];
+    uint32_t len = sched_heap_len[priority];
+
+    while(index > 0 && autopid_sched_less(heap, index, (index - 1) / 2))
+    {
+        autopid_sched_swap(heap, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+
+    while(1)
+    {
+        uint32_t smallest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+
+        if(left < len && autopid_sched_less(heap, left, smallest)) smallest = left;
+        if(right < len && autopid_sched_less(heap, right, smallest)) smallest = right;
+        if(smallest == index) break;
+
+        autopid_sched_swap(heap, index, smallest);
+        index = smallest;
+    }
+}
+
+static void autopid_sched_update(uint32_t pid_index)
+{
+    pid_data2_t *pid = &all_pids->pids[pid_index];
+
+    if(pid->sched.heap_index == AUTOPID_SCHED_NOT_QUEUED)
+    {
+        return;
+    }
+    pid->sched.deadline = autopid_pid_deadline(pid);
+    autopid_sched_sift(pid->priority, pid->sched.heap_index);
+}
+
+static bool autopid_sched_init(void)
+{
+    for(int c = 0; c < PID_PRIORITY_MAX; c++)
+    {
+        sched_heap[c] = (uint32_t*)calloc(all_pids->pid_count ? all_pids->pid_count : 1, sizeof(uint32_t));
+        sched_heap_len[c] = 0;
+        if(sched_heap[c] == NULL)
+        {
+            return false;
+        }
+    }
+
+    for(uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        pid_data2_t *pid = &all_pids->pids[i];
+
+        pid->sched.heap_index = AUTOPID_SCHED_NOT_QUEUED;
+        if(!autopid_pid_enabled(pid) || pid->parameters_count == 0)
+        {
+            continue;
+        }
+
+        pid->sched.deadline = autopid_pid_deadline(pid);
+        pid->sched.heap_index = sched_heap_len[pid->priority];
+        sched_heap[pid->priority][sched_heap_len[pid->priority]++] = i;
+        autopid_sched_sift(pid->priority, pid->sched.heap_index);
+    }
+    return true;
+}
+
+// Picks the PID to serve now, highest priority class first
+static bool autopid_sched_next(uint32_t *pid_index)
+{
+    int64_t now = esp_timer_get_time();
+
+    for(int c = 0; c < PID_PRIORITY_MAX; c++)
+    {
+        if(sched_heap_len[c] > 0 && all_pids->pids[sched_heap[c][0]].sched.deadline <= now)
+        {
+            *pid_index = sched_heap[c][0];
+            return true;
+        }
+    }
+    return false;
+}
+
+static int64_t autopid_sched_next_deadline(void)
+{
+    int64_t deadline = INT64_MAX;
+
+    for(int c = 0; c < PID_PRIORITY_MAX; c++)
+    {
+        if(sched_heap_len[c] > 0 && all_pids->pids[sched_heap[c][0]].sched.deadline < deadline)
+        {
+            deadline = all_pids->pids[sched_heap[c][0]].sched.deadline;
+        }
+    }
+    return deadline;
+}
+
+// Records how late the PID is served compared to its deadline
+static void autopid_sched_account(pid_data2_t *pid)
+{
+    int64_t lateness = esp_timer_get_time() - pid->sched.deadline;
+    uint32_t min_period = UINT32_MAX;
+
+    if(lateness < 0 || pid->sched.deadline == 0)
+    {
+        // First poll after boot has no meaningful deadline
+        lateness = 0;
+    }
+    if(lateness > UINT32_MAX)
+    {
+        lateness = UINT32_MAX;
+    }
+
+    for(uint32_t p = 0; p < pid->parameters_count; p++)
+    {
+        if(pid->parameters[p].period < min_period)
+        {
+            min_period = pid->parameters[p].period;
+        }
+    }
+
+    pid->sched.polls++;
+    if(lateness > pid->sched.jitter_max_us)
+    {
+        pid->sched.jitter_max_us = (uint32_t)lateness;
+    }
+    pid->sched.jitter_avg_us += ((int64_t)lateness - (int64_t)pid->sched.jitter_avg_us) >> AUTOPID_JITTER_AVG_SHIFT;
+
+    // Served more than half a period late
+    if(min_period != UINT32_MAX && min_period > 0 && lateness > (int64_t)min_period * 500)
+    {
+        pid->sched.deadline_misses++;
+    }
+}
+
+char* autopid_get_status(void)
+{
+    if (!all_pids || !all_pids->mutex) {
+        ESP_LOGE(TAG, "Invalid all_pids or mutex");
+        return NULL;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON *pids = cJSON_AddArrayToObject(root, "pids");
+    if (!root || !pids) {
+        ESP_LOGE(TAG, "Failed to create JSON object");
+        cJSON_Delete(root);
+        return NULL;
+    }
+
+    xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
+    for (uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        pid_data2_t *pid = &all_pids->pids[i];
+        char cmd[32] = "";
+
+        if (pid->sched.heap_index == AUTOPID_SCHED_NOT_QUEUED)
+        {
+            continue;
+        }
+        if (pid->cmd)
+        {
+            strlcpy(cmd, pid->cmd, sizeof(cmd));
+            cmd[strcspn(cmd, "\r")] = 0;
+        }
+
+        cJSON *item = cJSON_CreateObject();
+        if (!item) break;
+        cJSON_AddStringToObject(item, "name", (pid->parameters_count > 0 && pid->parameters[0].name) ? pid->parameters[0].name : "");
+        cJSON_AddStringToObject(item, "cmd", cmd);
+        cJSON_AddStringToObject(item, "priority", autopid_priority_str(pid->priority));
+        cJSON_AddNumberToObject(item, "polls", pid->sched.polls);
+        cJSON_AddNumberToObject(item, "deadline_misses", pid->sched.deadline_misses);
+        cJSON_AddNumberToObject(item, "jitter_avg_ms", pid->sched.jitter_avg_us / 1000.0);
+        cJSON_AddNumberToObject(item, "jitter_max_ms", pid->sched.jitter_max_us / 1000.0);
+        cJSON_AddItemToArray(pids, item);
+    }
+    xSemaphoreGive(all_pids->mutex);
+
+    char *response_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return response_str;
+}
+
+// Tracks the ATSH/ATCRA state an init string leaves the ELM327 in
+static void autopid_scan_init_headers(const char *init, uint32_t *sh, uint8_t *sh_digits, uint32_t *cra, uint8_t *cra_digits)
+{
+    while (init && *init)
+    {
+        char cmd[24];
+        uint8_t len = 0;
+
+        for (; *init && *init != '\r'; init++)
+        {
+            if (!isspace((unsigned char)*init) && len < sizeof(cmd) - 1)
+            {
+                cmd[len++] = tolower((unsigned char)*init);
+            }
+        }
+        cmd[len] = 0;
+        if (*init == '\r') init++;
+
+        if (strncmp(cmd, "atsh", 4) == 0 && len > 4)
+        {
+            *sh = strtoul(&cmd[4], NULL, 16);
+            *sh_digits = len - 4;
+        }
+        else if (strncmp(cmd, "atcra", 5) == 0)
+        {
+            // ATCRA without an address goes back to accepting everything
+            *cra = (len > 5) ? strtoul(&cmd[5], NULL, 16) : 0;
+            *cra_digits = len - 5;
+        }
+    }
+}
+
+// Identifier(s) an ECU answers a request sent with header sh on
+static bool autopid_response_id(uint32_t sh, uint8_t sh_digits, can_filter_id_t *id)
+{
+    if (sh_digits <= 3)
+    {
+        id->extd = false;
+        id->mask = 0;
+        if (sh == 0x7DF)
+        {
+            id->id = 0x7E8;
+            id->mask = 0x7;
+            return true;
+        }
+        else if (sh >= 0x7E0 && sh <= 0x7E7)
+        {
+            id->id = sh + 8;
+            return true;
+        }
+        return false;
+    }
+
+    // 6 digit headers use the default priority bits
+    if (sh_digits <= 6)
+    {
+        sh |= 0x18000000;
+    }
+
+    id->extd = true;
+    id->mask = 0;
+    if (((sh >> 16) & 0xFF) == 0xDB)
+    {
+        id->id = (sh & 0xFF000000) | 0x00DA0000 | ((sh & 0xFF) << 8);
+        id->mask = 0xFF;
+        return true;
+    }
+    else if (((sh >> 16) & 0xFF) == 0xDA)
+    {
+        id->id = (sh & 0xFFFF0000) | ((sh & 0xFF) << 8) | ((sh >> 8) & 0xFF);
+        return true;
+    }
+
+    return false;
+}
+
+static bool autopid_add_rx_id(can_filter_id_t *ids, uint32_t max, uint32_t *count, can_filter_id_t id)
+{
+    for (uint32_t i = 0; i < *count; i++)
+    {
+        if (ids[i].id == id.id && ids[i].mask == id.mask && ids[i].extd == id.extd)
+        {
+            return true;
+        }
+    }
+
+    if (*count >= max)
+    {
+        return false;
+    }
+
+    ids[(*count)++] = id;
+    return true;
+}
+
+/*
+ * Collects the identifiers the polled ECUs answer on, for the CAN acceptance
+ * filter. Functional (OBD scan) responses are always included. Returns the
+ * number of ids, or -1 if a response identifier can't be derived and every
+ * frame has to be accepted.
+ */
+int32_t autopid_get_rx_ids(can_filter_id_t *ids, uint32_t max)
+{
+    uint32_t count = 0;
+    can_filter_id_t id;
+
+    if (!all_pids || !all_pids->mutex)
+    {
+        return -1;
+    }
+
+    id = (can_filter_id_t){.id = 0x7E8, .mask = 0x7, .extd = false};
+    autopid_add_rx_id(ids, max, &count, id);
+    id = (can_filter_id_t){.id = 0x18DAF100, .mask = 0xFF, .extd = true};
+    autopid_add_rx_id(ids, max, &count, id);
+
+    xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
+    for (uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        pid_data2_t *pid = &all_pids->pids[i];
+        uint32_t sh = 0, cra = 0;
+        uint8_t sh_digits = 0, cra_digits = 0;
+        bool found = true;
+
+        if (!autopid_pid_enabled(pid))
+        {
+            continue;
+        }
+
+        autopid_scan_init_headers((pid->pid_type == PID_STD) ? all_pids->standard_init : 
+                                  (pid->pid_type == PID_SPECIFIC) ? all_pids->specific_init : NULL,
+                                  &sh, &sh_digits, &cra, &cra_digits);
+        autopid_scan_init_headers(pid->init, &sh, &sh_digits, &cra, &cra_digits);
+
+        if (pid->rxheader && strlen(pid->rxheader) > 0)
+        {
+            id = (can_filter_id_t){.id = strtoul(pid->rxheader, NULL, 16), .mask = 0, .extd = strlen(pid->rxheader) > 3};
+        }
+        else if (cra_digits > 0)
+        {
+            id = (can_filter_id_t){.id = cra, .mask = 0, .extd = cra_digits > 3};
+        }
+        else if (sh_digits > 0)
+        {
+            found = autopid_response_id(sh, sh_digits, &id);
+        }
+        else
+        {
+            // Default functional header, already included
+            continue;
+        }
+
+        if (!found || !autopid_add_rx_id(ids, max, &count, id))
+        {
+            ESP_LOGW(TAG, "No response id for %s, accepting all frames", pid->cmd ? pid->cmd : "");
+            xSemaphoreGive(all_pids->mutex);
+            return -1;
+        }
+    }
+    xSemaphoreGive(all_pids->mutex);
+
+    return count;
+}
+
+const block_pool_t *autopid_get_response_pool(void)
+{
+    return &autopid_response_pool;
+}
+
+// Sends cmd through the ELM327 text interface and parses the printed frames,
+// on success *out is the reply, returned to the pool by the caller
+static bool autopid_request_text(pid_data2_t *curr_pid, response_t **out)
+{
+    response_t *response;
+
+    twai_message_t tx_msg;
+
+    if(elm327_process_cmd((uint8_t*)curr_pid->cmd, 
+                        strlen(curr_pid->cmd), 
+                        &tx_msg, 
+                        &autopidQueue) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Command processed successfully");
+    DEBUG_LOGI(TAG, "Command processed successfully");
+    
+    if((response = autopid_receive(pdMS_TO_TICKS(1000))) == NULL)
+    {
+        ESP_LOGE(TAG, "Failed Queue Receive: curr_pid->cmd timeout");
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Response received, length: %lu", response->length);
+    DEBUG_LOGI(TAG, "Response received, length: %lu", response->length);
+    ESP_LOG_BUFFER_HEXDUMP(TAG, response->data, 1, ESP_LOG_INFO);
+    if(strstr((char*)response->data, "error") != NULL)
+    {   
+        ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
+        block_pool_free(&autopid_response_pool, response);
+        return false;
+    }
+    *out = response;
+    return true;
+}
+
+typedef struct
+{
+    response_t *response;
+    uint32_t first_id;
+    uint32_t lowest_id;
+    uint8_t lowest_len;
+    uint8_t frame_count;
+    uint8_t first_frames;       // multi-frame responses started
+    uint8_t payloads;           // multi-frame responses completed
+    bool ids_differ;
+}autopid_bin_ctx_t;
+
+// Appends the frame to the response the same way parse_elm327_response() does
+// for the text path: PCI byte followed by the frame data, frames in arrival order
+static void autopid_collect_frame(twai_message_t *rx_frame, uint8_t data_length, void *ctx)
+{
+    autopid_bin_ctx_t *bin = (autopid_bin_ctx_t*)ctx;
+    response_t *response = bin->response;
+    uint8_t len = data_length + 1;
+
+    if(bin->frame_count == 0)
+    {
+        bin->first_id = rx_frame->identifier;
+    }
+    else if(rx_frame->identifier != bin->first_id)
+    {
+        bin->ids_differ = true;
+    }
+    bin->frame_count++;
+    if((rx_frame->data[0] & 0xF0) == 0x10)
+    {
+        bin->first_frames++;
+    }
+
+    if(rx_frame->identifier < bin->lowest_id)
+    {
+        bin->lowest_id = rx_frame->identifier;
+        bin->lowest_len = len;
+        memcpy(response->priority_buf, rx_frame->data, len);
+    }
+
+    if(response->length + len <= sizeof(response->data))
+    {
+        memcpy(&response->data[response->length], rx_frame->data, len);
+        response->length += len;
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Response buffer full, frame dropped");
+    }
+}
+
+// The expressions index the frames as collected above, the completed message
+// only tells whether every multi-frame response arrived complete and in order,
+// so the request doesn't ask for the reassembled data
+static void autopid_collect_payload(uint32_t rx_id, const uint8_t *data, uint16_t length, void *ctx)
+{
+    autopid_bin_ctx_t *bin = (autopid_bin_ctx_t*)ctx;
+
+    if(length > 7)
+    {
+        bin->payloads++;
+    }
+}
+
+// Sends the pre-parsed request straight to the CAN bus, no ASCII round trip
+static esp_err_t autopid_request_bin(pid_data2_t *curr_pid, response_t *response)
+{
+    autopid_bin_ctx_t bin = {
+        .response = response,
+        .lowest_id = UINT32_MAX,
+    };
+
+    response->length = 0;
+    response->priority_data = NULL;
+    response->priority_data_len = 0;
+
+    esp_err_t err = elm327_request_bin(curr_pid->req, curr_pid->req_len, curr_pid->req_expected_rsp,
+                                        autopid_collect_frame, autopid_collect_payload, false, &bin);
+    if(err != ESP_OK)
+    {
+        if(err != ESP_ERR_NOT_SUPPORTED)
+        {
+            ESP_LOGE(TAG, "Failed to process command: %s, %s", curr_pid->cmd, esp_err_to_name(err));
+        }
+        return err;
+    }
+
+    // A lost or out of order consecutive frame would shift every byte after it
+    if(bin.payloads < bin.first_frames)
+    {
+        ESP_LOGE(TAG, "Incomplete response: %s, %u of %u multi-frame messages", curr_pid->cmd, bin.payloads, bin.first_frames);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    // Lowest ECU response is only used when several ECUs answered
+    if(bin.frame_count > 2 && bin.ids_differ)
+    {
+        response->priority_data = response->priority_buf;
+        response->priority_data_len = bin.lowest_len;
+    }
+
+    ESP_LOGI(TAG, "Response received, frames: %u, length: %lu", bin.frame_count, response->length);
+    return ESP_OK;
+}
+
+// Converts cmd to the bytes sent by elm327_request_bin(), following the rules
+// of the ELM327 text parser. req_len stays 0 when only the text path can send it.
+static void autopid_parse_request(pid_data2_t *pid)
+{
+    char hex[16];
+    uint8_t n = 0;
+    const char *c;
+
+    pid->req_len = 0;
+    pid->req_expected_rsp = 0xFF;
+    if(pid->cmd == NULL)
+    {
+        return;
+    }
+
+    for(c = pid->cmd; *c != '\0' && *c != '\r'; c++)
+    {
+        if(*c == ' ' || *c == '\n')
+        {
+            continue;
+        }
+        if(!isxdigit((unsigned char)*c) || n >= sizeof(hex) - 1)
+        {
+            return;
+        }
+        hex[n++] = *c;
+    }
+    hex[n] = '\0';
+
+    // Anything after the first command goes through the text path
+    if(*c == '\r' && c[1] != '\0')
+    {
+        return;
+    }
+
+    // Odd length, the last digit is the number of frames to expect
+    if(n % 2 == 1)
+    {
+        pid->req_expected_rsp = hex[n - 1] - '0';
+        if(pid->req_expected_rsp == 0 || pid->req_expected_rsp > 9)
+        {
+            pid->req_expected_rsp = 0xFF;
+        }
+        hex[--n] = '\0';
+    }
+
+    if(n == 0 || n / 2 > sizeof(pid->req))
+    {
+        return;
+    }
+
+    for(uint8_t i = 0; i < n / 2; i++)
+    {
+        char byte_str[3] = {hex[2 * i], hex[2 * i + 1], 0};
+        pid->req[i] = (uint8_t)strtol(byte_str, NULL, 16);
+    }
+    pid->req_len = n / 2;
 }
 
+// Sends one request and decodes every due parameter that shares it
+static void autopid_poll_pid(uint32_t i, pid_type_t *previous_pid_type)
+{
+    pid_data2_t *curr_pid = &all_pids->pids[i];
+    uint32_t due_count = 0;
+
+    autopid_sched_account(curr_pid);
+
+    // Mark every due parameter of this PID and of any other PID that sends
+    // the same request, they are all decoded from one response
+    for(uint32_t j = 0; j < all_pids->pid_count; j++)
+    {
+        pid_data2_t *group_pid = &all_pids->pids[j];
+
+        if(j != i && (!autopid_pid_enabled(group_pid) || !autopid_same_request(curr_pid, group_pid)))
+        {
+            continue;
+        }
+
+        for(uint32_t p = 0; p < group_pid->parameters_count; p++) 
+        {
+            parameter_t *param = &group_pid->parameters[p];
+
+            if(wc_timer_is_expired(&param->timer)) 
+            {
+                // Reset timer with parameter period
+                wc_timer_set(&param->timer, param->period);
+                param->pending = true;
+                due_count++;
+            }
+        }
+    }
+
+    if(due_count == 0)
+    {
+        return;
+    }
+
+    if(curr_pid->pid_type != *previous_pid_type) {
+        // Send appropriate initialization based on new PID type
+        switch(curr_pid->pid_type) {
+            case PID_CUSTOM:
+                if(all_pids->custom_init && strlen(all_pids->custom_init) > 0) {
+                    ESP_LOGI(TAG, "Sending custom init: %s, length: %d", 
+                            all_pids->custom_init, strlen(all_pids->custom_init));
+                    DEBUG_LOGI(TAG, "Sending custom init: %s, length: %d", 
+                            all_pids->custom_init, strlen(all_pids->custom_init));
+                    send_commands(all_pids->custom_init, 2);
+                }
+                break;
+                
+            case PID_STD:
+                if(all_pids->standard_init && strlen(all_pids->standard_init) > 0) {
+                    ESP_LOGI(TAG, "Sending standard init: %s, length: %d", 
+                            all_pids->standard_init, strlen(all_pids->standard_init));
+                    DEBUG_LOGI(TAG, "Sending standard init: %s, length: %d", 
+                            all_pids->standard_init, strlen(all_pids->standard_init));
+                    send_commands(all_pids->standard_init, 2);
+                }
+                break;
+                
+            case PID_SPECIFIC:
+                if(all_pids->specific_init && strlen(all_pids->specific_init) > 0) {
+                    ESP_LOGI(TAG, "Sending specific init: %s, length: %d", 
+                            all_pids->specific_init, strlen(all_pids->specific_init));
+                    DEBUG_LOGI(TAG, "Sending specific init: %s, length: %d", 
+                            all_pids->specific_init, strlen(all_pids->specific_init));
+                    send_commands(all_pids->specific_init, 2);
+                }
+                break;
+                
+            case PID_MAX:
+                break;
+        }
+
+        *previous_pid_type = curr_pid->pid_type;
+    }
+
+    bool response_ok = false;
+    response_t *response = NULL;
+
+    if(curr_pid->cmd != NULL && strlen(curr_pid->cmd) > 0) 
+    {
+        if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
+        {
+            if(curr_pid->init != NULL && strlen(curr_pid->init) > 0)
+            {
+                send_commands(curr_pid->init, 2);
+            }
+        }
+
+        ESP_LOGI(TAG, "Executing command: %s, parameters: %lu", curr_pid->cmd, due_count);
+        DEBUG_LOGI(TAG, "Executing command: %s, parameters: %lu", curr_pid->cmd, due_count);
+
+        esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+        if(curr_pid->req_len > 0)
+        {
+            response = (response_t*)block_pool_alloc(&autopid_response_pool);
+            err = (response == NULL) ? ESP_ERR_NO_MEM : autopid_request_bin(curr_pid, response);
+            response_ok = (err == ESP_OK);
+            if(err == ESP_ERR_NOT_SUPPORTED)
+            {
+                block_pool_free(&autopid_response_pool, response);
+                response = NULL;
+            }
+        }
+        if(err == ESP_ERR_NOT_SUPPORTED)
+        {
+            // Not a CAN protocol or the command is not plain hex
+            response_ok = autopid_request_text(curr_pid, &response);
+        }
+
+        if(response_ok)
+        {
+            xEventGroupSetBits(xautopid_event_group, ECU_CONNECTED_BIT);
+        }
+    }
+    else 
+    {
+        ESP_LOGE(TAG, "Failed, cmd is NULL");
+    }
+
+    // Decode every marked parameter from the single response
+    for(uint32_t j = 0; j < all_pids->pid_count && due_count > 0; j++)
+    {
+        pid_data2_t *group_pid = &all_pids->pids[j];
+        bool touched = false;
+
+        for(uint32_t p = 0; p < group_pid->parameters_count; p++) 
+        {
+            parameter_t *param = &group_pid->parameters[p];
+
+            if(!param->pending)
+            {
+                continue;
+            }
+            param->pending = false;
+            touched = true;
+            due_count--;
+
+            if(response_ok)
+            {
+                param->failed = false;
+                autopid_decode_parameter(group_pid, param, response);
+            }
+            else if(curr_pid->cmd != NULL && strlen(curr_pid->cmd) > 0)
+            {
+                param->failed = true;
+            }
+        }
+
+        if(touched)
+        {
+            autopid_sched_update(j);
+        }
+    }
+
+    block_pool_free(&autopid_response_pool, response);
+}
 
 static void autopid_task(void *pvParameters)
 {
     static char default_init[] = "ati\rate0\rath1\ratl0\rats1\ratsp6\ratst96\r";
-    wc_timer_t ecu_check_timer;
-    wc_timer_t group_cycle_timer;
+    wc_timer_t ecu_check_timer = 0;
+    wc_timer_t group_cycle_timer = 0;
 
     ESP_LOGI(TAG, "Autopid Task Started");
     DEBUG_LOGI(TAG, "Autopid Task Started");
@@ -1569,9 +2415,18 @@ static void autopid_task(void *pvParameters)
     ESP_LOGI(TAG, "Total PIDs: %lu", all_pids->pid_count);
     DEBUG_LOGI(TAG, "Total PIDs: %lu", all_pids->pid_count);
 
+    if (!autopid_sched_init())
+    {
+        ESP_LOGE(TAG, "Failed to allocate PID scheduler");
+        DEBUG_LOGE(TAG, "Failed to allocate PID scheduler");
+        return;
+    }
+
     while(1) 
     {
         static pid_type_t previous_pid_type = PID_MAX;
+        uint32_t pid_index;
+        uint32_t served = 0;
 
         dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
 
@@ -1583,209 +2438,13 @@ static void autopid_task(void *pvParameters)
         elm327_lock();
         xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
         
-        // Loop through all PIDs
-        for(uint32_t i = 0; i < all_pids->pid_count; i++) 
+        // Serve due PIDs, re-checking the higher priority classes after every
+        // request. One pass at most so the ELM327 lock is released regularly
+        while(served < all_pids->pid_count && autopid_sched_next(&pid_index))
         {
-            pid_data2_t *curr_pid = &all_pids->pids[i];
-            // Skip if PID type not enabled
-            if((curr_pid->pid_type == PID_STD && !all_pids->pid_std_en) ||
-            (curr_pid->pid_type == PID_CUSTOM && !all_pids->pid_custom_en) ||
-            (curr_pid->pid_type == PID_SPECIFIC && !all_pids->pid_specific_en))
-            {
-                continue;
-            }
-
-            // Loop through parameters
-            for(uint32_t p = 0; p < curr_pid->parameters_count; p++) 
-            {
-                parameter_t *param = &curr_pid->parameters[p];
-                
-                // Check parameter timer
-                if(wc_timer_is_expired(&param->timer)) 
-                {
-                    // autopid_data_write
-                    if(curr_pid->pid_type != previous_pid_type) {
-                        // Send appropriate initialization based on new PID type
-                        switch(curr_pid->pid_type) {
-                            case PID_CUSTOM:
-                                if(all_pids->custom_init && strlen(all_pids->custom_init) > 0) {
-                                    ESP_LOGI(TAG, "Sending custom init: %s, length: %d", 
-                                            all_pids->custom_init, strlen(all_pids->custom_init));
-                    DEBUG_LOGI(TAG, "Sending custom init: %s, length: %d", 
-                        all_pids->custom_init, strlen(all_pids->custom_init));
-                                    send_commands(all_pids->custom_init, 2);
-                                }
-                                break;
-                                
-                            case PID_STD:
-                                if(all_pids->standard_init && strlen(all_pids->standard_init) > 0) {
-                                    ESP_LOGI(TAG, "Sending standard init: %s, length: %d", 
-                                            all_pids->standard_init, strlen(all_pids->standard_init));
-                    DEBUG_LOGI(TAG, "Sending standard init: %s, length: %d", 
-                        all_pids->standard_init, strlen(all_pids->standard_init));
-                                    send_commands(all_pids->standard_init, 2);
-                                }
-                                break;
-                                
-                            case PID_SPECIFIC:
-                                if(all_pids->specific_init && strlen(all_pids->specific_init) > 0) {
-                                    ESP_LOGI(TAG, "Sending specific init: %s, length: %d", 
-                                            all_pids->specific_init, strlen(all_pids->specific_init));
-                    DEBUG_LOGI(TAG, "Sending specific init: %s, length: %d", 
-                        all_pids->specific_init, strlen(all_pids->specific_init));
-                                    send_commands(all_pids->specific_init, 2);
-                                }
-                                break;
-                                
-                            case PID_MAX:
-                                break;
-                        }
-
-                        previous_pid_type = curr_pid->pid_type;
-                    }
-
-                    ESP_LOGI(TAG, "Processing parameter: %s", param->name);
-                    DEBUG_LOGI(TAG, "Processing parameter: %s", param->name);
-                    // Reset timer with parameter period
-                    wc_timer_set(&param->timer, param->period);
-
-                    if(curr_pid->cmd != NULL && strlen(curr_pid->cmd) > 0) 
-                    {
-                        twai_message_t tx_msg;
-
-                        if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
-                        {
-                            if(curr_pid->init != NULL && strlen(curr_pid->init) > 0)
-                            {
-                                send_commands(curr_pid->init, 2);
-                            }
-                        }
-
-                        ESP_LOGI(TAG, "Executing command: %s", curr_pid->cmd);
-                        DEBUG_LOGI(TAG, "Executing command: %s", curr_pid->cmd);
-                        if(elm327_process_cmd((uint8_t*)curr_pid->cmd, 
-                                            strlen(curr_pid->cmd), 
-                                            &tx_msg, 
-                                            &autopidQueue) == ESP_OK)
-                        {
-                            ESP_LOGI(TAG, "Command processed successfully");
-                            DEBUG_LOGI(TAG, "Command processed successfully");
-                            
-                            if(xQueueReceive(autopidQueue, &elm327_response, pdMS_TO_TICKS(1000)) == pdPASS)
-                            {
-                                ESP_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
-                                DEBUG_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
-                                ESP_LOG_BUFFER_HEXDUMP(TAG, elm327_response.data, 1, ESP_LOG_INFO);
-                                if(strstr((char*)elm327_response.data, "error") == NULL)
-                                {
-                                    double result;
-
-                                    param->failed = false;
-
-                                    ESP_LOGI(TAG, "Response received, length: %lu", elm327_response.length);
-                                    xEventGroupSetBits(xautopid_event_group, ECU_CONNECTED_BIT);
-                                    // Process response based on PID type
-                                    if(curr_pid->pid_type == PID_CUSTOM || curr_pid->pid_type == PID_SPECIFIC) 
-                                    {
-                                        ESP_LOGI(TAG, "Processing custom/specific PID");
-                                        if(param->expression && 
-                                        evaluate_expression((uint8_t*)param->expression, 
-                                                            elm327_response.data, 0, &result))
-                                        {
-                                            if (param->min != FLT_MAX && result < param->min) {
-                                                ESP_LOGW(TAG, "Parameter %s value %.2f below min %.2f - ignoring", 
-                                                        param->name, result, param->min);
-                                            } else if (param->max != FLT_MAX && result > param->max) {
-                                                ESP_LOGW(TAG, "Parameter %s value %.2f above max %.2f - ignoring", 
-                                                        param->name, result, param->max);
-                                            } else {
-                                                result = round(result * 100.0) / 100.0;
-                                                ESP_LOGI(TAG, "Parameter %s result: %.2f", 
-                                                        param->name, result);
-                                                param->value = result;
-                                                publish_parameter_mqtt(param);
-                                            }
-                                        }
-                                    }
-                                    else if(curr_pid->pid_type == PID_STD) 
-                                    {
-                                        ESP_LOGI(TAG, "Processing standard PID");
-                                        if(curr_pid->pid_type == PID_STD) 
-                                        {
-                                            const std_pid_t* pid_info = get_pid_from_string(param->name);
-                                            if(pid_info)
-                                            {
-                                                ESP_LOGI(TAG, "Found PID info for: %s", param->name);
-                                                // Find matching parameter in pid_info
-                                                for(int p = 0; p < pid_info->num_params; p++)
-                                                {
-                                                    // Match parameter name after the dash
-                                                    const char* param_name = strchr(param->name, '-');
-                                                    if(param_name && strcmp(param_name + 1, pid_info->params[p].name) == 0)
-                                                    {
-                                                        esp_err_t err = ESP_FAIL;
-
-                                                        ESP_LOGI(TAG, "Processing parameter: %s", pid_info->params[p].name);
-                                                        if(elm327_response.priority_data != NULL && elm327_response.priority_data != 0)
-                                                        {
-                                                            err = extract_signal_value(
-                                                                elm327_response.priority_data,           // Your CAN response data buffer
-                                                                elm327_response.priority_data_len,         // Length of your CAN response data
-                                                                &pid_info->params[p],    // Parameter definition from pid_info
-                                                                &param->value            // Where to store the result
-                                                            );
-                                                        }
-                                                        else
-                                                        {
-                                                            err = extract_signal_value(
-                                                                elm327_response.data,           // Your CAN response data buffer
-                                                                elm327_response.length,         // Length of your CAN response data
-                                                                &pid_info->params[p],    // Parameter definition from pid_info
-                                                                &param->value            // Where to store the result
-                                                            );
-                                                        }
- 
-                                                        if (err != ESP_OK) {
-                                                            ESP_LOGE(TAG, "Failed to extract signal: %s", esp_err_to_name(err));
-                                                            break;
-                                                        }
-                                                        param->value = roundf(param->value * 100.0) / 100.0;
-                                                        ESP_LOGI(TAG, "Parameter %s result: %.2f %s", 
-                                                                        param->name, 
-                                                                        param->value, 
-                                                                        pid_info->params[p].unit);
-                                                        param->value = roundf(param->value * 100.0) / 100.0;
-                                                        publish_parameter_mqtt(param);
-                                                        break;
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                                else
-                                {   
-                                    param->failed = true;
-                                    ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
-                                }
-                            }
-                            else
-                            {
-                                param->failed = true;
-                                ESP_LOGE(TAG, "Failed Queue Receive: curr_pid->cmd timeout");
-                            }
-                        }
-                        else 
-                        {
-                            ESP_LOGE(TAG, "Failed to process command: %s", curr_pid->cmd);
-                        }
-                    }
-                    else 
-                    {
-                        ESP_LOGE(TAG, "Failed, cmd is NULL");
-                    }
-                }
-            }
+            autopid_poll_pid(pid_index, &previous_pid_type);
+            autopid_sched_update(pid_index);
+            served++;
         }
 
         elm327_unlock();
@@ -1797,9 +2456,9 @@ static void autopid_task(void *pvParameters)
             xEventGroupClearBits(xautopid_event_group, AUTOPID_REQUEST_BIT);
         }
 
-        vTaskDelay(pdMS_TO_TICKS(10));
+        bool group_publish = (strcmp("enable", all_pids->grouping) == 0 && all_pids->group_destination_type == DEST_MQTT_TOPIC);
 
-        if (strcmp("enable", all_pids->grouping) == 0 && all_pids->group_destination_type == DEST_MQTT_TOPIC && wc_timer_is_expired(&group_cycle_timer))
+        if (group_publish && wc_timer_is_expired(&group_cycle_timer))
         {
             wc_timer_set(&group_cycle_timer, all_pids->cycle);
             
@@ -1815,6 +2474,27 @@ static void autopid_task(void *pvParameters)
             }
             wc_timer_set(&ecu_check_timer, 2000); // Reset timer for next check
         }
+
+        // Sleep until the next PID, group publish or ECU check is due
+        xSemaphoreTake(all_pids->mutex, portMAX_DELAY);
+        int64_t wake = autopid_sched_next_deadline();
+        xSemaphoreGive(all_pids->mutex);
+        if (group_publish && group_cycle_timer < wake)
+        {
+            wake = group_cycle_timer;
+        }
+        if (ecu_check_timer < wake)
+        {
+            wake = ecu_check_timer;
+        }
+
+        int64_t wait_ms = (wake - esp_timer_get_time()) / 1000;
+        if (wait_ms > AUTOPID_SCHED_MAX_SLEEP_MS)
+        {
+            wait_ms = AUTOPID_SCHED_MAX_SLEEP_MS;
+        }
+        TickType_t wait_ticks = (wait_ms > 0) ? (TickType_t)((wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS) : 0;
+        vTaskDelay((wait_ticks > 0) ? wait_ticks : 1);
     }
 
 
@@ -1836,8 +2516,55 @@ cJSON* parse_json_file(FILE* f) {
     return root;
 }
 
+// Instruction totals of the compiled expressions, logged once load_all_pids() is done
+static uint32_t expr_insn_before = 0;
+static uint32_t expr_insn_after = 0;
+
+static void autopid_compile_parameter(parameter_t *param)
+{
+    param->program = NULL;
+    if (param->expression == NULL || strlen(param->expression) == 0)
+    {
+        return;
+    }
+
+    param->program = compile_expression(param->expression);
+    if (param->program == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to compile expression for %s: %s", param->name ? param->name : "NULL", param->expression);
+        DEBUG_LOGE(TAG, "Failed to compile expression for %s: %s", param->name ? param->name : "NULL", param->expression);
+        return;
+    }
+
+    expr_insn_before += param->program->unoptimized_len;
+    expr_insn_after += param->program->code_len;
+}
+
+// Profile values are usually strings, accept numbers too
+static float autopid_json_float(cJSON *item, float def)
+{
+    if (cJSON_IsNumber(item))
+    {
+        return (float)item->valuedouble;
+    }
+    if (cJSON_IsString(item) && item->valuestring && strlen(item->valuestring) > 0)
+    {
+        return atof(item->valuestring);
+    }
+    return def;
+}
+
+static void autopid_load_deadband(parameter_t *param, cJSON *obj, const char *band_key, const char *pct_key, const char *heartbeat_key)
+{
+    param->deadband = autopid_json_float(cJSON_GetObjectItem(obj, band_key), 0);
+    param->deadband_pct = autopid_json_float(cJSON_GetObjectItem(obj, pct_key), 0);
+    param->heartbeat = (uint32_t)autopid_json_float(cJSON_GetObjectItem(obj, heartbeat_key), 0);
+}
+
 all_pids_t* load_all_pids(void){
     int total_pids = 0;
+    expr_insn_before = 0;
+    expr_insn_after = 0;
     int car_data_pids = 0;
     int auto_pids = 0;
     
@@ -1985,18 +2712,21 @@ all_pids_t* load_all_pids(void){
                     curr_pid->period = period_item ? atoi(period_item->valuestring) : 10000;
                     curr_pid->rxheader = rxheader_item ? strdup(rxheader_item->valuestring) : NULL;
                     curr_pid->pid_type = PID_CUSTOM;
+                    curr_pid->priority = autopid_priority_from_json(cJSON_GetObjectItem(pid, "Priority"));
 
                     curr_pid->parameters_count = 1;
                     curr_pid->parameters = (parameter_t*)calloc(1, sizeof(parameter_t));
                     if (curr_pid->parameters) {
                         curr_pid->parameters->name = name_item ? strdup(name_item->valuestring) : NULL;
                         curr_pid->parameters->expression = expr_item ? strdup(expr_item->valuestring) : NULL;
+                        autopid_compile_parameter(curr_pid->parameters);
                         curr_pid->parameters->period = period_item ? atoi(period_item->valuestring) : 0;
                         curr_pid->parameters->destination = send_to_item ? strdup(send_to_item->valuestring) : NULL;
                         curr_pid->parameters->timer = 0;
                         curr_pid->parameters->value = FLT_MAX;
                         curr_pid->parameters->min = (min_value_item && strlen(min_value_item->valuestring) > 0) ? atof(min_value_item->valuestring) : FLT_MAX;
                         curr_pid->parameters->max = (max_value_item && strlen(max_value_item->valuestring) > 0) ? atof(max_value_item->valuestring) : FLT_MAX;
+                        autopid_load_deadband(curr_pid->parameters, pid, "Deadband", "DeadbandPercent", "Heartbeat");
                         curr_pid->parameters->destination_type = type_item && type_item->valuestring ? 
                             (strcmp(type_item->valuestring, "MQTT_Topic") == 0 ? DEST_MQTT_TOPIC :
                             strcmp(type_item->valuestring, "MQTT_WallBox") == 0 ? DEST_MQTT_WALLBOX :
@@ -2020,6 +2750,7 @@ all_pids_t* load_all_pids(void){
                 cJSON_ArrayForEach(pid, std_pids) {
                     pid_data2_t* curr_pid = &all_pids->pids[pid_index];
                     curr_pid->pid_type = PID_STD;
+                    curr_pid->priority = autopid_priority_from_json(cJSON_GetObjectItem(pid, "Priority"));
 
                     char std_init_buf[64];
                     int is_protocol_68 = 1;
@@ -2047,6 +2778,7 @@ all_pids_t* load_all_pids(void){
                         curr_pid->parameters->value = FLT_MAX;
                         curr_pid->parameters->sensor_type = sensor_type_item ? 
                             (strcmp(sensor_type_item->valuestring, "binary") == 0 ? BINARY_SENSOR : SENSOR) : SENSOR;
+                        autopid_load_deadband(curr_pid->parameters, pid, "Deadband", "DeadbandPercent", "Heartbeat");
                             
                         curr_pid->rxheader = rxheader_item ? strdup(rxheader_item->valuestring) : NULL;
 
@@ -2201,6 +2933,7 @@ all_pids_t* load_all_pids(void){
                             }
 
                             curr_pid->pid_type = PID_SPECIFIC;
+                            curr_pid->priority = autopid_priority_from_json(cJSON_GetObjectItem(pid, "priority"));
                             
                             cJSON* params = cJSON_GetObjectItem(pid, "parameters");
                             if (params) 
@@ -2220,6 +2953,7 @@ all_pids_t* load_all_pids(void){
 
                                     cJSON* expr_item = cJSON_GetObjectItem(param, "expression");
                                     curr_pid->parameters[param_index].expression = expr_item ? strdup(expr_item->valuestring) : NULL;
+                                    autopid_compile_parameter(&curr_pid->parameters[param_index]);
 
                                     cJSON* unit_item = cJSON_GetObjectItem(param, "unit");
                                     curr_pid->parameters[param_index].unit = unit_item && unit_item->valuestring ? 
@@ -2242,6 +2976,8 @@ all_pids_t* load_all_pids(void){
                                     cJSON* period_item = cJSON_GetObjectItem(param, "period");
                                     curr_pid->parameters[param_index].period = period_item ? atof(period_item->valuestring) : FLT_MAX;
 
+                                    autopid_load_deadband(&curr_pid->parameters[param_index], param, "deadband", "deadband_percent", "heartbeat");
+
                                     cJSON* send_to_item = cJSON_GetObjectItem(param, "send_to");
                                     curr_pid->parameters[param_index].destination = send_to_item ? strdup(send_to_item->valuestring) : strdup("none");
 
@@ -2267,7 +3003,20 @@ all_pids_t* load_all_pids(void){
     }
     
     all_pids->pid_count = total_pids;
+
+    for (uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        autopid_parse_request(&all_pids->pids[i]);
+
+        for (uint32_t j = 0; j < all_pids->pids[i].parameters_count; j++)
+        {
+            parameter_t *param = &all_pids->pids[i].parameters[j];
+            param->json_key = json_writer_make_key(param->name);
+            param->published_value = FLT_MAX;
+        }
+    }
     
+    ESP_LOGI(TAG, "Compiled expressions: %lu instructions, %lu before optimization", expr_insn_after, expr_insn_before);
     return all_pids;
 }
 
@@ -2278,9 +3027,9 @@ static void autopid_webhook_task(void *pvParameters)
 
     uint64_t last_post_time = 0;
     uint64_t last_wifi_status_time = 0;
-    char *prev_autopid_snapshot = NULL;
-    char *prev_config_snapshot = NULL;
-    char *prev_status_snapshot = NULL;
+    uint32_t autopid_posted_version = 0;
+    json_digest_t config_digest = {0};
+    json_digest_t status_digest = {0};
 
     vTaskDelay(pdMS_TO_TICKS(5000));
 
@@ -2308,6 +3057,8 @@ static void autopid_webhook_task(void *pvParameters)
                 ESP_LOGW(TAG, "Webhook: STA not connected yet (no route to HA)");
             }
 
+            webhook_conn_close();
+
             vTaskDelay(pdMS_TO_TICKS(1000));
             continue;
         }
@@ -2352,189 +3103,183 @@ static void autopid_webhook_task(void *pvParameters)
                 {
                     last_post_time = now;
 
-                    char *raw_json = autopid_data_read();
-                    if (raw_json)
+                    char *url = strdup_heap(webhook_cfg.url);
+                    if (url)
                     {
-                        char *url = strdup_heap(webhook_cfg.url);
-                        if (url)
+                        ESP_LOGI(TAG, "Webhook: posting %s payload to %s", send_full_data ? "full" : "diff", url);
+                        cJSON *root_obj = cJSON_CreateObject();
+                        cJSON *cfg_curr = autopid_build_config_object();
+                        char *status_json = config_server_get_status_json(true /* remove_sensitive_info */);
+                        cJSON *sts_curr = status_json ? cJSON_Parse(status_json) : NULL;
+                        free(status_json);
+                        if (!sts_curr)
+                            sts_curr = cJSON_CreateObject();
+
+                        // Ensure these are always present for webhook payload consumers
+                        if (sts_curr)
+                        {
+                            cJSON_DeleteItemFromObjectCaseSensitive(sts_curr, "autopid_enabled");
+                            cJSON_AddBoolToObject(sts_curr, "autopid_enabled", (config_server_protocol() == AUTO_PID));
+
+                            uint64_t uptime_sec = (uint64_t)(esp_timer_get_time() / 1000000ULL);
+                            cJSON_DeleteItemFromObjectCaseSensitive(sts_curr, "uptime_sec");
+                            cJSON_AddNumberToObject(sts_curr, "uptime_sec", (double)uptime_sec);
+                        }
+                        // Diff mode only collects the values the poller changed since the last post
+                        cJSON *auto_curr = NULL;
+                        uint32_t auto_version = autopid_posted_version;
+                        json_digest_t config_next = {0};
+                        json_digest_t status_next = {0};
+                        if (send_full_data)
+                        {
+                            char *raw_json = autopid_data_read();
+                            auto_curr = raw_json ? cJSON_Parse(raw_json) : NULL;
+                            free(raw_json);
+                        }
+                        else
                         {
-                            ESP_LOGI(TAG, "Webhook: posting %s payload to %s", send_full_data ? "full" : "diff", url);
-                            cJSON *root_obj = cJSON_CreateObject();
-                            cJSON *cfg_curr = autopid_build_config_object();
-                            char *status_json = config_server_get_status_json(true /* remove_sensitive_info */);
-                            cJSON *sts_curr = status_json ? cJSON_Parse(status_json) : NULL;
-                            free(status_json);
-                            if (!sts_curr)
-                                sts_curr = cJSON_CreateObject();
-
-                            // Ensure these are always present for webhook payload consumers
-                            if (sts_curr)
+                            auto_curr = autopid_data_diff(autopid_posted_version, &auto_version);
+                        }
+                        if (!auto_curr)
+                            auto_curr = cJSON_CreateObject();
+
+                        if (root_obj && cfg_curr && sts_curr && auto_curr)
+                        {
+                            // CONFIG
+                            cJSON *cfg_payload = NULL;
+                            if (send_full_data)
+                            {
+                                cfg_payload = cJSON_Duplicate(cfg_curr, true);
+                            }
+                            else
                             {
-                                cJSON_DeleteItemFromObjectCaseSensitive(sts_curr, "autopid_enabled");
-                                cJSON_AddBoolToObject(sts_curr, "autopid_enabled", (config_server_protocol() == AUTO_PID));
+                                cfg_payload = json_object_diff_digest(cfg_curr, &config_digest, &config_next);
+                            }
 
-                                uint64_t uptime_sec = (uint64_t)(esp_timer_get_time() / 1000000ULL);
-                                cJSON_DeleteItemFromObjectCaseSensitive(sts_curr, "uptime_sec");
-                                cJSON_AddNumberToObject(sts_curr, "uptime_sec", (double)uptime_sec);
+                            // STATUS
+                            cJSON *sts_payload = NULL;
+                            if (send_full_data)
+                            {
+                                sts_payload = cJSON_Duplicate(sts_curr, true);
+                            }
+                            else
+                            {
+                                sts_payload = json_object_diff_digest(sts_curr, &status_digest, &status_next);
                             }
-                            cJSON *auto_curr = cJSON_Parse(raw_json);
-                            if (!auto_curr)
-                                auto_curr = cJSON_CreateObject();
 
-                            if (root_obj && cfg_curr && sts_curr && auto_curr)
+                            // AUTOPID_DATA
+                            cJSON *auto_payload = NULL;
+                            if (send_full_data)
                             {
-                                // CONFIG
-                                cJSON *cfg_payload = NULL;
-                                if (send_full_data)
-                                {
-                                    cfg_payload = cJSON_Duplicate(cfg_curr, true);
-                                }
-                                else
-                                {
-                                    cJSON *prev = prev_config_snapshot ? cJSON_Parse(prev_config_snapshot) : NULL;
-                                    cfg_payload = json_object_diff_simple(cfg_curr, prev);
-                                    if (prev)
-                                        cJSON_Delete(prev);
+                                auto_payload = cJSON_Duplicate(auto_curr, true);
+                            }
+                            else
+                            {
+                                auto_payload = auto_curr;
+                                auto_curr = NULL;
+                            }
 
-                                    char *snap = cJSON_PrintUnformatted(cfg_curr);
-                                    if (snap)
-                                    {
-                                        free(prev_config_snapshot);
-                                        prev_config_snapshot = snap;
-                                    }
-                                }
+                            if (cfg_payload && cJSON_GetArraySize(cfg_payload) > 0)
+                                cJSON_AddItemToObject(root_obj, "config", cfg_payload);
+                            else if (cfg_payload)
+                                cJSON_Delete(cfg_payload);
+
+                            if (sts_payload && cJSON_GetArraySize(sts_payload) > 0)
+                                cJSON_AddItemToObject(root_obj, "status", sts_payload);
+                            else if (sts_payload)
+                                cJSON_Delete(sts_payload);
+
+                            if (auto_payload && cJSON_GetArraySize(auto_payload) > 0)
+                                cJSON_AddItemToObject(root_obj, "autopid_data", auto_payload);
+                            else if (auto_payload)
+                                cJSON_Delete(auto_payload);
+
+                            // Always include GPS block (mock for now)
+                            // cJSON *gps = cJSON_CreateObject();
+                            // if (gps)
+                            // {
+                            //     cJSON_AddNumberToObject(gps, "latitude", 37.7749);
+                            //     cJSON_AddNumberToObject(gps, "longitude", -122.4194);
+                            //     cJSON_AddNumberToObject(gps, "accuracy", 10);
+                            //     cJSON_AddNumberToObject(gps, "altitude", 25.5);
+                            //     cJSON_AddNumberToObject(gps, "speed", 15.3);
+                            //     cJSON_AddNumberToObject(gps, "heading", 180);
+                            //     cJSON_AddItemToObject(root_obj, "gps", gps);
+                            // }
+
+                            limitJsonDecimalPrecision(root_obj);
+
+                            char *body = cJSON_PrintUnformatted(root_obj);
+                            if (body)
+                            {
+                                int status = -1;
+                                char snippet[96] = {0};
+                                esp_err_t post_err = webhook_post_json(url, body, strlen(body), 5000, &status, snippet, sizeof(snippet));
+                                bool ok = (post_err == ESP_OK && status >= 200 && status < 300);
 
-                                // STATUS
-                                cJSON *sts_payload = NULL;
-                                if (send_full_data)
-                                {
-                                    sts_payload = cJSON_Duplicate(sts_curr, true);
-                                }
-                                else
+                                ha_webhook_config_t upd = webhook_cfg;
+                                if (ok)
                                 {
-                                    cJSON *prev = prev_status_snapshot ? cJSON_Parse(prev_status_snapshot) : NULL;
-                                    sts_payload = json_object_diff_simple(sts_curr, prev);
-                                    if (prev)
-                                        cJSON_Delete(prev);
-
-                                    char *snap = cJSON_PrintUnformatted(sts_curr);
-                                    if (snap)
+                                    upd.success_count++;
+                                    upd.retries = 0;
+                                    strlcpy(upd.status, "ok", sizeof(upd.status));
+                                    webhook_format_utc(upd.last_post);
+                                    upd.last_error[0] = '\0';
+                                    upd.last_error_time[0] = '\0';
+                                    ESP_LOGI(TAG, "Webhook POST success, status %d", status);
+
+                                    // The diff state only moves on with a delivered post
+                                    if (!send_full_data)
                                     {
-                                        free(prev_status_snapshot);
-                                        prev_status_snapshot = snap;
+                                        autopid_posted_version = auto_version;
+                                        json_digest_free(&config_digest);
+                                        config_digest = config_next;
+                                        json_digest_free(&status_digest);
+                                        status_digest = status_next;
+                                        memset(&config_next, 0, sizeof(config_next));
+                                        memset(&status_next, 0, sizeof(status_next));
                                     }
                                 }
-
-                                // AUTOPID_DATA
-                                cJSON *auto_payload = NULL;
-                                if (send_full_data)
-                                {
-                                    auto_payload = cJSON_Duplicate(auto_curr, true);
-                                }
                                 else
                                 {
-                                    cJSON *prev = prev_autopid_snapshot ? cJSON_Parse(prev_autopid_snapshot) : NULL;
-                                    auto_payload = json_object_diff_simple(auto_curr, prev);
-                                    if (prev)
-                                        cJSON_Delete(prev);
-
-                                    char *snap = cJSON_PrintUnformatted(auto_curr);
-                                    if (snap)
-                                    {
-                                        free(prev_autopid_snapshot);
-                                        prev_autopid_snapshot = snap;
-                                    }
-                                }
-
-                                if (cfg_payload && cJSON_GetArraySize(cfg_payload) > 0)
-                                    cJSON_AddItemToObject(root_obj, "config", cfg_payload);
-                                else if (cfg_payload)
-                                    cJSON_Delete(cfg_payload);
-
-                                if (sts_payload && cJSON_GetArraySize(sts_payload) > 0)
-                                    cJSON_AddItemToObject(root_obj, "status", sts_payload);
-                                else if (sts_payload)
-                                    cJSON_Delete(sts_payload);
-
-                                if (auto_payload && cJSON_GetArraySize(auto_payload) > 0)
-                                    cJSON_AddItemToObject(root_obj, "autopid_data", auto_payload);
-                                else if (auto_payload)
-                                    cJSON_Delete(auto_payload);
-
-                                // Always include GPS block (mock for now)
-                                // cJSON *gps = cJSON_CreateObject();
-                                // if (gps)
-                                // {
-                                //     cJSON_AddNumberToObject(gps, "latitude", 37.7749);
-                                //     cJSON_AddNumberToObject(gps, "longitude", -122.4194);
-                                //     cJSON_AddNumberToObject(gps, "accuracy", 10);
-                                //     cJSON_AddNumberToObject(gps, "altitude", 25.5);
-                                //     cJSON_AddNumberToObject(gps, "speed", 15.3);
-                                //     cJSON_AddNumberToObject(gps, "heading", 180);
-                                //     cJSON_AddItemToObject(root_obj, "gps", gps);
-                                // }
-
-                                limitJsonDecimalPrecision(root_obj);
-
-                                char *body = cJSON_PrintUnformatted(root_obj);
-                                if (body)
-                                {
-                                    int status = -1;
-                                    char snippet[96] = {0};
-                                    esp_err_t post_err = webhook_post_json(url, body, strlen(body), 5000, &status, snippet, sizeof(snippet));
-                                    bool ok = (post_err == ESP_OK && status >= 200 && status < 300);
-
-                                    ha_webhook_config_t upd = webhook_cfg;
-                                    if (ok)
+                                    upd.fail_count++;
+                                    upd.retries++;
+                                    strlcpy(upd.status, "failed", sizeof(upd.status));
+                                    webhook_format_utc(upd.last_error_time);
+                                    if (post_err != ESP_OK)
                                     {
-                                        upd.success_count++;
-                                        upd.retries = 0;
-                                        strlcpy(upd.status, "ok", sizeof(upd.status));
-                                        webhook_format_utc(upd.last_post);
-                                        upd.last_error[0] = '\0';
-                                        upd.last_error_time[0] = '\0';
-                                        ESP_LOGI(TAG, "Webhook POST success, status %d", status);
+                                        if (snippet[0])
+                                            snprintf(upd.last_error, sizeof(upd.last_error), "esp_err=%s; resp=%s", esp_err_to_name(post_err), snippet);
+                                        else
+                                            snprintf(upd.last_error, sizeof(upd.last_error), "esp_err=%s", esp_err_to_name(post_err));
                                     }
                                     else
                                     {
-                                        upd.fail_count++;
-                                        upd.retries++;
-                                        strlcpy(upd.status, "failed", sizeof(upd.status));
-                                        webhook_format_utc(upd.last_error_time);
-                                        if (post_err != ESP_OK)
-                                        {
-                                            if (snippet[0])
-                                                snprintf(upd.last_error, sizeof(upd.last_error), "esp_err=%s; resp=%s", esp_err_to_name(post_err), snippet);
-                                            else
-                                                snprintf(upd.last_error, sizeof(upd.last_error), "esp_err=%s", esp_err_to_name(post_err));
-                                        }
+                                        if (snippet[0])
+                                            snprintf(upd.last_error, sizeof(upd.last_error), "http=%d; resp=%s", status, snippet);
                                         else
-                                        {
-                                            if (snippet[0])
-                                                snprintf(upd.last_error, sizeof(upd.last_error), "http=%d; resp=%s", status, snippet);
-                                            else
-                                                snprintf(upd.last_error, sizeof(upd.last_error), "http=%d", status);
-                                        }
-                                        ESP_LOGE(TAG, "Webhook POST failed: %s (http=%d)", esp_err_to_name(post_err), status);
+                                            snprintf(upd.last_error, sizeof(upd.last_error), "http=%d", status);
                                     }
-                                    (void)ha_webhooks_update_cache(&upd);
-
-                                    free(body);
+                                    ESP_LOGE(TAG, "Webhook POST failed: %s (http=%d)", esp_err_to_name(post_err), status);
                                 }
-                            }
+                                (void)ha_webhooks_update_cache(&upd);
 
-                            if (root_obj)
-                                cJSON_Delete(root_obj);
-                            if (cfg_curr)
-                                cJSON_Delete(cfg_curr);
-                            if (sts_curr)
-                                cJSON_Delete(sts_curr);
-                            if (auto_curr)
-                                cJSON_Delete(auto_curr);
-
-                            free(url);
+                                free(body);
+                            }
                         }
-                        free(raw_json);
+
+                        if (root_obj)
+                            cJSON_Delete(root_obj);
+                        if (cfg_curr)
+                            cJSON_Delete(cfg_curr);
+                        if (sts_curr)
+                            cJSON_Delete(sts_curr);
+                        if (auto_curr)
+                            cJSON_Delete(auto_curr);
+                        json_digest_free(&config_next);
+                        json_digest_free(&status_next);
+
+                        free(url);
                     }
                 }
             }
@@ -2594,8 +3339,8 @@ void autopid_init(char* id)
     xEventGroupSetBits(xautopid_event_group, AUTOPID_REQUEST_BIT);
 
     ha_webhooks_init();
-    autopidQueue = xQueueCreate(QUEUE_SIZE, sizeof(response_t));
-    if (autopidQueue == NULL)
+    autopidQueue = xQueueCreate(QUEUE_SIZE, sizeof(response_t*));
+    if (autopidQueue == NULL || !block_pool_init(&autopid_response_pool, sizeof(response_t), RESPONSE_POOL_SIZE))
     {
         ESP_LOGE(TAG, "Failed to create queue");
         return;
@@ -2636,7 +3381,8 @@ void autopid_init(char* id)
         ESP_LOGE(TAG, "Failed to create autopid_values mutex");
         return;
     }
-    autopid_values = malloc(sizeof(autopid_value_t) * all_pids->pid_count);
+    // Zeroed, a version of 0 means the value was never read
+    autopid_values = calloc(all_pids->pid_count, sizeof(autopid_value_t));
     if (!autopid_values)
     {
         ESP_LOGE(TAG, "Failed to allocate memory for autopid_values");
@@ -2647,11 +3393,32 @@ void autopid_init(char* id)
     {
         autopid_values[i].name = malloc(strlen(all_pids->pids[i].parameters->name) + 1);
         strcpy(autopid_values[i].name, all_pids->pids[i].parameters->name);
+        autopid_values[i].json_key = json_writer_make_key(autopid_values[i].name);
         autopid_values[i].value = FLT_MAX;
         autopid_values[i].sensor_type = all_pids->pids[i].parameters->sensor_type;
     }
     autopid_values_count = all_pids->pid_count;
 
+    // Largest publish payload: every parameter with the longest number
+    autopid_json_buf_size = 3;
+    for (uint32_t i = 0; i < all_pids->pid_count; i++)
+    {
+        for (uint32_t j = 0; j < all_pids->pids[i].parameters_count; j++)
+        {
+            parameter_t *param = &all_pids->pids[i].parameters[j];
+            if (param->json_key)
+            {
+                autopid_json_buf_size += strlen(param->json_key) + JSON_NUMBER_MAX_LEN + 1;
+            }
+        }
+    }
+    autopid_json_buf = malloc(autopid_json_buf_size);
+    if (!autopid_json_buf)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the publish buffer", (unsigned)autopid_json_buf_size);
+        return;
+    }
+
 
     
     xTaskCreate(autopid_task, "autopid_task", 5000, (void *)AF_INET, 5, NULL);
@@ -21,15 +21,23 @@
 #ifndef __AUTO_PID_H__
 #define __AUTO_PID_H__
 
+#include "expression_parser.h"
+#include "can.h"
+#include "block_pool.h"
+#include "wc_timer.h"
+
 #define BUFFER_SIZE 1024
 #define QUEUE_SIZE 10
+#define RESPONSE_POOL_SIZE 4        // parser, queued replies and the one being decoded
+#define PRIORITY_DATA_SIZE 16
 
-
+// Allocated from the response pool, autopidQueue carries pointers
 typedef struct {
     uint8_t data[BUFFER_SIZE];
     uint32_t length;
-    uint8_t* priority_data;
+    uint8_t* priority_data;         // NULL or priority_buf
     uint8_t  priority_data_len;
+    uint8_t  priority_buf[PRIORITY_DATA_SIZE];
 } response_t;
 
 typedef enum
@@ -48,6 +56,25 @@ typedef enum
     PID_MAX
 }pid_type_t;
 
+// Scheduling class of a PID, a due PID of a higher class is served first
+typedef enum
+{
+    PID_PRIORITY_HIGH = 0,
+    PID_PRIORITY_NORMAL = 1,
+    PID_PRIORITY_LOW = 2,
+    PID_PRIORITY_MAX
+}pid_priority_t;
+
+typedef struct
+{
+    int64_t deadline;           // earliest parameter timer, esp_timer_get_time() base
+    uint32_t heap_index;
+    uint32_t polls;
+    uint32_t deadline_misses;   // served more than half a period late
+    uint32_t jitter_max_us;
+    uint32_t jitter_avg_us;
+}pid_sched_t;
+
 typedef enum
 {
     DEST_DEFAULT,
@@ -59,7 +86,9 @@ typedef enum
 typedef struct 
 {
     char *name;
+    char *json_key;             // "name": escaped for json_writer_key(), built in load_all_pids()
     char *expression;
+    expr_program_t *program;    // compiled form of expression, built in load_all_pids()
     char *unit;
     char *class;
     uint32_t period; 
@@ -71,6 +100,13 @@ typedef struct
     int64_t timer;
     float value;
     bool failed;
+    bool pending;               // due in the current poll cycle, decoded from the shared response
+    float deadband;             // publish only when the value moves more than this
+    float deadband_pct;         // or more than this percent of the last published value
+    uint32_t heartbeat;         // ms, publish anyway after this long without a publish, 0 never
+    float published_value;      // FLT_MAX until the first publish
+    wc_timer_t heartbeat_timer;
+    uint32_t version;           // change counter value when value last changed, 0 never
 }parameter_t;
 
 typedef struct 
@@ -82,6 +118,11 @@ typedef struct
     uint32_t parameters_count;
     pid_type_t pid_type;
     char* rxheader;
+    uint8_t req[7];             // cmd as bytes for elm327_request_bin()
+    uint8_t req_len;            // 0 when cmd can only be sent as ELM327 text
+    uint8_t req_expected_rsp;
+    pid_priority_t priority;
+    pid_sched_t sched;
 }pid_data2_t;
 
 typedef struct 
@@ -110,8 +151,10 @@ typedef struct
 
 typedef struct{
     char* name;
+    char* json_key;
     float value;
     sensor_type_t sensor_type; 
+    uint32_t version;           // copied from parameter_t::version
 }autopid_value_t;
 
 ////////////////
@@ -127,6 +170,9 @@ void autopid_init(char* id);
 char *autopid_data_read(void);
 bool autopid_get_ecu_status(void);
 char* autopid_get_config(void);
+char* autopid_get_status(void);
+int32_t autopid_get_rx_ids(can_filter_id_t *ids, uint32_t max);
+const block_pool_t *autopid_get_response_pool(void);
 esp_err_t autopid_find_standard_pid(uint8_t protocol, char *available_pids, uint32_t available_pids_size) ;
 void autopid_request_data(void);
 #endif
@@ -45,6 +45,7 @@
 #include "esp_log.h"
 #include "esp_gatt_common_api.h"
 #include "types.h"
+#include "dev_buffer.h"
 #include "ble.h"
 #include "comm_server.h"
 #include "config_server.h"
@@ -573,6 +574,7 @@ static void gatts_profile_event_handler(esp_gatts_cb_event_t event,
 //            wifi_network_restart();
 //        	config_server_restart();
             is_connected = false;
+            xEventGroupClearBits(s_ble_event_group, BLE_CONNECTED_BIT);
             gpio_set_level(conn_led, 1);
             /* start advertising again when missing the connect */
             esp_ble_gap_start_advertising(&heart_rate_adv_params);
@@ -650,9 +652,22 @@ static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_
 
 
 
+// Waits for a peer, what was queued for the last one is freed meanwhile
+static void ble_wait_connected(void)
+{
+	while(!(xEventGroupWaitBits(s_ble_event_group,
+								BLE_CONNECTED_BIT,
+								pdFALSE,
+								pdFALSE,
+								pdMS_TO_TICKS(1000)) & BLE_CONNECTED_BIT))
+	{
+		dev_buffer_flush(*xBle_TX_Queue);
+	}
+}
+
 static void ble_task(void *pvParameters)
 {
-	static xdev_buffer tx_buffer;
+	dev_buffer_t *tx_buffer;
 	static uint8_t ble_send_buf[BLE_SEND_BUF_SIZE];
 	static uint32_t ble_send_buf_len = 0;
 	static uint32_t num_msg = 0;
@@ -661,21 +676,16 @@ static void ble_task(void *pvParameters)
 	while(1)
 	{
 		//		ESP_LOGI(GATTS_TABLE_TAG, "wait BLE_CONNECTED_BIT");
-				xEventGroupWaitBits(s_ble_event_group,
-									BLE_CONNECTED_BIT,
-									pdFALSE,
-									pdFALSE,
-									portMAX_DELAY);
+				ble_wait_connected();
 		//		ESP_LOGI(GATTS_TABLE_TAG, "BLE_CONNECTED_BIT");
 
-				xQueuePeek(*xBle_TX_Queue, ( void * ) &tx_buffer, portMAX_DELAY);
+				if(xQueuePeek(*xBle_TX_Queue, ( void * ) &tx_buffer, pdMS_TO_TICKS(1000)) != pdTRUE)
+				{
+					continue;
+				}
 		//		memcpy(ble_send_buf, tx_buffer.ucElement, tx_buffer.usLen);
 		//		ble_send_buf_len = tx_buffer.usLen;
-				xEventGroupWaitBits(s_ble_event_group,
-									BLE_CONNECTED_BIT,
-									pdFALSE,
-									pdFALSE,
-									portMAX_DELAY);
+				ble_wait_connected();
 
 
 				dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
@@ -691,9 +701,9 @@ static void ble_task(void *pvParameters)
 					while((xQueuePeek(*xBle_TX_Queue, ( void * ) &tx_buffer, 0) == pdTRUE))
 					{
 						// figure out how many packets are needed to send this tx_buffer
-						int num_req_packets = ((ble_send_buf_len + tx_buffer.usLen) / ble_max_data_size);
+						int num_req_packets = ((ble_send_buf_len + tx_buffer->total_len) / ble_max_data_size);
 						// Round up. Only part of a packet might be needed and integer math rounds down.
-						if((ble_send_buf_len + tx_buffer.usLen) % ble_max_data_size) {
+						if((ble_send_buf_len + tx_buffer->total_len) % ble_max_data_size) {
 							num_req_packets++;
 						}
 
@@ -703,7 +713,7 @@ static void ble_task(void *pvParameters)
 							break;
 						}
 
-						xQueueReceive(*xBle_TX_Queue, ( void * ) &tx_buffer, 0);
+						dev_buffer_receive(*xBle_TX_Queue, &tx_buffer, 0);
 						num_msg++;
 						if(esp_timer_get_time() - time_old > 1000*1000)
 						{
@@ -713,13 +723,13 @@ static void ble_task(void *pvParameters)
 							num_msg = 0;
 						}
 						int tx_buffer_copied = 0;
-						while(tx_buffer_copied < tx_buffer.usLen)
+						while(tx_buffer_copied < tx_buffer->total_len)
 						{
 							int ble_send_buf_remaining = ble_max_data_size - ble_send_buf_len;
-							int tx_buffer_remaining = tx_buffer.usLen - tx_buffer_copied;
+							int tx_buffer_remaining = tx_buffer->total_len - tx_buffer_copied;
 							// only copy bytes that will fit in the ble_send_buf
 							int copy_len = tx_buffer_remaining >= ble_send_buf_remaining ? ble_send_buf_remaining : tx_buffer_remaining;
-							memcpy(ble_send_buf+ble_send_buf_len, tx_buffer.ucElement+tx_buffer_copied, copy_len);
+							dev_buffer_copy(tx_buffer, tx_buffer_copied, ble_send_buf+ble_send_buf_len, copy_len);
 							ble_send_buf_len += copy_len;
 							tx_buffer_copied += copy_len;
 
@@ -746,6 +756,7 @@ static void ble_task(void *pvParameters)
 								}
 							}
 						}
+						dev_buffer_free(tx_buffer);
 					}
 					if(free_packet != 0 && ble_send_buf_len != 0)
 					{
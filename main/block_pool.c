@@ -0,0 +1,99 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include <stdlib.h>
+#include <string.h>
+#include "block_pool.h"
+
+#define TAG 		__func__
+
+bool block_pool_init(block_pool_t *pool, size_t block_size, uint16_t count)
+{
+	// Free blocks store the next pointer in place, keep every block aligned
+	block_size = (block_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+	memset(pool, 0, sizeof(block_pool_t));
+	pool->storage = (uint8_t*)malloc(block_size * count);
+	if(pool->storage == NULL)
+	{
+		ESP_LOGE(TAG, "Failed to allocate %u blocks of %u bytes", count, (unsigned)block_size);
+		return false;
+	}
+
+	pool->block_size = block_size;
+	pool->count = count;
+	portMUX_INITIALIZE(&pool->lock);
+	for(uint16_t i = count; i > 0; i--)
+	{
+		void **block = (void**)&pool->storage[(i - 1) * block_size];
+		*block = pool->free_list;
+		pool->free_list = block;
+	}
+
+	return true;
+}
+
+// Returns NULL when every block is in use
+void *block_pool_alloc(block_pool_t *pool)
+{
+	void **block;
+
+	taskENTER_CRITICAL(&pool->lock);
+	block = (void**)pool->free_list;
+	if(block != NULL)
+	{
+		pool->free_list = *block;
+		pool->used++;
+		if(pool->used > pool->high_water)
+		{
+			pool->high_water = pool->used;
+		}
+	}
+	else
+	{
+		pool->failures++;
+	}
+	taskEXIT_CRITICAL(&pool->lock);
+
+	return block;
+}
+
+void block_pool_free(block_pool_t *pool, void *block)
+{
+	if(block == NULL)
+	{
+		return;
+	}
+
+	if((uint8_t*)block < pool->storage || (uint8_t*)block >= pool->storage + pool->block_size * pool->count)
+	{
+		ESP_LOGE(TAG, "Block %p not from this pool", block);
+		return;
+	}
+
+	taskENTER_CRITICAL(&pool->lock);
+	*(void**)block = pool->free_list;
+	pool->free_list = block;
+	pool->used--;
+	taskEXIT_CRITICAL(&pool->lock);
+}
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BLOCK_POOL_H__
+#define __BLOCK_POOL_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+
+// Fixed size blocks carved from one allocation made at init, alloc and free
+// are O(1) and never touch the heap afterwards
+typedef struct {
+	uint8_t *storage;
+	void *free_list;
+	size_t block_size;
+	uint16_t count;
+	uint16_t used;
+	uint16_t high_water;			// most blocks in use at the same time
+	uint32_t failures;				// allocations refused because the pool was empty
+	portMUX_TYPE lock;
+}block_pool_t;
+
+bool block_pool_init(block_pool_t *pool, size_t block_size, uint16_t count);
+void *block_pool_alloc(block_pool_t *pool);
+void block_pool_free(block_pool_t *pool, void *block);
+#endif
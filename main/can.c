@@ -22,6 +22,7 @@
 #include "freertos/task.h"
 #include  "freertos/queue.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_wifi.h"
 #include "esp_system.h"
 #include "esp_event.h"
@@ -32,10 +33,12 @@
 #include "comm_server.h"
 #include "lwip/sockets.h"
 #include "driver/twai.h"
+#include "esp_timer.h"
 #include "can.h"
 #include "hw_config.h"
 
 static EventGroupHandle_t s_can_event_group = NULL;
+static SemaphoreHandle_t s_can_rx_mutex = NULL;
 #define CAN_ENABLE_BIT 		BIT0
 
 #define TAG 		__func__
@@ -68,7 +71,7 @@ static uint8_t datarate = CAN_500K;
 //static uint8_t bus_state = OFF_BUS;
 // static uint32_t mask = 0xFFFFFFFF;
 // static uint32_t filter = 0;
-static can_cfg_t can_cfg = {.bus_state = END_BUS, .auto_bitrate = 0, .mask = 0xFFFFFFFF, .filter = 0};
+static can_cfg_t can_cfg = {.bus_state = END_BUS, .auto_bitrate = 0, .mask = 0xFFFFFFFF, .filter = 0, .single_filter = 1};
 
 #define TWAI_CONFIG(tx_io_num, rx_io_num, op_mode) {.mode = op_mode, .tx_io = tx_io_num, .rx_io = rx_io_num,        \
                                                                     .clkout_io = TWAI_IO_UNUSED, .bus_off_io = TWAI_IO_UNUSED,      \
@@ -126,7 +129,7 @@ void can_enable(void)
 
 	f_config.acceptance_code = can_cfg.filter;
 	f_config.acceptance_mask = can_cfg.mask;
-	f_config.single_filter = 1;
+	f_config.single_filter = can_cfg.single_filter;
 
 	if(can_cfg.silent)
 	{
@@ -155,8 +158,12 @@ void can_disable(void)
 	{
 		gpio_set_level(CAN_STDBY_GPIO_NUM, 1);
 		can_block();
+		// can_rx_task may be blocked in twai_receive, wait for it to return
+		// before the driver queue is deleted
+		xSemaphoreTake(s_can_rx_mutex, portMAX_DELAY);
 		twai_stop();
 		twai_driver_uninstall();
+		xSemaphoreGive(s_can_rx_mutex);
 		can_cfg.bus_state = OFF_BUS;
 	}
 }
@@ -202,6 +209,7 @@ void can_set_filter(uint32_t f)
 	}
 
 	can_cfg.filter = f;
+	can_cfg.single_filter = 1;
 }
 
 void can_set_mask(uint32_t m)
@@ -211,6 +219,191 @@ void can_set_mask(uint32_t m)
 		return;
 	}
 	can_cfg.mask = m;
+	can_cfg.single_filter = 1;
+}
+
+void can_set_filter_config(const twai_filter_config_t *config)
+{
+	if(can_cfg.bus_state == ON_BUS)
+	{
+		return;
+	}
+
+	can_cfg.filter = config->acceptance_code;
+	can_cfg.mask = config->acceptance_mask;
+	can_cfg.single_filter = config->single_filter;
+	ESP_LOGI(TAG, "acceptance code: %08lX, mask: %08lX, %s filter", can_cfg.filter, can_cfg.mask, can_cfg.single_filter ? "single" : "dual");
+}
+
+/*
+ * Acceptance filter planner
+ *
+ * Identifiers are merged into groups, a group accepts every identifier that
+ * matches its id on the bits not set in its mask. Merging two groups marks
+ * every bit where they differ as don't care, so the cost of a group is the
+ * number of identifiers it accepts: 2^(don't care bits).
+ *
+ * Filter layouts (see the TWAI acceptance filter section of the TRM):
+ * - single, standard: bits 31-21 ID, 20 RTR, 19-0 first two data bytes
+ * - single, extended: bits 31-3 ID, 2 RTR
+ * - dual, standard:   filter 1 bits 31-21 ID, 20 RTR, 19-16 and 3-0 data byte 1,
+ *                     filter 2 bits 15-5 ID, 4 RTR
+ * - dual, extended:   filter 1 bits 31-16 and filter 2 bits 15-0, ID bits 28-13
+ */
+typedef struct {
+	uint32_t id;
+	uint32_t mask;
+}can_filter_group_t;
+
+static can_filter_group_t can_filter_merge(can_filter_group_t a, can_filter_group_t b)
+{
+	can_filter_group_t group;
+
+	group.mask = a.mask | b.mask | (a.id ^ b.id);
+	group.id = a.id & ~group.mask;
+
+	return group;
+}
+
+static uint32_t can_filter_group_bits(can_filter_group_t group, uint32_t width_mask)
+{
+	return __builtin_popcount(group.mask & width_mask);
+}
+
+// Merges the cheapest pair of groups until max_groups are left, returns the group count
+static uint32_t can_filter_reduce(can_filter_group_t *groups, uint32_t count, uint32_t max_groups, uint32_t width_mask)
+{
+	while(count > max_groups)
+	{
+		uint32_t best_i = 0, best_j = 1;
+		uint32_t best_bits = UINT32_MAX;
+
+		for(uint32_t i = 0; i < count; i++)
+		{
+			for(uint32_t j = i + 1; j < count; j++)
+			{
+				uint32_t bits = can_filter_group_bits(can_filter_merge(groups[i], groups[j]), width_mask);
+
+				if(bits < best_bits)
+				{
+					best_bits = bits;
+					best_i = i;
+					best_j = j;
+				}
+			}
+		}
+
+		groups[best_i] = can_filter_merge(groups[best_i], groups[best_j]);
+		groups[best_j] = groups[--count];
+	}
+
+	return count;
+}
+
+// Cost of a set of groups in accepted identifiers, as a power of two sum
+static uint64_t can_filter_cost(const can_filter_group_t *groups, uint32_t count, uint32_t width_mask, uint32_t extra_bits)
+{
+	uint64_t cost = 0;
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		cost += 1ULL << (can_filter_group_bits(groups[i], width_mask) + extra_bits);
+	}
+
+	return cost;
+}
+
+/*
+ * Computes the tightest single or dual filter accepting every identifier in
+ * ids. Other frames may still be accepted, the filter is only a first stage.
+ * Returns false if ids is empty or too large, the caller should then accept all.
+ */
+bool can_plan_filter(const can_filter_id_t *ids, uint32_t count, twai_filter_config_t *plan)
+{
+	can_filter_group_t std[CAN_FILTER_PLAN_MAX_IDS];
+	can_filter_group_t ext[CAN_FILTER_PLAN_MAX_IDS];
+	can_filter_group_t ext16[CAN_FILTER_PLAN_MAX_IDS];
+	uint32_t std_count = 0, ext_count = 0;
+
+	if(count == 0 || count > CAN_FILTER_PLAN_MAX_IDS)
+	{
+		return false;
+	}
+
+	for(uint32_t i = 0; i < count; i++)
+	{
+		if(ids[i].extd)
+		{
+			ext[ext_count].mask = ids[i].mask & TWAI_EXTD_ID_MASK;
+			ext[ext_count].id = ids[i].id & TWAI_EXTD_ID_MASK & ~ext[ext_count].mask;
+			// Dual filters only see the 16 most significant bits of extended IDs
+			ext16[ext_count].mask = ext[ext_count].mask >> 13;
+			ext16[ext_count].id = ext[ext_count].id >> 13;
+			ext_count++;
+		}
+		else
+		{
+			std[std_count].mask = ids[i].mask & TWAI_STD_ID_MASK;
+			std[std_count].id = ids[i].id & TWAI_STD_ID_MASK & ~std[std_count].mask;
+			std_count++;
+		}
+	}
+
+	if(std_count != 0 && ext_count != 0)
+	{
+		// Filter 1 takes the standard IDs, filter 2 the extended ones. Bits 3-0
+		// are data byte 1 for filter 1, so they are don't care for both.
+		can_filter_reduce(std, std_count, 1, TWAI_STD_ID_MASK);
+		can_filter_reduce(ext16, ext_count, 1, 0xFFFF);
+		ext16[0].mask |= 0x000F;
+		ext16[0].id &= ~ext16[0].mask;
+
+		plan->single_filter = false;
+		plan->acceptance_code = (std[0].id << 21) | ext16[0].id;
+		plan->acceptance_mask = (std[0].mask << 21) | (0x1F << 16) | ext16[0].mask;
+	}
+	else if(std_count != 0)
+	{
+		can_filter_group_t pair[CAN_FILTER_PLAN_MAX_IDS];
+		uint32_t pair_count;
+
+		memcpy(pair, std, sizeof(can_filter_group_t) * std_count);
+		pair_count = can_filter_reduce(pair, std_count, 2, TWAI_STD_ID_MASK);
+		can_filter_reduce(std, std_count, 1, TWAI_STD_ID_MASK);
+
+		if(pair_count == 2 && can_filter_cost(pair, 2, TWAI_STD_ID_MASK, 0) < can_filter_cost(std, 1, TWAI_STD_ID_MASK, 0))
+		{
+			plan->single_filter = false;
+			plan->acceptance_code = (pair[0].id << 21) | (pair[1].id << 5);
+			plan->acceptance_mask = (pair[0].mask << 21) | (0x1F << 16) | (pair[1].mask << 5) | 0x1F;
+		}
+		else
+		{
+			plan->single_filter = true;
+			plan->acceptance_code = std[0].id << 21;
+			plan->acceptance_mask = (std[0].mask << 21) | 0x1FFFFF;
+		}
+	}
+	else
+	{
+		uint32_t pair_count = can_filter_reduce(ext16, ext_count, 2, 0xFFFF);
+		can_filter_reduce(ext, ext_count, 1, TWAI_EXTD_ID_MASK);
+
+		if(pair_count == 2 && can_filter_cost(ext16, 2, 0xFFFF, 13) < can_filter_cost(ext, 1, TWAI_EXTD_ID_MASK, 0))
+		{
+			plan->single_filter = false;
+			plan->acceptance_code = (ext16[0].id << 16) | ext16[1].id;
+			plan->acceptance_mask = (ext16[0].mask << 16) | ext16[1].mask;
+		}
+		else
+		{
+			plan->single_filter = true;
+			plan->acceptance_code = ext[0].id << 3;
+			plan->acceptance_mask = (ext[0].mask << 3) | 0x7;
+		}
+	}
+
+	return true;
 }
 
 void can_set_bitrate(uint8_t rate)
@@ -234,6 +427,7 @@ void can_init(uint8_t bitrate)
 	if(s_can_event_group == NULL)
 	{
 		s_can_event_group = xEventGroupCreate();
+		s_can_rx_mutex = xSemaphoreCreateMutex();
 		xCAN_EN_Timer= xTimerCreate
 						   ( /* Just a text name, not used by the RTOS
 							 kernel. */
@@ -273,15 +467,25 @@ void can_init(uint8_t bitrate)
 esp_err_t can_receive(twai_message_t *message, TickType_t ticks_to_wait)
 {
 	esp_err_t ret;
-	static uint32_t rx_error;
-	static uint8_t store_silent_flag = 0;
-	static uint8_t bitrate_found = 1;
+//	static uint32_t rx_error;
+//	static uint8_t store_silent_flag = 0;
+//	static uint8_t bitrate_found = 1;
 
-	xEventGroupWaitBits(s_can_event_group,
-							CAN_ENABLE_BIT,
-							pdFALSE,
-							pdFALSE,
-							portMAX_DELAY);
+	while(1)
+	{
+		xEventGroupWaitBits(s_can_event_group,
+								CAN_ENABLE_BIT,
+								pdFALSE,
+								pdFALSE,
+								portMAX_DELAY);
+
+		xSemaphoreTake(s_can_rx_mutex, portMAX_DELAY);
+		if(xEventGroupGetBits(s_can_event_group) & CAN_ENABLE_BIT)
+		{
+			break;
+		}
+		xSemaphoreGive(s_can_rx_mutex);
+	}
 
 	// if(can_cfg.auto_bitrate)
 	// {
@@ -327,7 +531,9 @@ esp_err_t can_receive(twai_message_t *message, TickType_t ticks_to_wait)
 	// }
 	// else
 	{
-		return twai_receive(message, ticks_to_wait);
+		ret = twai_receive(message, ticks_to_wait);
+		xSemaphoreGive(s_can_rx_mutex);
+		return ret;
 	}
 }
 
@@ -367,6 +573,44 @@ void can_flush_rx(void)
 }
 
 
+static can_rx_stats_t can_rx_stats_current;
+static can_rx_stats_t can_rx_stats_last;
+static int64_t can_rx_stats_start = 0;
+static portMUX_TYPE can_rx_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Called by can_rx_task once per wakeup, batch is 0 when the wait timed out
+void can_rx_stats_account(uint32_t batch, uint32_t queue_depth)
+{
+	int64_t now = esp_timer_get_time();
+
+	can_rx_stats_current.wakeups++;
+	can_rx_stats_current.frames += batch;
+	if(batch > can_rx_stats_current.max_batch)
+	{
+		can_rx_stats_current.max_batch = batch;
+	}
+	if(queue_depth > can_rx_stats_current.max_queue_depth)
+	{
+		can_rx_stats_current.max_queue_depth = queue_depth;
+	}
+
+	if(now - can_rx_stats_start >= 1000*1000)
+	{
+		taskENTER_CRITICAL(&can_rx_stats_lock);
+		can_rx_stats_last = can_rx_stats_current;
+		taskEXIT_CRITICAL(&can_rx_stats_lock);
+		memset(&can_rx_stats_current, 0, sizeof(can_rx_stats_current));
+		can_rx_stats_start = now;
+	}
+}
+
+void can_get_rx_stats(can_rx_stats_t *stats)
+{
+	taskENTER_CRITICAL(&can_rx_stats_lock);
+	*stats = can_rx_stats_last;
+	taskEXIT_CRITICAL(&can_rx_stats_lock);
+}
+
 uint32_t can_msgs_to_rx(void)
 {
 	twai_status_info_t status_info;
@@ -47,9 +47,28 @@ typedef struct {
 	uint8_t sjw;
 	uint32_t filter;
 	uint32_t mask;
+	uint8_t single_filter;
 	uint8_t auto_bitrate;
 }can_cfg_t;
 
+// An identifier, or a range of them, the acceptance filter must let through.
+// Bits set in mask are don't care, like the TWAI acceptance mask.
+typedef struct {
+	uint32_t id;
+	uint32_t mask;
+	bool extd;
+}can_filter_id_t;
+
+#define CAN_FILTER_PLAN_MAX_IDS		64
+
+// RX path activity over the last complete second
+typedef struct {
+	uint32_t wakeups;				// times can_rx_task woke up, including timeouts
+	uint32_t frames;
+	uint32_t max_batch;				// most frames drained in one wakeup
+	uint32_t max_queue_depth;		// most frames waiting in the driver when woken up
+}can_rx_stats_t;
+
 
 void can_enable(void);
 void can_disable(void);
@@ -58,6 +77,8 @@ void can_set_loopback(uint8_t flag);
 void can_set_auto_retransmit(uint8_t flag);
 void can_set_filter(uint32_t f);
 void can_set_mask(uint32_t m);
+bool can_plan_filter(const can_filter_id_t *ids, uint32_t count, twai_filter_config_t *plan);
+void can_set_filter_config(const twai_filter_config_t *config);
 void can_set_bitrate(uint8_t rate);
 esp_err_t can_receive(twai_message_t *message, TickType_t ticks_to_wait);
 esp_err_t can_send(twai_message_t *message, TickType_t ticks_to_wait);
@@ -66,5 +87,7 @@ uint8_t can_is_silent(void);
 bool can_is_enabled(void);
 uint8_t can_get_bitrate(void);
 uint32_t can_msgs_to_rx(void);
+void can_rx_stats_account(uint32_t batch, uint32_t queue_depth);
+void can_get_rx_stats(can_rx_stats_t *stats);
 void can_flush_rx(void);
 #endif
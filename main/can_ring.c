@@ -0,0 +1,180 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include <string.h>
+#include "driver/twai.h"
+#include "can_ring.h"
+
+#define TAG 		__func__
+
+/*
+ * Single producer, multi consumer ring of received CAN frames.
+ *
+ * can_rx_task is the only writer: it fills the slot of sequence number
+ * head and then publishes head + 1. Readers never block the writer, a reader
+ * that falls more than CAN_RING_SIZE frames behind skips ahead and counts the
+ * lost frames. A reader copies a slot and then checks head again, if the
+ * writer may have started overwriting that slot meanwhile the copy is dropped.
+ */
+static can_ring_frame_t can_ring_slots[CAN_RING_SIZE];
+static uint32_t can_ring_head = 0;
+static uint32_t can_ring_notified = 0;
+static uint32_t can_ring_readers_bits = 0;
+static uint8_t can_ring_readers = 0;
+static EventGroupHandle_t can_ring_event_group = NULL;
+static portMUX_TYPE can_ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void can_ring_init(void)
+{
+	if(can_ring_event_group == NULL)
+	{
+		can_ring_event_group = xEventGroupCreate();
+	}
+}
+
+// Producer side, only called from can_rx_task
+void can_ring_push(const twai_message_t *frame, int64_t timestamp)
+{
+	uint32_t head = __atomic_load_n(&can_ring_head, __ATOMIC_RELAXED);
+	can_ring_frame_t *slot = &can_ring_slots[head & (CAN_RING_SIZE - 1)];
+
+	// The head published by the previous push must be visible before any
+	// write to this slot, a reader that sees the new data then also sees
+	// that head and drops its copy
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->frame = *frame;
+	slot->timestamp = timestamp;
+	__atomic_store_n(&can_ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Wakes up the readers once per batch of pushed frames
+void can_ring_notify(void)
+{
+	uint32_t head = __atomic_load_n(&can_ring_head, __ATOMIC_RELAXED);
+
+	if(head != can_ring_notified && can_ring_readers_bits != 0)
+	{
+		can_ring_notified = head;
+		xEventGroupSetBits(can_ring_event_group, can_ring_readers_bits);
+	}
+}
+
+// Registers a reader, it starts with the next pushed frame
+bool can_ring_reader_init(can_ring_reader_t *reader)
+{
+	bool ret = false;
+
+	can_ring_init();
+
+	taskENTER_CRITICAL(&can_ring_lock);
+	if(can_ring_readers < CAN_RING_MAX_READERS)
+	{
+		reader->bit = BIT0 << can_ring_readers;
+		reader->cursor = __atomic_load_n(&can_ring_head, __ATOMIC_ACQUIRE);
+		reader->overflows = 0;
+		can_ring_readers_bits |= reader->bit;
+		can_ring_readers++;
+		ret = true;
+	}
+	taskEXIT_CRITICAL(&can_ring_lock);
+
+	if(!ret)
+	{
+		ESP_LOGE(TAG, "too many readers");
+	}
+
+	return ret;
+}
+
+uint32_t can_ring_available(can_ring_reader_t *reader)
+{
+	uint32_t pending = __atomic_load_n(&can_ring_head, __ATOMIC_ACQUIRE) - reader->cursor;
+
+	return (pending > CAN_RING_SIZE) ? CAN_RING_SIZE : pending;
+}
+
+// Drops everything received so far
+void can_ring_skip(can_ring_reader_t *reader)
+{
+	reader->cursor = __atomic_load_n(&can_ring_head, __ATOMIC_ACQUIRE);
+	xEventGroupClearBits(can_ring_event_group, reader->bit);
+}
+
+// Waits until the reader has a frame to read, returns false on timeout
+bool can_ring_wait(can_ring_reader_t *reader, TickType_t ticks_to_wait)
+{
+	TickType_t start = xTaskGetTickCount();
+
+	while(can_ring_available(reader) == 0)
+	{
+		TickType_t elapsed = xTaskGetTickCount() - start;
+
+		if(elapsed >= ticks_to_wait)
+		{
+			return false;
+		}
+
+		xEventGroupWaitBits(can_ring_event_group, reader->bit, pdTRUE, pdFALSE, 
+							(ticks_to_wait == portMAX_DELAY) ? portMAX_DELAY : ticks_to_wait - elapsed);
+	}
+
+	return true;
+}
+
+bool can_ring_read(can_ring_reader_t *reader, can_ring_frame_t *out, TickType_t ticks_to_wait)
+{
+	while(1)
+	{
+		uint32_t head = __atomic_load_n(&can_ring_head, __ATOMIC_ACQUIRE);
+
+		if(head == reader->cursor)
+		{
+			if(ticks_to_wait == 0 || !can_ring_wait(reader, ticks_to_wait))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		if(head - reader->cursor >= CAN_RING_SIZE)
+		{
+			// Lapped, the oldest slot may already be getting overwritten
+			reader->overflows += head - reader->cursor - (CAN_RING_SIZE - 1);
+			reader->cursor = head - (CAN_RING_SIZE - 1);
+		}
+
+		*out = can_ring_slots[reader->cursor & (CAN_RING_SIZE - 1)];
+
+		// The copy is only valid if the writer hasn't reached this slot again
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&can_ring_head, __ATOMIC_RELAXED);
+		if(head - reader->cursor >= CAN_RING_SIZE)
+		{
+			continue;
+		}
+
+		reader->cursor++;
+		return true;
+	}
+}
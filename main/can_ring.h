@@ -0,0 +1,49 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __CAN_RING_H__
+#define __CAN_RING_H__
+#include "driver/twai.h"
+
+#define CAN_RING_SIZE				256		// must be a power of 2
+#define CAN_RING_MAX_READERS		8
+
+typedef struct {
+	twai_message_t frame;
+	int64_t timestamp;				// esp_timer_get_time() when the frame was taken from the driver
+}can_ring_frame_t;
+
+// Each sink keeps its own cursor, a slow sink only loses its own frames
+typedef struct {
+	uint32_t cursor;				// sequence number of the next frame to read
+	uint32_t overflows;				// frames overwritten before this reader got to them
+	uint32_t bit;					// wake up bit in the ring event group
+}can_ring_reader_t;
+
+void can_ring_init(void);
+void can_ring_push(const twai_message_t *frame, int64_t timestamp);
+void can_ring_notify(void);
+bool can_ring_reader_init(can_ring_reader_t *reader);
+bool can_ring_read(can_ring_reader_t *reader, can_ring_frame_t *out, TickType_t ticks_to_wait);
+bool can_ring_wait(can_ring_reader_t *reader, TickType_t ticks_to_wait);
+uint32_t can_ring_available(can_ring_reader_t *reader);
+void can_ring_skip(can_ring_reader_t *reader);
+#endif
@@ -0,0 +1,536 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "hw_config.h"
+#include "filesystem.h"
+#include "can_ring.h"
+#include "can_trace.h"
+
+#define TAG 		__func__
+
+// Raw bus log recorded from the CAN ring into numbered segment files. The
+// encoder task packs frames into fixed size blocks, the write task puts
+// whole blocks on the flash, a slow write only stalls the encoder once all
+// blocks are in flight and the frames it misses are counted per block.
+//
+// A segment is a run of CAN_TRACE_BLOCK_SIZE blocks, block k starts at
+// k * CAN_TRACE_BLOCK_SIZE and its header holds the absolute timestamp of its
+// first frame, so the headers are the segment's time index: seek by binary
+// search over them, decode from the start of one block.
+//
+// Block header, little endian: "WT", version, reserved, uint16 frames,
+// uint16 used bytes (header included), uint32 frames lost between the
+// previous block and this one, int64 first timestamp (us since boot),
+// uint16 CRC-16 of the header before it and of the frames, 2 reserved
+// bytes. Unused bytes are zero.
+//
+// Frame: flags (dlc bits 0-3, extended id bit 4, rtr bit 5, same id as the
+// previous frame bit 6), varint timestamp delta in us, zigzag varint id
+// delta unless same id, min(dlc, 8) data bytes unless rtr. The first frame
+// of a block is relative to the block timestamp and to id 0. Frames lost
+// in the ring end the block, so a gap is always between two blocks.
+//
+// The number of segments kept is sized at boot from the free space on the
+// filesystem, what is already recorded counts as free.
+#define CAN_TRACE_DIR				FS_MOUNT_POINT"/trace"
+#define CAN_TRACE_BLOCKS			3			// encoding, being written and one queued
+#define CAN_TRACE_VERSION			1
+#define CAN_TRACE_HEADER_SIZE		24
+#define CAN_TRACE_FRAME_MAX			(1 + 5 + 5 + 8)
+#define CAN_TRACE_EXTD				0x10
+#define CAN_TRACE_RTR				0x20
+#define CAN_TRACE_SAME_ID			0x40
+#define CAN_TRACE_IDLE_MS			1000		// bus quiet this long, the partial block is written
+#define CAN_TRACE_BLOCK_AGE_US		(5*1000*1000)	// bounds what a power loss takes with it
+#define CAN_TRACE_SEGMENT_BYTES		(CAN_TRACE_BLOCK_SIZE * CAN_TRACE_SEGMENT_BLOCKS)
+#define CAN_TRACE_SEGMENTS_MIN		2
+#define CAN_TRACE_FS_RESERVE		(96*1024)	// config files, the MQTT outbox and filesystem metadata
+
+typedef struct
+{
+	uint8_t *block;
+	uint32_t used;
+	uint16_t frames;
+	int64_t first_timestamp;
+	int64_t last_timestamp;
+	uint32_t last_id;
+	uint32_t lost;					// frames lost before this block
+	uint32_t overflows;				// reader overflows already reported in a block
+}can_trace_encoder_t;
+
+static can_ring_reader_t trace_reader;
+static QueueHandle_t trace_free_queue = NULL;
+static QueueHandle_t trace_write_queue = NULL;
+static SemaphoreHandle_t trace_lock = NULL;		// segment files and stats
+static can_trace_stats_t trace_stats;
+static uint32_t trace_head;					// oldest segment
+static uint32_t trace_tail;					// segment being written
+static FILE *trace_file = NULL;
+static uint32_t trace_tail_blocks;
+static uint32_t trace_segments_max = CAN_TRACE_SEGMENTS_MIN;
+
+static void can_trace_put_le(uint8_t *p, uint64_t v, uint8_t len)
+{
+	for(uint8_t i = 0; i < len; i++)
+	{
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+static uint8_t *can_trace_put_varint(uint8_t *p, uint32_t v)
+{
+	while(v >= 0x80)
+	{
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+static void can_trace_path(char *path, size_t size, uint32_t seq)
+{
+	snprintf(path, size, CAN_TRACE_DIR"/%08lx.trc", seq);
+}
+
+static void can_trace_submit(can_trace_encoder_t *enc)
+{
+	uint8_t *block = enc->block;
+
+	block[0] = 'W';
+	block[1] = 'T';
+	block[2] = CAN_TRACE_VERSION;
+	block[3] = 0;
+	can_trace_put_le(&block[4], enc->frames, 2);
+	can_trace_put_le(&block[6], enc->used, 2);
+	can_trace_put_le(&block[8], enc->lost, 4);
+	can_trace_put_le(&block[12], (uint64_t)enc->first_timestamp, 8);
+	memset(&block[22], 0, CAN_TRACE_HEADER_SIZE - 22);
+	memset(&block[enc->used], 0, CAN_TRACE_BLOCK_SIZE - enc->used);
+
+	uint16_t crc = esp_rom_crc16_le(0, block, 20);
+	crc = esp_rom_crc16_le(crc, &block[CAN_TRACE_HEADER_SIZE], enc->used - CAN_TRACE_HEADER_SIZE);
+	can_trace_put_le(&block[20], crc, 2);
+
+	xQueueSend(trace_write_queue, &block, portMAX_DELAY);
+	enc->block = NULL;
+}
+
+static void can_trace_encode(can_trace_encoder_t *enc, const can_ring_frame_t *item)
+{
+	const twai_message_t *frame = &item->frame;
+	uint8_t *p = &enc->block[enc->used];
+	uint8_t *flags = p++;
+	uint8_t len = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+	int64_t delta = item->timestamp - enc->last_timestamp;
+
+	*flags = frame->data_length_code & 0x0F;
+	*flags |= frame->extd ? CAN_TRACE_EXTD : 0;
+	p = can_trace_put_varint(p, (delta > 0) ? (uint32_t)delta : 0);
+
+	if(frame->identifier == enc->last_id)
+	{
+		*flags |= CAN_TRACE_SAME_ID;
+	}
+	else
+	{
+		int32_t id_delta = (int32_t)(frame->identifier - enc->last_id);
+
+		p = can_trace_put_varint(p, ((uint32_t)id_delta << 1) ^ (uint32_t)(id_delta >> 31));
+	}
+
+	if(frame->rtr)
+	{
+		*flags |= CAN_TRACE_RTR;
+	}
+	else
+	{
+		memcpy(p, frame->data, len);
+		p += len;
+	}
+
+	enc->used = p - enc->block;
+	enc->frames++;
+	enc->last_id = frame->identifier;
+	if(delta > 0)
+	{
+		enc->last_timestamp = item->timestamp;
+	}
+}
+
+static void can_trace_task(void *pvParameters)
+{
+	can_trace_encoder_t enc = {0};
+	can_ring_frame_t item;
+
+	while(1)
+	{
+		if(!can_ring_read(&trace_reader, &item, pdMS_TO_TICKS(CAN_TRACE_IDLE_MS)))
+		{
+			if(enc.block != NULL && enc.frames != 0)
+			{
+				can_trace_submit(&enc);
+			}
+			continue;
+		}
+
+		// Frames lost since the last one read start a new block
+		if(enc.block != NULL && (enc.used + CAN_TRACE_FRAME_MAX > CAN_TRACE_BLOCK_SIZE ||
+			item.timestamp - enc.first_timestamp > CAN_TRACE_BLOCK_AGE_US ||
+			trace_reader.overflows != enc.overflows))
+		{
+			can_trace_submit(&enc);
+		}
+
+		if(enc.block == NULL)
+		{
+			// Blocks until the write task hands one back, the ring absorbs the wait
+			xQueueReceive(trace_free_queue, &enc.block, portMAX_DELAY);
+			enc.used = CAN_TRACE_HEADER_SIZE;
+			enc.frames = 0;
+			enc.first_timestamp = item.timestamp;
+			enc.last_timestamp = item.timestamp;
+			enc.last_id = 0;
+			enc.lost = trace_reader.overflows - enc.overflows;
+			enc.overflows = trace_reader.overflows;
+		}
+
+		can_trace_encode(&enc, &item);
+	}
+}
+
+static void can_trace_remove_head(void)
+{
+	char path[48];
+
+	can_trace_path(path, sizeof(path), trace_head);
+	unlink(path);
+	trace_head++;
+}
+
+static bool can_trace_append(const uint8_t *block)
+{
+	char path[48];
+
+	if(trace_file == NULL)
+	{
+		while((trace_tail - trace_head) >= trace_segments_max)
+		{
+			can_trace_remove_head();
+		}
+
+		can_trace_path(path, sizeof(path), trace_tail);
+		trace_file = fopen(path, "wb");
+		trace_tail_blocks = 0;
+		if(trace_file == NULL)
+		{
+			ESP_LOGE(TAG, "Failed to open %s", path);
+			return false;
+		}
+		// Blocks are written whole, stdio buffering would only split them
+		setvbuf(trace_file, NULL, _IONBF, 0);
+	}
+
+	if(fwrite(block, 1, CAN_TRACE_BLOCK_SIZE, trace_file) != CAN_TRACE_BLOCK_SIZE ||
+		fsync(fileno(trace_file)) != 0)
+	{
+		// Most likely out of space, close the segment and give up the oldest one.
+		// A torn block fails its CRC and is skipped by readers
+		ESP_LOGE(TAG, "Trace write failed, closing segment %lu", trace_tail);
+		fclose(trace_file);
+		trace_file = NULL;
+		trace_tail++;
+		if((trace_tail - trace_head) > 1)
+		{
+			can_trace_remove_head();
+		}
+		return false;
+	}
+
+	trace_tail_blocks++;
+	if(trace_tail_blocks >= CAN_TRACE_SEGMENT_BLOCKS)
+	{
+		fclose(trace_file);
+		trace_file = NULL;
+		trace_tail++;
+	}
+	return true;
+}
+
+static void can_trace_write_task(void *pvParameters)
+{
+	uint8_t *block;
+
+	while(1)
+	{
+		xQueueReceive(trace_write_queue, &block, portMAX_DELAY);
+
+		int64_t start = esp_timer_get_time();
+		uint16_t frames = block[4] | (block[5] << 8);
+
+		xSemaphoreTake(trace_lock, portMAX_DELAY);
+		if(can_trace_append(block))
+		{
+			uint32_t ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+
+			trace_stats.blocks++;
+			trace_stats.frames += frames;
+			if(ms > trace_stats.write_max_ms)
+			{
+				trace_stats.write_max_ms = ms;
+			}
+		}
+		else
+		{
+			trace_stats.write_errors++;
+		}
+		xSemaphoreGive(trace_lock);
+
+		xQueueSend(trace_free_queue, &block, portMAX_DELAY);
+	}
+}
+
+void can_trace_get_stats(can_trace_stats_t *stats)
+{
+	if(trace_lock == NULL)
+	{
+		memset(stats, 0, sizeof(can_trace_stats_t));
+		return;
+	}
+
+	xSemaphoreTake(trace_lock, portMAX_DELAY);
+	*stats = trace_stats;
+	stats->lost = trace_reader.overflows;
+	stats->segments = trace_tail - trace_head + (trace_file != NULL ? 1 : 0);
+	stats->segments_max = trace_segments_max;
+	xSemaphoreGive(trace_lock);
+}
+
+// Oldest first, returns the number of segments or -1 when not recording
+int32_t can_trace_list(can_trace_segment_t *segments, uint32_t max)
+{
+	char path[48];
+	uint8_t header[CAN_TRACE_HEADER_SIZE];
+	struct stat st;
+	uint32_t count = 0;
+
+	if(trace_lock == NULL)
+	{
+		return -1;
+	}
+
+	xSemaphoreTake(trace_lock, portMAX_DELAY);
+	uint32_t end = trace_tail + (trace_file != NULL ? 1 : 0);
+
+	for(uint32_t seq = trace_head; seq != end && count < max; seq++)
+	{
+		can_trace_path(path, sizeof(path), seq);
+		if(stat(path, &st) != 0)
+		{
+			continue;
+		}
+
+		can_trace_segment_t *segment = &segments[count++];
+		FILE *f = fopen(path, "rb");
+
+		segment->seq = seq;
+		segment->size = (uint32_t)st.st_size;
+		segment->active = (seq == trace_tail && trace_file != NULL);
+		segment->first_timestamp = -1;
+		if(f != NULL)
+		{
+			if(fread(header, 1, sizeof(header), f) == sizeof(header) && header[0] == 'W' && header[1] == 'T')
+			{
+				segment->first_timestamp = 0;
+				for(uint8_t i = 0; i < 8; i++)
+				{
+					segment->first_timestamp |= (int64_t)header[12 + i] << (8 * i);
+				}
+			}
+			fclose(f);
+		}
+	}
+	xSemaphoreGive(trace_lock);
+
+	return count;
+}
+
+// Reads part of a segment, returns the number of bytes read, 0 at the end
+// and -1 when the segment does not exist or was rotated out
+int32_t can_trace_read(uint32_t seq, uint32_t offset, uint8_t *buf, size_t len)
+{
+	char path[48];
+	int32_t ret = -1;
+
+	if(trace_lock == NULL)
+	{
+		return -1;
+	}
+
+	// The file is opened per call, a download never holds a segment open
+	// while the write task evicts it
+	xSemaphoreTake(trace_lock, portMAX_DELAY);
+	if((int32_t)(seq - trace_head) >= 0 && (int32_t)(seq - trace_tail) <= 0)
+	{
+		can_trace_path(path, sizeof(path), seq);
+		FILE *f = fopen(path, "rb");
+
+		if(f != NULL)
+		{
+			ret = 0;
+			if(fseek(f, offset, SEEK_SET) == 0)
+			{
+				ret = (int32_t)fread(buf, 1, len, f);
+			}
+			fclose(f);
+		}
+	}
+	xSemaphoreGive(trace_lock);
+
+	return ret;
+}
+
+// As many segments as fit in the free space and the recorded bytes, less the
+// reserve for the other files
+static uint32_t can_trace_retention(uint64_t recorded)
+{
+	uint64_t total, free_bytes;
+
+	if(filesystem_get_info(&total, &free_bytes) != ESP_OK)
+	{
+		ESP_LOGW(TAG, "Filesystem size unknown, keeping %u segments", CAN_TRACE_SEGMENTS_MIN);
+		return CAN_TRACE_SEGMENTS_MIN;
+	}
+
+	uint64_t budget = free_bytes + recorded;
+	uint64_t segments = (budget > CAN_TRACE_FS_RESERVE) ? (budget - CAN_TRACE_FS_RESERVE) / CAN_TRACE_SEGMENT_BYTES : 0;
+
+	if(segments < CAN_TRACE_SEGMENTS_MIN)
+	{
+		segments = CAN_TRACE_SEGMENTS_MIN;
+	}
+	else if(segments > CAN_TRACE_SEGMENTS_MAX)
+	{
+		segments = CAN_TRACE_SEGMENTS_MAX;
+	}
+	return (uint32_t)segments;
+}
+
+// Picks up the segments left by a previous run, recording continues in a new one
+bool can_trace_init(void)
+{
+	struct stat st;
+
+	if(trace_lock != NULL)
+	{
+		return true;
+	}
+
+	if(stat(CAN_TRACE_DIR, &st) != 0 && mkdir(CAN_TRACE_DIR, 0775) != 0)
+	{
+		ESP_LOGE(TAG, "Failed to create %s", CAN_TRACE_DIR);
+		return false;
+	}
+
+	DIR *dir = opendir(CAN_TRACE_DIR);
+	bool found = false;
+	uint32_t first = 0;
+	uint32_t last = 0;
+	uint64_t recorded = 0;
+
+	if(dir != NULL)
+	{
+		struct dirent *entry;
+		char path[48];
+
+		while((entry = readdir(dir)) != NULL)
+		{
+			char *end = NULL;
+			uint32_t seq = strtoul(entry->d_name, &end, 16);
+
+			if(end == NULL || strcmp(end, ".trc") != 0)
+			{
+				continue;
+			}
+			can_trace_path(path, sizeof(path), seq);
+			if(stat(path, &st) == 0)
+			{
+				recorded += st.st_size;
+			}
+			if(!found || (int32_t)(seq - first) < 0)
+			{
+				first = seq;
+			}
+			if(!found || (int32_t)(seq - last) > 0)
+			{
+				last = seq;
+			}
+			found = true;
+		}
+		closedir(dir);
+	}
+	trace_head = first;
+	trace_tail = found ? last + 1 : 0;
+	trace_segments_max = can_trace_retention(recorded);
+
+	trace_free_queue = xQueueCreate(CAN_TRACE_BLOCKS, sizeof(uint8_t*));
+	trace_write_queue = xQueueCreate(CAN_TRACE_BLOCKS, sizeof(uint8_t*));
+	if(trace_free_queue == NULL || trace_write_queue == NULL)
+	{
+		ESP_LOGE(TAG, "Failed to create trace queues");
+		return false;
+	}
+
+	for(uint8_t i = 0; i < CAN_TRACE_BLOCKS; i++)
+	{
+		uint8_t *block = (uint8_t*)malloc(CAN_TRACE_BLOCK_SIZE);
+
+		if(block == NULL)
+		{
+			ESP_LOGE(TAG, "Failed to allocate trace blocks");
+			return false;
+		}
+		xQueueSend(trace_free_queue, &block, 0);
+	}
+
+	if(!can_ring_reader_init(&trace_reader))
+	{
+		return false;
+	}
+
+	trace_lock = xSemaphoreCreateMutex();
+	xTaskCreate(can_trace_task, "can_trace_task", 1024*3, NULL, 5, NULL);
+	xTaskCreate(can_trace_write_task, "can_trace_wr_task", 1024*4, NULL, 4, NULL);
+	ESP_LOGI(TAG, "CAN trace recording, %lu segments kept, up to %lu (%lu KB)", trace_tail - trace_head,
+			trace_segments_max, trace_segments_max * (CAN_TRACE_SEGMENT_BYTES / 1024));
+	return true;
+}
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CAN_TRACE_H__
+#define __CAN_TRACE_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CAN_TRACE_BLOCK_SIZE		4096		// one flash sector, segments are a whole number of blocks
+#define CAN_TRACE_SEGMENT_BLOCKS	8
+#define CAN_TRACE_SEGMENTS_MAX		256			// upper bound, the kept count is sized from free space
+
+typedef struct
+{
+	uint32_t frames;				// frames written to flash
+	uint32_t lost;					// frames overwritten in the ring before the recorder got to them
+	uint32_t blocks;
+	uint32_t write_errors;
+	uint32_t write_max_ms;			// slowest block write
+	uint32_t segments;
+	uint32_t segments_max;			// kept before the oldest is deleted
+}can_trace_stats_t;
+
+typedef struct
+{
+	uint32_t seq;
+	uint32_t size;
+	int64_t first_timestamp;		// of the first block, -1 when unreadable
+	bool active;					// being written
+}can_trace_segment_t;
+
+bool can_trace_init(void);
+void can_trace_get_stats(can_trace_stats_t *stats);
+int32_t can_trace_list(can_trace_segment_t *segments, uint32_t max);
+int32_t can_trace_read(uint32_t seq, uint32_t offset, uint8_t *buf, size_t len);
+#endif
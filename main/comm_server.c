@@ -30,11 +30,13 @@
 #include "nvs_flash.h"
 #include "esp_netif.h"
 #include "driver/gpio.h"
+#include "esp_timer.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 #include "types.h"
+#include "dev_buffer.h"
 #include "comm_server.h"
 
 #define TAG 		__func__
@@ -43,6 +45,8 @@
 #define KEEPALIVE_INTERVAL          5
 #define KEEPALIVE_COUNT             3
 
+#define TCP_TX_BATCH_SIZE		1460	// one TCP segment on ethernet MTU
+
 #define PORT_CLOSED_BIT			BIT0
 #define PORT_OPEN_BIT			BIT1
 
@@ -54,6 +58,7 @@ static EventGroupHandle_t xSocketEventGroup;
 static QueueHandle_t *xTX_Queue, *xRX_Queue;
 static SemaphoreHandle_t xTCP_Socket_Semaphore;
 static uint8_t conn_led = 0;
+static int64_t tx_latency_us = 0;
 
 uint8_t udp_enable = 0;
 
@@ -155,7 +160,7 @@ wait_skt_rx:
 static void udp_server_tx_task(void *pvParameters)
 {
 //	int addr_family = (int)pvParameters;
-	static xdev_buffer tx_buffer;
+	dev_buffer_t *tx_buffer;
 	struct sockaddr_in Recv_addr;
 
 	Recv_addr.sin_family       = AF_INET;
@@ -173,30 +178,71 @@ wait_skt_tx:
 	ESP_LOGI(TAG, "Socket connected...");
 	while(1)
 	{
-		xQueueReceive(*xTX_Queue, ( void * ) &tx_buffer, portMAX_DELAY);
+		dev_buffer_receive(*xTX_Queue, &tx_buffer, portMAX_DELAY);
 //		ESP_LOGI(TAG, "Sending %d bytes: %s", tx_buffer.usLen, tx_buffer.ucElement);
         if( xSemaphoreTake( xTCP_Socket_Semaphore, portMAX_DELAY ) == pdTRUE )
         {
-			int err = sendto(listen_sock, tx_buffer.ucElement, tx_buffer.usLen, 0, (struct sockaddr *)&Recv_addr, sizeof(Recv_addr));
-			if (err < 0)
+        	// One datagram per segment
+        	for(dev_buffer_t *seg = tx_buffer; seg != NULL; seg = seg->next)
+        	{
+				int err = sendto(listen_sock, seg->data, seg->len, 0, (struct sockaddr *)&Recv_addr, sizeof(Recv_addr));
+				if (err < 0)
+				{
+					ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+					xEventGroupSetBits( xSocketEventGroup, PORT_CLOSED_BIT );
+					xEventGroupClearBits( xSocketEventGroup, PORT_OPEN_BIT );
+					xSemaphoreGive( xTCP_Socket_Semaphore );
+					dev_buffer_free(tx_buffer);
+					goto wait_skt_tx;
+				}
+        	}
+        }
+        xSemaphoreGive( xTCP_Socket_Semaphore );
+        dev_buffer_free(tx_buffer);
+	}
+}
+
+// Sends the whole batch, returns false if the connection is gone
+static bool tcp_server_flush(uint8_t *buf, uint16_t len)
+{
+	int to_write = len;
+	bool ok = true;
+
+	if( xSemaphoreTake( xTCP_Socket_Semaphore, portMAX_DELAY ) == pdTRUE )
+	{
+		while (to_write > 0)
+		{
+			int written = send(sock, buf + (len - to_write), to_write, 0);
+			if (written < 0)
 			{
 				ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
 				xEventGroupSetBits( xSocketEventGroup, PORT_CLOSED_BIT );
 				xEventGroupClearBits( xSocketEventGroup, PORT_OPEN_BIT );
-				xSemaphoreGive( xTCP_Socket_Semaphore );
-				goto wait_skt_tx;
+				ok = false;
+				break;
 			}
-        }
-        xSemaphoreGive( xTCP_Socket_Semaphore );
+			to_write -= written;
+		}
 	}
+	xSemaphoreGive( xTCP_Socket_Semaphore );
+
+	return ok;
 }
 
+// Queued buffers are appended to one segment sized batch, it is sent when
+// full or tx_latency_us after its first byte was queued
 static void tcp_server_tx_task(void *pvParameters)
 {
 //	int addr_family = (int)pvParameters;
-	static xdev_buffer tx_buffer;
+	dev_buffer_t *tx_buffer;
+	static uint8_t tx_batch[TCP_TX_BATCH_SIZE];
+	uint16_t batch_len;
+	int64_t deadline = 0;
 
 wait_skt_tx:
+	batch_len = 0;
+	// Whatever was queued for the last client would only hold its segments
+	dev_buffer_flush(*xTX_Queue);
 	xEventGroupWaitBits(
 					  xSocketEventGroup,   /* The event group being tested. */
 					  PORT_OPEN_BIT, /* The bits within the event group to wait for. */
@@ -206,31 +252,59 @@ wait_skt_tx:
 	ESP_LOGI(TAG, "Socket connected...");
 	while(1)
 	{
-		xQueuePeek(*xTX_Queue, ( void * ) &tx_buffer, portMAX_DELAY);
+		TickType_t wait = portMAX_DELAY;
 
-		while(xQueuePeek(*xTX_Queue, ( void * ) &tx_buffer, 0) == pdTRUE)
+		if(batch_len != 0)
 		{
-			if( xSemaphoreTake( xTCP_Socket_Semaphore, portMAX_DELAY ) == pdTRUE )
+			int64_t left = deadline - esp_timer_get_time();
+			wait = (left > 0) ? pdMS_TO_TICKS((left + 999) / 1000) : 0;
+		}
+
+		if(!dev_buffer_receive(*xTX_Queue, &tx_buffer, wait))
+		{
+			if(!tcp_server_flush(tx_batch, batch_len))
 			{
-				int to_write = tx_buffer.usLen;
-				xQueueReceive(*xTX_Queue, ( void * ) &tx_buffer, 0);
-				while (to_write > 0)
+				goto wait_skt_tx;
+			}
+			batch_len = 0;
+			continue;
+		}
+
+		if(batch_len == 0)
+		{
+			deadline = esp_timer_get_time() + tx_latency_us;
+		}
+
+		uint32_t offset = 0;
+		while(offset < tx_buffer->total_len)
+		{
+			uint32_t copied = dev_buffer_copy(tx_buffer, offset, &tx_batch[batch_len], sizeof(tx_batch) - batch_len);
+			offset += copied;
+			batch_len += copied;
+
+			if(batch_len == sizeof(tx_batch))
+			{
+				if(!tcp_server_flush(tx_batch, batch_len))
 				{
-					int written = send(sock, tx_buffer.ucElement + (tx_buffer.usLen - to_write), to_write, 0);
-					if (written < 0)
-					{
-						ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-						xEventGroupSetBits( xSocketEventGroup, PORT_CLOSED_BIT );
-						xEventGroupClearBits( xSocketEventGroup, PORT_OPEN_BIT );
-						xSemaphoreGive( xTCP_Socket_Semaphore );
-						goto wait_skt_tx;
-					}
-					to_write -= written;
+					dev_buffer_free(tx_buffer);
+					goto wait_skt_tx;
 				}
+				batch_len = 0;
+				deadline = esp_timer_get_time() + tx_latency_us;
 			}
-			xSemaphoreGive( xTCP_Socket_Semaphore );
 		}
-		vTaskDelay(pdMS_TO_TICKS(1));
+		dev_buffer_free(tx_buffer);
+
+		// A steady stream keeps the queue from timing out, the latency
+		// bound is checked after every append as well
+		if(batch_len != 0 && esp_timer_get_time() >= deadline)
+		{
+			if(!tcp_server_flush(tx_batch, batch_len))
+			{
+				goto wait_skt_tx;
+			}
+			batch_len = 0;
+		}
 	}
 }
 
@@ -320,6 +394,13 @@ accept_socket:
 			setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
 			setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
 			setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+			// The TX task already batches streamed frames into full segments,
+			// Nagle would only hold back the tail of each batch
+			if(tx_latency_us > 0)
+			{
+				int no_delay = 1;
+				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(int));
+			}
 			// Convert ip address to string
 			if (source_addr.ss_family == PF_INET)
 			{
@@ -446,6 +527,13 @@ int8_t tcp_server_init(uint32_t port, QueueHandle_t *xTXp_Queue, QueueHandle_t *
 	}
 	return 0;
 }
+// Longest time a queued buffer may wait for more data before it is sent,
+// 0 sends as soon as the queue is empty
+void tcp_server_set_tx_latency(uint32_t latency_ms)
+{
+	tx_latency_us = (int64_t)latency_ms * 1000;
+}
+
 void tcp_server_suspend(void)
 {
 	vTaskSuspend(xserver_handle);
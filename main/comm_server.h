@@ -23,6 +23,7 @@
 #define __COMM_SERVER_H__
 int8_t tcp_server_init(uint32_t port, QueueHandle_t *xTXp_Queue, QueueHandle_t *xRXp_Queue, uint8_t connected_led, uint8_t udp_en);
 int8_t tcp_port_open(void);
+void tcp_server_set_tx_latency(uint32_t latency_ms);
 
 void tcp_server_suspend(void);
 void tcp_server_resume(void);
@@ -64,6 +64,7 @@
 #include "esp_http_server.h"
 #include "comm_server.h"
 #include "types.h"
+#include "dev_buffer.h"
 #include "driver/gpio.h"
 #include "wifi_network.h"
 #include "esp_vfs.h"
@@ -75,6 +76,7 @@
 #include "wc_mdns.h"
 #include "hw_config.h"
 #include "ha_webhooks.h"
+#include "can_trace.h"
 
 #define WIFI_CONNECTED_BIT			BIT0
 #define WS_CONNECTED_BIT			BIT1
@@ -855,6 +857,36 @@ char *config_server_get_status_json(bool remove_sensitive_info)
 	cJSON_AddStringToObject(root, "ble_status", device_config.ble_status);
 	cJSON_AddStringToObject(root, "can_datarate", can_datarate_str[can_get_bitrate()]);
 	cJSON_AddStringToObject(root, "can_mode", device_config.can_mode);
+	can_rx_stats_t rx_stats;
+	can_get_rx_stats(&rx_stats);
+	cJSON *can_rx = cJSON_AddObjectToObject(root, "can_rx");
+	cJSON_AddNumberToObject(can_rx, "wakeups", rx_stats.wakeups);
+	cJSON_AddNumberToObject(can_rx, "frames", rx_stats.frames);
+	cJSON_AddNumberToObject(can_rx, "frames_per_wakeup", rx_stats.wakeups ? (double)rx_stats.frames / rx_stats.wakeups : 0);
+	cJSON_AddNumberToObject(can_rx, "max_batch", rx_stats.max_batch);
+	cJSON_AddNumberToObject(can_rx, "max_queue_depth", rx_stats.max_queue_depth);
+	cJSON *tx_pool = cJSON_AddObjectToObject(root, "tx_pool");
+	cJSON_AddNumberToObject(tx_pool, "segments", DEV_SEGMENT_POOL_SIZE);
+	cJSON_AddNumberToObject(tx_pool, "free", dev_buffer_free_segments());
+	cJSON_AddNumberToObject(tx_pool, "min_free", dev_buffer_min_free_segments());
+	cJSON_AddNumberToObject(tx_pool, "dropped", dev_buffer_dropped());
+	const block_pool_t *rsp_pool = autopid_get_response_pool();
+	cJSON *response_pool = cJSON_AddObjectToObject(root, "response_pool");
+	cJSON_AddNumberToObject(response_pool, "blocks", rsp_pool->count);
+	cJSON_AddNumberToObject(response_pool, "used", rsp_pool->used);
+	cJSON_AddNumberToObject(response_pool, "high_water", rsp_pool->high_water);
+	cJSON_AddNumberToObject(response_pool, "failures", rsp_pool->failures);
+	if(config_server_can_trace_config() == 1)
+	{
+		can_trace_stats_t trace_stats;
+		can_trace_get_stats(&trace_stats);
+		cJSON *can_trace = cJSON_AddObjectToObject(root, "can_trace");
+		cJSON_AddNumberToObject(can_trace, "frames", trace_stats.frames);
+		cJSON_AddNumberToObject(can_trace, "lost", trace_stats.lost);
+		cJSON_AddNumberToObject(can_trace, "write_errors", trace_stats.write_errors);
+		cJSON_AddNumberToObject(can_trace, "write_max_ms", trace_stats.write_max_ms);
+		cJSON_AddNumberToObject(can_trace, "segments", trace_stats.segments);
+	}
 	cJSON_AddStringToObject(root, "port_type", device_config.port_type);
 	cJSON_AddStringToObject(root, "port", device_config.port);
 	cJSON_AddStringToObject(root, "fw_version", fver);
@@ -1402,6 +1434,23 @@ esp_err_t autopid_data_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+static esp_err_t autopid_status_handler(httpd_req_t *req)
+{
+    char *data = autopid_get_status();
+
+    if (data == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to generate JSON response");
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to generate JSON");
+        return ESP_OK;
+    }
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, data, strlen(data));
+    free(data);
+    return ESP_OK;
+}
+
 static esp_err_t scan_available_pids_handler(httpd_req_t *req)
 {
     char protocol[8];
@@ -1439,6 +1488,115 @@ static esp_err_t scan_available_pids_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+// CAN trace segments, oldest first, download them with /trace_file?seg=<seq>
+static esp_err_t trace_list_handler(httpd_req_t *req)
+{
+    can_trace_stats_t stats;
+    char name[16];
+
+    // One more than kept, the segment being written
+    can_trace_get_stats(&stats);
+    can_trace_segment_t *segments = malloc((stats.segments_max + 1) * sizeof(can_trace_segment_t));
+    if(segments == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    int32_t count = can_trace_list(segments, stats.segments_max + 1);
+
+    httpd_resp_set_type(req, "application/json");
+    if(count < 0)
+    {
+        const char *resp_str = "{\"text\":\"Enable CAN trace and reboot to record\"}";
+        free(segments);
+        httpd_resp_send(req, resp_str, strlen(resp_str));
+        return ESP_OK;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "block_size", CAN_TRACE_BLOCK_SIZE);
+    cJSON_AddNumberToObject(root, "frames", stats.frames);
+    cJSON_AddNumberToObject(root, "lost", stats.lost);
+    cJSON_AddNumberToObject(root, "write_max_ms", stats.write_max_ms);
+    cJSON_AddNumberToObject(root, "segments_max", stats.segments_max);
+    cJSON *list = cJSON_AddArrayToObject(root, "segments");
+    for(int32_t i = 0; i < count; i++)
+    {
+        cJSON *segment = cJSON_CreateObject();
+        snprintf(name, sizeof(name), "%08lx.trc", segments[i].seq);
+        cJSON_AddNumberToObject(segment, "seq", segments[i].seq);
+        cJSON_AddStringToObject(segment, "name", name);
+        cJSON_AddNumberToObject(segment, "size", segments[i].size);
+        cJSON_AddNumberToObject(segment, "first_ts", segments[i].first_timestamp);
+        cJSON_AddBoolToObject(segment, "active", segments[i].active);
+        cJSON_AddItemToArray(list, segment);
+    }
+    free(segments);
+
+    char *resp_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if(resp_str == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    httpd_resp_send(req, resp_str, strlen(resp_str));
+    free(resp_str);
+    return ESP_OK;
+}
+
+static esp_err_t trace_file_handler(httpd_req_t *req)
+{
+    char param[32];
+    char value[12];
+    char disposition[48];
+    uint32_t offset = 0;
+    int32_t len;
+
+    if(httpd_req_get_url_query_str(req, param, sizeof(param)) != ESP_OK ||
+        httpd_query_key_value(param, "seg", value, sizeof(value)) != ESP_OK)
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing seg");
+        return ESP_OK;
+    }
+
+    uint32_t seq = strtoul(value, NULL, 10);
+    uint8_t *buf = malloc(CAN_TRACE_BLOCK_SIZE);
+    if(buf == NULL)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    len = can_trace_read(seq, offset, buf, CAN_TRACE_BLOCK_SIZE);
+    if(len < 0)
+    {
+        free(buf);
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Segment not found");
+        return ESP_OK;
+    }
+
+    snprintf(disposition, sizeof(disposition), "attachment; filename=\"%08lx.trc\"", seq);
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", disposition);
+
+    // One block per chunk, the segment may still be growing or get rotated out
+    while(len > 0)
+    {
+        if(httpd_resp_send_chunk(req, (const char*)buf, len) != ESP_OK)
+        {
+            free(buf);
+            return ESP_FAIL;
+        }
+        offset += len;
+        len = can_trace_read(seq, offset, buf, CAN_TRACE_BLOCK_SIZE);
+    }
+
+    free(buf);
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
 static const httpd_uri_t index_uri = {
     .uri       = "/",
     .method    = HTTP_GET,
@@ -1561,6 +1719,12 @@ static const httpd_uri_t autopid_data = {
     .handler   = autopid_data_handler,
     .user_ctx  = &server_data    // Pass server data as context
 };
+static const httpd_uri_t autopid_status = {
+    .uri       = "/autopid_status",
+    .method    = HTTP_GET,
+    .handler   = autopid_status_handler,
+    .user_ctx  = &server_data    // Pass server data as context
+};
 static const httpd_uri_t store_car_data_uri = {
     .uri       = "/store_car_data",
     .method    = HTTP_POST,
@@ -1573,6 +1737,18 @@ static const httpd_uri_t scan_available_pids_uri = {
     .handler   = scan_available_pids_handler,
     .user_ctx  = NULL
 };
+static const httpd_uri_t trace_list_uri = {
+    .uri       = "/trace_list",
+    .method    = HTTP_GET,
+    .handler   = trace_list_handler,
+    .user_ctx  = NULL
+};
+static const httpd_uri_t trace_file_uri = {
+    .uri       = "/trace_file",
+    .method    = HTTP_GET,
+    .handler   = trace_file_handler,
+    .user_ctx  = NULL
+};
 static void config_server_load_cfg(char *cfg)
 {
 	cJSON * root, *key = 0;
@@ -1962,6 +2138,51 @@ static void config_server_load_cfg(char *cfg)
 	ESP_LOGE(TAG, "device_config.mqtt_rx_topic: %s", device_config.mqtt_rx_topic);
 	//*****
 
+	//*****
+	// "json", "binary" or "cbor", older configs don't have it
+	key = cJSON_GetObjectItem(root,"mqtt_rx_format");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_rx_format)))
+	{
+		strcpy(device_config.mqtt_rx_format, "json");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_rx_format, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_rx_format: %s", device_config.mqtt_rx_format);
+	//*****
+
+	//*****
+	// Store-and-forward of MQTT messages while the broker is unreachable
+	key = cJSON_GetObjectItem(root,"mqtt_outbox");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.mqtt_outbox)))
+	{
+		strcpy(device_config.mqtt_outbox, "disable");
+	}
+	else
+	{
+		strcpy(device_config.mqtt_outbox, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.mqtt_outbox: %s", device_config.mqtt_outbox);
+	//*****
+
+	//*****
+	// Raw bus log to flash, see can_trace.c
+	key = cJSON_GetObjectItem(root,"can_trace");
+	if(key == 0 || !cJSON_IsString(key) || (strlen(key->valuestring) >= sizeof(device_config.can_trace)))
+	{
+		strcpy(device_config.can_trace, "disable");
+	}
+	else
+	{
+		strcpy(device_config.can_trace, key->valuestring);
+	}
+
+	ESP_LOGE(TAG, "device_config.can_trace: %s", device_config.can_trace);
+	//*****
+
 	//*****
 	key = cJSON_GetObjectItem(root,"mqtt_status_topic");
 	if(key == 0 || (strlen(key->valuestring) > sizeof(device_config.mqtt_status_topic)) || strlen(key->valuestring) == 0)
@@ -2269,9 +2490,12 @@ static httpd_handle_t config_server_init(void)
 		httpd_register_uri_handler(server, &load_pid_auto_conf_uri);
 		httpd_register_uri_handler(server, &upload_car_data);
 		httpd_register_uri_handler(server, &autopid_data);
+		httpd_register_uri_handler(server, &autopid_status);
 		httpd_register_uri_handler(server, &load_car_config_uri);
 		httpd_register_uri_handler(server, &store_car_data_uri);
 		httpd_register_uri_handler(server, &scan_available_pids_uri);
+		httpd_register_uri_handler(server, &trace_list_uri);
+		httpd_register_uri_handler(server, &trace_file_uri);
 		ha_webhooks_register_handlers(server);
         #if CONFIG_EXAMPLE_BASIC_AUTH
         httpd_register_basic_auth(server);
@@ -2308,9 +2532,12 @@ void config_server_restart(void)
 		httpd_register_uri_handler(server, &load_pid_auto_conf_uri);
 		httpd_register_uri_handler(server, &upload_car_data);
 		httpd_register_uri_handler(server, &autopid_data);
+		httpd_register_uri_handler(server, &autopid_status);
 		httpd_register_uri_handler(server, &load_car_config_uri);
 		httpd_register_uri_handler(server, &store_car_data_uri);
 		httpd_register_uri_handler(server, &scan_available_pids_uri);
+		httpd_register_uri_handler(server, &trace_list_uri);
+		httpd_register_uri_handler(server, &trace_file_uri);
 		ha_webhooks_register_handlers(server);
         return;
     }
@@ -2328,28 +2555,41 @@ void config_server_stop(void)
 }
 static void websocket_task(void *pvParameters)
 {
-	static xdev_buffer ucTX_Buffer;
+	dev_buffer_t *ucTX_Buffer;
 	httpd_ws_frame_t ws_pkt;  
 	ESP_LOGI(TAG, "websocket_task started");
 	while(1)
 	{
-		xQueueReceive(*xTX_Queue, &ucTX_Buffer, portMAX_DELAY);
+		dev_buffer_receive(*xTX_Queue, &ucTX_Buffer, portMAX_DELAY);
 
-		memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-		ws_pkt.payload = (uint8_t*)ucTX_Buffer.ucElement;
-		ws_pkt.len = ucTX_Buffer.usLen;
-		ws_pkt.type = HTTPD_WS_TYPE_TEXT;
-
-	    esp_err_t ret = httpd_ws_send_frame_async(rsp_arg.hd, rsp_arg.fd, &ws_pkt);
-	    if (ret != ESP_OK)
-	    {
-//	    	tcp_server_resume();
-	    	gpio_set_level(ws_led, 1);
-	    	xEventGroupClearBits( xServerEventGroup, WS_CONNECTED_BIT );
-//	    	vTaskSuspend( NULL );
+		// Messages longer than one segment go out as a fragmented frame
+		for(dev_buffer_t *seg = ucTX_Buffer; seg != NULL; seg = seg->next)
+		{
+			memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+			ws_pkt.payload = seg->data;
+			ws_pkt.len = seg->len;
+			ws_pkt.type = (seg == ucTX_Buffer) ? HTTPD_WS_TYPE_TEXT : HTTPD_WS_TYPE_CONTINUE;
+			ws_pkt.fragmented = (ucTX_Buffer->next != NULL);
+			ws_pkt.final = (seg->next == NULL);
+
+			esp_err_t ret = httpd_ws_send_frame_async(rsp_arg.hd, rsp_arg.fd, &ws_pkt);
+			if (ret != ESP_OK)
+			{
+//				tcp_server_resume();
+				gpio_set_level(ws_led, 1);
+				xEventGroupClearBits( xServerEventGroup, WS_CONNECTED_BIT );
+//				vTaskSuspend( NULL );
+
+				ESP_LOGE(TAG, "httpd_ws_send_frame_async failed  %d", ret);
+				break;
+			}
+		}
+		dev_buffer_free(ucTX_Buffer);
 
-	        ESP_LOGE(TAG, "httpd_ws_send_frame_async failed  %d", ret);
-	    }
+		if(!(xEventGroupGetBits(xServerEventGroup) & WS_CONNECTED_BIT))
+		{
+			dev_buffer_flush(*xTX_Queue);
+		}
 	}
 
 }
@@ -2630,6 +2870,32 @@ int8_t config_server_mqtt_rx_en_config(void)
 	return -1;
 }
 
+int8_t config_server_mqtt_outbox_config(void)
+{
+	if(strcmp(device_config.mqtt_outbox, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.mqtt_outbox, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
+int8_t config_server_can_trace_config(void)
+{
+	if(strcmp(device_config.can_trace, "enable") == 0)
+	{
+		return 1;
+	}
+	else if(strcmp(device_config.can_trace, "disable") == 0)
+	{
+		return 0;
+	}
+	return -1;
+}
+
 int8_t config_server_mqtt_elm327_log(void)
 {
 	if(strcmp(device_config.mqtt_elm327_log, "enable") == 0)
@@ -2678,6 +2944,11 @@ char *config_server_get_mqtt_rx_topic(void)
 	return device_config.mqtt_rx_topic;
 }
 
+char *config_server_get_mqtt_rx_format(void)
+{
+	return device_config.mqtt_rx_format;
+}
+
 char *config_server_get_mqtt_status_topic(void)
 {
 	return device_config.mqtt_status_topic;
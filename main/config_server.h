@@ -104,7 +104,10 @@ typedef struct _device_config
 	char mqtt_elm327_log[10];
 	char mqtt_tx_topic[64];
 	char mqtt_rx_topic[64];
+	char mqtt_rx_format[10];
+	char mqtt_outbox[10];
 	char mqtt_status_topic[64];
+	char can_trace[10];
 }device_config_t;
 
 
@@ -154,9 +157,12 @@ char *config_server_get_mqtt_canflt(void);
 int8_t config_server_mqtt_elm327_log(void);
 char *config_server_get_mqtt_tx_topic(void);
 char *config_server_get_mqtt_rx_topic(void);
+char *config_server_get_mqtt_rx_format(void);
 char *config_server_get_mqtt_status_topic(void);
 int8_t config_server_mqtt_tx_en_config(void);
 int8_t config_server_mqtt_rx_en_config(void);
+int8_t config_server_mqtt_outbox_config(void);
+int8_t config_server_can_trace_config(void);
 int8_t config_server_get_wakeup_volt(float *wakeup_volt);
 int8_t config_server_get_sleep_time(uint32_t *sleep_time);
 int8_t config_server_get_wakeup_time(uint32_t *wakeup_time);
@@ -0,0 +1,363 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include <string.h>
+#include "dev_buffer.h"
+
+#define TAG 		__func__
+
+static dev_buffer_t dev_segments[DEV_SEGMENT_POOL_SIZE];
+static dev_buffer_t *dev_free_list = NULL;
+static uint32_t dev_free_count = 0;
+static uint32_t dev_min_free_count = 0;
+static portMUX_TYPE dev_buffer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+	QueueHandle_t q;
+	uint32_t quota;					// segments the queue may hold
+	uint32_t held;
+}dev_buffer_queue_t;
+
+static dev_buffer_queue_t dev_queues[DEV_BUFFER_QUEUES_MAX];
+static uint32_t dev_queue_count = 0;
+static uint32_t dev_quota_total = 0;
+static uint32_t dev_dropped = 0;
+
+void dev_buffer_init(void)
+{
+	taskENTER_CRITICAL(&dev_buffer_lock);
+	dev_free_list = NULL;
+	for(uint32_t i = 0; i < DEV_SEGMENT_POOL_SIZE; i++)
+	{
+		dev_segments[i].next = dev_free_list;
+		dev_free_list = &dev_segments[i];
+	}
+	dev_free_count = DEV_SEGMENT_POOL_SIZE;
+	dev_min_free_count = DEV_SEGMENT_POOL_SIZE;
+	dev_queue_count = 0;
+	dev_quota_total = 0;
+	dev_dropped = 0;
+	taskEXIT_CRITICAL(&dev_buffer_lock);
+}
+
+static uint32_t dev_buffer_segments(const dev_buffer_t *buf)
+{
+	uint32_t count = 0;
+
+	for(; buf != NULL; buf = buf->next)
+	{
+		count++;
+	}
+
+	return count;
+}
+
+// Called with dev_buffer_lock held
+static dev_buffer_queue_t *dev_buffer_queue_find(QueueHandle_t q)
+{
+	for(uint32_t i = 0; i < dev_queue_count; i++)
+	{
+		if(dev_queues[i].q == q)
+		{
+			return &dev_queues[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Takes count segments of the queue's quota, false if it is used up.
+// Queues not made with dev_buffer_queue_create() have no quota.
+static bool dev_buffer_quota_take(QueueHandle_t q, uint32_t count)
+{
+	bool ok = true;
+
+	taskENTER_CRITICAL(&dev_buffer_lock);
+	dev_buffer_queue_t *dq = dev_buffer_queue_find(q);
+	if(dq != NULL)
+	{
+		if(dq->held + count > dq->quota)
+		{
+			ok = false;
+		}
+		else
+		{
+			dq->held += count;
+		}
+	}
+	taskEXIT_CRITICAL(&dev_buffer_lock);
+
+	return ok;
+}
+
+static void dev_buffer_quota_give(QueueHandle_t q, uint32_t count)
+{
+	taskENTER_CRITICAL(&dev_buffer_lock);
+	dev_buffer_queue_t *dq = dev_buffer_queue_find(q);
+	if(dq != NULL)
+	{
+		dq->held -= count;
+	}
+	taskEXIT_CRITICAL(&dev_buffer_lock);
+}
+
+// Creates a TX queue of dev_buffer_t pointers holding at most quota
+// segments. The quotas of all queues together are kept below the pool size
+// minus DEV_SEGMENT_RESERVE, so a sink that stops reading can't starve the
+// others or the CAN rx task.
+QueueHandle_t dev_buffer_queue_create(uint32_t length, uint32_t quota)
+{
+	uint32_t left = DEV_SEGMENT_POOL_SIZE - DEV_SEGMENT_RESERVE - dev_quota_total;
+
+	if(dev_queue_count >= DEV_BUFFER_QUEUES_MAX)
+	{
+		ESP_LOGE(TAG, "too many queues");
+		return NULL;
+	}
+
+	if(quota > left)
+	{
+		ESP_LOGW(TAG, "quota %lu reduced to %lu", quota, left);
+		quota = left;
+	}
+
+	QueueHandle_t q = xQueueCreate(length, sizeof(dev_buffer_t*));
+	if(q == NULL)
+	{
+		return NULL;
+	}
+
+	taskENTER_CRITICAL(&dev_buffer_lock);
+	dev_queues[dev_queue_count].q = q;
+	dev_queues[dev_queue_count].quota = quota;
+	dev_queues[dev_queue_count].held = 0;
+	dev_queue_count++;
+	dev_quota_total += quota;
+	taskEXIT_CRITICAL(&dev_buffer_lock);
+
+	return q;
+}
+
+// Takes all the segments of a message at once, so two large messages can't
+// each hold half of the pool and wait for the other
+static dev_buffer_t *dev_buffer_take(uint32_t count)
+{
+	dev_buffer_t *head = NULL;
+
+	taskENTER_CRITICAL(&dev_buffer_lock);
+	if(dev_free_count >= count)
+	{
+		head = dev_free_list;
+		dev_buffer_t *last = head;
+		for(uint32_t i = 1; i < count; i++)
+		{
+			last = last->next;
+		}
+		dev_free_list = last->next;
+		last->next = NULL;
+		dev_free_count -= count;
+		if(dev_free_count < dev_min_free_count)
+		{
+			dev_min_free_count = dev_free_count;
+		}
+	}
+	taskEXIT_CRITICAL(&dev_buffer_lock);
+
+	return head;
+}
+
+// Returns a message holding a copy of data with one reference, data can be
+// NULL with len 0 to get one empty segment to fill in place and
+// dev_buffer_commit(). Returns NULL if the pool stays empty for ticks_to_wait.
+dev_buffer_t *dev_buffer_alloc(const uint8_t *data, uint32_t len, TickType_t ticks_to_wait)
+{
+	uint32_t count = (len == 0) ? 1 : (len + DEV_SEGMENT_SIZE - 1) / DEV_SEGMENT_SIZE;
+	TickType_t start = xTaskGetTickCount();
+	dev_buffer_t *head;
+
+	if(count > DEV_SEGMENT_POOL_SIZE)
+	{
+		ESP_LOGE(TAG, "message too large: %lu", len);
+		return NULL;
+	}
+
+	while((head = dev_buffer_take(count)) == NULL)
+	{
+		if(xTaskGetTickCount() - start >= ticks_to_wait)
+		{
+			return NULL;
+		}
+		vTaskDelay(pdMS_TO_TICKS(1));
+	}
+
+	head->ref = 1;
+	head->total_len = len;
+	for(dev_buffer_t *seg = head; seg != NULL; seg = seg->next)
+	{
+		seg->len = (len > DEV_SEGMENT_SIZE) ? DEV_SEGMENT_SIZE : len;
+		if(data != NULL)
+		{
+			memcpy(seg->data, data, seg->len);
+			data += seg->len;
+		}
+		len -= seg->len;
+	}
+
+	return head;
+}
+
+// Adds len bytes written in place after the current end of a single segment
+void dev_buffer_commit(dev_buffer_t *buf, uint16_t len)
+{
+	buf->len += len;
+	buf->total_len += len;
+}
+
+// Drops one reference, the segments go back to the pool with the last one
+void dev_buffer_free(dev_buffer_t *buf)
+{
+	if(buf == NULL)
+	{
+		return;
+	}
+
+	if(__atomic_sub_fetch(&buf->ref, 1, __ATOMIC_ACQ_REL) != 0)
+	{
+		return;
+	}
+
+	uint32_t count = 1;
+	dev_buffer_t *last = buf;
+	while(last->next != NULL)
+	{
+		last = last->next;
+		count++;
+	}
+
+	taskENTER_CRITICAL(&dev_buffer_lock);
+	last->next = dev_free_list;
+	dev_free_list = buf;
+	dev_free_count += count;
+	taskEXIT_CRITICAL(&dev_buffer_lock);
+}
+
+// Queues a pointer to buf, the queue gets its own reference. The caller
+// still owns its reference and frees it when done sending. Waits up to
+// ticks_to_wait for room in the queue and in its quota, the message is
+// dropped for this queue only if there is none.
+bool dev_buffer_send(QueueHandle_t q, dev_buffer_t *buf, TickType_t ticks_to_wait)
+{
+	uint32_t count = dev_buffer_segments(buf);
+	TickType_t start = xTaskGetTickCount();
+
+	while(!dev_buffer_quota_take(q, count))
+	{
+		if(xTaskGetTickCount() - start >= ticks_to_wait)
+		{
+			__atomic_add_fetch(&dev_dropped, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		vTaskDelay(pdMS_TO_TICKS(1));
+	}
+
+	TickType_t waited = xTaskGetTickCount() - start;
+	__atomic_add_fetch(&buf->ref, 1, __ATOMIC_RELAXED);
+	if(xQueueSend(q, &buf, (ticks_to_wait > waited) ? ticks_to_wait - waited : 0) != pdTRUE)
+	{
+		dev_buffer_quota_give(q, count);
+		dev_buffer_free(buf);
+		__atomic_add_fetch(&dev_dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	return true;
+}
+
+// Takes the next message off a TX queue, the caller gets the queue's
+// reference and frees it when done
+bool dev_buffer_receive(QueueHandle_t q, dev_buffer_t **buf, TickType_t ticks_to_wait)
+{
+	if(xQueueReceive(q, buf, ticks_to_wait) != pdTRUE)
+	{
+		return false;
+	}
+
+	dev_buffer_quota_give(q, dev_buffer_segments(*buf));
+
+	return true;
+}
+
+// Frees everything queued for a sink that went away
+void dev_buffer_flush(QueueHandle_t q)
+{
+	dev_buffer_t *buf;
+
+	while(dev_buffer_receive(q, &buf, 0))
+	{
+		dev_buffer_free(buf);
+	}
+}
+
+// Copies up to len bytes of the message starting at offset, returns the
+// number of bytes copied
+uint32_t dev_buffer_copy(const dev_buffer_t *buf, uint32_t offset, uint8_t *dst, uint32_t len)
+{
+	uint32_t copied = 0;
+
+	for(const dev_buffer_t *seg = buf; seg != NULL && copied < len; seg = seg->next)
+	{
+		if(offset >= seg->len)
+		{
+			offset -= seg->len;
+			continue;
+		}
+
+		uint32_t n = seg->len - offset;
+		if(n > len - copied)
+		{
+			n = len - copied;
+		}
+		memcpy(dst + copied, seg->data + offset, n);
+		copied += n;
+		offset = 0;
+	}
+
+	return copied;
+}
+
+uint32_t dev_buffer_free_segments(void)
+{
+	return dev_free_count;
+}
+
+uint32_t dev_buffer_min_free_segments(void)
+{
+	return dev_min_free_count;
+}
+
+// Messages a TX queue turned away, queue full or quota used up
+uint32_t dev_buffer_dropped(void)
+{
+	return dev_dropped;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEV_BUFFER_H__
+#define __DEV_BUFFER_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define DEV_SEGMENT_SIZE			128
+#define DEV_SEGMENT_POOL_SIZE		48
+// Segments no TX queue quota can take, left for the messages being built
+// by the CAN rx task and send_to_host()
+#define DEV_SEGMENT_RESERVE			4
+#define DEV_BUFFER_QUEUES_MAX		4
+
+// Transport TX queues carry dev_buffer_t pointers. A message is a chain of
+// fixed size segments from a static pool, the head segment holds the
+// reference count and the total length. Every queue a message is sent to
+// holds a reference, the writer task calls dev_buffer_free() once sent.
+// Queues made with dev_buffer_queue_create() can hold at most their quota
+// of segments, a slow or stalled sink drops its own messages instead of
+// taking the pool from the others.
+typedef struct dev_buffer{
+	struct dev_buffer *next;		// next segment of the same message
+	uint32_t total_len;				// head only, sum of all segment lengths
+	uint16_t len;
+	uint8_t ref;					// head only
+	uint8_t data[DEV_SEGMENT_SIZE];
+}dev_buffer_t;
+
+void dev_buffer_init(void);
+dev_buffer_t *dev_buffer_alloc(const uint8_t *data, uint32_t len, TickType_t ticks_to_wait);
+void dev_buffer_commit(dev_buffer_t *buf, uint16_t len);
+void dev_buffer_free(dev_buffer_t *buf);
+QueueHandle_t dev_buffer_queue_create(uint32_t length, uint32_t quota);
+bool dev_buffer_send(QueueHandle_t q, dev_buffer_t *buf, TickType_t ticks_to_wait);
+bool dev_buffer_receive(QueueHandle_t q, dev_buffer_t **buf, TickType_t ticks_to_wait);
+void dev_buffer_flush(QueueHandle_t q);
+uint32_t dev_buffer_copy(const dev_buffer_t *buf, uint32_t offset, uint8_t *dst, uint32_t len);
+uint32_t dev_buffer_free_segments(void);
+uint32_t dev_buffer_min_free_segments(void);
+uint32_t dev_buffer_dropped(void);
+#endif
@@ -30,12 +30,15 @@
 #include "driver/gpio.h"
 #include "esp_log.h"
 #include <string.h>
+#include <stdlib.h>
 #include "driver/twai.h"
 #include "slcan.h"
 #include "can.h"
 #include "std_pid.h"
 #include "sleep_mode.h"
 #include "elm327.h"
+#include "isotp.h"
+#include "can_ring.h"
 
 #define TAG 		__func__
 
@@ -51,8 +54,17 @@ uint8_t service_09_rsp_len[] = {1, 1, 4, 1, 255, 1, 255, 1, 1, 1, 4, 1}; //255 u
 
 #define ELM327_READY_TO_RECEIVE_CAN			BIT0
 
+// Adaptive timing (AT1/AT2): the wait after the last response frame is
+// learned per (header, service) from the last ELM327_AT_SAMPLES requests
+#define ELM327_AT_KEYS						16
+#define ELM327_AT_SAMPLES					32
+#define ELM327_AT_MIN_SAMPLES				4
+#define ELM327_AT_PROBE_INTERVAL			32		// every n-th request waits the full timeout to re-learn
+#define ELM327_AT1_MIN_MARGIN_US			10000
+#define ELM327_AT2_MIN_MARGIN_US			4000
+
 static EventGroupHandle_t elm327_event_group = NULL;
-static QueueHandle_t *can_rx_queue = NULL;
+static can_ring_reader_t elm327_can_reader;
 
 const char *ok_str = "OK";
 const char *question_mark_str = "?";
@@ -73,6 +85,7 @@ typedef struct __xelm327_config
 	uint8_t fc_data[5];
 	uint8_t protocol;
 	uint8_t priority_bits;
+	uint8_t adaptive_timing;
 	uint8_t fc_data_length:3;
 	uint8_t fc_mode:2;
 	uint8_t linefeed:1;
@@ -89,6 +102,41 @@ typedef struct __xelm327_config
 
 static _xelm327_config_t elm327_config;
 static SemaphoreHandle_t elm327_mutex = NULL;
+static isotp_link_t elm327_isotp;
+// Reassembly buffers of the ISO-TP sessions, allocated the first time a
+// binary request asks for the reassembled data
+static uint8_t *elm327_isotp_buf[ISOTP_MAX_SESSIONS];
+
+typedef struct
+{
+	uint32_t header;
+	uint32_t samples[ELM327_AT_SAMPLES];	// us from request to the last response frame
+	uint32_t last_used;
+	uint8_t service;
+	uint8_t count;
+	uint8_t next;
+	uint8_t probe;
+}elm327_at_stats_t;
+
+static elm327_at_stats_t elm327_at_stats[ELM327_AT_KEYS];
+static uint32_t elm327_at_clock = 0;
+
+static void elm327_at_reset(void)
+{
+	memset(elm327_at_stats, 0, sizeof(elm327_at_stats));
+	elm327_at_clock = 0;
+}
+
+// Every protocol change goes through here, response times learned on the old
+// bus don't apply anymore
+static void elm327_use_protocol(char protocol)
+{
+	if(protocol != elm327_config.protocol)
+	{
+		elm327_config.protocol = protocol;
+		elm327_at_reset();
+	}
+}
 
 static void elm327_set_default_config(bool reset_protocol)
 {
@@ -104,10 +152,11 @@ static void elm327_set_default_config(bool reset_protocol)
 	// See reset_all for why this is optional
 	if (reset_protocol)
 	{
-		elm327_config.protocol = '6';
+		elm327_use_protocol('6');
 	}
 
 	elm327_config.req_timeout = 0x32; //50 ms
+	elm327_config.adaptive_timing = 1;
 
 	// Flow Control Settings
 	elm327_config.fc_mode = 0;
@@ -477,7 +526,7 @@ static char* elm327_set_protocol(const char* command_str)
 		return (char*)ok_str;
 	}
 
-	elm327_config.protocol = new_protocol;
+	elm327_use_protocol(new_protocol);
 	
 	ESP_LOGI(TAG, "elm327_config.protocol: %c", elm327_config.protocol);
 
@@ -528,6 +577,106 @@ static char* elm327_set_timeout(const char* command_str)
 	return (char*)ok_str;
 }
 
+static char* elm327_set_adaptive_timing(const char* command_str)
+{
+	if(command_str[2] < '0' || command_str[2] > '2')
+	{
+		return 0;
+	}
+
+	elm327_config.adaptive_timing = command_str[2] - '0';
+	ESP_LOGI(TAG, "elm327_config.adaptive_timing: %u", elm327_config.adaptive_timing);
+
+	return (char*)ok_str;
+}
+
+// Finds the statistics for (header, service), the least recently used
+// entry is recycled when the table is full
+static elm327_at_stats_t *elm327_at_find(uint32_t header, uint8_t service)
+{
+	elm327_at_stats_t *lru = &elm327_at_stats[0];
+
+	elm327_at_clock++;
+	for(int i = 0; i < ELM327_AT_KEYS; i++)
+	{
+		elm327_at_stats_t *stats = &elm327_at_stats[i];
+
+		if(stats->last_used != 0 && stats->header == header && stats->service == service)
+		{
+			stats->last_used = elm327_at_clock;
+			return stats;
+		}
+
+		if(stats->last_used < lru->last_used)
+		{
+			lru = stats;
+		}
+	}
+
+	memset(lru, 0, sizeof(elm327_at_stats_t));
+	lru->header = header;
+	lru->service = service;
+	lru->last_used = elm327_at_clock;
+
+	return lru;
+}
+
+/*
+ * Returns how long after the request the response is considered complete,
+ * or 0 to wait the full timeout after every frame. The window is the p99 of
+ * the recent response times plus a margin, with AT2 using a tighter margin.
+ * With at most ELM327_AT_SAMPLES samples the p99 is the window maximum.
+ */
+static int64_t elm327_at_window_us(elm327_at_stats_t *stats)
+{
+	uint32_t p99 = 0;
+	uint32_t margin;
+	int64_t timeout_us = elm327_config.req_timeout*4096;
+
+	if(elm327_config.adaptive_timing == 0 || stats->count < ELM327_AT_MIN_SAMPLES)
+	{
+		return 0;
+	}
+
+	if(++stats->probe >= ELM327_AT_PROBE_INTERVAL)
+	{
+		// Wait the full timeout now and then so slower responses are learned
+		stats->probe = 0;
+		return 0;
+	}
+
+	for(int i = 0; i < stats->count; i++)
+	{
+		if(stats->samples[i] > p99)
+		{
+			p99 = stats->samples[i];
+		}
+	}
+
+	if(elm327_config.adaptive_timing == 2)
+	{
+		margin = p99/4;
+		if(margin < ELM327_AT2_MIN_MARGIN_US) margin = ELM327_AT2_MIN_MARGIN_US;
+	}
+	else
+	{
+		margin = p99/2;
+		if(margin < ELM327_AT1_MIN_MARGIN_US) margin = ELM327_AT1_MIN_MARGIN_US;
+	}
+
+	return ((int64_t)p99 + margin < timeout_us) ? (int64_t)p99 + margin : 0;
+}
+
+static void elm327_at_record(elm327_at_stats_t *stats, uint32_t response_us)
+{
+	stats->samples[stats->next] = response_us;
+	stats->next = (stats->next + 1) % ELM327_AT_SAMPLES;
+	if(stats->count < ELM327_AT_SAMPLES)
+	{
+		stats->count++;
+	}
+}
+
 static char hex_to_num(char a)
 {
 	char x = a;
@@ -651,208 +800,226 @@ static uint8_t elm327_should_receive(twai_message_t *rx_frame)
 	}
 }
 
-static void elm327_send_flow_control_frame(twai_message_t *first_frame)
+/*
+ * Identifier of the flow control frame answering first_frame when the
+ * automatic flow control header is used (fc_mode 0 or 2).
+ */
+static uint32_t elm327_fc_identifier(twai_message_t *first_frame)
 {
-	twai_message_t txframe;
-	uint8_t source_ecu;
-
-	// Use the same size id as the first frame
-	txframe.extd = first_frame->extd;
-
 	if (first_frame->extd)
 	{
-		if (elm327_config.fc_mode == 0 || elm327_config.fc_mode == 2)
-		{
-			// Automatically compute the identifier from the first frame
-			//
-			// We find the source ECU and then construct an identifier with
-			// - the default priority bits (18)
-			// - a physical type (DA) as opposed to a functional type
-			// - the source_ecu as the destination
-			// - ourselves (F1) as the source
-			source_ecu = 0xFF & first_frame->identifier;
-			txframe.identifier = 0x18DA00F1 | (source_ecu << 8);
-		}
-		else
-		{
-			// fc_mode 1: use the configured header
-			txframe.identifier = elm327_config.fc_header;
-		}
+		// Automatically compute the identifier from the first frame
+		//
+		// We find the source ECU and then construct an identifier with
+		// - the default priority bits (18)
+		// - a physical type (DA) as opposed to a functional type
+		// - the source_ecu as the destination
+		// - ourselves (F1) as the source
+		uint8_t source_ecu = 0xFF & first_frame->identifier;
+		return 0x18DA00F1 | (source_ecu << 8);
 	}
 	else
 	{
-		if (elm327_config.fc_mode == 0 || elm327_config.fc_mode == 2)
-		{
-			// Automatically compute the identifier from the first frame
-			//
-			// We set the 4th bit to 0. Apparently when the first two nibbles are
-			// 7E, this 4th bit indicates wether a message is being sent to or
-			// received from an ECU identified by the last 3 bits.
-			// For example 0x7E8 becomes 0x7E0 and 0x7EF becomes 0x7E7
-			txframe.identifier = first_frame->identifier & 0xFF7;
-		}
-		else
+		// Automatically compute the identifier from the first frame
+		//
+		// We set the 4th bit to 0. Apparently when the first two nibbles are
+		// 7E, this 4th bit indicates wether a message is being sent to or
+		// received from an ECU identified by the last 3 bits.
+		// For example 0x7E8 becomes 0x7E0 and 0x7EF becomes 0x7E7
+		return first_frame->identifier & 0xFF7;
+	}
+}
+
+/*
+ * Identifier the ECU addressed by identifier answers with, or UINT32_MAX
+ * for functional requests where several ECUs may answer.
+ */
+static uint32_t elm327_answer_identifier(uint32_t identifier)
+{
+	if(elm327_config.protocol == '7' || elm327_config.protocol == '9')
+	{
+		// 18 DA <target> <source> is answered by 18 DA <source> <target>
+		if(((identifier >> 16) & 0xFF) == 0xDA)
 		{
-			// fc_mode 1: use the configured header
-			txframe.identifier = elm327_config.fc_header & TWAI_STD_ID_MASK;;
+			return (identifier & 0xFFFF0000) | ((identifier & 0xFF) << 8) | ((identifier >> 8) & 0xFF);
 		}
 	}
+	else if(identifier >= 0x7E0 && identifier <= 0x7E7)
+	{
+		return identifier + 8;
+	}
+
+	return UINT32_MAX;
+}
+
+/*
+ * Identifier the ECU addressed by the current header answers with, or
+ * UINT32_MAX for functional requests where several ECUs may answer.
+ */
+static uint32_t elm327_get_response_identifier(void)
+{
+	if(elm327_config.rx_address_is_set)
+	{
+		return elm327_config.rx_address;
+	}
 
-	txframe.rtr = 0;
+	return elm327_answer_identifier(elm327_get_identifier());
+}
 
-	// Initialize the data
-	memset(txframe.data, 0xAA, 8);
+/*
+ * Receive side flow control of the ISO-TP engine, it must pace consecutive
+ * frames the way the flow control frames sent by elm327_isotp_send() ask
+ * for. In mode 2 (ATFCSM2) every ECU gets the client's data. In mode 1 the
+ * flow control goes to the ATFCSH header, so only the ECU behind it sees the
+ * client's block size and STmin, the others keep the defaults.
+ */
+static void elm327_update_fc_params(void)
+{
+	uint8_t block_size = 0;
+	uint8_t st_min = 0;
 
-	if (elm327_config.fc_mode == 0)
+	if(elm327_config.fc_mode != 0 && elm327_config.fc_data_length >= 3)
 	{
-		// data[0] & 0xF0 == 0x30 identifies it as a flow control frame,
-		// data[0] & 0X0F is the flow status:
-		// - 0 tells the ECU we are ready to receive more frames
-		// - 1 tells the ECU to wait
-		// - 2 tells the ECU we are overloaded and it should abort
-		txframe.data[0] = 0x30;
-		// Block Size:
-		// - 0 means send all of the frames
-		// - greater than 0 means send this number of frames then wait for a flow control ACK
-		txframe.data[1] = 0x00;
-		// Separation time in ms. There are also special values for large separation times.
-		// The spec indicates this is supposed to be the time from when the last bit of the
-		// last frame was sent to when the first bit of the next frame. However the spec
-		// notes that some ECUs will implement this as the time from first bit to first bit
-		//
-		// Note: this value of 10ms is just a guess. Some docs have 20ms in their examples.
-		// When carscanner sets the flow control data it uses a value 0ms.
-		txframe.data[2] = 10;
+		block_size = elm327_config.fc_data[1];
+		st_min = elm327_config.fc_data[2];
+	}
+
+	uint32_t rx_id = (elm327_config.fc_mode == 1) ? elm327_answer_identifier(elm327_config.fc_header) : UINT32_MAX;
+
+	if(rx_id != UINT32_MAX)
+	{
+		isotp_reset_fc_params(&elm327_isotp, 0, 0);
+		isotp_set_fc_params(&elm327_isotp, rx_id, block_size, st_min);
 	}
 	else
 	{
-		// mode 1 or 2: use the data set by the client
-		memcpy(txframe.data, elm327_config.fc_data, elm327_config.fc_data_length);
+		isotp_reset_fc_params(&elm327_isotp, block_size, st_min);
 	}
+}
 
-	// CAN frames always have a data length code of 8
-	txframe.data_length_code = 8;
-	txframe.self = 0;
+// Every frame built by the ISO-TP engine goes out here
+static void elm327_isotp_send(twai_message_t *txframe, void *ctx)
+{
+	if((txframe->data[0] & 0xF0) == 0x30 && elm327_config.fc_mode != 0)
+	{
+		// mode 1 or 2: use the data set by the client
+		memset(txframe->data, 0xAA, 8);
+		memcpy(txframe->data, elm327_config.fc_data, elm327_config.fc_data_length);
+
+		if(elm327_config.fc_mode == 1)
+		{
+			// fc_mode 1: use the configured header
+			txframe->identifier = txframe->extd ? elm327_config.fc_header : (elm327_config.fc_header & TWAI_STD_ID_MASK);
+		}
+	}
 
 	if( elm327_can_log != NULL)
 	{
-		elm327_can_log(&txframe, ELM327_CAN_TX);
+		elm327_can_log(txframe, ELM327_CAN_TX);
 	}
 	
-	can_send(&txframe, 1);
+	can_send(txframe, 1);
 }
 
-static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
+static bool elm327_protocol_is_can(void)
 {
-	twai_message_t txframe;
-	uint8_t cmd_data_length;
+	return (elm327_config.protocol == '6') || (elm327_config.protocol == '8') || (elm327_config.protocol == '7') || (elm327_config.protocol == '9');
+}
 
-	ESP_LOGI(TAG, "PID req, cmd_buffer: %s", cmd);
-	ESP_LOG_BUFFER_HEX(TAG, cmd, strlen(cmd));
+// Opens the session for frames from rx_id, with a reassembly buffer when the
+// caller reads the reassembled data. A buffer is allocated on first use and
+// kept for the session slot, text requests never need one
+static isotp_session_t *elm327_isotp_open(uint32_t tx_id, uint32_t rx_id, bool extd, bool reassemble)
+{
+	isotp_session_t *session = isotp_open(&elm327_isotp, tx_id, rx_id, extd, NULL, 0);
 
-	if((elm327_config.protocol != '6') && (elm327_config.protocol != '8') && (elm327_config.protocol != '7') && (elm327_config.protocol != '9'))
+	if(session != NULL && reassemble)
 	{
-		if(elm327_config.protocol == '1' || elm327_config.protocol == '2')
+		uint32_t index = session - elm327_isotp.sessions;
+
+		if(elm327_isotp_buf[index] == NULL)
 		{
-			strcat(rsp, "NO DATA\r\r>");
-			elm327_response((char*)rsp, 0, queue);
+			elm327_isotp_buf[index] = malloc(ISOTP_MAX_LENGTH);
 		}
-		else
+		if(elm327_isotp_buf[index] != NULL)
 		{
-			strcat(rsp, "BUS INIT: ...ERROR\r\r>");
-			elm327_response((char*)rsp, 0, queue);
+			session->buf = elm327_isotp_buf[index];
+			session->buf_size = ISOTP_MAX_LENGTH;
 		}
-
-		return 0;
-	}
-
-	twai_message_t rx_frame;
-
-	txframe.identifier = elm327_get_identifier();
-	txframe.extd = elm327_config.protocol == '7' || elm327_config.protocol == '9';
-
-	txframe.rtr = 0;
-	// Pad the data
-	txframe.data[0] = 0xAA;
-	txframe.data[1] = 0xAA;
-	txframe.data[2] = 0xAA;
-	txframe.data[3] = 0xAA;
-	txframe.data[4] = 0xAA;
-	txframe.data[5] = 0xAA;
-	txframe.data[6] = 0xAA;
-	txframe.data[7] = 0xAA;
-
-	uint8_t req_expected_rsp = 0xFF;
-
-	// If the command length is odd then the last digit is the number of frames
-	// to expect in response. This is an optimization supported by the ELM327
-	// protocol. It is so the OBD2 device doesn't have to wait to see if there
-	// are more frames. Once it gets the expected number it can stop waiting and
-	// return the result.
-	if(strlen(cmd) % 2 == 1)
-	{
-		// FIXME: this should use hex conversion since the expected response
-		// frames could be more than 9.
-		req_expected_rsp = cmd[strlen(cmd)-1] - 0x30;
-		cmd[strlen(cmd)-1] = 0;
-		if(req_expected_rsp == 0 || req_expected_rsp > 9)
+		else
 		{
-			req_expected_rsp = 0xFF;
+			ESP_LOGE(TAG, "No memory to reassemble %08lX", rx_id);
 		}
-		ESP_LOGW(TAG, "req_expected_rsp 1: %u", req_expected_rsp);
 	}
 
-	cmd_data_length = strlen(cmd)/2;
-	if(cmd_data_length > 7)
-	{
-		// commands can't be longer than 7 bytes unless flow control is used
-		// FIXME: this should use the linefeed setting and match the number of
-		// `\r`s that are normally sent.
-		strcat(rsp, "?\r>");
-		elm327_response((char*)rsp, 0, queue);
-		return 0;
-	}
+	return session;
+}
 
-	txframe.data[0] = cmd_data_length;
-	elm327_fill_data_from_hex_str(cmd, &txframe.data[1], cmd_data_length);
+/*
+ * Sends the request through the ISO-TP engine and passes every accepted
+ * response frame to on_frame. The engine answers first frames with flow
+ * control and paces requests longer than 7 bytes as the ECU asks. data_length
+ * is the number of bytes after the PCI byte that belong to the frame, this is
+ * what the text path prints after the header. When on_payload is set every
+ * complete message is passed to it after its last frame went to on_frame,
+ * with the reassembled data only when reassemble is set: the buffers take
+ * ISOTP_MAX_LENGTH bytes per session. Returns the number of frames received.
+ */
+static uint8_t elm327_transact(const uint8_t *req, uint16_t req_len, uint8_t req_expected_rsp, elm327_frame_cb_t on_frame, elm327_payload_cb_t on_payload, bool reassemble, void *ctx)
+{
+	twai_message_t rx_frame;
+	can_ring_frame_t rx_item;
+	bool extd = elm327_config.protocol == '7' || elm327_config.protocol == '9';
 
-	// CAN frames always have a data length code of 8, this is different than the
-	// PCI byte (txframe.data[0])
-	txframe.data_length_code = 8;
-	txframe.self = 0;
+	isotp_close_all(&elm327_isotp);
+	elm327_update_fc_params();
+	isotp_session_t *txsession = elm327_isotp_open(elm327_get_identifier(), elm327_get_response_identifier(), extd, reassemble);
 
-	// if(txframe.extd == 0)
-	// {
-	// 	ESP_LOGI(TAG, "sending %03X", txframe.identifier&0xFFF);
-	// }
-	// else
-	// {
-	// 	ESP_LOGI(TAG, "sending %08X", txframe.identifier&TWAI_EXTD_ID_MASK);
-	// }
-	// ESP_LOG_BUFFER_HEX(TAG, txframe.data, 8);
-	if( elm327_can_log != NULL)
-	{
-		elm327_can_log(&txframe, ELM327_CAN_TX);
-	}
-	while( xQueueReceive(*can_rx_queue, ( void * ) &rx_frame, pdMS_TO_TICKS(1)) == pdPASS );
 	can_flush_rx();
-	can_send(&txframe, 1);
+	can_ring_skip(&elm327_can_reader);
+	isotp_send(&elm327_isotp, txsession, req, req_len, esp_timer_get_time());
 	xEventGroupSetBits(elm327_event_group, ELM327_READY_TO_RECEIVE_CAN);
 
 	TickType_t xtimeout = (elm327_config.req_timeout*4.096) / portTICK_PERIOD_MS;
 	TickType_t xwait_time;
 	int64_t txtime = esp_timer_get_time();
+	int64_t last_rx_time = 0;
+	elm327_at_stats_t *at_stats = elm327_at_find(elm327_get_identifier(), req[0]);
+	int64_t at_window_us = elm327_at_window_us(at_stats);
 	uint8_t timeout_flag = 0;
-	uint8_t rsp_found = 0;
 	uint8_t number_of_rsp = 0;
-	char tmp[10];
 	xwait_time = xtimeout;
-	memset(tmp, 0, sizeof(tmp));
-	ESP_LOGW(TAG, "req_expected_rsp: %u", req_expected_rsp);
+	ESP_LOGD(TAG, "req_expected_rsp: %u", req_expected_rsp);
 	while(timeout_flag == 0)
 	{
-		if( xQueueReceive(*can_rx_queue, ( void * ) &rx_frame, xwait_time) == pdPASS )
+		TickType_t xrx_wait = xwait_time;
+
+		if(isotp_tx_active(txsession))
 		{
+			// Still sending a long request, wake up for the next consecutive frame
+			int64_t now = esp_timer_get_time();
+			int64_t next = isotp_poll(&elm327_isotp, now);
+
+			if(isotp_tx_active(txsession))
+			{
+				TickType_t ticks = (next > now) ? (TickType_t)(((next - now) / 1000) / portTICK_PERIOD_MS) : 0;
+				if(ticks < xrx_wait)
+				{
+					xrx_wait = ticks;
+				}
+			}
+			else
+			{
+				// Request fully sent, the response timeout starts now
+				txtime = esp_timer_get_time();
+				xwait_time = xtimeout;
+				xrx_wait = xtimeout;
+			}
+		}
+
+		if( can_ring_read(&elm327_can_reader, &rx_item, xrx_wait) )
+		{
+			rx_frame = rx_item.frame;
 			xwait_time = xtimeout;
 			// if(rx_frame.extd == 0)
 			// {
@@ -869,8 +1036,22 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 				{
 					elm327_can_log(&rx_frame, ELM327_CAN_RX);
 				}
+
+				isotp_session_t *session = isotp_find(&elm327_isotp, rx_frame.identifier);
+				if(session == NULL)
+				{
+					session = elm327_isotp_open(elm327_fc_identifier(&rx_frame), rx_frame.identifier, rx_frame.extd, reassemble);
+				}
+
+				bool tx_active = isotp_tx_active(session);
+				isotp_session_t *rx_session = isotp_on_frame(&elm327_isotp, &rx_frame, esp_timer_get_time());
+				if(tx_active && (rx_frame.data[0] & 0xF0) == 0x30)
+				{
+					// Flow control for our own request, not part of the response
+					continue;
+				}
+
 				//reset timeout after response is received
-				rsp_found = 1;
 				number_of_rsp++;
 
 				// Identify what kind of frame this is.
@@ -879,8 +1060,8 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 				if (frame_type == 0x10)
 				{
 					// This is a first frame
-					// Send a flow control response so we can get the remaining frames
-					elm327_send_flow_control_frame(&rx_frame);
+					// The ISO-TP engine has sent the flow control response so we
+					// can get the remaining frames
 					// Length of the full data is:
 					//   ((0x0F & data[0]) << 8 | data[1])
 					//
@@ -924,52 +1105,29 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 					rx_frame_data_length = rx_frame.data[0];
 				}
 
-				// Based on the "CAF0 AND CAF1" section of the ELM doc, if headers are shown
-				// the PCI byte(s) (usually just data[0]) should be printed.
-				if(elm327_config.show_header)
-				{
-					if(rx_frame.extd == 0)
-					{
-						sprintf((char*)rsp, "%03lX", rx_frame.identifier&0xFFF);
-					}
-					else
-					{
-						sprintf((char*)rsp, "%08lX", rx_frame.identifier&TWAI_EXTD_ID_MASK);
-					}
-					if(elm327_config.space_print)
-					{
-						strcat((char*)rsp, (char*)" ");
-					}
-					sprintf((char*)tmp, "%02X", rx_frame.data[0]);
-					strcat((char*)rsp, (char*)tmp);
-				}
-
-//				ESP_LOGI(TAG, "ELM327 send 1: %s", rsp);
-
 				// If this is a first frame, consecutive frame, or flow control frame the PCI (rx_frame.data[0]) will
 				// not be a valid length without some processing, so just print all 7 bytes
 				if(rx_frame_data_length > 7) rx_frame_data_length = 7;
 
-				for (int i = 0; i < rx_frame_data_length; i++)
+				on_frame(&rx_frame, rx_frame_data_length, ctx);
+				if(on_payload != NULL && rx_session != NULL && rx_session->state == ISOTP_RX_DONE)
 				{
-					if(elm327_config.space_print)
-					{
-						sprintf((char*)tmp, " %02X", rx_frame.data[1+i]);
-					}
-					else
+					on_payload(rx_session->rx_id, rx_session->buf, rx_session->length, ctx);
+				}
+				last_rx_time = esp_timer_get_time();
+
+				if(at_window_us != 0 && (session == NULL || session->state != ISOTP_RX))
+				{
+					// Adaptive timing: more frames are only expected within the learned
+					// window, unless a multi-frame response is still coming in
+					int64_t left_us = txtime + at_window_us - last_rx_time;
+					TickType_t ticks = (left_us > 0) ? (TickType_t)((left_us/1000)/portTICK_PERIOD_MS) : 0;
+					if(ticks < xwait_time)
 					{
-						sprintf((char*)tmp, "%02X", rx_frame.data[1+i]);
+						xwait_time = ticks;
 					}
-					
-					strcat((char*)rsp, (char*)tmp);
 				}
 
-				strcat((char*)rsp, "\r");
-				ESP_LOGW(TAG, "ELM327 send: %s", rsp);
-//				ESP_LOG_BUFFER_HEX(TAG, rsp, strlen(rsp));
-				elm327_response(rsp, 0, queue);
-				memset(rsp, 0, strlen(rsp));
-//				strcat((char*)rsp, "\r");
 				if(req_expected_rsp != 0xFF)
 				{
 					if(req_expected_rsp == number_of_rsp)
@@ -990,15 +1148,139 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 				}
 			}
 		}
-		else
+		else if(!isotp_tx_active(txsession))
 		{
 			timeout_flag = 1;
 		}
 	}
 	xEventGroupClearBits(elm327_event_group, ELM327_READY_TO_RECEIVE_CAN);
-	ESP_LOGW(TAG, "Response time: %" PRIu32, (uint32_t)((esp_timer_get_time() - txtime)/1000));
+	ESP_LOGD(TAG, "Response time: %" PRIu32, (uint32_t)((esp_timer_get_time() - txtime)/1000));
+
+	if(number_of_rsp > 0)
+	{
+		elm327_at_record(at_stats, (uint32_t)(last_rx_time - txtime));
+	}
+
+	return number_of_rsp;
+}
+
+typedef struct
+{
+	char *rsp;
+	QueueHandle_t *queue;
+}elm327_text_ctx_t;
 
-	if(rsp_found == 0)
+static void elm327_print_frame(twai_message_t *rx_frame, uint8_t data_length, void *ctx)
+{
+	elm327_text_ctx_t *text = (elm327_text_ctx_t*)ctx;
+	char *rsp = text->rsp;
+	char tmp[10];
+
+	memset(tmp, 0, sizeof(tmp));
+
+	// Based on the "CAF0 AND CAF1" section of the ELM doc, if headers are shown
+	// the PCI byte(s) (usually just data[0]) should be printed.
+	if(elm327_config.show_header)
+	{
+		if(rx_frame->extd == 0)
+		{
+			sprintf((char*)rsp, "%03lX", rx_frame->identifier&0xFFF);
+		}
+		else
+		{
+			sprintf((char*)rsp, "%08lX", rx_frame->identifier&TWAI_EXTD_ID_MASK);
+		}
+		if(elm327_config.space_print)
+		{
+			strcat((char*)rsp, (char*)" ");
+		}
+		sprintf((char*)tmp, "%02X", rx_frame->data[0]);
+		strcat((char*)rsp, (char*)tmp);
+	}
+
+//	ESP_LOGI(TAG, "ELM327 send 1: %s", rsp);
+
+	for (int i = 0; i < data_length; i++)
+	{
+		if(elm327_config.space_print)
+		{
+			sprintf((char*)tmp, " %02X", rx_frame->data[1+i]);
+		}
+		else
+		{
+			sprintf((char*)tmp, "%02X", rx_frame->data[1+i]);
+		}
+		
+		strcat((char*)rsp, (char*)tmp);
+	}
+
+	strcat((char*)rsp, "\r");
+	ESP_LOGW(TAG, "ELM327 send: %s", rsp);
+//	ESP_LOG_BUFFER_HEX(TAG, rsp, strlen(rsp));
+	elm327_response(rsp, 0, text->queue);
+	memset(rsp, 0, strlen(rsp));
+}
+
+static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
+{
+	uint8_t cmd_data_length;
+	uint8_t req[64];
+
+	ESP_LOGI(TAG, "PID req, cmd_buffer: %s", cmd);
+	ESP_LOG_BUFFER_HEX(TAG, cmd, strlen(cmd));
+
+	if(!elm327_protocol_is_can())
+	{
+		if(elm327_config.protocol == '1' || elm327_config.protocol == '2')
+		{
+			strcat(rsp, "NO DATA\r\r>");
+			elm327_response((char*)rsp, 0, queue);
+		}
+		else
+		{
+			strcat(rsp, "BUS INIT: ...ERROR\r\r>");
+			elm327_response((char*)rsp, 0, queue);
+		}
+
+		return 0;
+	}
+
+	uint8_t req_expected_rsp = 0xFF;
+
+	// If the command length is odd then the last digit is the number of frames
+	// to expect in response. This is an optimization supported by the ELM327
+	// protocol. It is so the OBD2 device doesn't have to wait to see if there
+	// are more frames. Once it gets the expected number it can stop waiting and
+	// return the result.
+	if(strlen(cmd) % 2 == 1)
+	{
+		// FIXME: this should use hex conversion since the expected response
+		// frames could be more than 9.
+		req_expected_rsp = cmd[strlen(cmd)-1] - 0x30;
+		cmd[strlen(cmd)-1] = 0;
+		if(req_expected_rsp == 0 || req_expected_rsp > 9)
+		{
+			req_expected_rsp = 0xFF;
+		}
+		ESP_LOGD(TAG, "req_expected_rsp 1: %u", req_expected_rsp);
+	}
+
+	cmd_data_length = strlen(cmd)/2;
+	if(cmd_data_length > sizeof(req) || (cmd_data_length > 7 && elm327_get_response_identifier() == UINT32_MAX))
+	{
+		// commands longer than 7 bytes need flow control, so they can only
+		// be sent to a single ECU
+		// FIXME: this should use the linefeed setting and match the number of
+		// `\r`s that are normally sent.
+		strcat(rsp, "?\r>");
+		elm327_response((char*)rsp, 0, queue);
+		return 0;
+	}
+
+	elm327_fill_data_from_hex_str(cmd, req, cmd_data_length);
+
+	elm327_text_ctx_t text = {.rsp = rsp, .queue = queue};
+	if(elm327_transact(req, cmd_data_length, req_expected_rsp, elm327_print_frame, NULL, false, &text) == 0)
 	{
 		strcat((char*)rsp, "NO DATA\r\r>");
 	}
@@ -1011,6 +1293,28 @@ static int8_t elm327_request(char *cmd, char *rsp, QueueHandle_t *queue)
 	return 0;
 }
 
+/*
+ * Binary version of a request for internal users such as autopid. Uses the
+ * header, receive filter, flow control and timeout set with the AT commands
+ * but hands the response frames to on_frame instead of formatting them as text.
+ * The caller must hold the elm327 lock.
+ */
+esp_err_t elm327_request_bin(const uint8_t *req, uint16_t req_len, uint8_t expected_rsp, elm327_frame_cb_t on_frame, elm327_payload_cb_t on_payload, bool reassemble, void *ctx)
+{
+	if(!elm327_protocol_is_can())
+	{
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	if(req == NULL || req_len == 0 || req_len > ISOTP_MAX_LENGTH || on_frame == NULL ||
+		(req_len > 7 && elm327_get_response_identifier() == UINT32_MAX))
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	return (elm327_transact(req, req_len, expected_rsp, on_frame, on_payload, reassemble, ctx) > 0) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
 
 const xelm327_cmd_t elm327_commands[] = {
 											{"fcsd", elm327_set_fc_data},// set the flow control data
@@ -1021,7 +1325,7 @@ const xelm327_cmd_t elm327_commands[] = {
 											{"cp", elm327_set_priority_bits},// set five most significant bits of 29bit header
 											{"dp", elm327_describe_protocol},//describe current protocol
 											{"sh", elm327_set_header},// set header to xyz, xx yy zz, or ww xx yy zz
-											{"at", elm327_return_ok},//adaptive timing control
+											{"at", elm327_set_adaptive_timing},//adaptive timing control, 0, 1 or 2
 											{"sp", elm327_set_protocol},//set protocol to h and save as new default, 6, 7, 8, 9
 																	 // or ah	set protocol to auto, h
 											{"rv", elm327_input_voltage},//read input voltage
@@ -1179,7 +1483,7 @@ uint8_t elm327_ready_to_receive(void)
 }
 
 
-void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), QueueHandle_t *rx_queue, void (*can_log)(twai_message_t* frame, uint8_t type))
+void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), void (*can_log)(twai_message_t* frame, uint8_t type))
 {
 	elm327_mutex = xSemaphoreCreateMutex();
 	elm327_event_group = xEventGroupCreate();
@@ -1190,7 +1494,8 @@ void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), QueueH
     }
 	
 	elm327_set_default_config(true);
+	isotp_init(&elm327_isotp, elm327_isotp_send, NULL);
 	elm327_response = send_to_host;
-	can_rx_queue = rx_queue;
+	can_ring_reader_init(&elm327_can_reader);
 	elm327_can_log = can_log;
 }
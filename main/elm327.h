@@ -25,7 +25,15 @@
 #define ELM327_CAN_RX   0x01
 #define ELM327_CAN_TX   0x02
 
-void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), QueueHandle_t *rx_queue, void (*can_log)(twai_message_t* frame, uint8_t type));
+// Called for every response frame of elm327_request_bin(), data_length is the
+// number of bytes after the PCI byte (rx_frame->data[0])
+typedef void (*elm327_frame_cb_t)(twai_message_t *rx_frame, uint8_t data_length, void *ctx);
+// Called with every complete ISO-TP message of elm327_request_bin(), single
+// frames and reassembled multi-frame responses, without the PCI bytes. data is
+// NULL when the request was made without reassemble, length is still set
+typedef void (*elm327_payload_cb_t)(uint32_t rx_id, const uint8_t *data, uint16_t length, void *ctx);
+
+void elm327_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q), void (*can_log)(twai_message_t* frame, uint8_t type));
 int8_t elm327_process_cmd(uint8_t *buf, uint8_t len, twai_message_t *frame, QueueHandle_t *q);
 char elm327_get_current_protocol(void);
 void elm327_lock(void);
@@ -33,4 +41,5 @@ void elm327_unlock(void);
 uint32_t elm327_get_identifier(void);
 uint32_t elm327_get_rx_address(void);
 uint8_t elm327_ready_to_receive(void);
+esp_err_t elm327_request_bin(const uint8_t *req, uint16_t req_len, uint8_t expected_rsp, elm327_frame_cb_t on_frame, elm327_payload_cb_t on_payload, bool reassemble, void *ctx);
 #endif
@@ -20,13 +20,13 @@
 
 #include "esp_log.h"
 #include <string.h>
-#include "types.h"
 #include <stdbool.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
+#include "expression_parser.h"
 
 #define TAG 		__func__
 #define STACK_MAX 100
@@ -331,3 +331,688 @@ bool evaluate_expression(uint8_t *expression, uint8_t *data, double V, double *r
     return true;
 }
 
+
+// Compiled expressions
+//
+// compile_expression() runs the same tokenizer and shunting-yard pass as
+// evaluate_expression() once, at load time, and keeps the resulting postfix
+// program. evaluate_compiled_expression() then only walks the instructions,
+// so the poll loop no longer pays for sscanf/strtod/precedence handling.
+#define EXPR_EVAL_STACK_MAX     32
+#define EXPR_REG_MAX            8
+#define EXPR_WIDTH_UNKNOWN      0xFF
+#define EXPR_NO_REG             0xFF
+// Uses a single byte load needs before it is kept in a register. The ESP32
+// converts the byte to double in software, EXPR_OP_REG only copies it, so
+// two conversions saved pay for the EXPR_OP_TEE.
+#define EXPR_BYTE_REG_MIN_USES  3
+
+typedef struct
+{
+    expr_insn_t *code;
+    uint16_t code_len;
+    uint16_t code_cap;
+    double *consts;
+    uint16_t consts_len;
+    uint16_t consts_cap;
+    int depth;
+    int max_depth;
+    int data_len;
+    uint8_t regs_used;
+} expr_builder_t;
+
+static uint8_t expr_opcode_from_operator(char operator)
+{
+    switch (operator) {
+        case '+': return EXPR_OP_ADD;
+        case '-': return EXPR_OP_SUB;
+        case '*': return EXPR_OP_MUL;
+        case '/': return EXPR_OP_DIV;
+        case '&': return EXPR_OP_AND;
+        case '|': return EXPR_OP_OR;
+        case '^': return EXPR_OP_XOR;
+        case '<': return EXPR_OP_SHL;
+        case '>': return EXPR_OP_SHR;
+        default: return EXPR_OP_MAX;
+    }
+}
+
+static bool expr_add_const(expr_builder_t *b, double value, uint16_t *index)
+{
+    for (uint16_t i = 0; i < b->consts_len; i++) {
+        if (b->consts[i] == value) {
+            *index = i;
+            return true;
+        }
+    }
+    if (b->consts_len >= b->consts_cap) {
+        ESP_LOGE(TAG, "Too many constants");
+        return false;
+    }
+    b->consts[b->consts_len] = value;
+    *index = b->consts_len++;
+    return true;
+}
+
+static bool expr_emit(expr_builder_t *b, uint8_t op, uint8_t a, uint16_t arg)
+{
+    if (op >= EXPR_OP_ADD) {
+        if (b->depth == 0) {
+            ESP_LOGE(TAG, "Operand stack underflow");
+            return false;
+        }
+        if (b->depth == 1) {
+            // evaluate_expression() reads a missing left operand as 0 (e.g. "-40"),
+            // keep that behaviour by seeding the stack with a 0 constant.
+            uint16_t zero;
+            if (b->code_len + 1 >= b->code_cap || !expr_add_const(b, 0, &zero)) {
+                ESP_LOGE(TAG, "Expression too long");
+                return false;
+            }
+            memmove(&b->code[1], &b->code[0], b->code_len * sizeof(expr_insn_t));
+            b->code[0] = (expr_insn_t){.op = EXPR_OP_CONST, .a = 0, .b = zero};
+            b->code_len++;
+            b->depth++;
+            // The 0 sits below everything emitted so far, every earlier depth grows by one
+            if (++b->max_depth > EXPR_EVAL_STACK_MAX) {
+                ESP_LOGE(TAG, "Expression too deep");
+                return false;
+            }
+        }
+        b->depth--;
+    } else {
+        if (++b->depth > b->max_depth) {
+            b->max_depth = b->depth;
+        }
+        if (b->max_depth > EXPR_EVAL_STACK_MAX) {
+            ESP_LOGE(TAG, "Expression too deep");
+            return false;
+        }
+    }
+
+    if (b->code_len >= b->code_cap) {
+        ESP_LOGE(TAG, "Expression too long");
+        return false;
+    }
+    b->code[b->code_len++] = (expr_insn_t){.op = op, .a = a, .b = arg};
+    return true;
+}
+
+static bool expr_emit_load(expr_builder_t *b, uint8_t op, uint8_t a, int index)
+{
+    // a is the span of a range load, the bit number of EXPR_OP_B_BIT
+    int last = index + ((op == EXPR_OP_B_RANGE || op == EXPR_OP_S_RANGE) ? a : 0);
+
+    if (index < 0 || index > UINT16_MAX || last > UINT16_MAX) {
+        ESP_LOGE(TAG, "Byte index out of range: %d", index);
+        return false;
+    }
+    if (last + 1 > b->data_len) {
+        b->data_len = last + 1;
+    }
+    return expr_emit(b, op, a, (uint16_t)index);
+}
+
+// Optimizing pass
+//
+// Works directly on the postfix program: every instruction gets a node that
+// records what is known about the value it leaves on the stack. Folding or
+// strength reduction rewrites the operator node in place and marks the consumed
+// constant nodes dead, so emitting the remaining nodes in their original order
+// is still a valid postfix program.
+typedef struct
+{
+    double value;           // CONST nodes
+    uint8_t width;          // bits needed by an integral value
+    uint8_t reg;            // register assigned to a repeated load
+    bool integral;
+    bool is_unsigned;
+    bool dead;
+    bool reuse;             // load replaced by EXPR_OP_REG
+} expr_node_t;
+
+static bool expr_is_load(uint8_t op)
+{
+    return op >= EXPR_OP_B && op <= EXPR_OP_S_RANGE;
+}
+
+// Live loads identical to the one at i
+static uint16_t expr_load_uses(const expr_builder_t *b, const expr_node_t *nodes, uint16_t n, uint16_t i)
+{
+    uint16_t uses = 0;
+
+    for (uint16_t j = 0; j < n; j++) {
+        if (!nodes[j].dead && memcmp(&b->code[j], &b->code[i], sizeof(expr_insn_t)) == 0) {
+            uses++;
+        }
+    }
+    return uses;
+}
+
+static uint8_t expr_const_width(double value)
+{
+    if (value != floor(value) || fabs(value) >= 2147483648.0) {
+        return EXPR_WIDTH_UNKNOWN;
+    }
+    uint32_t v = (uint32_t)fabs(value);
+    uint8_t width = 0;
+    while (v) {
+        width++;
+        v >>= 1;
+    }
+    return width;
+}
+
+static uint8_t expr_width_add(uint8_t a, uint8_t b, uint8_t extra)
+{
+    uint16_t w = (uint16_t)((a > b) ? a : b) + extra;
+    if (a == EXPR_WIDTH_UNKNOWN || b == EXPR_WIDTH_UNKNOWN || w > 64) {
+        return EXPR_WIDTH_UNKNOWN;
+    }
+    return (uint8_t)w;
+}
+
+// Same arithmetic as the evaluators, used to fold constant subexpressions
+static bool expr_apply(uint8_t op, double a, double b, double *out)
+{
+    switch (op) {
+        case EXPR_OP_ADD: *out = a + b; break;
+        case EXPR_OP_SUB: *out = a - b; break;
+        case EXPR_OP_MUL: *out = a * b; break;
+        case EXPR_OP_DIV:
+            if (b == 0) {
+                return false;   // keep it, the error must happen at run time
+            }
+            *out = a / b;
+            break;
+        case EXPR_OP_AND: *out = (int)a & (int)b; break;
+        case EXPR_OP_OR: *out = (int)a | (int)b; break;
+        case EXPR_OP_XOR: *out = (int)a ^ (int)b; break;
+        case EXPR_OP_SHL: *out = (int)a << (int)b; break;
+        case EXPR_OP_SHR: *out = (int)a >> (int)b; break;
+        default: return false;
+    }
+    return true;
+}
+
+// Returns n when value is exactly 2^n (n != 0), 0 otherwise
+static int expr_pow2_exponent(double value)
+{
+    int exp;
+    if (value <= 0 || frexp(value, &exp) != 0.5 || exp - 1 == 0 || exp - 1 > 63 || exp - 1 < -63) {
+        return 0;
+    }
+    return exp - 1;
+}
+
+static bool expr_optimize(expr_builder_t *b)
+{
+    uint16_t n = b->code_len;
+    expr_node_t *nodes = (expr_node_t *)calloc(n, sizeof(expr_node_t));
+    uint16_t *stack = (uint16_t *)malloc(n * sizeof(uint16_t));
+    expr_insn_t *code = (expr_insn_t *)malloc(2 * n * sizeof(expr_insn_t));
+    double *consts = (double *)malloc(n * sizeof(double));
+    int top = -1;
+    bool ret = false;
+
+    if (!nodes || !stack || !code || !consts) {
+        ESP_LOGE(TAG, "Failed to allocate optimizer buffers");
+        goto end;
+    }
+
+    for (uint16_t i = 0; i < n; i++) {
+        expr_insn_t *insn = &b->code[i];
+        expr_node_t *node = &nodes[i];
+        node->reg = EXPR_NO_REG;
+        node->width = EXPR_WIDTH_UNKNOWN;
+
+        switch (insn->op) {
+            case EXPR_OP_CONST:
+                node->value = b->consts[insn->b];
+                node->width = expr_const_width(node->value);
+                node->integral = (node->width != EXPR_WIDTH_UNKNOWN);
+                node->is_unsigned = node->value >= 0;
+                stack[++top] = i;
+                continue;
+            case EXPR_OP_V:
+                stack[++top] = i;
+                continue;
+            case EXPR_OP_B:
+            case EXPR_OP_S:
+                node->width = 8;
+                break;
+            case EXPR_OP_B_BIT:
+                node->width = 1;
+                break;
+            case EXPR_OP_B_RANGE:
+            case EXPR_OP_S_RANGE:
+                node->width = (insn->a + 1) * 8;
+                break;
+            default: {
+                uint16_t r = stack[top--];
+                uint16_t l = stack[top--];
+                expr_node_t *ln = &nodes[l], *rn = &nodes[r];
+                bool l_const = (b->code[l].op == EXPR_OP_CONST);
+                bool r_const = (b->code[r].op == EXPR_OP_CONST);
+                double folded;
+
+                if (l_const && r_const && expr_apply(insn->op, ln->value, rn->value, &folded)) {
+                    ln->dead = rn->dead = true;
+                    insn->op = EXPR_OP_CONST;
+                    node->value = folded;
+                    node->width = expr_const_width(folded);
+                    node->integral = (node->width != EXPR_WIDTH_UNKNOWN);
+                    node->is_unsigned = folded >= 0;
+                    stack[++top] = i;
+                    continue;
+                }
+
+                // x * 2^n, 2^n * x, x / 2^n
+                int exp = 0;
+                uint16_t x = l, c = r;
+                if (insn->op == EXPR_OP_MUL && r_const) {
+                    exp = expr_pow2_exponent(rn->value);
+                }
+                if (insn->op == EXPR_OP_MUL && exp == 0 && l_const) {
+                    exp = expr_pow2_exponent(ln->value);
+                    x = r;
+                    c = l;
+                }
+                if (insn->op == EXPR_OP_DIV && r_const) {
+                    exp = -expr_pow2_exponent(rn->value);
+                }
+                if (exp != 0) {
+                    expr_node_t *xn = &nodes[x];
+                    nodes[c].dead = true;
+                    if (xn->integral && xn->is_unsigned && exp > 0 && xn->width + exp <= 31) {
+                        insn->op = EXPR_OP_SHL_IMM;
+                        node->width = xn->width + exp;
+                    } else {
+                        insn->op = EXPR_OP_SCALE;
+                        node->width = (xn->integral && exp > 0) ? expr_width_add(xn->width, 0, exp) : EXPR_WIDTH_UNKNOWN;
+                    }
+                    insn->a = (uint8_t)(int8_t)exp;
+                    node->integral = (node->width != EXPR_WIDTH_UNKNOWN);
+                    node->is_unsigned = xn->is_unsigned;
+                    stack[++top] = i;
+                    continue;
+                }
+
+                switch (insn->op) {
+                    case EXPR_OP_ADD:
+                        node->width = expr_width_add(ln->width, rn->width, 1);
+                        node->is_unsigned = ln->is_unsigned && rn->is_unsigned;
+                        break;
+                    case EXPR_OP_SUB:
+                        node->width = expr_width_add(ln->width, rn->width, 1);
+                        break;
+                    case EXPR_OP_MUL:
+                        node->width = (ln->width == EXPR_WIDTH_UNKNOWN || rn->width == EXPR_WIDTH_UNKNOWN || ln->width + rn->width > 64) ?
+                                        EXPR_WIDTH_UNKNOWN : ln->width + rn->width;
+                        node->is_unsigned = ln->is_unsigned && rn->is_unsigned;
+                        break;
+                    case EXPR_OP_DIV:
+                        break;
+                    default:
+                        // Bitwise operators work on int
+                        node->width = 32;
+                        break;
+                }
+                if (insn->op != EXPR_OP_DIV && !(ln->integral && rn->integral)) {
+                    node->width = EXPR_WIDTH_UNKNOWN;
+                }
+                node->integral = (node->width != EXPR_WIDTH_UNKNOWN);
+                stack[++top] = i;
+                continue;
+            }
+        }
+
+        // Byte loads
+        node->integral = true;
+        node->is_unsigned = (insn->op != EXPR_OP_S && insn->op != EXPR_OP_S_RANGE);
+        stack[++top] = i;
+    }
+
+    // Hoist repeated loads into registers, single byte loads only once
+    // they are used EXPR_BYTE_REG_MIN_USES times
+    uint8_t regs_used = 0;
+    for (uint16_t i = 0; i < n; i++) {
+        if (nodes[i].dead || !expr_is_load(b->code[i].op)) {
+            continue;
+        }
+        if ((b->code[i].op == EXPR_OP_B || b->code[i].op == EXPR_OP_S) &&
+            expr_load_uses(b, nodes, n, i) < EXPR_BYTE_REG_MIN_USES) {
+            continue;
+        }
+        for (uint16_t j = 0; j < i; j++) {
+            if (nodes[j].dead || nodes[j].reuse || !expr_is_load(b->code[j].op) ||
+                memcmp(&b->code[j], &b->code[i], sizeof(expr_insn_t)) != 0) {
+                continue;
+            }
+            if (nodes[j].reg == EXPR_NO_REG && regs_used < EXPR_REG_MAX) {
+                nodes[j].reg = regs_used++;
+            }
+            if (nodes[j].reg != EXPR_NO_REG) {
+                nodes[i].reuse = true;
+                nodes[i].reg = nodes[j].reg;
+            }
+            break;
+        }
+    }
+
+    // Emit the surviving nodes
+    uint16_t code_len = 0, consts_len = 0;
+    int depth = 0, max_depth = 0;
+    for (uint16_t i = 0; i < n; i++) {
+        expr_insn_t insn = b->code[i];
+        if (nodes[i].dead) {
+            continue;
+        }
+
+        if (insn.op == EXPR_OP_CONST) {
+            uint16_t k;
+            for (k = 0; k < consts_len && consts[k] != nodes[i].value; k++);
+            if (k == consts_len) {
+                consts[consts_len++] = nodes[i].value;
+            }
+            insn.b = k;
+        } else if (nodes[i].reuse) {
+            insn = (expr_insn_t){.op = EXPR_OP_REG, .a = nodes[i].reg, .b = 0};
+        }
+        code[code_len++] = insn;
+
+        if (insn.op <= EXPR_OP_REG) {
+            depth++;
+        } else if (insn.op >= EXPR_OP_ADD) {
+            depth--;
+        }
+        if (depth > max_depth) {
+            max_depth = depth;
+        }
+
+        if (!nodes[i].reuse && nodes[i].reg != EXPR_NO_REG) {
+            code[code_len++] = (expr_insn_t){.op = EXPR_OP_TEE, .a = nodes[i].reg, .b = 0};
+        }
+    }
+
+    if (depth != 1) {
+        ESP_LOGE(TAG, "Optimizer produced an invalid program");
+        goto end;
+    }
+
+    free(b->code);
+    free(b->consts);
+    b->code = code;
+    b->code_len = code_len;
+    b->code_cap = 2 * n;
+    b->consts = consts;
+    b->consts_len = consts_len;
+    b->consts_cap = n;
+    b->max_depth = max_depth;
+    b->regs_used = regs_used;
+    code = NULL;
+    consts = NULL;
+    ret = true;
+
+end:
+    free(nodes);
+    free(stack);
+    free(code);
+    free(consts);
+    return ret;
+}
+
+expr_program_t *compile_expression(const char *expression)
+{
+    if (expression == NULL) {
+        return NULL;
+    }
+
+    size_t expr_len = strlen(expression);
+    if (expr_len == 0 || expr_len > UINT16_MAX / 2) {
+        ESP_LOGE(TAG, "Invalid expression length");
+        return NULL;
+    }
+
+    // Every token emits at most one instruction, plus one for a seeded 0
+    expr_builder_t b = {0};
+    b.code_cap = expr_len + 1;
+    b.consts_cap = expr_len + 1;
+    b.code = (expr_insn_t *)malloc(b.code_cap * sizeof(expr_insn_t));
+    b.consts = (double *)malloc(b.consts_cap * sizeof(double));
+    char *operators = (char *)malloc(expr_len);
+    int op_top = -1;
+    expr_program_t *program = NULL;
+
+    if (!b.code || !b.consts || !operators) {
+        ESP_LOGE(TAG, "Failed to allocate compiler buffers");
+        goto end;
+    }
+
+    size_t i = 0;
+    while (expression[i] != '\0') {
+        char c = expression[i];
+
+        if (isspace((unsigned char)c)) {
+            i++;
+        } else if (isdigit((unsigned char)c) || c == '.') {
+            uint16_t index;
+            if (!expr_add_const(&b, strtod(&expression[i], NULL), &index) ||
+                !expr_emit(&b, EXPR_OP_CONST, 0, index)) {
+                goto end;
+            }
+            while (isdigit((unsigned char)expression[i]) || expression[i] == '.') {
+                i++;
+            }
+        } else if (c == 'V') {
+            if (!expr_emit(&b, EXPR_OP_V, 0, 0)) {
+                goto end;
+            }
+            i++;
+        } else if (c == '[') {
+            int start_index = 0, end_index = 0, chars_read = 0;
+            uint8_t op;
+
+            if (sscanf(&expression[i], "[B%d:B%d]%n", &start_index, &end_index, &chars_read) == 2 && chars_read > 0) {
+                op = EXPR_OP_B_RANGE;
+            } else if (sscanf(&expression[i], "[S%d:S%d]%n", &start_index, &end_index, &chars_read) == 2 && chars_read > 0) {
+                op = EXPR_OP_S_RANGE;
+            } else {
+                ESP_LOGE(TAG, "Invalid array syntax, couldn't parse indices correctly.");
+                goto end;
+            }
+            if (end_index < start_index || end_index - start_index > 7) {
+                ESP_LOGE(TAG, "Range too large for 64-bit storage.");
+                goto end;
+            }
+            if (!expr_emit_load(&b, op, (uint8_t)(end_index - start_index), start_index)) {
+                goto end;
+            }
+            i += chars_read;
+        } else if (c == 'B' || c == 'S') {
+            int index = 0;
+            i++;
+            if (!isdigit((unsigned char)expression[i])) {
+                ESP_LOGE(TAG, "Missing byte index after %c", c);
+                goto end;
+            }
+            while (isdigit((unsigned char)expression[i])) {
+                index = index * 10 + (expression[i] - '0');
+                if (index > UINT16_MAX) {
+                    ESP_LOGE(TAG, "Byte index out of range");
+                    goto end;
+                }
+                i++;
+            }
+            if (c == 'B' && expression[i] == ':') {
+                i++;
+                if (expression[i] < '0' || expression[i] > '7') {
+                    ESP_LOGE(TAG, "Invalid bit index");
+                    goto end;
+                }
+                if (!expr_emit_load(&b, EXPR_OP_B_BIT, (uint8_t)(expression[i] - '0'), index)) {
+                    goto end;
+                }
+                i++;
+            } else if (!expr_emit_load(&b, (c == 'B') ? EXPR_OP_B : EXPR_OP_S, 0, index)) {
+                goto end;
+            }
+        } else if (c == '(') {
+            operators[++op_top] = c;
+            i++;
+        } else if (c == ')') {
+            while (op_top >= 0 && operators[op_top] != '(') {
+                if (!expr_emit(&b, expr_opcode_from_operator(operators[op_top--]), 0, 0)) {
+                    goto end;
+                }
+            }
+            if (op_top < 0) {
+                ESP_LOGE(TAG, "Mismatched parentheses");
+                goto end;
+            }
+            op_top--;
+            i++;
+        } else if (c == '+' || c == '-' || c == '*' || c == '/' || c == '&' || c == '|' || c == '^' ||
+                   ((c == '<' || c == '>') && expression[i + 1] == c)) {
+            if (c == '<' || c == '>') {
+                i++; // Recognize << and >> as a single operator
+            }
+            while (op_top >= 0 && precedence(operators[op_top]) >= precedence(c)) {
+                if (!expr_emit(&b, expr_opcode_from_operator(operators[op_top--]), 0, 0)) {
+                    goto end;
+                }
+            }
+            operators[++op_top] = c;
+            i++;
+        } else {
+            ESP_LOGE(TAG, "Invalid character: %c", c);
+            goto end;
+        }
+    }
+
+    while (op_top >= 0) {
+        if (operators[op_top] == '(') {
+            ESP_LOGE(TAG, "Mismatched parentheses");
+            goto end;
+        }
+        if (!expr_emit(&b, expr_opcode_from_operator(operators[op_top--]), 0, 0)) {
+            goto end;
+        }
+    }
+
+    if (b.depth != 1) {
+        ESP_LOGE(TAG, "Invalid expression");
+        goto end;
+    }
+
+    uint16_t unoptimized_len = b.code_len;
+    if (!expr_optimize(&b)) {
+        goto end;
+    }
+
+    // Header, constants and code share one allocation (constants first for alignment)
+    program = (expr_program_t *)malloc(sizeof(expr_program_t) + b.consts_len * sizeof(double) + b.code_len * sizeof(expr_insn_t));
+    if (program == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate program");
+        goto end;
+    }
+    program->consts = (double *)(program + 1);
+    program->code = (expr_insn_t *)(program->consts + b.consts_len);
+    memcpy(program->consts, b.consts, b.consts_len * sizeof(double));
+    memcpy(program->code, b.code, b.code_len * sizeof(expr_insn_t));
+    program->consts_len = b.consts_len;
+    program->code_len = b.code_len;
+    program->unoptimized_len = unoptimized_len;
+    program->stack_depth = (uint8_t)b.max_depth;
+    program->regs_used = b.regs_used;
+    program->data_len = (uint32_t)b.data_len;
+
+end:
+    free(b.code);
+    free(b.consts);
+    free(operators);
+    return program;
+}
+
+static inline uint64_t expr_load_be(const uint8_t *data, uint16_t start, uint8_t span)
+{
+    uint64_t value = 0;
+    for (uint16_t j = start; j <= start + span; j++) {
+        value = (value << 8) | data[j];
+    }
+    return value;
+}
+
+// data_len is the number of valid bytes in data, a program reading past it fails
+bool evaluate_compiled_expression(const expr_program_t *program, const uint8_t *data, uint32_t data_len, double V, double *result)
+{
+    double stack[EXPR_EVAL_STACK_MAX];
+    double regs[EXPR_REG_MAX];
+    int top = -1;
+
+    if (program == NULL || data == NULL || result == NULL) {
+        return false;
+    }
+    if (program->data_len > data_len) {
+        ESP_LOGD(TAG, "Expression reads %lu bytes, only %lu received", (unsigned long)program->data_len, (unsigned long)data_len);
+        return false;
+    }
+
+    const expr_insn_t *insn = program->code;
+    const expr_insn_t *end = insn + program->code_len;
+
+    for (; insn < end; insn++) {
+        switch (insn->op) {
+            case EXPR_OP_CONST: stack[++top] = program->consts[insn->b]; break;
+            case EXPR_OP_V: stack[++top] = V; break;
+            case EXPR_OP_B: stack[++top] = data[insn->b]; break;
+            case EXPR_OP_B_BIT: stack[++top] = (data[insn->b] >> insn->a) & 1; break;
+            case EXPR_OP_S: stack[++top] = (int8_t)data[insn->b]; break;
+            case EXPR_OP_B_RANGE: stack[++top] = (double)expr_load_be(data, insn->b, insn->a); break;
+            case EXPR_OP_S_RANGE: {
+                uint64_t raw = expr_load_be(data, insn->b, insn->a);
+                if (insn->a == 0) {
+                    stack[++top] = (double)(int8_t)raw;
+                } else if (insn->a == 1) {
+                    stack[++top] = (double)(int16_t)raw;
+                } else if (insn->a <= 3) {
+                    stack[++top] = (double)(int32_t)(uint32_t)raw;
+                } else {
+                    stack[++top] = (double)(int64_t)raw;
+                }
+                break;
+            }
+            case EXPR_OP_REG: stack[++top] = regs[insn->a]; break;
+            case EXPR_OP_TEE: regs[insn->a] = stack[top]; break;
+            case EXPR_OP_SCALE: stack[top] = ldexp(stack[top], (int8_t)insn->a); break;
+            case EXPR_OP_SHL_IMM: stack[top] = (double)((uint32_t)stack[top] << insn->a); break;
+            case EXPR_OP_ADD: top--; stack[top] = stack[top] + stack[top + 1]; break;
+            case EXPR_OP_SUB: top--; stack[top] = stack[top] - stack[top + 1]; break;
+            case EXPR_OP_MUL: top--; stack[top] = stack[top] * stack[top + 1]; break;
+            case EXPR_OP_DIV:
+                top--;
+                if (stack[top + 1] == 0) {
+                    ESP_LOGE(TAG, "Division by zero");
+                    return false;
+                }
+                stack[top] = stack[top] / stack[top + 1];
+                break;
+            case EXPR_OP_AND: top--; stack[top] = (int)stack[top] & (int)stack[top + 1]; break;
+            case EXPR_OP_OR: top--; stack[top] = (int)stack[top] | (int)stack[top + 1]; break;
+            case EXPR_OP_XOR: top--; stack[top] = (int)stack[top] ^ (int)stack[top + 1]; break;
+            case EXPR_OP_SHL: top--; stack[top] = (int)stack[top] << (int)stack[top + 1]; break;
+            case EXPR_OP_SHR: top--; stack[top] = (int)stack[top] >> (int)stack[top + 1]; break;
+            default:
+                ESP_LOGE(TAG, "Invalid opcode: %u", insn->op);
+                return false;
+        }
+    }
+
+    *result = stack[0];
+    return true;
+}
+
+void free_compiled_expression(expr_program_t *program)
+{
+    free(program);
+}
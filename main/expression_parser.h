@@ -22,6 +22,58 @@
 #ifndef __EXP_PAR__
 #define __EXP_PAR__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum
+{
+    EXPR_OP_CONST = 0,      // push consts[b]
+    EXPR_OP_V,              // push V
+    EXPR_OP_B,              // push data[b]
+    EXPR_OP_B_BIT,          // push (data[b] >> a) & 1
+    EXPR_OP_S,              // push (int8_t)data[b]
+    EXPR_OP_B_RANGE,        // push unsigned big endian data[b]..data[b+a]
+    EXPR_OP_S_RANGE,        // push signed big endian data[b]..data[b+a]
+    EXPR_OP_REG,            // push regs[a]
+    EXPR_OP_TEE,            // regs[a] = top of stack (no pop)
+    EXPR_OP_SCALE,          // top *= 2^(int8_t)a, exact exponent adjust
+    EXPR_OP_SHL_IMM,        // top <<= a, integral operand known to fit 31 bits
+    EXPR_OP_ADD,
+    EXPR_OP_SUB,
+    EXPR_OP_MUL,
+    EXPR_OP_DIV,
+    EXPR_OP_AND,
+    EXPR_OP_OR,
+    EXPR_OP_XOR,
+    EXPR_OP_SHL,
+    EXPR_OP_SHR,
+    EXPR_OP_MAX
+}expr_opcode_t;
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t a;
+    uint16_t b;
+}expr_insn_t;
+
+// Postfix program produced by compile_expression(). Instructions and constants
+// live in the same allocation, so a single free releases everything.
+typedef struct expr_program
+{
+    expr_insn_t *code;
+    double *consts;
+    uint16_t code_len;
+    uint16_t consts_len;
+    uint16_t unoptimized_len;   // instruction count before the optimizing pass
+    uint8_t stack_depth;
+    uint8_t regs_used;
+    uint32_t data_len;          // bytes the program reads, shorter data is rejected
+}expr_program_t;
+
 bool evaluate_expression(uint8_t *expression,  uint8_t *data, double V, double *result);
+expr_program_t *compile_expression(const char *expression);
+bool evaluate_compiled_expression(const expr_program_t *program, const uint8_t *data, uint32_t data_len, double V, double *result);
+void free_compiled_expression(expr_program_t *program);
 
 #endif
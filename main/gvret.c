@@ -73,6 +73,18 @@ int64_t gvert_tmr_get()
 	return (int64_t)ret;
 }
 
+// Microseconds from the GVRET time base to timestamp (an esp_timer_get_time() value)
+static uint32_t gvert_tmr_get_at(int64_t timestamp)
+{
+	int64_t ret = 0;
+	xSemaphoreTake(xgvert_tmr_semaphore, portMAX_DELAY);
+	ret = timestamp - gvert_tmr_start_time;
+	xSemaphoreGive(xgvert_tmr_semaphore);
+
+	// Received just before the time base was reset
+	return (ret < 0) ? 0 : (uint32_t)ret;
+}
+
 static void periodic_timer_callback(void* arg)
 {
     int64_t time_since_boot = esp_timer_get_time();
@@ -662,34 +674,48 @@ void gvret_parse(uint8_t *buf, uint8_t len, twai_message_t *frame, QueueHandle_t
     }
 }
 
-int8_t gvret_parse_can_frame(uint8_t *buf, twai_message_t *frame)
+// Appends one frame to buf, returns the number of bytes written or 0 if the
+// frame doesn't fit in size
+uint16_t gvret_encode_frame(uint8_t *buf, uint16_t size, const twai_message_t *frame, int64_t timestamp)
 {
-	uint8_t length = 0;
+	uint16_t length = 0;
+	uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+	uint32_t identifier = frame->identifier;
+
+	if(12 + dlc > size)
+	{
+		return 0;
+	}
+
     if (frame->extd)
     {
-    	frame->identifier |= 1 << 31;
+    	identifier |= 1 << 31;
     }
     buf[length++] = 0xF1;
     buf[length++] = 0; //0 = canbus frame sending
-    uint32_t now = gvert_tmr_get();
+    uint32_t now = gvert_tmr_get_at(timestamp);
     buf[length++] = (uint8_t)(now & 0xFF);
     buf[length++] = (uint8_t)(now >> 8);
     buf[length++] = (uint8_t)(now >> 16);
     buf[length++] = (uint8_t)(now >> 24);
-    buf[length++] = (uint8_t)(frame->identifier & 0xFF);
-    buf[length++] = (uint8_t)(frame->identifier >> 8);
-    buf[length++] = (uint8_t)(frame->identifier >> 16);
-    buf[length++] = (uint8_t)(frame->identifier >> 24);
-    buf[length++] = frame->data_length_code;
-    for (int c = 0; c < frame->data_length_code; c++)
-    {
-        buf[length++] = frame->data[c];
-    }
+    buf[length++] = (uint8_t)(identifier & 0xFF);
+    buf[length++] = (uint8_t)(identifier >> 8);
+    buf[length++] = (uint8_t)(identifier >> 16);
+    buf[length++] = (uint8_t)(identifier >> 24);
+    buf[length++] = dlc;
+    memcpy(&buf[length], frame->data, dlc);
+    length += dlc;
     //temp = checksumCalc(buff, 11 + frame.length);
-    uint8_t temp = checksumCalc(transmitBuffer, 11 + frame->data_length_code);
+    uint8_t temp = checksumCalc(transmitBuffer, 11 + dlc);
     buf[length++] = temp;
 
-    return (int8_t)length;
+    return length;
+}
+
+// buf must hold at least GVRET_FRAME_MAX bytes
+int8_t gvret_parse_can_frame(uint8_t *buf, twai_message_t *frame, int64_t timestamp)
+{
+	return gvret_encode_frame(buf, GVRET_FRAME_MAX, frame, timestamp);
 }
 
 
@@ -22,6 +22,7 @@
 
 #define CFG_BUILD_NUM   	618
 #define WIFI_BUFF_SIZE      2048
+#define GVRET_FRAME_MAX		20		// F1 00, time, id, dlc, 8 data bytes, checksum
 enum parse_state
 {
 	GET_HEADER = 0,
@@ -113,6 +114,7 @@ typedef struct  {
 
 void gvret_parse(uint8_t *buf, uint8_t len, twai_message_t *frame, QueueHandle_t *q);
 void gvret_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q));
-int8_t gvret_parse_can_frame(uint8_t *buf, twai_message_t *frame);
+int8_t gvret_parse_can_frame(uint8_t *buf, twai_message_t *frame, int64_t timestamp);
+uint16_t gvret_encode_frame(uint8_t *buf, uint16_t size, const twai_message_t *frame, int64_t timestamp);
 
 #endif
@@ -21,8 +21,11 @@
 
 #include "esp_err.h"
 
+// The host build passes a scratch directory instead
 #if HARDWARE_VER == WICAN_PRO
+#ifndef FS_MOUNT_POINT
 #define FS_MOUNT_POINT              "/fatfs"
+#endif
 #define TX_GPIO_NUM             	2
 #define RX_GPIO_NUM             	1
 #define CAN_STDBY_GPIO_NUM			38
@@ -47,7 +50,9 @@
 
 #else
 
+#ifndef FS_MOUNT_POINT
 #define FS_MOUNT_POINT              "/littlefs"
+#endif
 #define TX_GPIO_NUM             	0
 #define RX_GPIO_NUM             	3
 #define CONNECTED_LED_GPIO_NUM		8
@@ -0,0 +1,457 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// ISO 15765-2 transport layer
+//
+// Pure state machine, it never blocks and never reads the clock. The caller
+// feeds received frames to isotp_on_frame(), calls isotp_poll() when the time
+// returned by the previous call is reached, and sends the frames handed to the
+// send callback.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "esp_log.h"
+#include "isotp.h"
+
+#define TAG                 __func__
+
+#define ISOTP_PCI_SF        0x00
+#define ISOTP_PCI_FF        0x10
+#define ISOTP_PCI_CF        0x20
+#define ISOTP_PCI_FC        0x30
+
+#define ISOTP_FC_CTS        0x00
+#define ISOTP_FC_WAIT       0x01
+#define ISOTP_FC_OVFLW      0x02
+
+uint32_t isotp_st_min_to_us(uint8_t st_min)
+{
+    if (st_min <= 0x7F)
+    {
+        return st_min * 1000;
+    }
+    if (st_min >= 0xF1 && st_min <= 0xF9)
+    {
+        return (st_min - 0xF0) * 100;
+    }
+    // Reserved values are treated as the longest separation time
+    return 127000;
+}
+
+void isotp_init(isotp_link_t *link, isotp_send_t send, void *ctx)
+{
+    memset(link, 0, sizeof(isotp_link_t));
+    link->send = send;
+    link->ctx = ctx;
+    // Same as a genuine ELM327, let the ECU send as fast as it can
+    link->default_fc.block_size = 0;
+    link->default_fc.st_min = 0;
+}
+
+bool isotp_set_fc_params(isotp_link_t *link, uint32_t rx_id, uint8_t block_size, uint8_t st_min)
+{
+    for (uint8_t i = 0; i < link->ecu_fc_count; i++)
+    {
+        if (link->ecu_fc[i].rx_id == rx_id)
+        {
+            link->ecu_fc[i].fc.block_size = block_size;
+            link->ecu_fc[i].fc.st_min = st_min;
+            return true;
+        }
+    }
+
+    if (link->ecu_fc_count >= ISOTP_MAX_ECU_FC)
+    {
+        ESP_LOGE(TAG, "No room for flow control parameters of %08lX", rx_id);
+        return false;
+    }
+
+    link->ecu_fc[link->ecu_fc_count].rx_id = rx_id;
+    link->ecu_fc[link->ecu_fc_count].fc.block_size = block_size;
+    link->ecu_fc[link->ecu_fc_count].fc.st_min = st_min;
+    link->ecu_fc_count++;
+    return true;
+}
+
+// Drops the per-ECU parameters, sessions opened from now on get these
+void isotp_reset_fc_params(isotp_link_t *link, uint8_t block_size, uint8_t st_min)
+{
+    link->ecu_fc_count = 0;
+    link->default_fc.block_size = block_size;
+    link->default_fc.st_min = st_min;
+}
+
+static isotp_fc_params_t isotp_get_fc_params(isotp_link_t *link, uint32_t rx_id)
+{
+    for (uint8_t i = 0; i < link->ecu_fc_count; i++)
+    {
+        if (link->ecu_fc[i].rx_id == rx_id)
+        {
+            return link->ecu_fc[i].fc;
+        }
+    }
+    return link->default_fc;
+}
+
+isotp_session_t *isotp_find(isotp_link_t *link, uint32_t rx_id)
+{
+    for (int i = 0; i < ISOTP_MAX_SESSIONS; i++)
+    {
+        if (link->sessions[i].in_use && link->sessions[i].rx_id == rx_id)
+        {
+            return &link->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+isotp_session_t *isotp_open(isotp_link_t *link, uint32_t tx_id, uint32_t rx_id, bool extd, uint8_t *buf, uint16_t buf_size)
+{
+    isotp_session_t *session = isotp_find(link, rx_id);
+
+    for (int i = 0; session == NULL && i < ISOTP_MAX_SESSIONS; i++)
+    {
+        if (!link->sessions[i].in_use)
+        {
+            session = &link->sessions[i];
+        }
+    }
+
+    if (session == NULL)
+    {
+        ESP_LOGE(TAG, "No free session for %08lX", rx_id);
+        return NULL;
+    }
+
+    memset(session, 0, sizeof(isotp_session_t));
+    session->in_use = true;
+    session->extd = extd;
+    session->tx_id = tx_id;
+    session->rx_id = rx_id;
+    session->fc = isotp_get_fc_params(link, rx_id);
+    session->buf = buf;
+    session->buf_size = buf_size;
+    return session;
+}
+
+void isotp_close(isotp_session_t *session)
+{
+    if (session != NULL)
+    {
+        session->in_use = false;
+    }
+}
+
+void isotp_close_all(isotp_link_t *link)
+{
+    for (int i = 0; i < ISOTP_MAX_SESSIONS; i++)
+    {
+        link->sessions[i].in_use = false;
+    }
+}
+
+bool isotp_tx_active(const isotp_session_t *session)
+{
+    return session != NULL && (session->state == ISOTP_TX || session->state == ISOTP_TX_WAIT_FC);
+}
+
+static void isotp_send_frame(isotp_link_t *link, isotp_session_t *session, const uint8_t *data, uint8_t len)
+{
+    twai_message_t frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.identifier = session->tx_id;
+    frame.extd = session->extd;
+    frame.data_length_code = 8;
+    memset(frame.data, ISOTP_PADDING, sizeof(frame.data));
+    memcpy(frame.data, data, len);
+    link->send(&frame, link->ctx);
+}
+
+static void isotp_send_fc(isotp_link_t *link, isotp_session_t *session, uint8_t flow_status)
+{
+    uint8_t fc[3] = {ISOTP_PCI_FC | flow_status, session->fc.block_size, session->fc.st_min};
+
+    isotp_send_frame(link, session, fc, sizeof(fc));
+}
+
+static void isotp_fail(isotp_link_t *link, isotp_session_t *session, isotp_error_t error)
+{
+    session->state = ISOTP_ERROR;
+    session->error = error;
+
+    switch (error)
+    {
+        case ISOTP_ERR_SEQ: link->seq_errors++; break;
+        case ISOTP_ERR_TIMEOUT: link->timeouts++; break;
+        case ISOTP_ERR_OVERFLOW: link->overflows++; break;
+        default: break;
+    }
+    ESP_LOGW(TAG, "%08lX transfer failed, error: %d, %u/%u bytes", session->rx_id, error, session->offset, session->length);
+}
+
+bool isotp_send(isotp_link_t *link, isotp_session_t *session, const uint8_t *data, uint16_t length, int64_t now)
+{
+    uint8_t frame[8];
+
+    if (session == NULL || length == 0 || length > ISOTP_MAX_LENGTH)
+    {
+        return false;
+    }
+
+    session->tx_data = data;
+    session->length = length;
+    session->error = ISOTP_ERR_NONE;
+
+    if (length <= 7)
+    {
+        frame[0] = ISOTP_PCI_SF | length;
+        memcpy(&frame[1], data, length);
+        isotp_send_frame(link, session, frame, length + 1);
+        session->offset = length;
+        session->state = ISOTP_TX_DONE;
+        return true;
+    }
+
+    frame[0] = ISOTP_PCI_FF | (length >> 8);
+    frame[1] = length & 0xFF;
+    memcpy(&frame[2], data, 6);
+    isotp_send_frame(link, session, frame, 8);
+    session->offset = 6;
+    session->seq = 1;
+    session->state = ISOTP_TX_WAIT_FC;
+    session->deadline = now + ISOTP_TIMEOUT_US;
+    return true;
+}
+
+static void isotp_rx_first(isotp_link_t *link, isotp_session_t *session, const uint8_t *data, int64_t now)
+{
+    uint16_t length = ((data[0] & 0x0F) << 8) | data[1];
+
+    if (length < 8)
+    {
+        isotp_fail(link, session, ISOTP_ERR_FRAME);
+        return;
+    }
+
+    session->length = length;
+    if (session->buf != NULL && length > session->buf_size)
+    {
+        isotp_send_fc(link, session, ISOTP_FC_OVFLW);
+        isotp_fail(link, session, ISOTP_ERR_OVERFLOW);
+        return;
+    }
+
+    if (session->buf != NULL)
+    {
+        memcpy(session->buf, &data[2], 6);
+    }
+    session->offset = 6;
+    session->seq = 1;
+    session->block_left = session->fc.block_size;
+    session->state = ISOTP_RX;
+    session->error = ISOTP_ERR_NONE;
+    session->deadline = now + ISOTP_TIMEOUT_US;
+    isotp_send_fc(link, session, ISOTP_FC_CTS);
+}
+
+static void isotp_rx_consecutive(isotp_link_t *link, isotp_session_t *session, const uint8_t *data, int64_t now)
+{
+    uint16_t n = session->length - session->offset;
+
+    if ((data[0] & 0x0F) != session->seq)
+    {
+        isotp_fail(link, session, ISOTP_ERR_SEQ);
+        return;
+    }
+
+    if (n > 7)
+    {
+        n = 7;
+    }
+    if (session->buf != NULL)
+    {
+        memcpy(&session->buf[session->offset], &data[1], n);
+    }
+    session->offset += n;
+    session->seq = (session->seq + 1) & 0x0F;
+
+    if (session->offset >= session->length)
+    {
+        session->state = ISOTP_RX_DONE;
+        return;
+    }
+
+    session->deadline = now + ISOTP_TIMEOUT_US;
+    if (session->fc.block_size > 0 && --session->block_left == 0)
+    {
+        session->block_left = session->fc.block_size;
+        isotp_send_fc(link, session, ISOTP_FC_CTS);
+    }
+}
+
+static void isotp_rx_flow_control(isotp_link_t *link, isotp_session_t *session, const uint8_t *data, int64_t now)
+{
+    switch (data[0] & 0x0F)
+    {
+        case ISOTP_FC_CTS:
+            session->tx_block_size = data[1];
+            session->tx_st_min_us = isotp_st_min_to_us(data[2]);
+            session->block_left = data[1];
+            session->state = ISOTP_TX;
+            session->deadline = now;
+            break;
+        case ISOTP_FC_WAIT:
+            session->deadline = now + ISOTP_TIMEOUT_US;
+            break;
+        default:
+            isotp_fail(link, session, ISOTP_ERR_ABORTED);
+            break;
+    }
+}
+
+/*
+ * Routes a received frame to the session of its arbitration ID. Returns the
+ * session when the frame belonged to one, its state tells whether a message
+ * is complete (ISOTP_RX_DONE) or the transfer failed.
+ */
+isotp_session_t *isotp_on_frame(isotp_link_t *link, const twai_message_t *frame, int64_t now)
+{
+    isotp_session_t *session = isotp_find(link, frame->identifier);
+    const uint8_t *data = frame->data;
+
+    if (session == NULL || frame->data_length_code < 1)
+    {
+        return NULL;
+    }
+
+    switch (data[0] & 0xF0)
+    {
+        case ISOTP_PCI_SF:
+        {
+            uint8_t length = data[0] & 0x0F;
+            if (length == 0 || length > 7 || length >= frame->data_length_code)
+            {
+                isotp_fail(link, session, ISOTP_ERR_FRAME);
+                break;
+            }
+            // A new message replaces any transfer in progress
+            if (session->buf != NULL)
+            {
+                uint16_t n = (length <= session->buf_size) ? length : session->buf_size;
+                memcpy(session->buf, &data[1], n);
+            }
+            session->length = length;
+            session->offset = length;
+            session->error = ISOTP_ERR_NONE;
+            session->state = ISOTP_RX_DONE;
+            break;
+        }
+        case ISOTP_PCI_FF:
+            if (frame->data_length_code < 8)
+            {
+                isotp_fail(link, session, ISOTP_ERR_FRAME);
+                break;
+            }
+            isotp_rx_first(link, session, data, now);
+            break;
+        case ISOTP_PCI_CF:
+            if (session->state != ISOTP_RX)
+            {
+                return NULL;
+            }
+            isotp_rx_consecutive(link, session, data, now);
+            break;
+        case ISOTP_PCI_FC:
+            if (session->state != ISOTP_TX_WAIT_FC || frame->data_length_code < 3)
+            {
+                return NULL;
+            }
+            isotp_rx_flow_control(link, session, data, now);
+            break;
+        default:
+            return NULL;
+    }
+
+    return session;
+}
+
+/*
+ * Sends the consecutive frames that are due and expires stalled transfers.
+ * Returns the time the next call is needed, INT64_MAX when nothing is pending.
+ */
+int64_t isotp_poll(isotp_link_t *link, int64_t now)
+{
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < ISOTP_MAX_SESSIONS; i++)
+    {
+        isotp_session_t *session = &link->sessions[i];
+
+        if (!session->in_use)
+        {
+            continue;
+        }
+
+        if ((session->state == ISOTP_RX || session->state == ISOTP_TX_WAIT_FC) && now >= session->deadline)
+        {
+            isotp_fail(link, session, ISOTP_ERR_TIMEOUT);
+            continue;
+        }
+
+        while (session->state == ISOTP_TX && now >= session->deadline)
+        {
+            uint8_t frame[8];
+            uint16_t n = session->length - session->offset;
+
+            if (n > 7)
+            {
+                n = 7;
+            }
+            frame[0] = ISOTP_PCI_CF | session->seq;
+            memcpy(&frame[1], &session->tx_data[session->offset], n);
+            isotp_send_frame(link, session, frame, n + 1);
+            session->offset += n;
+            session->seq = (session->seq + 1) & 0x0F;
+
+            if (session->offset >= session->length)
+            {
+                session->state = ISOTP_TX_DONE;
+            }
+            else if (session->tx_block_size > 0 && --session->block_left == 0)
+            {
+                session->state = ISOTP_TX_WAIT_FC;
+                session->deadline = now + ISOTP_TIMEOUT_US;
+            }
+            else
+            {
+                session->deadline = now + session->tx_st_min_us;
+            }
+        }
+
+        if ((session->state == ISOTP_RX || isotp_tx_active(session)) && session->deadline < next)
+        {
+            next = session->deadline;
+        }
+    }
+
+    return next;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ISOTP_H__
+#define __ISOTP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/twai.h"
+
+#define ISOTP_MAX_SESSIONS      8
+#define ISOTP_MAX_ECU_FC        8
+#define ISOTP_MAX_LENGTH        4095
+#define ISOTP_TIMEOUT_US        1000000     // N_Bs and N_Cr
+#define ISOTP_PADDING           0xAA
+
+typedef enum
+{
+    ISOTP_IDLE = 0,
+    ISOTP_RX,               // first frame received, waiting for consecutive frames
+    ISOTP_RX_DONE,          // complete message, length bytes
+    ISOTP_TX_WAIT_FC,       // first frame or block sent, waiting for flow control
+    ISOTP_TX,               // sending consecutive frames
+    ISOTP_TX_DONE,
+    ISOTP_ERROR,
+}isotp_state_t;
+
+typedef enum
+{
+    ISOTP_ERR_NONE = 0,
+    ISOTP_ERR_SEQ,          // consecutive frame out of order
+    ISOTP_ERR_TIMEOUT,
+    ISOTP_ERR_OVERFLOW,     // message larger than the buffer
+    ISOTP_ERR_ABORTED,      // receiver answered with overflow/abort
+    ISOTP_ERR_FRAME,        // malformed frame
+}isotp_error_t;
+
+// Flow control sent when receiving, the raw STmin byte is sent as is
+typedef struct
+{
+    uint8_t block_size;
+    uint8_t st_min;
+}isotp_fc_params_t;
+
+typedef struct
+{
+    bool in_use;
+    bool extd;
+    uint32_t tx_id;                 // our frames and flow control go here
+    uint32_t rx_id;                 // frames from the ECU
+    isotp_state_t state;
+    isotp_error_t error;
+    isotp_fc_params_t fc;           // flow control we send while receiving
+    uint8_t seq;
+    uint8_t block_left;
+    uint16_t length;
+    uint16_t offset;
+    uint8_t *buf;                   // reassembly buffer, NULL to only track the transfer
+    uint16_t buf_size;
+    const uint8_t *tx_data;
+    uint8_t tx_block_size;          // flow control received while sending
+    uint32_t tx_st_min_us;
+    int64_t deadline;               // timeout, or time the next consecutive frame may go out
+}isotp_session_t;
+
+typedef void (*isotp_send_t)(twai_message_t *frame, void *ctx);
+
+typedef struct
+{
+    uint32_t rx_id;
+    isotp_fc_params_t fc;
+}isotp_ecu_fc_t;
+
+typedef struct
+{
+    isotp_session_t sessions[ISOTP_MAX_SESSIONS];
+    isotp_ecu_fc_t ecu_fc[ISOTP_MAX_ECU_FC];
+    uint8_t ecu_fc_count;
+    isotp_fc_params_t default_fc;
+    isotp_send_t send;
+    void *ctx;
+    uint32_t seq_errors;
+    uint32_t timeouts;
+    uint32_t overflows;
+}isotp_link_t;
+
+void isotp_init(isotp_link_t *link, isotp_send_t send, void *ctx);
+bool isotp_set_fc_params(isotp_link_t *link, uint32_t rx_id, uint8_t block_size, uint8_t st_min);
+void isotp_reset_fc_params(isotp_link_t *link, uint8_t block_size, uint8_t st_min);
+isotp_session_t *isotp_open(isotp_link_t *link, uint32_t tx_id, uint32_t rx_id, bool extd, uint8_t *buf, uint16_t buf_size);
+isotp_session_t *isotp_find(isotp_link_t *link, uint32_t rx_id);
+void isotp_close(isotp_session_t *session);
+void isotp_close_all(isotp_link_t *link);
+bool isotp_send(isotp_link_t *link, isotp_session_t *session, const uint8_t *data, uint16_t length, int64_t now);
+isotp_session_t *isotp_on_frame(isotp_link_t *link, const twai_message_t *frame, int64_t now);
+int64_t isotp_poll(isotp_link_t *link, int64_t now);
+bool isotp_tx_active(const isotp_session_t *session);
+uint32_t isotp_st_min_to_us(uint8_t st_min);
+
+#endif
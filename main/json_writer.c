@@ -0,0 +1,266 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "json_writer.h"
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size)
+{
+	w->buf = buf;
+	w->size = size;
+	w->len = 0;
+	w->overflow = (size == 0);
+	w->need_comma = false;
+}
+
+static void json_writer_put(json_writer_t *w, const char *str, size_t len)
+{
+	// Keep one byte for the terminator
+	if(w->overflow || w->len + len >= w->size)
+	{
+		w->overflow = true;
+		return;
+	}
+	memcpy(&w->buf[w->len], str, len);
+	w->len += len;
+}
+
+void json_writer_begin_object(json_writer_t *w)
+{
+	if(w->need_comma)
+	{
+		json_writer_put(w, ",", 1);
+	}
+	json_writer_put(w, "{", 1);
+	w->need_comma = false;
+}
+
+void json_writer_end_object(json_writer_t *w)
+{
+	json_writer_put(w, "}", 1);
+	w->need_comma = true;
+}
+
+// key is the quoted, escaped name followed by ':'
+void json_writer_key(json_writer_t *w, const char *key)
+{
+	if(w->need_comma)
+	{
+		json_writer_put(w, ",", 1);
+	}
+	json_writer_put(w, key, strlen(key));
+	w->need_comma = false;
+}
+
+void json_writer_number(json_writer_t *w, double value)
+{
+	char num[JSON_NUMBER_MAX_LEN];
+
+	json_writer_put(w, num, json_format_number(num, value));
+	w->need_comma = true;
+}
+
+// str must not need escaping
+void json_writer_string(json_writer_t *w, const char *str)
+{
+	json_writer_put(w, "\"", 1);
+	json_writer_put(w, str, strlen(str));
+	json_writer_put(w, "\"", 1);
+	w->need_comma = true;
+}
+
+const char *json_writer_finish(json_writer_t *w)
+{
+	if(w->overflow)
+	{
+		return NULL;
+	}
+	w->buf[w->len] = '\0';
+	return w->buf;
+}
+
+/*
+ * The text the cJSON tree printed after limitJsonDecimalPrecision(): the
+ * value went through "%.2f" with trailing zeros removed and atof(), then
+ * cJSON printed it with "%1.15g", or "%1.17g" when that doesn't read back
+ * as the same value.
+ */
+static size_t json_format_number_printf(char *out, double value)
+{
+	char fixed[32];
+	double d = value;
+
+	// From 1e15 on a double has no hundredths left to round
+	if(fabs(value) < 1e15)
+	{
+		size_t len = snprintf(fixed, sizeof(fixed), "%.2f", value);
+
+		while(fixed[len - 1] == '0')
+		{
+			len--;
+		}
+		if(fixed[len - 1] == '.')
+		{
+			len--;
+		}
+		fixed[len] = '\0';
+		d = strtod(fixed, NULL);
+	}
+
+	if(d == 0)
+	{
+		// cJSON took the integer path, no sign on zero
+		memcpy(out, "0", 2);
+		return 1;
+	}
+
+	size_t len = snprintf(out, JSON_NUMBER_MAX_LEN, "%1.15g", d);
+	double test = strtod(out, NULL);
+	if(fabs(test - d) > fmax(fabs(test), fabs(d)) * DBL_EPSILON)
+	{
+		len = snprintf(out, JSON_NUMBER_MAX_LEN, "%1.17g", d);
+	}
+
+	return len;
+}
+
+/*
+ * Same text as json_format_number_printf() without printf for the values
+ * autopid publishes. Below 1e13 the rounded value has at most 15 significant
+ * digits, which "%1.15g" prints as they are. "%.2f" rounds the exact value,
+ * value * 100 in a double doesn't hold it, so the distance to the rounded
+ * hundredths comes from fma(). Within a hair of a half, e.g. 0.005 which is
+ * slightly above, the rounding is left to printf.
+ * out holds JSON_NUMBER_MAX_LEN.
+ */
+size_t json_format_number(char *out, double value)
+{
+	char digits[20];
+	size_t len = 0;
+	uint8_t n = 0;
+
+	if(!isfinite(value))
+	{
+		memcpy(out, "null", 5);
+		return 4;
+	}
+
+	if(fabs(value) >= 1e13)
+	{
+		return json_format_number_printf(out, value);
+	}
+
+	double rounded = nearbyint(value * 100.0);
+	double rest = fma(value, 100.0, -rounded);
+	if(fabs(fabs(rest) - 0.5) < 1e-9)
+	{
+		return json_format_number_printf(out, value);
+	}
+	// value * 100 was rounded across the half
+	if(rest > 0.5)
+	{
+		rounded += 1;
+	}
+	else if(rest < -0.5)
+	{
+		rounded -= 1;
+	}
+
+	int64_t scaled = (int64_t)rounded;
+	uint64_t abs_scaled = (scaled < 0) ? -(uint64_t)scaled : (uint64_t)scaled;
+	uint64_t integer = abs_scaled / 100;
+	uint8_t frac = abs_scaled % 100;
+
+	if(scaled < 0)
+	{
+		out[len++] = '-';
+	}
+	do
+	{
+		digits[n++] = '0' + (integer % 10);
+		integer /= 10;
+	}while(integer != 0);
+	while(n > 0)
+	{
+		out[len++] = digits[--n];
+	}
+
+	if(frac != 0)
+	{
+		out[len++] = '.';
+		out[len++] = '0' + frac / 10;
+		if(frac % 10 != 0)
+		{
+			out[len++] = '0' + frac % 10;
+		}
+	}
+	out[len] = '\0';
+
+	return len;
+}
+
+// Builds "name": with the name escaped, done once when the profile is loaded
+char *json_writer_make_key(const char *name)
+{
+	size_t len = 3;
+
+	if(name == NULL)
+	{
+		return NULL;
+	}
+
+	for(const char *c = name; *c != '\0'; c++)
+	{
+		len += ((uint8_t)*c < 0x20) ? 6 : (*c == '"' || *c == '\\') ? 2 : 1;
+	}
+
+	char *key = malloc(len + 1);
+	if(key == NULL)
+	{
+		return NULL;
+	}
+
+	char *p = key;
+	*p++ = '"';
+	for(const char *c = name; *c != '\0'; c++)
+	{
+		if((uint8_t)*c < 0x20)
+		{
+			p += sprintf(p, "\\u%04x", (uint8_t)*c);
+		}
+		else
+		{
+			if(*c == '"' || *c == '\\')
+			{
+				*p++ = '\\';
+			}
+			*p++ = *c;
+		}
+	}
+	*p++ = '"';
+	*p++ = ':';
+	*p = '\0';
+
+	return key;
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __JSON_WRITER_H__
+#define __JSON_WRITER_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Appends JSON straight into a caller owned buffer, nothing is allocated.
+// Keys are written as prepared by json_writer_make_key(). Once the buffer is
+// full further writes are dropped and json_writer_finish() returns NULL.
+typedef struct {
+	char *buf;
+	size_t size;
+	size_t len;
+	bool overflow;
+	bool need_comma;
+}json_writer_t;
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+void json_writer_begin_object(json_writer_t *w);
+void json_writer_end_object(json_writer_t *w);
+void json_writer_key(json_writer_t *w, const char *key);
+void json_writer_number(json_writer_t *w, double value);
+void json_writer_string(json_writer_t *w, const char *str);
+const char *json_writer_finish(json_writer_t *w);
+size_t json_format_number(char *out, double value);
+char *json_writer_make_key(const char *name);
+
+#define JSON_NUMBER_MAX_LEN			32		// "%1.17g" of any double
+#endif
@@ -53,6 +53,9 @@
 #include "esp_mac.h"
 #include "ftp.h"
 #include "autopid.h"
+#include "can_ring.h"
+#include "can_trace.h"
+#include "dev_buffer.h"
 #include "wc_mdns.h"
 #include "hw_config.h"
 #include "dev_status.h"
@@ -65,16 +68,15 @@
 #define BLE_EN_PIN_SEL		(1ULL<<BLE_EN_PIN_NUM)
 #define BLE_Enabled()		(!gpio_get_level(BLE_EN_PIN_NUM))
 
-static QueueHandle_t xMsg_Tx_Queue, xMsg_Rx_Queue, xmsg_ws_tx_queue, xmsg_ble_tx_queue, xmsg_uart_tx_queue, xmsg_obd_rx_queue, xmsg_mqtt_rx_queue;
+static QueueHandle_t xMsg_Tx_Queue, xMsg_Rx_Queue, xmsg_ws_tx_queue, xmsg_ble_tx_queue, xmsg_uart_tx_queue, xmsg_mqtt_rx_queue;
 static xdev_buffer ucTCP_RX_Buffer;
-static xdev_buffer ucTCP_TX_Buffer;
+static dev_buffer_t *ucTCP_TX_Buffer = NULL;
 
 static uint8_t protocol = SLCAN;
 
 uint8_t project_hardware_rev;
 int FTP_TASK_FINISH_BIT = BIT2;
 EventGroupHandle_t xEventTask;
-static uint8_t mqtt_elm327_log_en = 0;
 static uint8_t derived_mac_addr[6] = {0};
 static uint8_t uid[16];
 static uint8_t ble_uid[33];
@@ -105,6 +107,7 @@ static void log_can_to_mqtt(twai_message_t *frame, uint8_t type)
 	mqtt_msg.frame.data[7] = frame->data[7];
 
 	mqtt_msg.type = type;
+	mqtt_msg.timestamp = esp_timer_get_time();
 	xQueueSend( xmsg_mqtt_rx_queue, ( void * ) &mqtt_msg, pdMS_TO_TICKS(0) );
 }
 static void process_led(bool state)
@@ -142,25 +145,29 @@ static void process_led(bool state)
 	}
 }
 
+// A reply waits at most this long for the pool or the queue, a stalled
+// sink drops it instead of blocking the protocol task
+#define SEND_TO_HOST_WAIT_MS		200
+
 //TODO: make this pretty?
 void send_to_host(char* str, uint32_t len, QueueHandle_t *q)
 {
-	static xdev_buffer xsend_buffer;
-
 	if(len == 0)
 	{
-		xsend_buffer.usLen = strlen(str);
+		len = strlen(str);
 	}
-	else
+
+	dev_buffer_t *xsend_buffer = dev_buffer_alloc((uint8_t*)str, len, pdMS_TO_TICKS(SEND_TO_HOST_WAIT_MS));
+	if(xsend_buffer == NULL)
 	{
-		xsend_buffer.usLen = len;
+		ESP_LOGW(TAG, "no buffer, reply dropped");
+		return;
 	}
-	memcpy(xsend_buffer.ucElement, str, xsend_buffer.usLen);
-	xQueueSend( *q, ( void * ) &xsend_buffer, portMAX_DELAY );
-
-//	ESP_LOG_BUFFER_HEX(TAG, ucTCP_TX_Buffer.ucElement, xsend_buffer.usLen);
-	memset(xsend_buffer.ucElement, 0, sizeof(xsend_buffer.ucElement));
-	xsend_buffer.usLen = 0;
+	if(!dev_buffer_send(*q, xsend_buffer, pdMS_TO_TICKS(SEND_TO_HOST_WAIT_MS)))
+	{
+		ESP_LOGW(TAG, "sink stalled, reply dropped");
+	}
+	dev_buffer_free(xsend_buffer);
 //	ESP_LOGI(TAG, "%s", str);
 }
 
@@ -236,6 +243,52 @@ static void can_tx_task(void *pvParameters)
 	}
 }
 #define HEAP_CAPS   (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define TCP_TX_STREAM_LATENCY_MS	5
+
+#define CAN_RX_WAIT_MS			50
+#define CAN_RX_BATCH_MAX		32
+
+// Streaming encoders, append one frame and return its length or 0 if it doesn't fit
+static uint16_t can_rx_encode(uint8_t *buf, uint16_t size, twai_message_t *frame, int64_t rx_time)
+{
+	if(protocol == SAVVYCAN)
+	{
+		return gvret_encode_frame(buf, size, frame, rx_time);
+	}
+
+	return slcan_encode_frame(buf, size, frame, rx_time);
+}
+
+// Queues the pending buffer to every connected host and drops our reference
+static void can_rx_dispatch(dev_buffer_t **buf)
+{
+	if(*buf == NULL)
+	{
+		return;
+	}
+
+	if((*buf)->total_len != 0)
+	{
+		if(tcp_port_open())
+		{
+			dev_buffer_send(xMsg_Tx_Queue, *buf, pdMS_TO_TICKS(0));
+		}
+		if(ble_connected())
+		{
+			dev_buffer_send(xmsg_ble_tx_queue, *buf, pdMS_TO_TICKS(0));
+		}
+		else if(project_hardware_rev == WICAN_USB_V100)
+		{
+			if(!config_server_mqtt_en_config())
+			{
+				dev_buffer_send(xmsg_uart_tx_queue, *buf, pdMS_TO_TICKS(0));
+			}
+		}
+	}
+	dev_buffer_free(*buf);
+	*buf = NULL;
+}
+
 static void can_rx_task(void *pvParameters)
 {
 //	static uint32_t num_msg = 0;
@@ -274,100 +327,134 @@ static void can_rx_task(void *pvParameters)
 		
 		dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
 
-        while(can_receive(&rx_msg, 0) ==  ESP_OK)
+		// Sleep in the driver until a frame arrives, the timeout only lets the
+		// LED turn off and the awake bit be checked again while the bus is idle
+		esp_err_t ret = can_receive(&rx_msg, pdMS_TO_TICKS(CAN_RX_WAIT_MS));
+		if(ret == ESP_ERR_TIMEOUT)
+		{
+			can_rx_stats_account(0, 0);
+			continue;
+		}
+		else if(ret != ESP_OK)
+		{
+			// Driver is being reinstalled, don't spin
+			vTaskDelay(pdMS_TO_TICKS(1));
+			continue;
+		}
+
+		uint32_t queue_depth = can_msgs_to_rx() + 1;
+		uint32_t batch = 0;
+
+		// Drain what is already queued, bounded so the ring readers get
+		// notified regularly under a flood
+        do
         {
-//        	num_msg++;
+        	// Stamp the frame before anything else, every encoder uses this time
+        	int64_t rx_time = esp_timer_get_time();
+        	batch++;
 
         	process_led(1);
 
+        	// The ELM327 and MQTT read the frames from the ring with their own cursor
+        	can_ring_push(&rx_msg, rx_time);
+
         	if(config_server_ws_connected())
         	{
-        		ucTCP_TX_Buffer.usLen = slcan_parse_frame(ucTCP_TX_Buffer.ucElement, &rx_msg);
-				if(config_server_ws_connected())
+        		dev_buffer_t *ws_tx_buffer = dev_buffer_alloc(NULL, 0, 0);
+				if(ws_tx_buffer != NULL)
 				{
-					xQueueSend( xmsg_ws_tx_queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
+					dev_buffer_commit(ws_tx_buffer, slcan_parse_frame(ws_tx_buffer->data, &rx_msg, rx_time));
+					dev_buffer_send(xmsg_ws_tx_queue, ws_tx_buffer, pdMS_TO_TICKS(0));
+					dev_buffer_free(ws_tx_buffer);
 				}
         	}
         	//TODO: optimize, useless ifs
 			if(tcp_port_open() || ble_connected() || project_hardware_rev == WICAN_USB_V100 || mqtt_connected() || protocol == AUTO_PID )
 			{
-				memset(ucTCP_TX_Buffer.ucElement, 0, sizeof(ucTCP_TX_Buffer.ucElement));
-				ucTCP_TX_Buffer.usLen = 0;
-
-				if(protocol == SLCAN)
-				{
-					ucTCP_TX_Buffer.usLen = slcan_parse_frame(ucTCP_TX_Buffer.ucElement, &rx_msg);
-				}
-				else if(protocol == REALDASH)
+				if(protocol == SLCAN || protocol == SAVVYCAN)
 				{
-					ucTCP_TX_Buffer.usLen = real_dash_set_66(&rx_msg, ucTCP_TX_Buffer.ucElement);
-				}
-				else if(protocol == SAVVYCAN)
-				{
-					ucTCP_TX_Buffer.usLen = gvret_parse_can_frame(ucTCP_TX_Buffer.ucElement, &rx_msg);
-				}
-				else if(protocol == OBD_ELM327 || protocol == AUTO_PID)
-				{
-					// Let elm327.c decide which messages to process
-					if(elm327_ready_to_receive())
-					{
-						xQueueSend( xmsg_obd_rx_queue, ( void * ) &rx_msg, pdMS_TO_TICKS(0) );
-					}
-				}
+					// Pack as many frames as fit in one buffer, it is sent when
+					// full or at the end of the batch
+					uint16_t len = 0;
 
-				if(ucTCP_TX_Buffer.usLen != 0)
-				{
-					if(tcp_port_open())
+					if(ucTCP_TX_Buffer != NULL)
 					{
-						xQueueSend( xMsg_Tx_Queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
+						len = can_rx_encode(&ucTCP_TX_Buffer->data[ucTCP_TX_Buffer->len],
+											DEV_SEGMENT_SIZE - ucTCP_TX_Buffer->len, &rx_msg, rx_time);
 					}
-					if(ble_connected())
+					if(len == 0)
 					{
-						xQueueSend( xmsg_ble_tx_queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
-					}
-					else if(project_hardware_rev == WICAN_USB_V100)
-					{
-						if(!config_server_mqtt_en_config())
+						can_rx_dispatch(&ucTCP_TX_Buffer);
+						// NULL if the pool is empty, the hosts are not keeping up
+						// and the frame is dropped
+						ucTCP_TX_Buffer = dev_buffer_alloc(NULL, 0, 0);
+						if(ucTCP_TX_Buffer != NULL)
 						{
-							xQueueSend( xmsg_uart_tx_queue, ( void * ) &ucTCP_TX_Buffer, pdMS_TO_TICKS(0) );
+							len = can_rx_encode(ucTCP_TX_Buffer->data, DEV_SEGMENT_SIZE, &rx_msg, rx_time);
 						}
 					}
+					if(ucTCP_TX_Buffer != NULL)
+					{
+						dev_buffer_commit(ucTCP_TX_Buffer, len);
+					}
 				}
-			}
-			if(mqtt_connected())
-			{
-				static mqtt_can_message_t mqtt_rx_msg;
-				if(mqtt_elm327_log_en == 0)
+				else if(protocol == REALDASH)
 				{
-					mqtt_rx_msg.frame.extd = rx_msg.extd;
-					mqtt_rx_msg.frame.rtr = rx_msg.rtr;
-					mqtt_rx_msg.frame.ss = rx_msg.ss;
-					mqtt_rx_msg.frame.self = rx_msg.self;
-					mqtt_rx_msg.frame.dlc_non_comp = rx_msg.dlc_non_comp;
-					mqtt_rx_msg.frame.identifier = rx_msg.identifier;
-					mqtt_rx_msg.frame.data_length_code = rx_msg.data_length_code;
-
-					mqtt_rx_msg.frame.data[0] = rx_msg.data[0];
-					mqtt_rx_msg.frame.data[1] = rx_msg.data[1];
-					mqtt_rx_msg.frame.data[2] = rx_msg.data[2];
-					mqtt_rx_msg.frame.data[3] = rx_msg.data[3];
-					mqtt_rx_msg.frame.data[4] = rx_msg.data[4];
-					mqtt_rx_msg.frame.data[5] = rx_msg.data[5];
-					mqtt_rx_msg.frame.data[6] = rx_msg.data[6];
-					mqtt_rx_msg.frame.data[7] = rx_msg.data[7];
-
-					mqtt_rx_msg.type = MQTT_CAN;
-					xQueueSend( xmsg_mqtt_rx_queue, ( void * ) &mqtt_rx_msg, pdMS_TO_TICKS(0) );
+					ucTCP_TX_Buffer = dev_buffer_alloc(NULL, 0, 0);
+					if(ucTCP_TX_Buffer != NULL)
+					{
+						memset(ucTCP_TX_Buffer->data, 0, DEV_SEGMENT_SIZE);
+						dev_buffer_commit(ucTCP_TX_Buffer, real_dash_set_66(&rx_msg, ucTCP_TX_Buffer->data));
+						can_rx_dispatch(&ucTCP_TX_Buffer);
+					}
 				}
 			}
-        }
-        vTaskDelay(pdMS_TO_TICKS(1));
+        }while(batch < CAN_RX_BATCH_MAX && can_receive(&rx_msg, 0) == ESP_OK);
+
+        can_rx_dispatch(&ucTCP_TX_Buffer);
+
+        can_ring_notify();
+        can_rx_stats_account(batch, queue_depth);
+	}
+}
+
+// In AUTO_PID mode only the responses of the polled ECUs and the MQTT
+// CAN filter IDs are used, let the controller drop everything else
+static void plan_can_filter(void)
+{
+	static can_filter_id_t ids[CAN_FILTER_PLAN_MAX_IDS];
+	twai_filter_config_t plan;
+
+	if(config_server_can_trace_config() == 1)
+	{
+		ESP_LOGI(TAG, "CAN trace recording, accepting all frames");
+		return;
+	}
+
+	int32_t count = autopid_get_rx_ids(ids, CAN_FILTER_PLAN_MAX_IDS);
+
+	if(count > 0 && config_server_mqtt_en_config())
+	{
+		int32_t mqtt_count = mqtt_get_filter_ids(&ids[count], CAN_FILTER_PLAN_MAX_IDS - count);
+		count = (mqtt_count < 0) ? -1 : count + mqtt_count;
+	}
+
+	if(count <= 0 || !can_plan_filter(ids, count, &plan))
+	{
+		ESP_LOGW(TAG, "CAN filter not planned, accepting all frames");
+		return;
 	}
+
+	can_disable();
+	can_set_filter_config(&plan);
+	can_enable();
 }
 
 void app_main(void)
 {
 	dev_status_init();
+	can_ring_init();
+	dev_buffer_init();
 	dev_status_set_bits(DEV_AWAKE_BIT);
     ESP_ERROR_CHECK(nvs_flash_init());
     ESP_ERROR_CHECK(esp_netif_init());
@@ -395,8 +482,10 @@ void app_main(void)
     gpio_set_level(CAN_STDBY_GPIO_NUM, 1);
 
     xMsg_Rx_Queue = xQueueCreate(16, sizeof( xdev_buffer) );
-    xMsg_Tx_Queue = xQueueCreate(16, sizeof( xdev_buffer) );
-    xmsg_ws_tx_queue = xQueueCreate(8, sizeof( xdev_buffer) );
+    // Segment quotas: TCP 16, WS 8, BLE 12, UART 8, together the pool
+    // minus DEV_SEGMENT_RESERVE
+    xMsg_Tx_Queue = dev_buffer_queue_create(16, 16);
+    xmsg_ws_tx_queue = dev_buffer_queue_create(8, 8);
 
 	esp_ota_mark_app_valid_cancel_rollback();
 //    xmsg_obd_rx_queue = xQueueCreate(100, sizeof( twai_message_t) );
@@ -462,25 +551,22 @@ void app_main(void)
 //		can_init(CAN_500K);
 		can_set_bitrate(can_datarate);
 		can_enable();
-		xmsg_obd_rx_queue = xQueueCreate(32, sizeof( twai_message_t) );
 		
 		if(config_server_mqtt_en_config() && config_server_mqtt_elm327_log())
 		{
-			mqtt_elm327_log_en = config_server_mqtt_elm327_log();
-			elm327_init(&send_to_host, &xmsg_obd_rx_queue, log_can_to_mqtt);
+			elm327_init(&send_to_host, log_can_to_mqtt);
 		}
 		else
 		{
-			elm327_init(&send_to_host, &xmsg_obd_rx_queue, NULL);
+			elm327_init(&send_to_host, NULL);
 		}
 	}
 	else if(protocol == AUTO_PID)
 	{
 		can_set_bitrate(can_datarate);
 		can_enable();
-		xmsg_obd_rx_queue = xQueueCreate(32, sizeof( twai_message_t) );
 		
-		elm327_init(&autopid_parser, &xmsg_obd_rx_queue, NULL);
+		elm327_init(&autopid_parser, NULL);
 		autopid_init((char*)&uid[0]);
 	}
 
@@ -491,6 +577,16 @@ void app_main(void)
 		can_enable();
 		mqtt_init((char*)&uid[0], CONNECTED_LED_GPIO_NUM, &xmsg_mqtt_rx_queue);
 	}
+
+	if(config_server_can_trace_config() == 1)
+	{
+		can_trace_init();
+	}
+
+	if(protocol == AUTO_PID)
+	{
+		plan_can_filter();
+	}
 //	else if(protocol == MQTT)
 //	{
 //		xmsg_mqtt_rx_queue = xQueueCreate(100, sizeof( twai_message_t) );
@@ -518,13 +614,19 @@ void app_main(void)
 		else
 		{
 			tcp_server_init(port, &xMsg_Tx_Queue, &xMsg_Rx_Queue, CONNECTED_LED_GPIO_NUM, 0);
+			// Streamed frames can wait a little to share a segment, ELM327
+			// replies go out as soon as they are queued
+			if(protocol != OBD_ELM327)
+			{
+				tcp_server_set_tx_latency(TCP_TX_STREAM_LATENCY_MS);
+			}
 		}
 	}
 	
     if(config_server_get_ble_config())
     {
     	int pass = config_server_ble_pass();
-    	xmsg_ble_tx_queue = xQueueCreate(100, sizeof( xdev_buffer) );
+    	xmsg_ble_tx_queue = dev_buffer_queue_create(100, 12);
     	ble_init(&xmsg_ble_tx_queue, &xMsg_Rx_Queue, CONNECTED_LED_GPIO_NUM, pass, &ble_uid[0]);
     }
 
@@ -558,7 +660,7 @@ void app_main(void)
         	ESP_LOGI(TAG, "project_hardware_rev: USB");
         	if(!config_server_mqtt_en_config())
         	{
-        	    xmsg_uart_tx_queue = xQueueCreate(32, sizeof( xdev_buffer) );
+        	    xmsg_uart_tx_queue = dev_buffer_queue_create(32, 8);
         		wc_uart_init(&xmsg_uart_tx_queue, &xMsg_Rx_Queue, CONNECTED_LED_GPIO_NUM);
         	}
 
@@ -63,6 +63,10 @@
 #include "expression_parser.h"
 #include "autopid.h"
 #include "dev_status.h"
+#include "can_ring.h"
+#include "mqtt_outbox.h"
+#include "mqtt_canflt.h"
+#include "mqtt_batch.h"
 
 #define TAG 		__func__
 // #define TAG 		"MQTT_CLIENT"
@@ -83,24 +87,12 @@ static uint8_t mqtt_led = 0;
 
 static QueueHandle_t *xmqtt_tx_queue;
 static uint8_t mqtt_elm327_log = 0;
-static SemaphoreHandle_t xmqtt_semaphore;
+static can_ring_reader_t mqtt_can_reader;
+static bool mqtt_elm327_log_active = false;      // the ELM327 logs its frames instead of the bus being forwarded
+static bool mqtt_outbox_en = false;              // messages are stored on flash while the broker is unreachable
 
 
-typedef struct 
-{
-    uint32_t can_id;
-    char name[16];
-	int32_t pid;
-    int32_t pidi;
-    uint32_t start_bit;
-    uint32_t bit_length;
-    char expression[32];
-    uint32_t cycle;
-	int64_t logtime;
-} CANFilter;
-
-static CANFilter *mqtt_canflt_values = NULL;
-static uint32_t mqtt_canflt_size = 0;
+static mqtt_canflt_t mqtt_canflt;
 
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
@@ -323,32 +315,235 @@ int mqtt_connected(void)
 	else return 0;
 }
 
-static int8_t mqtt_canflt_find_id(uint32_t id, uint8_t start_index)
+// Takes the next received CAN frame from the fan-out ring
+static bool mqtt_can_read(mqtt_can_message_t *msg)
+{
+	static can_ring_frame_t item;
+
+	if(!can_ring_read(&mqtt_can_reader, &item, 0))
+	{
+		return false;
+	}
+
+	msg->type = MQTT_CAN;
+	msg->frame = item.frame;
+	msg->timestamp = item.timestamp;
+	return true;
+}
+
+// Payload formats of the can/rx topic
+//
+// json:   {"bus":"0","type":"rx","ts":..,"frame":[{"id":..,"dlc":..,..},..]}
+// binary: 16 byte header "WC", version, 0, uint32 frame count, uint64 ts_us of
+//         the first frame, then one 16 byte record per frame: uint32 id with
+//         bit 31 extended and bit 30 rtr, uint8 dlc (0-8), uint24 us since the
+//         previous frame (saturated), 8 data bytes. Little endian
+// cbor:   indefinite array of [ts_us, id, flags, data] with flags bit 0
+//         extended and bit 1 rtr, data a byte string of dlc bytes
+typedef enum
+{
+	MQTT_RX_JSON = 0,
+	MQTT_RX_BINARY,
+	MQTT_RX_CBOR,
+}mqtt_rx_format_t;
+
+#define MQTT_RX_BIN_VERSION			1
+#define MQTT_RX_BIN_RECORD_SIZE		16
+#define MQTT_RX_BIN_EXTD			(1UL << 31)
+#define MQTT_RX_BIN_RTR				(1UL << 30)
+#define MQTT_RX_JSON_FRAME_MAX		128		// worst case object, 20 digit ts_us and 255 in every byte
+#define MQTT_RX_CBOR_FRAME_MAX		25
+
+typedef struct
+{
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	uint32_t count;
+	int64_t prev_ts;
+	mqtt_rx_format_t format;
+}mqtt_rx_batch_t;
+
+static mqtt_rx_format_t mqtt_rx_format = MQTT_RX_JSON;
+
+static void mqtt_put_le(uint8_t *p, uint64_t value, uint8_t bytes)
+{
+	for(uint8_t i = 0; i < bytes; i++)
+	{
+		p[i] = (uint8_t)(value >> (8 * i));
+	}
+}
+
+static size_t mqtt_cbor_head(uint8_t *p, uint8_t major, uint64_t value)
 {
-	if(mqtt_canflt_size == 0)
+	uint8_t bytes;
+
+	if(value < 24)
+	{
+		p[0] = (major << 5) | (uint8_t)value;
+		return 1;
+	}
+	else if(value <= UINT8_MAX)
+	{
+		p[0] = (major << 5) | 24;
+		bytes = 1;
+	}
+	else if(value <= UINT16_MAX)
 	{
-		return -1;
+		p[0] = (major << 5) | 25;
+		bytes = 2;
 	}
-	for(uint32_t i = start_index; i < mqtt_canflt_size; i++)
+	else if(value <= UINT32_MAX)
 	{
-		if(mqtt_canflt_values[i].can_id == id)
+		p[0] = (major << 5) | 26;
+		bytes = 4;
+	}
+	else
+	{
+		p[0] = (major << 5) | 27;
+		bytes = 8;
+	}
+
+	for(uint8_t i = 0; i < bytes; i++)
+	{
+		p[1 + i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+	}
+	return 1 + bytes;
+}
+
+static void mqtt_rx_batch_begin(mqtt_rx_batch_t *batch, mqtt_rx_format_t format, const char *type, int64_t ts)
+{
+	batch->len = 0;
+	batch->count = 0;
+	batch->prev_ts = ts;
+	batch->format = format;
+
+	switch(format)
+	{
+		case MQTT_RX_BINARY:
+			batch->buf[0] = 'W';
+			batch->buf[1] = 'C';
+			batch->buf[2] = MQTT_RX_BIN_VERSION;
+			batch->buf[3] = 0;
+			mqtt_put_le(&batch->buf[8], (uint64_t)ts, 8);
+			batch->len = MQTT_RX_BIN_RECORD_SIZE;
+			break;
+
+		case MQTT_RX_CBOR:
+			batch->buf[batch->len++] = 0x9F;
+			break;
+
+		default:
+			// The batch is stamped with its first frame, each frame carries its own ts_us
+			batch->len = snprintf((char*)batch->buf, batch->size, "{\"bus\":\"0\",\"type\":\"%s\",\"ts\":%lu,\"frame\":[", type, (uint32_t)((ts/1000)%60000));
+			break;
+	}
+}
+
+// True when a worst case frame and the closing bytes still fit
+static bool mqtt_rx_batch_room(const mqtt_rx_batch_t *batch)
+{
+	switch(batch->format)
+	{
+		case MQTT_RX_BINARY:
+			return batch->len + MQTT_RX_BIN_RECORD_SIZE <= batch->size;
+		case MQTT_RX_CBOR:
+			return batch->len + MQTT_RX_CBOR_FRAME_MAX + 1 <= batch->size;
+		default:
+			return batch->len + MQTT_RX_JSON_FRAME_MAX + 3 <= batch->size;
+	}
+}
+
+static void mqtt_rx_batch_add(mqtt_rx_batch_t *batch, const mqtt_can_message_t *msg)
+{
+	const twai_message_t *frame = &msg->frame;
+	uint8_t *p = batch->buf + batch->len;
+	uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+
+	switch(batch->format)
+	{
+		case MQTT_RX_BINARY:
 		{
-			return i;
+			int64_t delta = msg->timestamp - batch->prev_ts;
+
+			if(delta < 0)
+			{
+				delta = 0;
+			}
+			else if(delta > 0xFFFFFF)
+			{
+				delta = 0xFFFFFF;
+			}
+			mqtt_put_le(p, frame->identifier | (frame->extd ? MQTT_RX_BIN_EXTD : 0) | (frame->rtr ? MQTT_RX_BIN_RTR : 0), 4);
+			p[4] = dlc;
+			mqtt_put_le(&p[5], (uint64_t)delta, 3);
+			memcpy(&p[8], frame->data, 8);
+			batch->len += MQTT_RX_BIN_RECORD_SIZE;
+			break;
 		}
+
+		case MQTT_RX_CBOR:
+			p += mqtt_cbor_head(p, 4, 4);
+			p += mqtt_cbor_head(p, 0, (uint64_t)msg->timestamp);
+			p += mqtt_cbor_head(p, 0, frame->identifier);
+			p += mqtt_cbor_head(p, 0, (frame->extd ? 1 : 0) | (frame->rtr ? 2 : 0));
+			p += mqtt_cbor_head(p, 2, dlc);
+			memcpy(p, frame->data, dlc);
+			batch->len = (p + dlc) - batch->buf;
+			break;
+
+		default:
+			batch->len += snprintf((char*)p, batch->size - batch->len, "{\"id\":%lu,\"dlc\":%u,\"rtr\":%s,\"extd\":%s,\"ts_us\":%lld,\"data\":[%u,%u,%u,%u,%u,%u,%u,%u]},",
+									frame->identifier, frame->data_length_code, frame->rtr?"true":"false", frame->extd?"true":"false", msg->timestamp,
+									frame->data[0], frame->data[1], frame->data[2], frame->data[3], frame->data[4], frame->data[5], frame->data[6], frame->data[7]);
+			break;
+	}
+	batch->prev_ts = msg->timestamp;
+	batch->count++;
+}
+
+// Closes the batch and returns the payload length
+static size_t mqtt_rx_batch_end(mqtt_rx_batch_t *batch)
+{
+	switch(batch->format)
+	{
+		case MQTT_RX_BINARY:
+			mqtt_put_le(&batch->buf[4], batch->count, 4);
+			break;
+
+		case MQTT_RX_CBOR:
+			batch->buf[batch->len++] = 0xFF;
+			break;
+
+		default:
+			if(batch->count > 0)
+			{
+				batch->len--;
+			}
+			batch->len += snprintf((char*)batch->buf + batch->len, batch->size - batch->len, "]}");
+			break;
 	}
+	return batch->len;
+}
 
-	return -1;
+// Publishes a value decoded by the CAN filters, ctx is the topic
+static void mqtt_publish_filter_value(const CANFilter *filter, double value, void *ctx)
+{
+	// %lf of a double can take over 300 characters
+	static char json[sizeof(filter->name) + 340];
+
+	snprintf(json, sizeof(json), "{\"%s\": %lf}", filter->name, value);
+	mqtt_publish((char*)ctx, json, 0, 0, 0);
 }
 
 #define JSON_BUF_SIZE		2048
 static void mqtt_task(void *pvParameters)
 {
 	static char json_buffer[JSON_BUF_SIZE] = {0};
-	static char tmp[150];
 	mqtt_can_message_t tx_frame;
+	mqtt_rx_batch_t batch = {.buf = (uint8_t*)json_buffer, .size = JSON_BUF_SIZE};
 	static char mqtt_topic[64];
     static char mqtt_elm327_topic[64];
-	static uint64_t can_data = 0;
 
 	// sprintf(mqtt_topic, "wican/%s/can/rx", device_id);
     strcpy(mqtt_topic, config_server_get_mqtt_rx_topic());
@@ -365,134 +560,121 @@ static void mqtt_task(void *pvParameters)
 
 	while(1)
 	{
-		xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, portMAX_DELAY);
+		// The queue only carries ELM327 log frames, bus traffic comes from the ring
+		if(mqtt_elm327_log_active)
+		{
+			xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, portMAX_DELAY);
+		}
+		else
+		{
+			can_ring_wait(&mqtt_can_reader, portMAX_DELAY);
+			tx_frame.type = MQTT_CAN;
+		}
         dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
-		if(mqtt_connected())
+		// Decoded filter values are kept in the outbox while offline, raw
+		// frames and the ELM327 log are only forwarded live
+		if(mqtt_connected() || (mqtt_outbox_en && tx_frame.type == MQTT_CAN && mqtt_canflt.size != 0))
 		{
 			json_buffer[0] = 0;
             
             if(tx_frame.type == MQTT_CAN)
             {
-                if(mqtt_canflt_size != 0)
+                if(mqtt_canflt.size != 0)
                 {
-                    uint8_t start_index = 0;
-                    int8_t found_index = -1;
-                    static uint64_t value = 0;
-                    static double expression_result = 0;
-                    
-                    xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
-
-                    while ((found_index = mqtt_canflt_find_id(tx_frame.frame.identifier, start_index)) != -1)
+                    // Decode everything the ring holds before blocking again
+                    while(mqtt_can_read(&tx_frame))
                     {
-                        
-
-                        // Check if expecting PID
-                        if(mqtt_canflt_values[found_index].pid != -1)
-                        {
-                            if(mqtt_canflt_values[found_index].pid != tx_frame.frame.data[mqtt_canflt_values[found_index].pidi])
-                            {
-                                start_index = found_index + 1;
-                                continue;
-                            }
-                        }
-
-                        if(esp_timer_get_time() - mqtt_canflt_values[found_index].logtime < (mqtt_canflt_values[found_index].cycle*1000))
-                        {
-                            break;
-                        }
-                        mqtt_canflt_values[found_index].logtime = esp_timer_get_time();
-                        for (uint8_t i = 0; i < 8; i++) 
-                        {
-                            can_data = (can_data << 8) | tx_frame.frame.data[i];
-                        }
-
-                        uint64_t start_bit = 64 - mqtt_canflt_values[found_index].start_bit - mqtt_canflt_values[found_index].bit_length;
-                        uint64_t bit_length = mqtt_canflt_values[found_index].bit_length;
-
-                        uint64_t mask = ((1ULL << bit_length) - 1ULL) << start_bit;
-
-                        value = (can_data & mask) >> start_bit;
-
-
-
-                        ESP_LOGI(TAG, "-----------");
-                        ESP_LOGI(TAG, "can_data: %llx, mask: %llx, value: %llx\r\n", can_data, mask, value);
-
-                        if(evaluate_expression((uint8_t *)mqtt_canflt_values[found_index].expression, (uint8_t *)tx_frame.frame.data, (double)value, &expression_result) )
-                        {
-                            ESP_LOGI(TAG, "Expression result: %lf", expression_result);
-
-                            sprintf(json_buffer, "{\"%s\": %lf}", mqtt_canflt_values[found_index].name, expression_result);
-
-                            mqtt_publish(mqtt_topic, json_buffer, 0, 0, 0);
-                        }
-                        else
-                        {
-                            ESP_LOGE(TAG, "evaluate_expression error");
-                        }
-
-                        start_index = found_index + 1;
+                        mqtt_canflt_process(&mqtt_canflt, &tx_frame.frame, esp_timer_get_time(), mqtt_publish_filter_value, mqtt_topic);
                     }
                 }
                 else if(config_server_mqtt_rx_en_config())
                 {
-                    sprintf(json_buffer, "{\"bus\":\"0\",\"type\":\"rx\",\"ts\":%lu,\"frame\":[", (pdTICKS_TO_MS(xTaskGetTickCount())%60000));
-
-                    if(strlen(json_buffer) < (sizeof(json_buffer) -128))
+                    while(mqtt_can_read(&tx_frame))
                     {
-                        while(xQueuePeek(*xmqtt_tx_queue, ( void * ) &tx_frame, 0) == pdTRUE)
+                        mqtt_rx_batch_begin(&batch, mqtt_rx_format, "rx", tx_frame.timestamp);
+
+                        do
                         {
-                            xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
-                            sprintf(tmp, "{\"id\":%lu,\"dlc\":%u,\"rtr\":%s,\"extd\":%s,\"data\":[%u,%u,%u,%u,%u,%u,%u,%u]},",tx_frame.frame.identifier, tx_frame.frame.data_length_code, tx_frame.frame.rtr?"true":"false",
-                                                                                                                        tx_frame.frame.extd?"true":"false",tx_frame.frame.data[0], tx_frame.frame.data[1], tx_frame.frame.data[2], tx_frame.frame.data[3],
-                                                                                                                        tx_frame.frame.data[4], tx_frame.frame.data[5], tx_frame.frame.data[6], tx_frame.frame.data[7]);
-                            strcat((char*)json_buffer, (char*)tmp);
-
-                            if(strlen(json_buffer) > (JSON_BUF_SIZE - 100))
-                            {
-                                break;
-                            }
-                        }
-                        json_buffer[strlen(json_buffer)-1] = 0;
+                            mqtt_rx_batch_add(&batch, &tx_frame);
+                        }while(mqtt_rx_batch_room(&batch) && mqtt_can_read(&tx_frame));
+
+                        size_t len = mqtt_rx_batch_end(&batch);
+                        mqtt_publish(mqtt_topic, json_buffer, len, 0, 0);
                     }
-                    strcat((char*)json_buffer, "]}");
-                    
-                    mqtt_publish(mqtt_topic, json_buffer, 0, 0, 0);
+                }
+                else
+                {
+                    can_ring_skip(&mqtt_can_reader);
                 }
             }
             else
             {
                 xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
-                if(tx_frame.type == MQTT_RX)
-                {
-                    sprintf(json_buffer, "{\"bus\":\"0\",\"type\":\"rx\",\"ts\":%lu,\"frame\":[", (pdTICKS_TO_MS(xTaskGetTickCount())%60000));
-                    ESP_LOGI(TAG, "tx_frame.type: MQTT_RX");
-                }
-                else if(tx_frame.type == MQTT_TX)
-                {
-                    sprintf(json_buffer, "{\"bus\":\"0\",\"type\":\"tx\",\"ts\":%lu,\"frame\":[", (pdTICKS_TO_MS(xTaskGetTickCount())%60000));
-                    ESP_LOGI(TAG, "tx_frame.type: MQTT_TX");
-                }
-                
-                sprintf(tmp, "{\"id\":%lu,\"dlc\":%u,\"rtr\":%s,\"extd\":%s,\"data\":[%u,%u,%u,%u,%u,%u,%u,%u]},",tx_frame.frame.identifier, tx_frame.frame.data_length_code, tx_frame.frame.rtr?"true":"false",
-                                                                                                            tx_frame.frame.extd?"true":"false",tx_frame.frame.data[0], tx_frame.frame.data[1], tx_frame.frame.data[2], tx_frame.frame.data[3],
-                                                                                                            tx_frame.frame.data[4], tx_frame.frame.data[5], tx_frame.frame.data[6], tx_frame.frame.data[7]);
-                strcat((char*)json_buffer, (char*)tmp);
-                json_buffer[strlen(json_buffer)-1] = 0;
-                strcat((char*)json_buffer, "]}");
+                // The ELM327 log stays JSON, the format option only covers the can/rx topic
+                mqtt_rx_batch_begin(&batch, MQTT_RX_JSON, (tx_frame.type == MQTT_TX) ? "tx" : "rx", tx_frame.timestamp);
+                mqtt_rx_batch_add(&batch, &tx_frame);
+                mqtt_rx_batch_end(&batch);
 
                 mqtt_publish(mqtt_elm327_topic, json_buffer, 0, 0, 0);
             }
 
 		}
-		else
+		else if(mqtt_elm327_log_active)
 		{
 			xQueueReceive(*xmqtt_tx_queue, ( void * ) &tx_frame, 0);
 		}
-		vTaskDelay(pdMS_TO_TICKS(1));
+		else
+		{
+			can_ring_skip(&mqtt_can_reader);
+		}
+
+		// The CAN path has drained the ring and blocks in can_ring_wait()
+		if(tx_frame.type != MQTT_CAN)
+		{
+			vTaskDelay(pdMS_TO_TICKS(1));
+		}
 	}
 }
 
+static void mqtt_free_filter(void)
+{
+    mqtt_canflt_free(&mqtt_canflt);
+}
+
+// Identifiers the CAN filters extract signals from, -1 if every frame is
+// forwarded. IDs above 0x7FF are taken as extended, the filters only
+// compare the identifier.
+int32_t mqtt_get_filter_ids(can_filter_id_t *ids, uint32_t max)
+{
+    uint32_t count = 0;
+
+    if(mqtt_canflt.size == 0)
+    {
+        return config_server_mqtt_rx_en_config() ? -1 : 0;
+    }
+
+    // Sorted by CAN ID, so duplicates are next to each other
+    for(uint32_t i = 0; i < mqtt_canflt.size; i++)
+    {
+        if(i > 0 && mqtt_canflt.values[i].can_id == mqtt_canflt.values[i - 1].can_id)
+        {
+            continue;
+        }
+
+        if(count >= max)
+        {
+            return -1;
+        }
+
+        ids[count].id = mqtt_canflt.values[i].can_id;
+        ids[count].mask = 0;
+        ids[count].extd = mqtt_canflt.values[i].can_id > TWAI_STD_ID_MASK;
+        count++;
+    }
+
+    return count;
+}
+
 static void mqtt_load_filter(void)
 {
     char *canflt_json = config_server_get_mqtt_canflt();
@@ -515,26 +697,25 @@ static void mqtt_load_filter(void)
         return;
     }
 
-    mqtt_canflt_size = cJSON_GetArraySize(can_flt);
-    mqtt_canflt_values = (CANFilter *)malloc(mqtt_canflt_size * sizeof(CANFilter));
+    mqtt_canflt.size = cJSON_GetArraySize(can_flt);
+    mqtt_canflt.values = (CANFilter *)calloc(mqtt_canflt.size, sizeof(CANFilter));
 
-    if (mqtt_canflt_values == NULL) 
+    if (mqtt_canflt.values == NULL) 
     {
         cJSON_Delete(root);
-        ESP_LOGE(TAG, "(mqtt_canflt_values == NULL)");
-        mqtt_canflt_size = 0;
+        ESP_LOGE(TAG, "(mqtt_canflt.values == NULL)");
+        mqtt_canflt.size = 0;
         return;
     }
 
-    for (uint32_t i = 0; i < mqtt_canflt_size; i++) 
+    for (uint32_t i = 0; i < mqtt_canflt.size; i++) 
     {
         cJSON *item = cJSON_GetArrayItem(can_flt, i);
         if (!cJSON_IsObject(item)) 
         {
-            free(mqtt_canflt_values);
+            mqtt_free_filter();
             cJSON_Delete(root);
             ESP_LOGE(TAG, "Failed to get json array can_flt");
-            mqtt_canflt_size = 0;
             return;
         }
 
@@ -557,62 +738,364 @@ static void mqtt_load_filter(void)
         if (cJSON_IsNumber(can_id) && cJSON_IsString(name) && cJSON_IsNumber(pid) && cJSON_IsNumber(pidi) &&
             cJSON_IsNumber(start_bit) && cJSON_IsNumber(bit_length) && cJSON_IsString(expression) && cJSON_IsNumber(cycle)) 
         {
-            mqtt_canflt_values[i].can_id = (uint32_t)can_id->valuedouble;
-            strncpy(mqtt_canflt_values[i].name, name->valuestring, sizeof(mqtt_canflt_values[i].name));
-            mqtt_canflt_values[i].pid = (int32_t)pid->valuedouble;  // Set 'pid' field
-            mqtt_canflt_values[i].pidi = (int32_t)pidi->valuedouble;
-            mqtt_canflt_values[i].start_bit = (uint32_t)start_bit->valuedouble;
-            mqtt_canflt_values[i].bit_length = (uint32_t)bit_length->valuedouble;
-            strncpy(mqtt_canflt_values[i].expression, expression->valuestring, sizeof(mqtt_canflt_values[i].expression));
-            mqtt_canflt_values[i].cycle = (uint32_t)cycle->valuedouble;
-            mqtt_canflt_values[i].logtime = 0;
+            mqtt_canflt.values[i].can_id = (uint32_t)can_id->valuedouble;
+            strncpy(mqtt_canflt.values[i].name, name->valuestring, sizeof(mqtt_canflt.values[i].name));
+            mqtt_canflt.values[i].pid = (int32_t)pid->valuedouble;  // Set 'pid' field
+            mqtt_canflt.values[i].pidi = (int32_t)pidi->valuedouble;
+            mqtt_canflt.values[i].start_bit = (uint32_t)start_bit->valuedouble;
+            mqtt_canflt.values[i].bit_length = (uint32_t)bit_length->valuedouble;
+            strncpy(mqtt_canflt.values[i].expression, expression->valuestring, sizeof(mqtt_canflt.values[i].expression));
+            mqtt_canflt.values[i].expression[sizeof(mqtt_canflt.values[i].expression) - 1] = 0;
+            mqtt_canflt.values[i].program = compile_expression(mqtt_canflt.values[i].expression);
+            if (mqtt_canflt.values[i].program == NULL)
+            {
+                ESP_LOGE(TAG, "Failed to compile CAN filter expression: %s", mqtt_canflt.values[i].expression);
+            }
+            else
+            {
+                ESP_LOGI(TAG, "CAN filter expression compiled: %u -> %u instructions, %u registers",
+                         mqtt_canflt.values[i].program->unoptimized_len, mqtt_canflt.values[i].program->code_len,
+                         mqtt_canflt.values[i].program->regs_used);
+            }
+            mqtt_canflt.values[i].cycle = (uint32_t)cycle->valuedouble;
+            mqtt_canflt.values[i].logtime = 0;
 
             ESP_LOGI(TAG, "Loaded CAN Filter %lu: CAN ID=%lu, PID=%ld, PIDIndex=%ld, Name=%s, Start Bit=%lu, Bit Length=%lu, Expression=%s, Cycle=%lu",
-                     i, mqtt_canflt_values[i].can_id, mqtt_canflt_values[i].pid, mqtt_canflt_values[i].pidi, mqtt_canflt_values[i].name,
-                     mqtt_canflt_values[i].start_bit, mqtt_canflt_values[i].bit_length,
-                     mqtt_canflt_values[i].expression, mqtt_canflt_values[i].cycle);
+                     i, mqtt_canflt.values[i].can_id, mqtt_canflt.values[i].pid, mqtt_canflt.values[i].pidi, mqtt_canflt.values[i].name,
+                     mqtt_canflt.values[i].start_bit, mqtt_canflt.values[i].bit_length,
+                     mqtt_canflt.values[i].expression, mqtt_canflt.values[i].cycle);
         }
         else 
         {
-            free(mqtt_canflt_values);
+            mqtt_free_filter();
             cJSON_Delete(root);
             ESP_LOGE(TAG, "cJSON_IsNumber(can_id)");
-            mqtt_canflt_size = 0;
             return;
         }
     }
 
+    if(!mqtt_canflt_build_index(&mqtt_canflt))
+    {
+        mqtt_free_filter();
+        ESP_LOGE(TAG, "(mqtt_canflt_index == NULL)");
+    }
+
     cJSON_Delete(root);
 }
 
-void mqtt_publish(char *topic, char *data, int len, int qos, int retain)
+// Publisher
+//
+// mqtt_publish() copies the message into a queue and returns. The publisher
+// task merges JSON objects sent to the same topic into one message for up to
+// MQTT_PUB_BATCH_MS or MQTT_BATCH_SIZE bytes unless they share a top-level key
+// (mqtt_batch.c), everything else goes out as is. Messages are dropped instead of queued without bound when the pending
+// bytes or the esp-mqtt outbox grow past their limits.
+//
+// With the flash outbox enabled, messages sent while the broker is unreachable
+// are stored instead and replayed in order after reconnecting, new messages
+// queue behind them until the outbox is empty. The replay follows the
+// esp-mqtt outbox: every tick sends up to MQTT_OUTBOX_REPLAY_BURST records
+// while it holds less than MQTT_OUTBOX_REPLAY_OUTBOX_MAX bytes, and the next
+// tick comes after MQTT_OUTBOX_REPLAY_FAST_MS if there was room left, after
+// MQTT_OUTBOX_REPLAY_MS if the broker is not keeping up. While more than
+// MQTT_OUTBOX_LIVE_SEGMENTS segments are pending, new messages are published
+// directly instead, live data isn't held up behind minutes of history, and
+// the backlog keeps draining behind them.
+#define MQTT_PUB_QUEUE_LEN			32
+#define MQTT_PUB_PENDING_MAX		(1024*8)
+#define MQTT_PUB_OUTBOX_MAX			(1024*8)
+#define MQTT_PUB_BATCH_MS			100
+#define MQTT_PUB_STATS_PERIOD_MS	60000
+#define MQTT_PUB_LATENCY_AVG_SHIFT	3
+#define MQTT_OUTBOX_REPLAY_BURST	32			// records per replay tick at most
+#define MQTT_OUTBOX_REPLAY_MS		100
+#define MQTT_OUTBOX_REPLAY_FAST_MS	10
+#define MQTT_OUTBOX_REPLAY_OUTBOX_MAX	(MQTT_PUB_OUTBOX_MAX / 2)	// the rest is left for live messages
+#define MQTT_OUTBOX_LIVE_SEGMENTS	2
+#define MQTT_OUTBOX_FLUSH_MS		5000
+
+typedef struct
+{
+	int64_t time;					// esp_timer_get_time() when queued
+	uint16_t len;
+	uint8_t qos;
+	uint8_t retain;
+	char *payload;					// follows the topic in the same allocation
+	char topic[];
+}mqtt_pub_msg_t;
+
+typedef struct
+{
+	uint32_t enqueued;
+	uint32_t published;
+	uint32_t dropped;
+	uint32_t merged;				// messages sent as part of another one
+	uint32_t pending_bytes;
+	uint32_t latency_max_us;
+	uint32_t latency_avg_us;
+}mqtt_pub_stats_t;
+
+static QueueHandle_t mqtt_pub_queue = NULL;
+static mqtt_batcher_t mqtt_pub_batcher;
+static mqtt_pub_stats_t mqtt_pub_stats;
+static portMUX_TYPE mqtt_pub_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool mqtt_pub_bypass_outbox = false;	// backlog too long, live messages skip it
+
+static void mqtt_pub_drop(uint32_t bytes)
+{
+	portENTER_CRITICAL(&mqtt_pub_lock);
+	mqtt_pub_stats.dropped++;
+	mqtt_pub_stats.pending_bytes -= bytes;
+	portEXIT_CRITICAL(&mqtt_pub_lock);
+}
+
+static void mqtt_pub_send(const char *topic, const char *data, size_t len, uint8_t qos, uint8_t retain, int64_t time, uint16_t count, uint32_t bytes)
+{
+	if(mqtt_outbox_en && (!mqtt_connected() || (!mqtt_pub_bypass_outbox && !mqtt_outbox_empty())))
+	{
+		bool stored = mqtt_outbox_write(topic, data, len, qos, retain);
+
+		portENTER_CRITICAL(&mqtt_pub_lock);
+		if(!stored)
+		{
+			mqtt_pub_stats.dropped += count;
+		}
+		mqtt_pub_stats.pending_bytes -= bytes;
+		portEXIT_CRITICAL(&mqtt_pub_lock);
+		return;
+	}
+
+	if(!mqtt_connected() || esp_mqtt_client_get_outbox_size(client) > MQTT_PUB_OUTBOX_MAX ||
+		esp_mqtt_client_publish(client, topic, data, len, qos, retain) < 0)
+	{
+		portENTER_CRITICAL(&mqtt_pub_lock);
+		mqtt_pub_stats.dropped += count;
+		mqtt_pub_stats.pending_bytes -= bytes;
+		portEXIT_CRITICAL(&mqtt_pub_lock);
+		return;
+	}
+
+	uint32_t latency = (uint32_t)(esp_timer_get_time() - time);
+
+	portENTER_CRITICAL(&mqtt_pub_lock);
+	mqtt_pub_stats.published++;
+	mqtt_pub_stats.merged += count - 1;
+	mqtt_pub_stats.pending_bytes -= bytes;
+	if(latency > mqtt_pub_stats.latency_max_us)
+	{
+		mqtt_pub_stats.latency_max_us = latency;
+	}
+	mqtt_pub_stats.latency_avg_us += ((int32_t)latency - (int32_t)mqtt_pub_stats.latency_avg_us) >> MQTT_PUB_LATENCY_AVG_SHIFT;
+	portEXIT_CRITICAL(&mqtt_pub_lock);
+}
+
+static void mqtt_pub_send_batch(const mqtt_batch_t *batch, void *ctx)
+{
+	mqtt_pub_send(batch->topic, batch->buf, batch->len, batch->qos, batch->retain, batch->first_time, batch->count, batch->bytes);
+}
+
+// Sends the oldest stored messages while the esp-mqtt outbox has room, so the
+// broker is not flooded after a long offline period. Returns the time to the
+// next tick: short when the burst ran out before the room did.
+static uint32_t mqtt_pub_replay(void)
+{
+	mqtt_outbox_record_t record;
+
+	for(uint32_t i = 0; i < MQTT_OUTBOX_REPLAY_BURST; i++)
+	{
+		if(!mqtt_connected() || esp_mqtt_client_get_outbox_size(client) > MQTT_OUTBOX_REPLAY_OUTBOX_MAX ||
+			!mqtt_outbox_peek(&record))
+		{
+			return MQTT_OUTBOX_REPLAY_MS;
+		}
+
+		if(esp_mqtt_client_publish(client, record.topic, record.payload, record.len, record.qos, record.retain) < 0)
+		{
+			return MQTT_OUTBOX_REPLAY_MS;
+		}
+		mqtt_outbox_pop();
+	}
+	return MQTT_OUTBOX_REPLAY_FAST_MS;
+}
+
+static void mqtt_pub_publish_stats(void)
+{
+	static char json[384];
+	mqtt_pub_stats_t stats;
+	mqtt_outbox_stats_t outbox_stats;
+	int outbox = esp_mqtt_client_get_outbox_size(client);
+
+	mqtt_outbox_get_stats(&outbox_stats);
+
+	portENTER_CRITICAL(&mqtt_pub_lock);
+	stats = mqtt_pub_stats;
+	mqtt_pub_stats.latency_max_us = 0;
+	portEXIT_CRITICAL(&mqtt_pub_lock);
+
+	snprintf(json, sizeof(json), "{\"status\": \"online\", \"mqtt\": {\"enqueued\": %lu, \"published\": %lu, \"merged\": %lu, \"dropped\": %lu, "
+			"\"pending_bytes\": %lu, \"outbox_bytes\": %d, \"latency_avg_us\": %lu, \"latency_max_us\": %lu, "
+			"\"stored\": %lu, \"replayed\": %lu, \"store_dropped\": %lu, \"store_evicted\": %lu, \"store_segments\": %lu}}",
+			stats.enqueued, stats.published, stats.merged, stats.dropped,
+			stats.pending_bytes, outbox, stats.latency_avg_us, stats.latency_max_us,
+			outbox_stats.stored, outbox_stats.replayed, outbox_stats.dropped, outbox_stats.evicted, outbox_stats.segments);
+	// Not retained, the retained message stays the plain online status
+	esp_mqtt_client_publish(client, mqtt_status_topic, json, 0, 0, 0);
+}
+
+static void mqtt_pub_task(void *pvParameters)
+{
+	mqtt_pub_msg_t *msg;
+	int64_t stats_time = esp_timer_get_time() + (MQTT_PUB_STATS_PERIOD_MS * 1000LL);
+	int64_t outbox_time = 0;
+	uint32_t replay_ms = MQTT_OUTBOX_REPLAY_MS;
+
+	while(1)
+	{
+		int64_t now = esp_timer_get_time();
+		int64_t deadline = stats_time;
+
+		if(mqtt_outbox_en && !mqtt_outbox_empty())
+		{
+			if(outbox_time == 0)
+			{
+				outbox_time = now + (mqtt_connected() ? replay_ms : MQTT_OUTBOX_FLUSH_MS) * 1000LL;
+			}
+			if(outbox_time < deadline)
+			{
+				deadline = outbox_time;
+			}
+		}
+
+		deadline = mqtt_batch_next_deadline(&mqtt_pub_batcher, deadline);
+
+		TickType_t wait = (deadline > now) ? pdMS_TO_TICKS((deadline - now + 999) / 1000) : 0;
+
+		if(xQueueReceive(mqtt_pub_queue, &msg, wait) == pdTRUE)
+		{
+			uint32_t bytes = sizeof(mqtt_pub_msg_t) + strlen(msg->topic) + 1 + msg->len;
+
+			if(mqtt_batch_mergeable(msg->topic, msg->payload, msg->len))
+			{
+				mqtt_batch_add(&mqtt_pub_batcher, msg->topic, msg->payload, msg->len, msg->qos, msg->retain, msg->time, bytes);
+			}
+			else
+			{
+				// Keep the order on a topic, its pending batch goes first
+				mqtt_batch_flush_topic(&mqtt_pub_batcher, msg->topic);
+				mqtt_pub_send(msg->topic, msg->payload, msg->len, msg->qos, msg->retain, msg->time, 1, bytes);
+			}
+			free(msg);
+		}
+
+		now = esp_timer_get_time();
+		mqtt_batch_flush_due(&mqtt_pub_batcher, now);
+
+		if(outbox_time != 0 && now >= outbox_time)
+		{
+			mqtt_outbox_stats_t outbox_stats;
+
+			outbox_time = 0;
+			replay_ms = MQTT_OUTBOX_REPLAY_MS;
+			if(mqtt_connected())
+			{
+				replay_ms = mqtt_pub_replay();
+			}
+			else
+			{
+				mqtt_outbox_flush();
+			}
+
+			mqtt_outbox_get_stats(&outbox_stats);
+			mqtt_pub_bypass_outbox = outbox_stats.segments > MQTT_OUTBOX_LIVE_SEGMENTS;
+		}
+		else if(mqtt_pub_bypass_outbox && mqtt_outbox_empty())
+		{
+			mqtt_pub_bypass_outbox = false;
+		}
+
+		if(now >= stats_time)
+		{
+			stats_time = now + (MQTT_PUB_STATS_PERIOD_MS * 1000LL);
+			if(mqtt_connected())
+			{
+				mqtt_pub_publish_stats();
+			}
+		}
+	}
+}
+
+// Returns false when the message was dropped instead of queued
+bool mqtt_publish(char *topic, char *data, int len, int qos, int retain)
 {
-    int data_len = len;
+    static const char* error_msg = "{\"error\": \"Data length exceeds the data size\"}";
+    size_t data_len = len;
 
-    if( (config_server_mqtt_en_config() == 1) && mqtt_connected() && (xSemaphoreTake( xmqtt_semaphore, pdMS_TO_TICKS(2000) ) == pdTRUE) )
+    if( (config_server_mqtt_en_config() != 1) || (!mqtt_connected() && !mqtt_outbox_en) || mqtt_pub_queue == NULL )
     {
-        if(len == 0)
-        {
-            data_len = strlen(data);
-        }
+        return false;
+    }
 
-        if(data_len < MQTT_TX_RX_BUF_SIZE)
-        {
-            esp_mqtt_client_publish(client, topic, data, len, qos, retain);
-        }
-        else
-        {
-            static const char* error_msg = "{\"error\": \"Data length exceeds the data size\"}";
-            esp_mqtt_client_publish(client, topic, error_msg, strlen(error_msg), qos, 0);
-        }
-        
-        xSemaphoreGive( xmqtt_semaphore );
+    if(len == 0)
+    {
+        data_len = strlen(data);
     }
+
+    if(data_len >= MQTT_TX_RX_BUF_SIZE)
+    {
+        data = (char*)error_msg;
+        data_len = strlen(error_msg);
+        retain = 0;
+    }
+
+    size_t topic_len = strlen(topic);
+    uint32_t bytes = sizeof(mqtt_pub_msg_t) + topic_len + 1 + data_len;
+    bool accepted = false;
+
+    portENTER_CRITICAL(&mqtt_pub_lock);
+    if(mqtt_pub_stats.pending_bytes + bytes <= MQTT_PUB_PENDING_MAX)
+    {
+        mqtt_pub_stats.pending_bytes += bytes;
+        mqtt_pub_stats.enqueued++;
+        accepted = true;
+    }
+    else
+    {
+        mqtt_pub_stats.dropped++;
+    }
+    portEXIT_CRITICAL(&mqtt_pub_lock);
+
+    if(!accepted)
+    {
+        return false;
+    }
+
+    mqtt_pub_msg_t *msg = (mqtt_pub_msg_t *)malloc(bytes);
+    if(msg == NULL)
+    {
+        mqtt_pub_drop(bytes);
+        return false;
+    }
+
+    msg->time = esp_timer_get_time();
+    msg->len = data_len;
+    msg->qos = qos;
+    msg->retain = retain;
+    memcpy(msg->topic, topic, topic_len + 1);
+    msg->payload = msg->topic + topic_len + 1;
+    memcpy(msg->payload, data, data_len);
+
+    if(xQueueSend(mqtt_pub_queue, &msg, 0) != pdTRUE)
+    {
+        free(msg);
+        mqtt_pub_drop(bytes);
+        return false;
+    }
+
+    return true;
 }
 
 void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue)
 {
-    xmqtt_semaphore = xSemaphoreCreateMutex();
     esp_mqtt_client_config_t mqtt_cfg = {
 		// .session.protocol_ver = MQTT_PROTOCOL_V_5,
 		.broker.address.uri = config_server_get_mqtt_url(),
@@ -650,10 +1133,31 @@ void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue)
     sprintf(mqtt_rsp_topic, "wican/%s/cmd",device_id);
     ESP_LOGI(TAG, "device_id: %s, mqtt_cfg.uri: %s", device_id, mqtt_cfg.broker.address.uri);
     mqtt_elm327_log = config_server_mqtt_elm327_log();
+    mqtt_elm327_log_active = mqtt_elm327_log && (config_server_protocol() == OBD_ELM327);
+    if(!mqtt_elm327_log_active)
+    {
+        can_ring_reader_init(&mqtt_can_reader);
+    }
+    if(strcmp(config_server_get_mqtt_rx_format(), "binary") == 0)
+    {
+        mqtt_rx_format = MQTT_RX_BINARY;
+    }
+    else if(strcmp(config_server_get_mqtt_rx_format(), "cbor") == 0)
+    {
+        mqtt_rx_format = MQTT_RX_CBOR;
+    }
+    if(config_server_mqtt_outbox_config() == 1)
+    {
+        mqtt_outbox_en = mqtt_outbox_init();
+    }
 	mqtt_load_filter();
     s_mqtt_event_group = xEventGroupCreate();
     client = esp_mqtt_client_init(&mqtt_cfg);
 
+    mqtt_pub_queue = xQueueCreate(MQTT_PUB_QUEUE_LEN, sizeof(mqtt_pub_msg_t *));
+    mqtt_batch_init(&mqtt_pub_batcher, MQTT_PUB_BATCH_MS * 1000LL, mqtt_pub_send_batch, NULL);
+
     xTaskCreate(mqtt_task, "mqtt_task", 1024*5, (void*)AF_INET, 5, NULL);
+    xTaskCreate(mqtt_pub_task, "mqtt_pub_task", 1024*4, NULL, 5, NULL);
 }
 
@@ -23,6 +23,7 @@
 
 #include "driver/twai.h"
 #include "elm327.h"
+#include "can.h"
 
 #define MQTT_CAN        0x00
 #define MQTT_RX         ELM327_CAN_RX
@@ -32,9 +33,11 @@ typedef struct
 {
     uint8_t type;
     twai_message_t frame;
+    int64_t timestamp;          // esp_timer_get_time() when the frame was received or sent
 }mqtt_can_message_t;
 
 void mqtt_init(char* id, uint8_t connected_led, QueueHandle_t *xtx_queue);
 int mqtt_connected(void);
-void mqtt_publish(char *topic, char *data, int len, int qos, int retain);
+bool mqtt_publish(char *topic, char *data, int len, int qos, int retain);
+int32_t mqtt_get_filter_ids(can_filter_id_t *ids, uint32_t max);
 #endif
@@ -0,0 +1,310 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "mqtt_batch.h"
+
+// Merges JSON objects published to the same topic into one object. Messages
+// are only merged when no top-level key of the new message is already in the
+// batch, otherwise the batch is sent first so a key is never repeated.
+
+static size_t mqtt_batch_skip_space(const char *json, size_t len, size_t pos)
+{
+	while(pos < len && (json[pos] == ' ' || json[pos] == '\t' || json[pos] == '\r' || json[pos] == '\n'))
+	{
+		pos++;
+	}
+	return pos;
+}
+
+// Returns the index after the closing quote of the string starting at pos,
+// or len if it is not terminated
+static size_t mqtt_batch_skip_string(const char *json, size_t len, size_t pos)
+{
+	for(pos++; pos < len; pos++)
+	{
+		if(json[pos] == '\\')
+		{
+			pos++;
+		}
+		else if(json[pos] == '"')
+		{
+			return pos + 1;
+		}
+	}
+	return len;
+}
+
+// Returns the index after the value starting at pos, strings are skipped as a
+// whole so brackets and quotes inside them do not count
+static size_t mqtt_batch_skip_value(const char *json, size_t len, size_t pos)
+{
+	uint32_t depth = 0;
+
+	while(pos < len)
+	{
+		char c = json[pos];
+
+		if(c == '"')
+		{
+			pos = mqtt_batch_skip_string(json, len, pos);
+			if(depth == 0)
+			{
+				return pos;
+			}
+			continue;
+		}
+		if(c == '{' || c == '[')
+		{
+			depth++;
+		}
+		else if(c == '}' || c == ']')
+		{
+			if(depth == 0)
+			{
+				return pos;
+			}
+			if(--depth == 0)
+			{
+				return pos + 1;
+			}
+		}
+		else if(c == ',' && depth == 0)
+		{
+			return pos;
+		}
+		pos++;
+	}
+	return len;
+}
+
+// Walks the top-level keys of the object in json, *pos starts at 1. Returns
+// false at the closing brace, leaving *pos on it, or on malformed input,
+// leaving *pos at len. The key is returned without its quotes.
+static bool mqtt_batch_next_key(const char *json, size_t len, size_t *pos, const char **key, size_t *key_len)
+{
+	size_t p = mqtt_batch_skip_space(json, len, *pos);
+
+	if(p < len && json[p] == ',' && p > 1)
+	{
+		p = mqtt_batch_skip_space(json, len, p + 1);
+	}
+	else if(p < len && json[p] == '}')
+	{
+		*pos = p;
+		return false;
+	}
+
+	if(p >= len || json[p] != '"')
+	{
+		*pos = len;
+		return false;
+	}
+
+	size_t end = mqtt_batch_skip_string(json, len, p);
+	if(end >= len)
+	{
+		*pos = len;
+		return false;
+	}
+	*key = &json[p + 1];
+	*key_len = end - p - 2;
+
+	p = mqtt_batch_skip_space(json, len, end);
+	if(p >= len || json[p] != ':')
+	{
+		*pos = len;
+		return false;
+	}
+
+	p = mqtt_batch_skip_space(json, len, p + 1);
+	end = mqtt_batch_skip_value(json, len, p);
+	if(end == p || end >= len)
+	{
+		*pos = len;
+		return false;
+	}
+	*pos = end;
+	return true;
+}
+
+static bool mqtt_batch_has_key(const char *json, size_t len, const char *key, size_t key_len)
+{
+	size_t pos = 1;
+	const char *k;
+	size_t k_len;
+
+	while(mqtt_batch_next_key(json, len, &pos, &k, &k_len))
+	{
+		if(k_len == key_len && memcmp(k, key, key_len) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// True if any top-level key of payload is also a top-level key of the batch
+static bool mqtt_batch_repeats_key(const mqtt_batch_t *batch, const char *payload, size_t len)
+{
+	size_t pos = 1;
+	const char *key;
+	size_t key_len;
+
+	while(mqtt_batch_next_key(payload, len, &pos, &key, &key_len))
+	{
+		if(mqtt_batch_has_key(batch->buf, batch->len, key, key_len))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void mqtt_batch_init(mqtt_batcher_t *b, int64_t window_us, mqtt_batch_send_t send, void *ctx)
+{
+	memset(b, 0, sizeof(mqtt_batcher_t));
+	b->window_us = window_us;
+	b->send = send;
+	b->ctx = ctx;
+}
+
+// Only a well formed object with at least one key that fits a batch is merged
+bool mqtt_batch_mergeable(const char *topic, const char *payload, size_t len)
+{
+	size_t pos = 1;
+	const char *key;
+	size_t key_len;
+	uint32_t keys = 0;
+
+	if(len <= 2 || len >= MQTT_BATCH_SIZE || strlen(topic) >= sizeof(((mqtt_batch_t*)0)->topic) ||
+		payload[0] != '{' || payload[len - 1] != '}')
+	{
+		return false;
+	}
+
+	while(mqtt_batch_next_key(payload, len, &pos, &key, &key_len))
+	{
+		keys++;
+	}
+	return keys != 0 && pos == len - 1;
+}
+
+static void mqtt_batch_flush(mqtt_batcher_t *b, uint32_t slot)
+{
+	mqtt_batch_t *batch = &b->slots[slot];
+
+	if(batch->count != 0)
+	{
+		b->send(batch, b->ctx);
+		batch->count = 0;
+	}
+}
+
+// Adds a message accepted by mqtt_batch_mergeable() to the batch of its topic
+void mqtt_batch_add(mqtt_batcher_t *b, const char *topic, const char *payload, size_t len, uint8_t qos, uint8_t retain, int64_t time, uint32_t bytes)
+{
+	int32_t slot = -1;
+	int32_t oldest = 0;
+
+	for(uint32_t i = 0; i < MQTT_BATCH_SLOTS; i++)
+	{
+		mqtt_batch_t *batch = &b->slots[i];
+
+		if(batch->count != 0 && batch->qos == qos && batch->retain == retain && strcmp(batch->topic, topic) == 0)
+		{
+			slot = i;
+			break;
+		}
+		if(batch->count == 0 || (b->slots[oldest].count != 0 && batch->deadline < b->slots[oldest].deadline))
+		{
+			oldest = i;
+		}
+	}
+
+	if(slot >= 0)
+	{
+		mqtt_batch_t *batch = &b->slots[slot];
+
+		if(batch->len + len - 1 <= MQTT_BATCH_SIZE && !mqtt_batch_repeats_key(batch, payload, len))
+		{
+			batch->buf[batch->len - 1] = ',';
+			memcpy(&batch->buf[batch->len], payload + 1, len - 1);
+			batch->len += len - 1;
+			batch->count++;
+			batch->bytes += bytes;
+			return;
+		}
+		mqtt_batch_flush(b, slot);
+	}
+	else
+	{
+		slot = oldest;
+		mqtt_batch_flush(b, slot);
+	}
+
+	mqtt_batch_t *batch = &b->slots[slot];
+	strcpy(batch->topic, topic);
+	batch->qos = qos;
+	batch->retain = retain;
+	batch->count = 1;
+	batch->first_time = time;
+	batch->deadline = time + b->window_us;
+	batch->len = len;
+	memcpy(batch->buf, payload, len);
+	batch->bytes = bytes;
+}
+
+// Sends the pending batches of a topic, to keep the order of its messages
+void mqtt_batch_flush_topic(mqtt_batcher_t *b, const char *topic)
+{
+	for(uint32_t i = 0; i < MQTT_BATCH_SLOTS; i++)
+	{
+		if(b->slots[i].count != 0 && strcmp(b->slots[i].topic, topic) == 0)
+		{
+			mqtt_batch_flush(b, i);
+		}
+	}
+}
+
+void mqtt_batch_flush_due(mqtt_batcher_t *b, int64_t now)
+{
+	for(uint32_t i = 0; i < MQTT_BATCH_SLOTS; i++)
+	{
+		if(b->slots[i].count != 0 && b->slots[i].deadline <= now)
+		{
+			mqtt_batch_flush(b, i);
+		}
+	}
+}
+
+// Returns the earliest batch deadline, or deadline if that is sooner
+int64_t mqtt_batch_next_deadline(const mqtt_batcher_t *b, int64_t deadline)
+{
+	for(uint32_t i = 0; i < MQTT_BATCH_SLOTS; i++)
+	{
+		if(b->slots[i].count != 0 && b->slots[i].deadline < deadline)
+		{
+			deadline = b->slots[i].deadline;
+		}
+	}
+	return deadline;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MQTT_BATCH_H__
+#define __MQTT_BATCH_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MQTT_BATCH_SLOTS		4
+#define MQTT_BATCH_SIZE			1024
+
+// JSON objects published to the same topic, merged into one object
+typedef struct
+{
+	char topic[128];
+	uint8_t qos;
+	uint8_t retain;
+	uint16_t count;					// 0 marks a free slot
+	int64_t first_time;				// queue time of the oldest merged message
+	int64_t deadline;
+	uint32_t bytes;					// pending bytes of the merged messages
+	size_t len;
+	char buf[MQTT_BATCH_SIZE];
+}mqtt_batch_t;
+
+// Called with every batch that is due, full, or has to go first to keep the
+// order of its topic
+typedef void (*mqtt_batch_send_t)(const mqtt_batch_t *batch, void *ctx);
+
+typedef struct
+{
+	mqtt_batch_t slots[MQTT_BATCH_SLOTS];
+	int64_t window_us;				// how long the first message waits for others
+	mqtt_batch_send_t send;
+	void *ctx;
+}mqtt_batcher_t;
+
+void mqtt_batch_init(mqtt_batcher_t *b, int64_t window_us, mqtt_batch_send_t send, void *ctx);
+bool mqtt_batch_mergeable(const char *topic, const char *payload, size_t len);
+void mqtt_batch_add(mqtt_batcher_t *b, const char *topic, const char *payload, size_t len, uint8_t qos, uint8_t retain, int64_t time, uint32_t bytes);
+void mqtt_batch_flush_topic(mqtt_batcher_t *b, const char *topic);
+void mqtt_batch_flush_due(mqtt_batcher_t *b, int64_t now);
+int64_t mqtt_batch_next_deadline(const mqtt_batcher_t *b, int64_t deadline);
+#endif
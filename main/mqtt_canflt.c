@@ -0,0 +1,197 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Signals of the MQTT CAN filters: the ID index and the decoding of the
+// configured bit ranges and expressions. Kept apart from mqtt.c so the host
+// build can replay traces through it.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "mqtt_canflt.h"
+
+#define TAG 		__func__
+
+static inline uint32_t mqtt_canflt_hash(const mqtt_canflt_t *flt, uint32_t id)
+{
+    return (id * 2654435761u) & flt->index_mask;
+}
+
+// Returns the range of filters for id, most frames on the bus match no
+// filter and are rejected here without touching the filter table
+bool mqtt_canflt_find_id(const mqtt_canflt_t *flt, uint32_t id, uint16_t *first, uint16_t *count)
+{
+    if(flt->index == NULL)
+    {
+        return false;
+    }
+
+    for(uint32_t slot = mqtt_canflt_hash(flt, id); flt->index[slot].count != 0; slot = (slot + 1) & flt->index_mask)
+    {
+        if(flt->index[slot].can_id == id)
+        {
+            *first = flt->index[slot].first;
+            *count = flt->index[slot].count;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool mqtt_canflt_build_index(mqtt_canflt_t *flt)
+{
+    uint32_t slots = 2;
+
+    // Stable sort by CAN ID so filters sharing an ID keep their configured order
+    for(uint32_t i = 1; i < flt->size; i++)
+    {
+        CANFilter value = flt->values[i];
+        uint32_t j = i;
+
+        while(j > 0 && flt->values[j - 1].can_id > value.can_id)
+        {
+            flt->values[j] = flt->values[j - 1];
+            j--;
+        }
+        flt->values[j] = value;
+    }
+
+    // Keep the load factor at or below 50%
+    while(slots < flt->size * 2)
+    {
+        slots <<= 1;
+    }
+
+    flt->index = (CANFilterIndex *)calloc(slots, sizeof(CANFilterIndex));
+    if(flt->index == NULL)
+    {
+        return false;
+    }
+    flt->index_mask = slots - 1;
+
+    for(uint32_t i = 0; i < flt->size; )
+    {
+        uint32_t id = flt->values[i].can_id;
+        uint32_t slot = mqtt_canflt_hash(flt, id);
+        uint16_t count = 0;
+
+        while(i + count < flt->size && flt->values[i + count].can_id == id)
+        {
+            count++;
+        }
+
+        while(flt->index[slot].count != 0)
+        {
+            slot = (slot + 1) & flt->index_mask;
+        }
+
+        flt->index[slot].can_id = id;
+        flt->index[slot].first = i;
+        flt->index[slot].count = count;
+        i += count;
+    }
+
+    ESP_LOGI(TAG, "CAN filter index: %lu filters, %lu slots", flt->size, slots);
+
+    return true;
+}
+
+/*
+ * Decodes the filters of the frame's ID. A filter with a PID only matches
+ * frames carrying it at PIDIndex, and a filter decoded less than its cycle
+ * ago ends the search for this frame. Returns the number of values passed
+ * to on_value.
+ */
+uint32_t mqtt_canflt_process(mqtt_canflt_t *flt, const twai_message_t *frame, int64_t now, mqtt_canflt_value_cb_t on_value, void *ctx)
+{
+    uint16_t first_index = 0;
+    uint16_t filter_count = 0;
+    uint32_t decoded = 0;
+    uint64_t can_data = 0;
+    uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+
+    if(!mqtt_canflt_find_id(flt, frame->identifier, &first_index, &filter_count))
+    {
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < 8; i++) 
+    {
+        can_data = (can_data << 8) | frame->data[i];
+    }
+
+    for(uint32_t found_index = first_index; found_index < (uint32_t)first_index + filter_count; found_index++)
+    {
+        CANFilter *filter = &flt->values[found_index];
+        double expression_result = 0;
+
+        // Check if expecting PID
+        if(filter->pid != -1)
+        {
+            if(filter->pidi < 0 || filter->pidi > 7 || filter->pid != frame->data[filter->pidi])
+            {
+                continue;
+            }
+        }
+
+        if(now - filter->logtime < (filter->cycle*1000))
+        {
+            break;
+        }
+        filter->logtime = now;
+
+        uint64_t start_bit = 64 - filter->start_bit - filter->bit_length;
+        uint64_t bit_length = filter->bit_length;
+        uint64_t mask = ((1ULL << bit_length) - 1ULL) << start_bit;
+        uint64_t value = (can_data & mask) >> start_bit;
+
+        ESP_LOGD(TAG, "can_data: %llx, mask: %llx, value: %llx", can_data, mask, value);
+
+        if(evaluate_compiled_expression(filter->program, frame->data, dlc, (double)value, &expression_result))
+        {
+            ESP_LOGD(TAG, "Expression result: %lf", expression_result);
+            on_value(filter, expression_result, ctx);
+            decoded++;
+        }
+        else
+        {
+            ESP_LOGE(TAG, "evaluate_expression error");
+        }
+    }
+
+    return decoded;
+}
+
+void mqtt_canflt_free(mqtt_canflt_t *flt)
+{
+    for (uint32_t i = 0; i < flt->size; i++)
+    {
+        free_compiled_expression(flt->values[i].program);
+    }
+    free(flt->values);
+    flt->values = NULL;
+    flt->size = 0;
+    free(flt->index);
+    flt->index = NULL;
+    flt->index_mask = 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MQTT_CANFLT_H__
+#define __MQTT_CANFLT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/twai.h"
+#include "expression_parser.h"
+
+typedef struct 
+{
+    uint32_t can_id;
+    char name[16];
+	int32_t pid;
+    int32_t pidi;
+    uint32_t start_bit;
+    uint32_t bit_length;
+    char expression[32];
+    expr_program_t *program;
+    uint32_t cycle;
+	int64_t logtime;
+} CANFilter;
+
+// Open addressing index from CAN ID to the range of filters with that ID,
+// values is sorted by CAN ID so the range is contiguous
+typedef struct 
+{
+    uint32_t can_id;
+    uint16_t first;
+    uint16_t count;                 // 0 marks an empty slot
+} CANFilterIndex;
+
+typedef struct
+{
+    CANFilter *values;
+    uint32_t size;
+    CANFilterIndex *index;
+    uint32_t index_mask;
+} mqtt_canflt_t;
+
+// Called with every value decoded from a frame
+typedef void (*mqtt_canflt_value_cb_t)(const CANFilter *filter, double value, void *ctx);
+
+bool mqtt_canflt_build_index(mqtt_canflt_t *flt);
+bool mqtt_canflt_find_id(const mqtt_canflt_t *flt, uint32_t id, uint16_t *first, uint16_t *count);
+uint32_t mqtt_canflt_process(mqtt_canflt_t *flt, const twai_message_t *frame, int64_t now, mqtt_canflt_value_cb_t on_value, void *ctx);
+void mqtt_canflt_free(mqtt_canflt_t *flt);
+
+#endif
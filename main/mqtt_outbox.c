@@ -0,0 +1,496 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "hw_config.h"
+#include "mqtt_outbox.h"
+
+#define TAG 		__func__
+
+// Store-and-forward log of MQTT messages published while the broker is
+// unreachable. Records are appended to numbered segment files and never
+// rewritten, a segment is deleted once replayed or when the oldest one is
+// evicted to stay within the budget. A segment is sealed when it is full, the
+// reader follows the one being written and then takes the records still in
+// the write buffer from RAM, so replaying while new messages arrive doesn't
+// write them to flash at all. Once everything is replayed the last segment
+// is deleted.
+//
+// Delivery is at least once: the read position is not stored, after a reboot
+// the oldest segment is replayed from its start, up to one segment of
+// messages that were already sent goes out again.
+//
+// Record, little endian: magic, flags (qos bits 0-1, retain bit 2), topic
+// length, uint16 payload length, uint16 CRC-16 of the rest, topic, payload
+#define MQTT_OUTBOX_DIR				FS_MOUNT_POINT"/outbox"
+#define MQTT_OUTBOX_SEGMENT_SIZE	(1024*16)
+#define MQTT_OUTBOX_SEGMENTS_MAX	6
+#define MQTT_OUTBOX_WRITE_BUF_SIZE	512			// batched so the flash sees few, larger writes
+#define MQTT_OUTBOX_MAGIC			0xA5
+#define MQTT_OUTBOX_HEADER_SIZE		7
+#define MQTT_OUTBOX_RETAIN			0x04
+
+typedef struct
+{
+	uint32_t head;					// oldest segment, the reader's
+	uint32_t tail;					// segment being written
+	FILE *writer;
+	uint32_t tail_size;
+	uint16_t write_len;
+	uint16_t write_read;			// write_buf bytes already replayed from RAM
+	FILE *reader;
+	uint32_t read_pos;				// bytes read from the head segment
+	bool record_ready;				// read_buf holds the record returned by peek
+	mqtt_outbox_record_t record;
+	mqtt_outbox_stats_t stats;
+	uint8_t write_buf[MQTT_OUTBOX_WRITE_BUF_SIZE];
+	uint8_t read_buf[UINT8_MAX + 1 + MQTT_OUTBOX_RECORD_MAX];
+}mqtt_outbox_t;
+
+static mqtt_outbox_t *outbox = NULL;
+
+static void mqtt_outbox_path(char *path, size_t size, uint32_t seq)
+{
+	snprintf(path, size, MQTT_OUTBOX_DIR"/%08lx.seg", seq);
+}
+
+static uint16_t mqtt_outbox_crc(const uint8_t *header, const uint8_t *body, size_t len)
+{
+	uint16_t crc = esp_rom_crc16_le(0, header, MQTT_OUTBOX_HEADER_SIZE - 2);
+	return esp_rom_crc16_le(crc, body, len);
+}
+
+static void mqtt_outbox_remove_head(void)
+{
+	char path[48];
+
+	if(outbox->reader != NULL)
+	{
+		fclose(outbox->reader);
+		outbox->reader = NULL;
+	}
+	outbox->record_ready = false;
+	outbox->read_pos = 0;
+	mqtt_outbox_path(path, sizeof(path), outbox->head);
+	unlink(path);
+	outbox->head++;
+}
+
+static bool mqtt_outbox_reading_tail(void)
+{
+	return outbox->head == outbox->tail && outbox->writer != NULL;
+}
+
+// Makes the appended records visible to the reader, FAT and LittleFS only
+// update another open handle of the file on sync
+static void mqtt_outbox_commit(void)
+{
+	fflush(outbox->writer);
+	if(mqtt_outbox_reading_tail() && outbox->reader != NULL)
+	{
+		fsync(fileno(outbox->writer));
+	}
+}
+
+static void mqtt_outbox_close_tail(void)
+{
+	if(outbox->writer != NULL)
+	{
+		fclose(outbox->writer);
+		outbox->writer = NULL;
+		outbox->tail++;
+	}
+}
+
+static bool mqtt_outbox_append(const uint8_t *data, size_t len)
+{
+	char path[48];
+
+	if(outbox->writer == NULL)
+	{
+		// Out of budget, the oldest segment makes room
+		while((outbox->tail - outbox->head) >= MQTT_OUTBOX_SEGMENTS_MAX)
+		{
+			ESP_LOGW(TAG, "Outbox full, evicting segment %lu", outbox->head);
+			outbox->stats.evicted++;
+			mqtt_outbox_remove_head();
+		}
+
+		mqtt_outbox_path(path, sizeof(path), outbox->tail);
+		outbox->writer = fopen(path, "ab");
+		outbox->tail_size = 0;
+		if(outbox->writer == NULL)
+		{
+			ESP_LOGE(TAG, "Failed to open %s", path);
+			return false;
+		}
+		outbox->stats.created++;
+	}
+
+	if(fwrite(data, 1, len, outbox->writer) != len)
+	{
+		// A partial record ends the segment, the reader drops what can't be framed
+		ESP_LOGE(TAG, "Outbox write failed, sealing segment %lu", outbox->tail);
+		outbox->tail_size = MQTT_OUTBOX_SEGMENT_SIZE;
+		return false;
+	}
+	outbox->tail_size += len;
+	return true;
+}
+
+static void mqtt_outbox_rotate(void)
+{
+	if(outbox->writer != NULL && outbox->tail_size >= MQTT_OUTBOX_SEGMENT_SIZE)
+	{
+		mqtt_outbox_close_tail();
+	}
+}
+
+// Writes the buffered records not yet replayed, the flash sees one write per buffer
+void mqtt_outbox_flush(void)
+{
+	if(outbox == NULL)
+	{
+		return;
+	}
+
+	uint16_t pending = outbox->write_len - outbox->write_read;
+
+	if(pending != 0)
+	{
+		if(!mqtt_outbox_append(&outbox->write_buf[outbox->write_read], pending))
+		{
+			outbox->stats.dropped++;
+		}
+		else
+		{
+			mqtt_outbox_commit();
+		}
+	}
+	outbox->write_len = 0;
+	outbox->write_read = 0;
+	mqtt_outbox_rotate();
+}
+
+bool mqtt_outbox_write(const char *topic, const char *payload, size_t len, uint8_t qos, uint8_t retain)
+{
+	size_t topic_len = strlen(topic);
+	size_t size = MQTT_OUTBOX_HEADER_SIZE + topic_len + len;
+
+	if(outbox == NULL)
+	{
+		return false;
+	}
+
+	if(topic_len > UINT8_MAX || len > MQTT_OUTBOX_RECORD_MAX)
+	{
+		outbox->stats.dropped++;
+		return false;
+	}
+
+	if(outbox->write_len + size > MQTT_OUTBOX_WRITE_BUF_SIZE)
+	{
+		mqtt_outbox_flush();
+	}
+
+	uint8_t *p = &outbox->write_buf[outbox->write_len];
+	uint8_t *body = p + MQTT_OUTBOX_HEADER_SIZE;
+	bool direct = (size > MQTT_OUTBOX_WRITE_BUF_SIZE);
+
+	if(direct)
+	{
+		// Does not fit the write buffer, written on its own
+		p = (uint8_t*)malloc(size);
+		if(p == NULL)
+		{
+			outbox->stats.dropped++;
+			return false;
+		}
+		body = p + MQTT_OUTBOX_HEADER_SIZE;
+	}
+
+	p[0] = MQTT_OUTBOX_MAGIC;
+	p[1] = (qos & 0x03) | (retain ? MQTT_OUTBOX_RETAIN : 0);
+	p[2] = (uint8_t)topic_len;
+	p[3] = (uint8_t)len;
+	p[4] = (uint8_t)(len >> 8);
+	memcpy(body, topic, topic_len);
+	memcpy(body + topic_len, payload, len);
+
+	uint16_t crc = mqtt_outbox_crc(p, body, topic_len + len);
+	p[5] = (uint8_t)crc;
+	p[6] = (uint8_t)(crc >> 8);
+
+	if(direct)
+	{
+		bool written = mqtt_outbox_append(p, size);
+
+		if(written)
+		{
+			mqtt_outbox_commit();
+		}
+		free(p);
+		mqtt_outbox_rotate();
+		if(!written)
+		{
+			outbox->stats.dropped++;
+			return false;
+		}
+	}
+	else
+	{
+		outbox->write_len += size;
+	}
+
+	outbox->stats.stored++;
+	return true;
+}
+
+// Nothing left to replay, neither on flash nor in RAM
+static bool mqtt_outbox_replayed(void)
+{
+	return outbox->head == outbox->tail && (outbox->writer == NULL || outbox->read_pos == outbox->tail_size) &&
+			outbox->write_read == outbox->write_len;
+}
+
+// Everything written has been replayed, the last segment is done with
+static void mqtt_outbox_release_tail(void)
+{
+	if(outbox->writer != NULL)
+	{
+		mqtt_outbox_close_tail();
+		outbox->head = outbox->tail - 1;
+		mqtt_outbox_remove_head();
+	}
+	outbox->write_len = 0;
+	outbox->write_read = 0;
+}
+
+bool mqtt_outbox_empty(void)
+{
+	return outbox == NULL || (!outbox->record_ready && mqtt_outbox_replayed());
+}
+
+// The topic is NUL terminated in place in read_buf, the payload is used with its length
+static void mqtt_outbox_load_record(const uint8_t *header)
+{
+	uint16_t len = header[3] | (header[4] << 8);
+
+	memmove(outbox->read_buf + header[2] + 1, outbox->read_buf + header[2], len);
+	outbox->read_buf[header[2]] = '\0';
+	outbox->record.topic = (const char*)outbox->read_buf;
+	outbox->record.payload = (const char*)outbox->read_buf + header[2] + 1;
+	outbox->record.len = len;
+	outbox->record.qos = header[1] & 0x03;
+	outbox->record.retain = (header[1] & MQTT_OUTBOX_RETAIN) ? 1 : 0;
+	outbox->record_ready = true;
+}
+
+// The next record still in the write buffer, it never reaches the flash
+static void mqtt_outbox_take_buffered(void)
+{
+	const uint8_t *header = &outbox->write_buf[outbox->write_read];
+	size_t body_len = header[2] + (header[3] | (header[4] << 8));
+
+	memcpy(outbox->read_buf, header + MQTT_OUTBOX_HEADER_SIZE, body_len);
+	outbox->write_read += MQTT_OUTBOX_HEADER_SIZE + body_len;
+	mqtt_outbox_load_record(header);
+}
+
+// The oldest record, valid until the next outbox call. False when empty
+bool mqtt_outbox_peek(mqtt_outbox_record_t *record)
+{
+	char path[48];
+	uint8_t header[MQTT_OUTBOX_HEADER_SIZE];
+
+	if(outbox == NULL)
+	{
+		return false;
+	}
+
+	while(!outbox->record_ready)
+	{
+		bool tail = (outbox->head == outbox->tail);
+
+		if(tail && (outbox->writer == NULL || outbox->read_pos == outbox->tail_size))
+		{
+			// The flash is caught up with, the rest is in RAM
+			if(outbox->write_read < outbox->write_len)
+			{
+				mqtt_outbox_take_buffered();
+				continue;
+			}
+			mqtt_outbox_release_tail();
+			return false;
+		}
+
+		if(outbox->reader == NULL)
+		{
+			mqtt_outbox_path(path, sizeof(path), outbox->head);
+			if(tail)
+			{
+				fflush(outbox->writer);
+				fsync(fileno(outbox->writer));
+			}
+			outbox->reader = fopen(path, "rb");
+			outbox->read_pos = 0;
+			if(outbox->reader == NULL)
+			{
+				if(tail)
+				{
+					return false;
+				}
+				outbox->head++;
+				continue;
+			}
+		}
+
+		// The segment being written is read up to tail_size, never into EOF
+		if(tail)
+		{
+			clearerr(outbox->reader);
+		}
+		size_t n = fread(header, 1, sizeof(header), outbox->reader);
+		if(n == 0 && !tail)
+		{
+			mqtt_outbox_remove_head();
+			continue;
+		}
+
+		uint16_t len = header[3] | (header[4] << 8);
+		size_t body_len = header[2] + len;
+
+		if(n != sizeof(header) || header[0] != MQTT_OUTBOX_MAGIC || len > MQTT_OUTBOX_RECORD_MAX ||
+			fread(outbox->read_buf, 1, body_len, outbox->reader) != body_len ||
+			mqtt_outbox_crc(header, outbox->read_buf, body_len) != (header[5] | (header[6] << 8)))
+		{
+			// Torn write or bad flash, the rest of the segment can't be framed.
+			// The write buffer goes to the next segment
+			ESP_LOGW(TAG, "Corrupt record in segment %lu", outbox->head);
+			outbox->stats.corrupt++;
+			if(tail)
+			{
+				mqtt_outbox_close_tail();
+			}
+			mqtt_outbox_remove_head();
+			continue;
+		}
+
+		outbox->read_pos += sizeof(header) + body_len;
+		mqtt_outbox_load_record(header);
+	}
+
+	*record = outbox->record;
+	return true;
+}
+
+void mqtt_outbox_pop(void)
+{
+	if(outbox != NULL && outbox->record_ready)
+	{
+		outbox->record_ready = false;
+		outbox->stats.replayed++;
+		if(mqtt_outbox_replayed())
+		{
+			mqtt_outbox_release_tail();
+		}
+	}
+}
+
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats)
+{
+	if(outbox == NULL)
+	{
+		memset(stats, 0, sizeof(mqtt_outbox_stats_t));
+		return;
+	}
+	*stats = outbox->stats;
+	stats->segments = outbox->tail - outbox->head + (outbox->writer != NULL ? 1 : 0);
+}
+
+// Picks up the segments left by a previous run, they are replayed first
+bool mqtt_outbox_init(void)
+{
+	struct stat st;
+
+	if(outbox != NULL)
+	{
+		return true;
+	}
+
+	if(stat(MQTT_OUTBOX_DIR, &st) != 0 && mkdir(MQTT_OUTBOX_DIR, 0775) != 0)
+	{
+		ESP_LOGE(TAG, "Failed to create %s", MQTT_OUTBOX_DIR);
+		return false;
+	}
+
+	outbox = (mqtt_outbox_t*)calloc(1, sizeof(mqtt_outbox_t));
+	if(outbox == NULL)
+	{
+		ESP_LOGE(TAG, "Failed to allocate outbox");
+		return false;
+	}
+
+	DIR *dir = opendir(MQTT_OUTBOX_DIR);
+	bool found = false;
+	uint32_t first = 0;
+	uint32_t last = 0;
+
+	if(dir != NULL)
+	{
+		struct dirent *entry;
+
+		while((entry = readdir(dir)) != NULL)
+		{
+			char *end = NULL;
+			uint32_t seq = strtoul(entry->d_name, &end, 16);
+
+			if(end == NULL || strcmp(end, ".seg") != 0)
+			{
+				continue;
+			}
+			if(!found || (int32_t)(seq - first) < 0)
+			{
+				first = seq;
+			}
+			if(!found || (int32_t)(seq - last) > 0)
+			{
+				last = seq;
+			}
+			found = true;
+		}
+		closedir(dir);
+	}
+
+	// Existing segments are all sealed, new records start a new one
+	outbox->head = first;
+	outbox->tail = found ? last + 1 : 0;
+	ESP_LOGI(TAG, "MQTT outbox: %lu segments pending", outbox->tail - outbox->head);
+	return true;
+}
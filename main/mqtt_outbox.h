@@ -0,0 +1,56 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MQTT_OUTBOX_H__
+#define __MQTT_OUTBOX_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MQTT_OUTBOX_RECORD_MAX		2048		// larger payloads are not stored
+
+typedef struct
+{
+	const char *topic;
+	const char *payload;
+	uint16_t len;
+	uint8_t qos;
+	uint8_t retain;
+}mqtt_outbox_record_t;
+
+typedef struct
+{
+	uint32_t stored;
+	uint32_t replayed;
+	uint32_t dropped;				// records too large or that failed to write
+	uint32_t evicted;				// oldest segments deleted to stay within the budget
+	uint32_t corrupt;				// segments cut short by a bad record
+	uint32_t created;				// segment files opened for writing
+	uint32_t segments;
+}mqtt_outbox_stats_t;
+
+bool mqtt_outbox_init(void);
+bool mqtt_outbox_empty(void);
+bool mqtt_outbox_write(const char *topic, const char *payload, size_t len, uint8_t qos, uint8_t retain);
+void mqtt_outbox_flush(void);
+bool mqtt_outbox_peek(mqtt_outbox_record_t *record);
+void mqtt_outbox_pop(void);
+void mqtt_outbox_get_stats(mqtt_outbox_stats_t *stats);
+#endif
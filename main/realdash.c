@@ -155,7 +155,6 @@ uint8_t real_dash_parse_66(twai_message_t *msg, uint8_t *buf)
 uint8_t real_dash_parse_44(twai_message_t *msg, uint8_t *buf, uint32_t len)
 {
 	uint8_t i;
-	uint32_t crc = 0;
 
 	memset(msg->data, 0, 8);
 	if((buf[0] == 0x44) && (buf[1] == 0x33) && (buf[2] == 0x22) && (buf[3] == 0x11))
@@ -19,15 +19,9 @@
  */
 
 #include <inttypes.h>
+#include <stdlib.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
 #include  "freertos/queue.h"
-#include "freertos/event_groups.h"
-#include "esp_wifi.h"
-#include "esp_system.h"
-#include "esp_event.h"
-#include "nvs_flash.h"
-#include "driver/gpio.h"
 #include "esp_timer.h"
 #include "esp_log.h"
 #include <string.h>
@@ -57,82 +51,76 @@ static uint8_t sl_bitrate[] = {CAN_10K, CAN_20K, CAN_50K, CAN_100K,
 								CAN_800K, CAN_1000K};
 void (*slcan_response)(char*, uint32_t, QueueHandle_t *q);
 
-static uint16_t slcan_get_time(void)
+// SLCAN timestamps are milliseconds wrapping at 60000
+static uint16_t slcan_get_time(int64_t timestamp)
 {
-	return pdTICKS_TO_MS(xTaskGetTickCount())%60000;
+	return (uint16_t)((timestamp/1000)%60000);
 }
 
-int8_t slcan_parse_frame(uint8_t *buf, twai_message_t *frame)
-{
-    uint8_t i = 0, j = 0;
+static const uint8_t slcan_hex[16] = {'0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F'};
 
-    uint32_t tmp;
-	uint8_t id_len = SLCAN_STD_ID_LEN;
+// Appends one frame to buf, returns the number of bytes written or 0 if the
+// frame doesn't fit in size. timestamp is the esp_timer_get_time() value taken
+// when the frame was received
+uint16_t slcan_encode_frame(uint8_t *buf, uint16_t size, const twai_message_t *frame, int64_t timestamp)
+{
+	uint8_t id_len = frame->extd ? SLCAN_EXT_ID_LEN : SLCAN_STD_ID_LEN;
+	uint8_t dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+	uint16_t len = 1 + id_len + 1 + (frame->rtr ? 0 : 2*dlc) + (timestamp_flag ? 4 : 0) + 1;
+	uint32_t tmp = frame->identifier;
+	uint16_t i = 0;
 
-    for (j=0; j < SLCAN_MTU; j++)
-    {
-        buf[j] = '\0';
-    }
+	if(len > size)
+	{
+		return 0;
+	}
 
 	if(frame->rtr == 0)
-    {
-        buf[i] = 't';
-    }
+	{
+		buf[i++] = frame->extd ? 'T' : 't';
+	}
 	else
 	{
-        buf[i] = 'r';
-    }
+		buf[i++] = frame->extd ? 'R' : 'r';
+	}
 
-    id_len = SLCAN_STD_ID_LEN;
-    tmp = frame->identifier;
-    if(frame->extd == 1)
-    {
-        buf[i] -= 32;
-        id_len = SLCAN_EXT_ID_LEN;
-        tmp = frame->identifier;
-    }
-    i++;
+	for(uint8_t j = id_len; j > 0; j--)
+	{
+		buf[j] = slcan_hex[tmp & 0xF];
+		tmp >>= 4;
+	}
+	i += id_len;
 
-    for(j = id_len; j > 0; j--)
-    {
-        buf[j] = (tmp & 0xF);
-        tmp = tmp >> 4;
-        i++;
-    }
+	buf[i++] = slcan_hex[dlc];
 
-    buf[i++] = frame->data_length_code;
+	if(frame->rtr == 0)
+	{
+		for(uint8_t j = 0; j < dlc; j++)
+		{
+			buf[i++] = slcan_hex[frame->data[j] >> 4];
+			buf[i++] = slcan_hex[frame->data[j] & 0x0F];
+		}
+	}
 
-    for (j = 0; j < frame->data_length_code; j++)
-    {
-        buf[i++] = (frame->data[j] >> 4);
-        buf[i++] = (frame->data[j] & 0x0F);
-    }
+	if(timestamp_flag)
+	{
+		uint16_t time_now = slcan_get_time(timestamp);
 
-    if(timestamp_flag)
-    {
-		uint32_t time_now = slcan_get_time();
-		uint8_t ts1, ts0;
-		ts1 = (time_now & 0xFF00) >> 8;
-		ts0 = (time_now & 0xFF);
-
-		buf[i++] = ts1 >> 4;
-		buf[i++] = ts1 & 0x0F;
-		buf[i++] = ts0 >> 4;
-		buf[i++] = ts0 & 0x0F;
-    }
+		buf[i++] = slcan_hex[(time_now >> 12) & 0x0F];
+		buf[i++] = slcan_hex[(time_now >> 8) & 0x0F];
+		buf[i++] = slcan_hex[(time_now >> 4) & 0x0F];
+		buf[i++] = slcan_hex[time_now & 0x0F];
+	}
 
-    for (j = 1; j < i; j++)
-    {
-        if (buf[j] < 0xA) {
-            buf[j] += 0x30;
-        } else {
-            buf[j] += 0x37;
-        }
-    }
+	buf[i++] = '\r';
 
-    buf[i++] = '\r';
+	return i;
+}
 
-    return i;
+// buf must hold at least SLCAN_FRAME_MAX bytes
+int8_t slcan_parse_frame(uint8_t *buf, twai_message_t *frame, int64_t timestamp)
+{
+	return slcan_encode_frame(buf, SLCAN_FRAME_MAX, frame, timestamp);
 }
 
 static uint8_t ascii_to_num(uint8_t a)
@@ -56,6 +56,7 @@ enum can_bitrate {
 };
 
 #define SLCAN_MTU 30 // (sizeof("T1111222281122334455667788EA5F\r")+1)
+#define SLCAN_FRAME_MAX 31 // longest encoded frame, extended with 8 bytes and timestamp
 
 
 #define SLCAN_STD_ID_LEN 3
@@ -70,6 +71,7 @@ typedef struct _sl_message
 
 void slcan_init(void (*send_to_host)(char*, uint32_t, QueueHandle_t *q));
 char* slcan_parse_str(uint8_t *buf, uint8_t len, twai_message_t *frame, QueueHandle_t *q);
-int8_t slcan_parse_frame(uint8_t *buf, twai_message_t *frame);
+int8_t slcan_parse_frame(uint8_t *buf, twai_message_t *frame, int64_t timestamp);
+uint16_t slcan_encode_frame(uint8_t *buf, uint16_t size, const twai_message_t *frame, int64_t timestamp);
 
 #endif
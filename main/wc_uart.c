@@ -29,6 +29,7 @@
 #include "string.h"
 #include "driver/gpio.h"
 #include "types.h"
+#include "dev_buffer.h"
 #include "lwip/sockets.h"
 #include "dev_status.h"
 
@@ -85,13 +86,17 @@ static void uart_rx_task(void *arg)
 
 static void uart_tx_task(void *arg)
 {
-    static xdev_buffer tx_buffer;
+    dev_buffer_t *tx_buffer;
 
     while (1)
     {
-    	xQueueReceive(*xuart_tx_queue, ( void * ) &tx_buffer, portMAX_DELAY);
+    	dev_buffer_receive(*xuart_tx_queue, &tx_buffer, portMAX_DELAY);
         dev_status_wait_for_bits(DEV_AWAKE_BIT, portMAX_DELAY);
-    	uart_write_bytes(UART_NUM_0, tx_buffer.ucElement, tx_buffer.usLen);
+        for(dev_buffer_t *seg = tx_buffer; seg != NULL; seg = seg->next)
+        {
+        	uart_write_bytes(UART_NUM_0, seg->data, seg->len);
+        }
+        dev_buffer_free(tx_buffer);
 //    	rx_buffer.usLen = uart_read_bytes(UART_NUM_0, rx_buffer.ucElement, RX_BUF_SIZE, 1 / portTICK_PERIOD_MS);
 //    	rx_buffer.dev_channel = DEV_UART;
 //    	if(rx_buffer.usLen > 0)
@@ -0,0 +1,439 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "webhook_client.h"
+
+#define TAG "WEBHOOK"
+
+static void webhook_sanitize_snippet(char *s)
+{
+    if (!s)
+        return;
+    for (size_t i = 0; s[i]; i++)
+    {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '\r' || c == '\n' || c == '\t')
+        {
+            s[i] = ' ';
+        }
+        else if (c < 32 || c > 126)
+        {
+            s[i] = ' ';
+        }
+    }
+}
+
+// static void webhook_printf_post_body(const char *url, const char *body, size_t body_len)
+// {
+//     if (!url || !body)
+//         return;
+
+//     // Print URL + full JSON payload in bounded chunks (avoids extremely long single-line prints).
+//     printf("WEBHOOK POST url=%s len=%u\n", url, (unsigned)body_len);
+//     size_t off = 0;
+//     while (off < body_len)
+//     {
+//         size_t chunk = body_len - off;
+//         if (chunk > 256)
+//             chunk = 256;
+//         printf("%.*s", (int)chunk, body + off);
+//         off += chunk;
+//     }
+//     printf("\n");
+// }
+
+static bool webhook_parse_http_url(const char *url, char *host, size_t host_len, int *out_port, char *path, size_t path_len)
+{
+    if (!url || !host || !path || !out_port)
+        return false;
+
+    // HTTP only
+    if (strncasecmp(url, "http://", 7) != 0)
+        return false;
+
+    const char *p = url + 7;
+    // host[:port][/path]
+    const char *host_end = p;
+    while (*host_end && *host_end != '/' && *host_end != ':')
+        host_end++;
+
+    size_t hlen = (size_t)(host_end - p);
+    if (hlen == 0 || hlen >= host_len)
+        return false;
+    memcpy(host, p, hlen);
+    host[hlen] = '\0';
+
+    int port = 80;
+    const char *after_host = host_end;
+    if (*after_host == ':')
+    {
+        after_host++;
+        port = 0;
+        while (*after_host && isdigit((unsigned char)*after_host))
+        {
+            port = (port * 10) + (*after_host - '0');
+            after_host++;
+        }
+        if (port <= 0 || port > 65535)
+            return false;
+    }
+
+    if (*after_host == '\0')
+    {
+        strlcpy(path, "/", path_len);
+    }
+    else if (*after_host == '/')
+    {
+        strlcpy(path, after_host, path_len);
+    }
+    else
+    {
+        // Unexpected character after host/port
+        return false;
+    }
+
+    *out_port = port;
+    return true;
+}
+
+// Keep-alive connection of the webhook task. The socket is reused for the
+// next post while the server keeps it open, connect failures back off
+#define WEBHOOK_BACKOFF_MIN_MS      1000
+#define WEBHOOK_BACKOFF_MAX_MS      60000
+
+typedef struct
+{
+    int sock;
+    char host[96];
+    int port;
+    uint32_t connects;
+    uint32_t reuses;
+    uint32_t failures;          // consecutive connect failures
+    int64_t retry_time;         // no connect before this, esp_timer_get_time() base
+} webhook_conn_t;
+
+static webhook_conn_t webhook_conn = {.sock = -1};
+
+void webhook_conn_close(void)
+{
+    if (webhook_conn.sock >= 0)
+    {
+        close(webhook_conn.sock);
+        webhook_conn.sock = -1;
+    }
+}
+
+static esp_err_t webhook_conn_open(const char *host, int port, int timeout_ms, char *out_snippet, size_t out_snippet_len)
+{
+    int64_t now = esp_timer_get_time();
+    if (webhook_conn.failures && now < webhook_conn.retry_time)
+    {
+        if (out_snippet && out_snippet_len)
+            snprintf(out_snippet, out_snippet_len, "connect backoff %lums", (unsigned long)((webhook_conn.retry_time - now) / 1000));
+        return ESP_FAIL;
+    }
+
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res = NULL;
+    int gai = getaddrinfo(host, port_str, &hints, &res);
+    bool resolved = (gai == 0 && res);
+    int sock = -1;
+    int last_errno = 0;
+
+    if (resolved)
+    {
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+        {
+            sock = (int)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (sock < 0)
+                continue;
+
+            struct timeval tv;
+            tv.tv_sec = timeout_ms / 1000;
+            tv.tv_usec = (timeout_ms % 1000) * 1000;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+            if (connect(sock, ai->ai_addr, (socklen_t)ai->ai_addrlen) == 0)
+                break;
+
+            last_errno = errno;
+            close(sock);
+            sock = -1;
+        }
+        freeaddrinfo(res);
+    }
+
+    if (sock < 0)
+    {
+        uint32_t backoff_ms = WEBHOOK_BACKOFF_MIN_MS << (webhook_conn.failures < 6 ? webhook_conn.failures : 6);
+        if (backoff_ms > WEBHOOK_BACKOFF_MAX_MS)
+            backoff_ms = WEBHOOK_BACKOFF_MAX_MS;
+        webhook_conn.failures++;
+        webhook_conn.retry_time = now + (int64_t)backoff_ms * 1000;
+
+        if (out_snippet && out_snippet_len)
+        {
+            // Keep message short and always bounded (build uses -Werror=format-truncation)
+            if (!resolved)
+                snprintf(out_snippet, out_snippet_len, "getaddrinfo failed gai=%d", gai);
+            else
+                snprintf(out_snippet, out_snippet_len, "connect failed errno=%d", last_errno);
+        }
+        return ESP_FAIL;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    webhook_conn.sock = sock;
+    strlcpy(webhook_conn.host, host, sizeof(webhook_conn.host));
+    webhook_conn.port = port;
+    webhook_conn.failures = 0;
+    webhook_conn.connects++;
+    return ESP_OK;
+}
+
+// An idle kept socket has nothing to read, EOF or an error means the server
+// closed it and the request would fail on it
+static bool webhook_conn_alive(int sock)
+{
+    char c;
+    int r = (int)recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static bool webhook_send_all(int sock, const char *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        int n = (int)send(sock, buf + sent, (int)(len - sent), 0);
+        if (n <= 0)
+            return false;
+        sent += (size_t)n;
+    }
+    return true;
+}
+
+// Reads one response and consumes its body so the next request can reuse the
+// socket. ESP_ERR_INVALID_STATE when the peer closed before sending anything
+static esp_err_t webhook_read_response(int sock, int *out_status, char *out_snippet, size_t out_snippet_len, bool *keep_alive)
+{
+    char resp[512];
+    size_t len = 0;
+    char *hdr_end = NULL;
+
+    *keep_alive = false;
+    while (!hdr_end && len < sizeof(resp) - 1)
+    {
+        int r = (int)recv(sock, resp + len, sizeof(resp) - 1 - len, 0);
+        if (r <= 0)
+        {
+            // A reset is how a socket the server already closed answers a request
+            if (len == 0)
+                return (r == 0 || errno == ECONNRESET) ? ESP_ERR_INVALID_STATE : ESP_FAIL;
+            break;
+        }
+        len += (size_t)r;
+        resp[len] = '\0';
+        hdr_end = strstr(resp, "\r\n\r\n");
+    }
+
+    // Parse status code
+    int status = -1;
+    const char *sp = strstr(resp, "HTTP/");
+    if (sp)
+    {
+        const char *code = strchr(sp, ' ');
+        if (code)
+            status = atoi(code + 1);
+    }
+    if (out_status)
+        *out_status = status;
+
+    // Extract a snippet after headers if possible
+    const char *body_start = hdr_end ? (hdr_end + 4) : resp;
+    if (out_snippet && out_snippet_len > 0)
+    {
+        strlcpy(out_snippet, body_start, out_snippet_len);
+        webhook_sanitize_snippet(out_snippet);
+    }
+
+    if (!hdr_end || strncmp(resp, "HTTP/1.1", 8) != 0)
+        return ESP_OK;
+
+    // Only a HTTP/1.1 response with a known length leaves the socket usable
+    long content_length = -1;
+    bool close_requested = false;
+    *hdr_end = '\0';
+    for (char *line = strstr(resp, "\r\n"); line; line = strstr(line, "\r\n"))
+    {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            content_length = strtol(line + 15, NULL, 10);
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+        {
+            const char *value = line + 11;
+            while (*value == ' ')
+                value++;
+            close_requested = (strncasecmp(value, "close", 5) == 0);
+        }
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            close_requested = true;
+    }
+
+    if (content_length < 0 || close_requested)
+        return ESP_OK;
+
+    long remaining = content_length - (long)(len - (size_t)(body_start - resp));
+    if (remaining < 0)
+        return ESP_OK;
+
+    while (remaining > 0)
+    {
+        int r = (int)recv(sock, resp, (remaining < (long)sizeof(resp)) ? (size_t)remaining : sizeof(resp), 0);
+        if (r <= 0)
+            return ESP_OK;
+        remaining -= r;
+    }
+
+    *keep_alive = true;
+    return ESP_OK;
+}
+
+esp_err_t webhook_post_json(const char *url, const char *body, size_t body_len, int timeout_ms, int *out_status, char *out_snippet, size_t out_snippet_len)
+{
+    if (!url || !body)
+        return ESP_ERR_INVALID_ARG;
+
+    // webhook_printf_post_body(url, body, body_len);
+
+    if (out_status)
+        *out_status = -1;
+    if (out_snippet && out_snippet_len)
+        out_snippet[0] = '\0';
+
+    char host[96] = {0};
+    char path[192] = {0};
+    int port = 80;
+    if (!webhook_parse_http_url(url, host, sizeof(host), &port, path, sizeof(path)))
+        return ESP_ERR_INVALID_ARG;
+
+    // Build HTTP request
+    const char *fmt =
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Type: application/json\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Length: %u\r\n"
+        "\r\n";
+
+    int hdr_len = snprintf(NULL, 0, fmt, path, host, (unsigned)body_len);
+    if (hdr_len <= 0)
+        return ESP_FAIL;
+
+    size_t req_len = (size_t)hdr_len + body_len;
+    char *req = (char *)malloc(req_len + 1);
+    if (!req)
+        return ESP_ERR_NO_MEM;
+
+    int w = snprintf(req, (size_t)hdr_len + 1, fmt, path, host, (unsigned)body_len);
+    if (w != hdr_len)
+    {
+        free(req);
+        return ESP_FAIL;
+    }
+    memcpy(req + hdr_len, body, body_len);
+    req[req_len] = '\0';
+
+    if (webhook_conn.sock >= 0 && (webhook_conn.port != port || strcmp(webhook_conn.host, host) != 0))
+        webhook_conn_close();
+
+    if (webhook_conn.sock >= 0 && !webhook_conn_alive(webhook_conn.sock))
+        webhook_conn_close();
+
+    // A reused socket may have been closed by the server while idle, that
+    // shows up as a failed send or a close before any response byte and the
+    // request is retried once on a new connection
+    esp_err_t ret = ESP_FAIL;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        bool reused = (webhook_conn.sock >= 0);
+        if (!reused)
+        {
+            ret = webhook_conn_open(host, port, timeout_ms, out_snippet, out_snippet_len);
+            if (ret != ESP_OK)
+                break;
+        }
+
+        if (!webhook_send_all(webhook_conn.sock, req, req_len))
+        {
+            webhook_conn_close();
+            ret = ESP_FAIL;
+            if (reused)
+                continue;
+            break;
+        }
+
+        bool keep_alive = false;
+        ret = webhook_read_response(webhook_conn.sock, out_status, out_snippet, out_snippet_len, &keep_alive);
+        if (ret != ESP_OK || !keep_alive)
+            webhook_conn_close();
+        if (ret == ESP_ERR_INVALID_STATE)
+        {
+            ret = ESP_FAIL;
+            if (reused)
+                continue;
+        }
+        if (ret == ESP_OK && reused)
+            webhook_conn.reuses++;
+        break;
+    }
+    free(req);
+
+    ESP_LOGD(TAG, "Webhook connections: %lu opened, %lu reused", (unsigned long)webhook_conn.connects, (unsigned long)webhook_conn.reuses);
+    return ret;
+}
+
+void webhook_conn_get_stats(uint32_t *connects, uint32_t *reuses)
+{
+    if (connects)
+        *connects = webhook_conn.connects;
+    if (reuses)
+        *reuses = webhook_conn.reuses;
+}
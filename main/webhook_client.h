@@ -0,0 +1,37 @@
+/*
+ * This file is part of the WiCAN project.
+ *
+ * Copyright (C) 2022  Meatpi Electronics.
+ * Written by Ali Slim <ali@meatpi.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WEBHOOK_CLIENT_H__
+#define __WEBHOOK_CLIENT_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// HTTP POST of a JSON body to an http:// URL over one keep-alive connection,
+// used by the webhook task only. out_status is the HTTP status or -1,
+// out_snippet the start of the response body or the reason of a failure.
+esp_err_t webhook_post_json(const char *url, const char *body, size_t body_len, int timeout_ms, int *out_status, char *out_snippet, size_t out_snippet_len);
+// Drops the kept connection, e.g. when the STA disconnects
+void webhook_conn_close(void);
+// Connections opened and posts sent on a reused connection so far
+void webhook_conn_get_stats(uint32_t *connects, uint32_t *reuses);
+
+#endif
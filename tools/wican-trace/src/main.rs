@@ -0,0 +1,394 @@
+// Converts CAN trace segments downloaded from /trace_file to candump or ASC
+// text and reports how many frames were recorded and lost. The format is
+// described in main/can_trace.c.
+use std::fs::File;
+use std::io::{self, BufWriter, Read, Seek, SeekFrom, Write};
+use std::process::exit;
+use std::time::Instant;
+
+const BLOCK_SIZE: usize = 4096;
+const HEADER_SIZE: usize = 24;
+const VERSION: u8 = 1;
+const EXTD: u8 = 0x10;
+const RTR: u8 = 0x20;
+const SAME_ID: u8 = 0x40;
+
+#[derive(Clone, Copy, PartialEq)]
+enum Format { Candump, Asc, None }
+
+struct Args {
+    format: Format,
+    iface: String,
+    from_us: Option<i64>,
+    files: Vec<String>,
+}
+
+#[derive(Default)]
+struct Stats {
+    frames: u64,
+    lost: u64,
+    blocks: u64,
+    bad_blocks: u64,
+    first_ts: Option<i64>,
+    last_ts: i64,
+}
+
+struct Frame {
+    ts: i64,
+    id: u32,
+    extd: bool,
+    rtr: bool,
+    dlc: u8,
+    data: [u8; 8],
+}
+
+fn usage() -> ! {
+    eprintln!("usage: wican-trace [--format candump|asc|none] [--iface can0] [--from <seconds>] <segment.trc>...");
+    eprintln!("  segments are read in the order given, pass them oldest first");
+    exit(2);
+}
+
+fn parse_args() -> Args {
+    let mut args = Args { format: Format::Candump, iface: "can0".to_string(), from_us: None, files: Vec::new() };
+    let mut it = std::env::args().skip(1);
+    while let Some(a) = it.next() {
+        match a.as_str() {
+            "--format" => args.format = match it.next().as_deref() {
+                Some("candump") => Format::Candump,
+                Some("asc") => Format::Asc,
+                Some("none") => Format::None,
+                _ => usage(),
+            },
+            "--iface" => args.iface = it.next().unwrap_or_else(|| usage()),
+            "--from" => {
+                let s: f64 = it.next().and_then(|v| v.parse().ok()).unwrap_or_else(|| usage());
+                args.from_us = Some((s * 1e6) as i64);
+            }
+            "-h" | "--help" => usage(),
+            _ => args.files.push(a),
+        }
+    }
+    if args.files.is_empty() { usage(); }
+    args
+}
+
+// esp_rom_crc16_le(), CRC-16/X-25, chained calls equal one CRC over the concatenation
+fn crc16_le(buf: &[u8]) -> u16 {
+    let mut crc: u16 = 0xFFFF;
+    for &b in buf {
+        crc ^= b as u16;
+        for _ in 0..8 {
+            crc = if crc & 1 != 0 { (crc >> 1) ^ 0x8408 } else { crc >> 1 };
+        }
+    }
+    !crc
+}
+
+fn le(b: &[u8]) -> u64 {
+    b.iter().rev().fold(0u64, |v, &x| (v << 8) | x as u64)
+}
+
+fn varint(b: &[u8], pos: &mut usize) -> Option<u32> {
+    let mut v: u32 = 0;
+    for shift in (0..35).step_by(7) {
+        let x = *b.get(*pos)?;
+        *pos += 1;
+        v |= ((x & 0x7F) as u32) << shift;
+        if x & 0x80 == 0 { return Some(v); }
+    }
+    None
+}
+
+struct Block<'a> {
+    frames: u16,
+    lost: u32,
+    ts: i64,
+    body: &'a [u8],
+}
+
+fn parse_block(b: &[u8]) -> Option<Block<'_>> {
+    if b.len() != BLOCK_SIZE || &b[0..2] != b"WT" || b[2] != VERSION { return None; }
+    let used = le(&b[6..8]) as usize;
+    if used < HEADER_SIZE || used > BLOCK_SIZE { return None; }
+    let mut crc_buf = b[0..20].to_vec();
+    crc_buf.extend_from_slice(&b[HEADER_SIZE..used]);
+    if crc16_le(&crc_buf) != le(&b[20..22]) as u16 { return None; }
+    Some(Block { frames: le(&b[4..6]) as u16, lost: le(&b[8..12]) as u32, ts: le(&b[12..20]) as i64, body: &b[HEADER_SIZE..used] })
+}
+
+fn decode_block(block: &Block, out: &mut Vec<Frame>) -> bool {
+    let b = block.body;
+    let mut pos = 0;
+    let mut ts = block.ts;
+    let mut id: u32 = 0;
+    for _ in 0..block.frames {
+        let Some(&flags) = b.get(pos) else { return false };
+        pos += 1;
+        let Some(dt) = varint(b, &mut pos) else { return false };
+        ts += dt as i64;
+        if flags & SAME_ID == 0 {
+            let Some(z) = varint(b, &mut pos) else { return false };
+            id = id.wrapping_add(((z >> 1) as i32 ^ -((z & 1) as i32)) as u32);
+        }
+        let dlc = flags & 0x0F;
+        let mut frame = Frame { ts, id, extd: flags & EXTD != 0, rtr: flags & RTR != 0, dlc, data: [0; 8] };
+        if !frame.rtr {
+            let len = dlc.min(8) as usize;
+            let Some(d) = b.get(pos..pos + len) else { return false };
+            frame.data[..len].copy_from_slice(d);
+            pos += len;
+        }
+        out.push(frame);
+    }
+    pos == b.len()
+}
+
+// The block headers are the segment's time index, finds the last block
+// starting at or before ts so decoding begins just before it
+fn seek_block(f: &mut File, blocks: u64, ts: i64) -> io::Result<u64> {
+    let (mut lo, mut hi) = (0u64, blocks);
+    let mut header = [0u8; HEADER_SIZE];
+    while lo + 1 < hi {
+        let mid = (lo + hi) / 2;
+        f.seek(SeekFrom::Start(mid * BLOCK_SIZE as u64))?;
+        f.read_exact(&mut header)?;
+        if &header[0..2] == b"WT" && (le(&header[12..20]) as i64) > ts { hi = mid; } else { lo = mid; }
+    }
+    Ok(lo)
+}
+
+fn write_frame(w: &mut impl Write, args: &Args, base: i64, f: &Frame) -> io::Result<()> {
+    let data: Vec<String> = f.data[..f.dlc.min(8) as usize].iter().map(|b| format!("{:02X}", b)).collect();
+    match args.format {
+        Format::Candump => {
+            let id = if f.extd { format!("{:08X}", f.id) } else { format!("{:03X}", f.id) };
+            let body = if f.rtr { "R".to_string() } else { data.concat() };
+            writeln!(w, "({}.{:06}) {} {}#{}", f.ts / 1_000_000, f.ts % 1_000_000, args.iface, id, body)
+        }
+        Format::Asc => {
+            let t = (f.ts - base) as f64 / 1e6;
+            let id = if f.extd { format!("{:X}x", f.id) } else { format!("{:X}", f.id) };
+            if f.rtr {
+                writeln!(w, "{:>11.6} 1  {:<15} Rx   r {:X}", t, id, f.dlc)
+            } else {
+                writeln!(w, "{:>11.6} 1  {:<15} Rx   d {:X} {}", t, id, f.dlc, data.join(" "))
+            }
+        }
+        Format::None => Ok(()),
+    }
+}
+
+fn main() -> io::Result<()> {
+    let args = parse_args();
+    let stdout = io::stdout();
+    let mut w = BufWriter::new(stdout.lock());
+    let mut stats = Stats::default();
+    let mut frames = Vec::with_capacity(512);
+    let mut buf = vec![0u8; BLOCK_SIZE];
+    let start = Instant::now();
+
+    if args.format == Format::Asc {
+        writeln!(w, "date Thu Jan 1 00:00:00.000 am 1970\nbase hex  timestamps absolute\ninternal events logged\nBegin Triggerblock")?;
+    }
+
+    for path in &args.files {
+        let mut f = File::open(path).unwrap_or_else(|e| { eprintln!("{path}: {e}"); exit(1) });
+        let blocks = f.metadata()?.len() / BLOCK_SIZE as u64;
+        let first = match args.from_us { Some(ts) if blocks > 0 => seek_block(&mut f, blocks, ts)?, _ => 0 };
+        f.seek(SeekFrom::Start(first * BLOCK_SIZE as u64))?;
+
+        for _ in first..blocks {
+            f.read_exact(&mut buf)?;
+            let Some(block) = parse_block(&buf) else { stats.bad_blocks += 1; continue };
+            frames.clear();
+            if !decode_block(&block, &mut frames) { stats.bad_blocks += 1; continue; }
+            stats.blocks += 1;
+            stats.lost += block.lost as u64;
+            for frame in frames.iter().filter(|fr| args.from_us.map_or(true, |ts| fr.ts >= ts)) {
+                let base = *stats.first_ts.get_or_insert(frame.ts);
+                stats.frames += 1;
+                stats.last_ts = frame.ts;
+                write_frame(&mut w, &args, base, frame)?;
+            }
+        }
+    }
+
+    if args.format == Format::Asc {
+        writeln!(w, "End TriggerBlock")?;
+    }
+    w.flush()?;
+
+    let span = stats.first_ts.map_or(0.0, |t| (stats.last_ts - t) as f64 / 1e6);
+    eprintln!("frames {} lost {} blocks {} bad blocks {}", stats.frames, stats.lost, stats.blocks, stats.bad_blocks);
+    if span > 0.0 {
+        eprintln!("recorded {:.3} s, {:.0} frames/s written, {:.3}% lost",
+            span, stats.frames as f64 / span, 100.0 * stats.lost as f64 / (stats.frames + stats.lost).max(1) as f64);
+    }
+    eprintln!("decoded in {:.3} s, {:.0} frames/s", start.elapsed().as_secs_f64(),
+        stats.frames as f64 / start.elapsed().as_secs_f64().max(1e-9));
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn put_varint(out: &mut Vec<u8>, mut v: u32) {
+        while v >= 0x80 {
+            out.push(v as u8 | 0x80);
+            v >>= 7;
+        }
+        out.push(v as u8);
+    }
+
+    // The block as can_trace_encode() and can_trace_submit() write it
+    fn encode_block(ts: i64, lost: u32, frames: &[Frame]) -> Vec<u8> {
+        let mut b = vec![0u8; HEADER_SIZE];
+        let (mut last_ts, mut last_id) = (ts, 0u32);
+        for f in frames {
+            let mut flags = f.dlc & 0x0F;
+            if f.extd { flags |= EXTD; }
+            if f.rtr { flags |= RTR; }
+            if f.id == last_id { flags |= SAME_ID; }
+            b.push(flags);
+            put_varint(&mut b, (f.ts - last_ts).max(0) as u32);
+            if f.id != last_id {
+                let d = f.id.wrapping_sub(last_id) as i32;
+                put_varint(&mut b, ((d as u32) << 1) ^ ((d >> 31) as u32));
+            }
+            if !f.rtr { b.extend_from_slice(&f.data[..f.dlc.min(8) as usize]); }
+            last_ts = last_ts.max(f.ts);
+            last_id = f.id;
+        }
+        let used = b.len();
+        b[0..3].copy_from_slice(&[b'W', b'T', VERSION]);
+        b[4..6].copy_from_slice(&(frames.len() as u16).to_le_bytes());
+        b[6..8].copy_from_slice(&(used as u16).to_le_bytes());
+        b[8..12].copy_from_slice(&lost.to_le_bytes());
+        b[12..20].copy_from_slice(&ts.to_le_bytes());
+        let mut crc_buf = b[0..20].to_vec();
+        crc_buf.extend_from_slice(&b[HEADER_SIZE..used]);
+        b[20..22].copy_from_slice(&crc16_le(&crc_buf).to_le_bytes());
+        b.resize(BLOCK_SIZE, 0);
+        b
+    }
+
+    fn frame(ts: i64, id: u32, extd: bool, rtr: bool, dlc: u8) -> Frame {
+        let mut data = [0u8; 8];
+        for (i, d) in data.iter_mut().enumerate().take(dlc.min(8) as usize) {
+            *d = (id as u8).wrapping_mul(31).wrapping_add(i as u8);
+        }
+        Frame { ts, id, extd, rtr, dlc, data }
+    }
+
+    fn sample_frames(ts: i64) -> Vec<Frame> {
+        vec![
+            frame(ts, 0x7E8, false, false, 8),
+            frame(ts + 120, 0x7E8, false, false, 3),
+            frame(ts + 120, 0x100, false, true, 2),
+            frame(ts + 5_000_000, 0x18DAF110, true, false, 8),
+            frame(ts + 5_000_010, 0x18DAF110, true, false, 0),
+            frame(ts + 5_000_011, 0x001, false, false, 15),
+        ]
+    }
+
+    // Written by can_trace.c from a synthetic bus trace (host/test/test_can_trace.c),
+    // the log is the candump text of the frames it was fed
+    #[test]
+    fn decodes_segment_written_by_firmware() {
+        let segment = include_bytes!("../tests/data/synth.trc");
+        let expected = include_str!("../tests/data/synth.log");
+        let args = Args { format: Format::Candump, iface: "can0".to_string(), from_us: None, files: Vec::new() };
+        let mut text = Vec::new();
+        let mut frames = Vec::new();
+
+        assert_eq!(segment.len() % BLOCK_SIZE, 0);
+        for b in segment.chunks(BLOCK_SIZE) {
+            let block = parse_block(b).expect("valid block");
+            assert_eq!(block.lost, 0);
+            frames.clear();
+            assert!(decode_block(&block, &mut frames));
+            for f in &frames {
+                write_frame(&mut text, &args, 0, f).unwrap();
+            }
+        }
+        assert_eq!(String::from_utf8(text).unwrap(), expected);
+    }
+
+    #[test]
+    fn crc16_matches_x25_check_value() {
+        assert_eq!(crc16_le(b"123456789"), 0x906E);
+    }
+
+    #[test]
+    fn decode_round_trip() {
+        let frames = sample_frames(1_234_567);
+        let b = encode_block(1_234_567, 7, &frames);
+        let block = parse_block(&b).expect("valid block");
+        assert_eq!(block.frames as usize, frames.len());
+        assert_eq!(block.lost, 7);
+        assert_eq!(block.ts, 1_234_567);
+
+        let mut out = Vec::new();
+        assert!(decode_block(&block, &mut out));
+        assert_eq!(out.len(), frames.len());
+        for (a, e) in out.iter().zip(&frames) {
+            assert_eq!((a.ts, a.id, a.extd, a.rtr, a.dlc), (e.ts, e.id, e.extd, e.rtr, e.dlc));
+            let len = if e.rtr { 0 } else { e.dlc.min(8) as usize };
+            assert_eq!(a.data[..len], e.data[..len]);
+        }
+    }
+
+    #[test]
+    fn crc_rejects_corruption() {
+        let b = encode_block(42, 0, &sample_frames(42));
+        assert!(parse_block(&b).is_some());
+        let used = le(&b[6..8]) as usize;
+        for pos in [4, 9, 13, HEADER_SIZE, used - 1] {
+            let mut bad = b.clone();
+            bad[pos] ^= 0x01;
+            assert!(parse_block(&bad).is_none(), "flip at {pos} accepted");
+        }
+        let mut bad = b.clone();
+        bad[20] ^= 0x80;
+        assert!(parse_block(&bad).is_none());
+        // Bytes past used are not covered, a torn tail of zeros stays valid
+        let mut tail = b.clone();
+        tail[BLOCK_SIZE - 1] = 0xFF;
+        assert!(parse_block(&tail).is_some());
+    }
+
+    #[test]
+    fn decode_rejects_truncated_frames() {
+        let frames = sample_frames(0);
+        let b = encode_block(0, 0, &frames);
+        let block = parse_block(&b).unwrap();
+        let short = Block { frames: block.frames, lost: 0, ts: 0, body: &block.body[..block.body.len() - 1] };
+        assert!(!decode_block(&short, &mut Vec::new()));
+        let extra = Block { frames: block.frames - 1, lost: 0, ts: 0, body: block.body };
+        assert!(!decode_block(&extra, &mut Vec::new()));
+    }
+
+    #[test]
+    fn seek_finds_the_block_holding_a_timestamp() {
+        let path = std::env::temp_dir().join(format!("wican-trace-seek-{}.trc", std::process::id()));
+        let starts: Vec<i64> = (0..9).map(|k| 1_000_000 + k * 250_000).collect();
+        let mut data = Vec::new();
+        for &ts in &starts {
+            data.extend(encode_block(ts, 0, &sample_frames(ts)[..2]));
+        }
+        std::fs::write(&path, &data).unwrap();
+        let mut f = File::open(&path).unwrap();
+        let blocks = starts.len() as u64;
+
+        assert_eq!(seek_block(&mut f, blocks, 0).unwrap(), 0);
+        for (k, &ts) in starts.iter().enumerate() {
+            assert_eq!(seek_block(&mut f, blocks, ts).unwrap(), k as u64);
+            assert_eq!(seek_block(&mut f, blocks, ts + 1).unwrap(), k as u64);
+            assert_eq!(seek_block(&mut f, blocks, ts - 1).unwrap(), k.saturating_sub(1) as u64);
+        }
+        assert_eq!(seek_block(&mut f, blocks, i64::MAX).unwrap(), blocks - 1);
+        drop(f);
+        std::fs::remove_file(&path).unwrap();
+    }
+}